@@ -47,4 +47,18 @@
 
 	#define DISK_READ_ONLY            false
 
+	#define RAW_ZERO_COPY
+
+	#define WRITE_CACHE_SETS          2
+	#define WRITE_CACHE_WAYS          2
+	#define WRITE_CACHE_IDLE_TICKS    50
+
+	#define READ_AHEAD_BLOCKS         4
+
+	#define CARD_IDENTITY_EEPROM      64
+
+	/*#define LATENCY_HISTOGRAMS*/
+
+	/*#define SCSI_TRACE_ENTRIES        32*/
+
 #endif
@@ -38,7 +38,12 @@
 #include "Lib/diskio.h"
 #include "Lib/mmc_avr.h"
 #include "Lib/ini.h"
+#include "Lib/Timebase.h"
+#include "Lib/Bench.h"
+#include "Lib/Latency.h"
+#include "Lib/Trace.h"
 #include "stdlib.h"
+#include <avr/eeprom.h>
 
 /** LUFA CDC Class driver interface configuration and state information. This structure is
  *  passed to all CDC Class driver functions, so that multiple instances of the same class
@@ -83,13 +88,13 @@ USB_ClassInfo_MS_Device_t Disk_MS_Interface =
 					{
 						.Address                = MASS_STORAGE_IN_EPADDR,
 						.Size                   = MASS_STORAGE_IO_EPSIZE,
-						.Banks                  = 1,
+						.Banks                  = 2,
 					},
 				.DataOUTEndpoint                =
 					{
 						.Address                = MASS_STORAGE_OUT_EPADDR,
 						.Size                   = MASS_STORAGE_IO_EPSIZE,
-						.Banks                  = 1,
+						.Banks                  = 2,
 					},
 				.TotalLUNs                      = TOTAL_LUNS,
 			},
@@ -123,13 +128,6 @@ USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
  */
 static FILE USBSerialStream;
 
-#define DEBUG
-#ifdef DEBUG
-#define DEBUG_HANG
-#else
-#define DEBUG_HANG for(;;)
-#endif
-
 static uint16_t Timer7 = 0;
 ISR(TIMER0_COMPA_vect)
 {
@@ -139,10 +137,102 @@ ISR(TIMER0_COMPA_vect)
 	if (n) Timer7 = --n;
 
 	disk_timerproc();
+	SCSI_CacheTimerproc();
 }
 
 uint32_t media_blocks = 0;
 
+/** Identity of the card in the socket, recorded in EEPROM for the next warm start. */
+static MMC_IDENT CardIdentity;
+
+/** FatFs work area of the volume on the card. */
+static FATFS FatFs;
+
+/** Console command line being received, the bench command taking its arguments from the rest of the line. */
+static char    ConsoleLine[24];
+
+/** Number of characters of the console command line received so far, zero when no line is being received. */
+static uint8_t ConsoleLength;
+
+/** Enum for the stages of the start-up, run one at a time from the main loop so that USB is serviced in between. */
+enum BootStages_t
+{
+	BOOT_RESUME = 0, /**< Taking over the card left initialized at a warm start */
+	BOOT_PROBE  = 1, /**< Power cycling and probing the card, one step per pass of the main loop */
+	BOOT_MOUNT  = 2, /**< Mounting the volume of the card */
+	BOOT_CONFIG = 3, /**< Parsing the wahaha.ini configuration file */
+	BOOT_OPEN   = 4, /**< Opening the udisk.txt image behind the loopback LUN */
+	BOOT_EXPAND = 5, /**< Allocating the whole image on the volume */
+	BOOT_COUNT  = 6, /**< Counting the fragments of the image */
+	BOOT_MAP    = 7, /**< Building the cluster link map table of the image */
+	BOOT_DONE   = 8, /**< Start-up finished, successfully or not */
+};
+
+/** Current stage of the start-up, a value from the \ref BootStages_t enum. */
+static uint8_t BootStage = BOOT_RESUME;
+
+/** Size of the cluster link map table of the image in DWORDs, counted by the \ref BOOT_COUNT stage. */
+static DWORD ClmtSize;
+
+/** Allocates the whole udisk.txt image behind the loopback LUN, as fast seek mode cannot expand the file later on.
+ *  A new image is allocated in one fragment if possible.
+ *
+ *  \return FatFs result of the operation that failed, FR_OK otherwise
+ */
+static FRESULT udisk_expand(void)
+{
+	FSIZE_t image_size = (FSIZE_t)media_blocks * VIRTUAL_MEMORY_BLOCK_SIZE;
+	FRESULT fr;
+
+	if (f_size(&MassStorage_Loopback) >= image_size)
+		return FR_OK;
+
+	fr = FR_DENIED;
+	if (f_size(&MassStorage_Loopback) == 0)
+		fr = f_expand(&MassStorage_Loopback, image_size, 1);
+	if (fr != FR_OK)
+		fr = f_lseek(&MassStorage_Loopback, image_size);
+	if (fr == FR_OK)
+		fr = f_sync(&MassStorage_Loopback);
+
+	return fr;
+}
+
+/** Attaches a cluster link map table to the udisk.txt image, sized from the fragment count in \ref ClmtSize. The SCSI
+ *  layer uses the table to map each LUN block straight to its card sector, bypassing FatFs for every transfer. Without
+ *  a table, the image is accessed through FatFs.
+ */
+static void udisk_map(void)
+{
+	MassStorage_Loopback.cltbl = malloc(ClmtSize * sizeof(DWORD));
+	if (MassStorage_Loopback.cltbl)
+	{
+		MassStorage_Loopback.cltbl[0] = ClmtSize;
+		if (f_lseek(&MassStorage_Loopback, CREATE_LINKMAP) == FR_OK)
+			return;
+
+		free(MassStorage_Loopback.cltbl);
+	}
+
+	/* No table, fall back to accessing the image through FatFs */
+	MassStorage_Loopback.cltbl = NULL;
+}
+
+/** Services the USB interfaces other than the Mass Storage one while the card is busy. Control requests need no
+ *  servicing here, they are handled in the USB interrupt (INTERRUPT_CONTROL_ENDPOINT). This is called back from the
+ *  card driver, possibly in the middle of a SCSI command, so the endpoint selected by the Mass Storage class driver is
+ *  restored afterwards.
+ */
+void mmc_yield(void)
+{
+	uint8_t PrevEndpoint = Endpoint_GetCurrentEndpoint();
+
+	CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
+	HID_Device_USBTask(&Keyboard_HID_Interface);
+
+	Endpoint_SelectEndpoint(PrevEndpoint);
+}
+
 static int ini_cb(void* user, const char* section, const char* name,
 	const char* value)
 {
@@ -161,6 +251,127 @@ static int ini_cb(void* user, const char* section, const char* name,
 	return 1;
 }
 
+/** Runs the next stage of the start-up, setting up the medium behind the Mass Storage LUN while USB is already
+ *  running. A stage that waits on the card, such as the card probing, returns to the main loop after each step and is
+ *  called again. The LUN reports NOT READY until the last stage is done, and MEDIUM NOT PRESENT if a stage fails.
+ *  This should be called from the main program loop.
+ */
+static void Boot_Task(void)
+{
+	FRESULT fr;
+
+	switch (BootStage)
+	{
+		case BOOT_RESUME:
+			BootStage = BOOT_PROBE;
+
+			#if defined(CARD_IDENTITY_EEPROM)
+			/* Warm start: take over the card as it was left if it is the one recorded at the previous boot, skipping
+			   the card probing */
+			eeprom_read_block(&CardIdentity, (const void*)CARD_IDENTITY_EEPROM, sizeof(CardIdentity));
+			if (mmc_disk_resume(&CardIdentity) & STA_NOINIT)
+				CardIdentity.sectors = 0;
+			else
+				BootStage = BOOT_MOUNT;
+			#endif
+			return;
+
+		case BOOT_PROBE:
+			/* Cold start: one step of the power cycle and the wait for the card to leave idle state */
+			if (mmc_disk_probe())
+				return;
+
+			if (mmc_disk_status() & STA_NOINIT)
+				break;
+
+			BootStage = BOOT_MOUNT;
+			return;
+
+		case BOOT_MOUNT:
+			/* A card without a volume is still served raw, as the configuration file cannot be found on it */
+			f_mount(&FatFs, "", 1);
+
+			#if defined(CARD_IDENTITY_EEPROM)
+			/* Cold start: record the probed card, only the changed bytes are written */
+			if (!(CardIdentity.sectors))
+			{
+				if (mmc_disk_identify(&CardIdentity) == RES_OK)
+					eeprom_update_block(&CardIdentity, (void*)CARD_IDENTITY_EEPROM, sizeof(CardIdentity));
+				else
+					CardIdentity.sectors = 0;
+			}
+			#endif
+
+			BootStage = BOOT_CONFIG;
+			return;
+
+		case BOOT_CONFIG:
+			if (ini_parse("wahaha.ini", ini_cb, NULL) < 0)
+				RawStorage = 1;
+
+			if (!(RawStorage))
+			{
+				BootStage = BOOT_OPEN;
+				return;
+			}
+
+			media_blocks = CardIdentity.sectors;
+			if (media_blocks == 0 && (mmc_disk_ioctl(GET_SECTOR_COUNT, &media_blocks) != RES_OK || media_blocks == 0))
+				break;
+
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		case BOOT_OPEN:
+			if (f_open(&MassStorage_Loopback, "udisk.txt", FA_READ | FA_WRITE | FA_OPEN_ALWAYS))
+				break;
+
+			media_blocks = 262144;
+			BootStage = BOOT_EXPAND;
+			return;
+
+		case BOOT_EXPAND:
+			if (udisk_expand())
+				break;
+
+			BootStage = BOOT_COUNT;
+			return;
+
+		case BOOT_COUNT:
+			/* Let FatFs count the fragments with a table too small to hold any */
+			ClmtSize = 1;
+			MassStorage_Loopback.cltbl = &ClmtSize;
+			fr = f_lseek(&MassStorage_Loopback, CREATE_LINKMAP);
+			MassStorage_Loopback.cltbl = NULL;
+
+			if (fr == FR_NOT_ENOUGH_CORE)
+			{
+				BootStage = BOOT_MAP;
+				return;
+			}
+
+			/* No table, access the image through FatFs */
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		case BOOT_MAP:
+			udisk_map();
+
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		default:
+			return;
+	}
+
+	/* A stage failed, leave the LUN without a medium */
+	BootStage = BOOT_DONE;
+	SCSI_SetMediaState(MEDIA_NOT_PRESENT);
+}
+
 /** Main program entry point. This routine contains the overall program flow, including initial
  *  setup of all components and the main program loop.
  */
@@ -172,40 +383,15 @@ int main(void)
 	TCCR0B = 0b101;
 	TIMSK0 = _BV(OCIE0A);
 
+	Timebase_Init();
+
 	sei();
 
 	SetupHardware();
 
 	FRESULT fr;
-	FATFS FatFs;
 
-	fr = f_mount(&FatFs, "", 1);
-	if (fr)
-	{
-		DEBUG_HANG;
-	}
-
-	/* dump ini config */
-
-	if (ini_parse("wahaha.ini", ini_cb, NULL) < 0 ) {
-		RawStorage = 1;
-		if (mmc_disk_ioctl(GET_SECTOR_COUNT, &media_blocks) != RES_OK || media_blocks == 0) {
-			DEBUG_HANG;
-		}
-	}
-	else if(!RawStorage)
-	{
-		/* udisk setup */
-		fr = f_open(&MassStorage_Loopback, "udisk.txt", FA_READ | FA_WRITE | FA_OPEN_ALWAYS);
-		if (fr)
-		{
-			DEBUG_HANG;
-		}
-		else
-		{
-			media_blocks = 262144;
-		}
-	}
+	/* The medium is set up by Boot_Task() from the main loop, so that the device enumerates at once */
 
 	/* Create a regular character stream for the interface so that it can be used with the stdio.h functions */
 	CDC_Device_CreateStream(&VirtualSerial_CDC_Interface, &USBSerialStream);
@@ -219,12 +405,82 @@ int main(void)
 		while(CDC_Device_BytesReceived(&VirtualSerial_CDC_Interface))
 		{
 			int c = fgetc(&USBSerialStream);
+
+			if (ConsoleLength)
+			{
+				/* Run the command once its line is complete */
+				if ((c == '\r') || (c == '\n'))
+				{
+					ConsoleLine[ConsoleLength] = '\0';
+					ConsoleLength = 0;
+					Bench_Run(&USBSerialStream, &ConsoleLine[1]);
+				}
+				else if (ConsoleLength < (sizeof(ConsoleLine) - 1))
+				{
+					ConsoleLine[ConsoleLength++] = c;
+				}
+
+				continue;
+			}
+
 			switch (c)
 			{
+			case 'b':
+				ConsoleLine[ConsoleLength++] = c;
+				break;
+			#if defined(LATENCY_HISTOGRAMS)
+			case 'l':
+				Latency_Dump(&USBSerialStream);
+				break;
+			#endif
+			#if defined(SCSI_TRACE_ENTRIES)
+			case 's':
+				Trace_Dump(&USBSerialStream);
+				break;
+			#endif
+			case 'k':
+				{
+					DWORD    sectors;
+					DWORD    cycles[2];
+					uint8_t* buff = malloc(512);
+
+					/* Check the block transfer loops bit-exact against the card CRC on the last sector, which is
+					   written back unchanged, and report the CPU cycles they spend per byte */
+					if (buff && (mmc_disk_ioctl(GET_SECTOR_COUNT, &sectors) == RES_OK) &&
+					    (mmc_disk_check(sectors - 1, buff, cycles) == RES_OK))
+					{
+						fprintf(&USBSerialStream, "CRC ok, receive %lu.%02lu, transmit %lu.%02lu cycles/byte\r\n",
+						        (unsigned long)(cycles[0] / 512), (unsigned long)(cycles[0] % 512 * 100 / 512),
+						        (unsigned long)(cycles[1] / 512), (unsigned long)(cycles[1] % 512 * 100 / 512));
+					}
+					else
+					{
+						fputs("CRC check failed\r\n", &USBSerialStream);
+					}
+
+					free(buff);
+				}
+				break;
 			case 't':
 				fr = f_rename("wahaha.ini", "wahaha.txt");
 				fprintf(&USBSerialStream, "t received, %d\r\n", (int)fr);
 				break;
+			case 'c':
+				{
+					DWORD sclk;
+					WORD  errors;
+					DWORD counts[2];
+
+					/* Report the SPI clock the card settled at, and the data packet errors seen so far */
+					if ((mmc_disk_ioctl(MMC_GET_SCLK, &sclk) == RES_OK) && (mmc_disk_ioctl(MMC_GET_ERRCNT, &errors) == RES_OK))
+					  fprintf(&USBSerialStream, "SPI clock %lu Hz, %u errors\r\n", (unsigned long)sclk, (unsigned)errors);
+
+					/* Report the card traffic since the last report, and the RAM the stack and heap have never reached */
+					if (mmc_disk_ioctl(MMC_GET_XFERCNT, counts) == RES_OK)
+					  fprintf(&USBSerialStream, "%lu commands, %lu data packets\r\n", (unsigned long)counts[0], (unsigned long)counts[1]);
+					fprintf(&USBSerialStream, "%u bytes of RAM never used\r\n", Stack_Unused());
+				}
+				break;
 			default:
 				break;
 			}
@@ -236,10 +492,42 @@ int main(void)
 		CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
 		HID_Device_USBTask(&Keyboard_HID_Interface);
 		MS_Device_USBTask(&Disk_MS_Interface);
+		SCSI_CacheTask();
+		mmc_stream_idle();
+		Boot_Task();
 		USB_USBTask();
 	}
 }
 
+/** Fills the RAM between the static variables and the stack with \ref STACK_PAINT before the C runtime starts up,
+ *  so that \c Stack_Unused() can later find the lowest address the stack has reached.
+ */
+void Stack_Paint(void)
+{
+	extern uint8_t __heap_start;
+
+	for (uint8_t* Paint = &__heap_start; Paint < (uint8_t*)SP; Paint++)
+	  *Paint = STACK_PAINT;
+}
+
+/** Measures the RAM that has never been used, between the top of the heap and the deepest point of the stack.
+ *
+ *  \return Number of bytes of RAM still holding \ref STACK_PAINT
+ */
+uint16_t Stack_Unused(void)
+{
+	extern uint8_t __heap_start;
+	extern char*   __brkval;
+
+	const uint8_t* Scan   = __brkval ? (const uint8_t*)__brkval : &__heap_start;
+	uint16_t       Unused = 0;
+
+	while ((Scan < (const uint8_t*)SP) && (*Scan++ == STACK_PAINT))
+	  Unused++;
+
+	return Unused;
+}
+
 /** Configures the board hardware and chip peripherals for the demo's functionality. */
 void SetupHardware(void)
 {
@@ -332,9 +620,27 @@ void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t *const C
 bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
 	bool CommandSuccess;
+	LATENCY_DECLARE(Start);
 
 	LEDs_SetAllLEDs(LEDMASK_USB_BUSY);
+	LATENCY_START(Start);
 	CommandSuccess = SCSI_DecodeSCSICommand(MSInterfaceInfo);
+
+	#if defined(LATENCY_HISTOGRAMS)
+	switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
+	{
+		case SCSI_CMD_READ_10:
+			LATENCY_STOP(LATENCY_SCSI_READ, Start);
+			break;
+		case SCSI_CMD_WRITE_10:
+			LATENCY_STOP(LATENCY_SCSI_WRITE, Start);
+			break;
+		default:
+			LATENCY_STOP(LATENCY_SCSI_OTHER, Start);
+			break;
+	}
+	#endif
+
 	LEDs_SetAllLEDs(LEDMASK_USB_READY);
 
 	return CommandSuccess;
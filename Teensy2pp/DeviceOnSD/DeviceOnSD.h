@@ -70,8 +70,13 @@
 		/** LED mask for the library LED driver, to indicate that the USB interface is busy. */
 		#define LEDMASK_USB_BUSY          LEDS_LED2
 
+		/** Byte the free RAM is filled with at start-up, to find out later how deep the stack has grown. */
+		#define STACK_PAINT               0xC5
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
+		void Stack_Paint(void) ATTR_NAKED ATTR_INIT_SECTION(3);
+		uint16_t Stack_Unused(void);
 
 		void EVENT_USB_Device_Connect(void);
 		void EVENT_USB_Device_Disconnect(void);
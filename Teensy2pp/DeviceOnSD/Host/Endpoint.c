@@ -0,0 +1,576 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Host build model of the Mass Storage endpoints and of the USB full speed bus behind them. The firmware fills and
+ *  empties the double banked endpoints through the LUFA Endpoint API as on the target, while the host side of the
+ *  model sends the queued OUT transfers and takes the IN packets one bulk packet time at a time, sharing the bus
+ *  between the two directions. Waiting for a bank advances the host build time to the moment the bank frees up.
+ */
+
+#include <string.h>
+
+#include "Endpoint.h"
+#include "Host.h"
+#include "Descriptors.h"
+
+/** Type define for an endpoint bank. An IN bank is free once the host has taken the packet committed into it, an OUT
+ *  bank is readable once the packet sent into it by the host has arrived.
+ */
+typedef struct
+{
+	uint8_t  Data[MASS_STORAGE_IO_EPSIZE]; /**< Packet data */
+	uint16_t Length;   /**< Number of bytes written into an IN bank, or received into an OUT bank */
+	uint16_t Position; /**< Number of bytes of an OUT bank read by the firmware */
+	bool     Busy;     /**< IN bank committed to the host, or OUT bank holding a packet */
+	uint64_t ReadyAt;  /**< Time the host takes a committed IN packet, or an OUT packet arrives */
+} Endpoint_Bank_t;
+
+/** Type define for a Mass Storage endpoint. */
+typedef struct
+{
+	Endpoint_Bank_t Banks[ENDPOINT_BANKS]; /**< Endpoint banks, used in turn */
+	uint8_t         Current; /**< Bank accessed by the firmware */
+} Endpoint_State_t;
+
+/** Type define for an OUT transfer queued by the host. */
+typedef struct
+{
+	uint32_t End;       /**< Offset of the end of the transfer data in \ref HostOUTData */
+	uint64_t NotBefore; /**< Earliest time the host starts sending the transfer */
+	bool     Started;   /**< First packet of the transfer sent */
+} Endpoint_Transfer_t;
+
+/** Traffic counters of the Mass Storage endpoints. */
+Endpoint_Stats_t Endpoint_Stats;
+
+/** Mass Storage data IN endpoint. */
+static Endpoint_State_t EndpointIN;
+
+/** Mass Storage data OUT endpoint. */
+static Endpoint_State_t EndpointOUT;
+
+/** Address of the endpoint selected by the firmware. */
+static uint8_t SelectedAddress;
+
+/** Time the bus finishes the last packet scheduled on it. */
+static uint64_t BusFree;
+
+/** Time the first packet of the last OUT transfer started by the host arrived. */
+static uint64_t TransferStartedAt;
+
+/** Data of the OUT transfers queued by the host. */
+static uint8_t HostOUTData[ENDPOINT_HOST_BUFFER_SIZE];
+
+/** Offset of the next byte of \ref HostOUTData to send. */
+static uint32_t HostOUTHead;
+
+/** OUT transfers queued by the host, the first one being sent. */
+static Endpoint_Transfer_t HostTransfers[ENDPOINT_HOST_TRANSFERS];
+
+/** Number of OUT transfers queued by the host. */
+static uint8_t HostTransferCount;
+
+/** Data of the IN packets taken by the host. */
+static uint8_t HostINData[ENDPOINT_HOST_BUFFER_SIZE];
+
+/** Number of bytes of IN packets taken by the host, including those not stored for lack of room. */
+static uint32_t HostINLength;
+
+
+/** Computes the bus time of a bulk packet, its data bytes being sent at 12Mbit/s.
+ *
+ *  \param[in] Length  Number of data bytes in the packet
+ *
+ *  \return Bus time of the packet in CPU cycles
+ */
+static uint32_t Endpoint_PacketTime(const uint16_t Length)
+{
+	return Host_Costs.PacketCycles + ((uint32_t)Length * 8 * (F_CPU / 1000000UL) / 12);
+}
+
+/** Hands the next packets of the queued OUT transfers to the free OUT banks, in the order the firmware reads them. */
+static void Endpoint_ScheduleOUT(void)
+{
+	for (uint8_t n = 0; (n < ENDPOINT_BANKS) && HostTransferCount; n++)
+	{
+		Endpoint_Bank_t*     Bank     = &EndpointOUT.Banks[(EndpointOUT.Current + n) % ENDPOINT_BANKS];
+		Endpoint_Transfer_t* Transfer = &HostTransfers[0];
+		uint64_t             Start    = MAX(MAX(BusFree, Host_Cycles), Transfer->NotBefore);
+
+		if (Bank->Busy)
+		  continue;
+
+		Bank->Length   = MIN(MASS_STORAGE_IO_EPSIZE, Transfer->End - HostOUTHead);
+		Bank->Position = 0;
+		Bank->Busy     = true;
+		Bank->ReadyAt  = Start + Endpoint_PacketTime(Bank->Length);
+		memcpy(Bank->Data, &HostOUTData[HostOUTHead], Bank->Length);
+		BusFree        = Bank->ReadyAt;
+
+		if (!(Transfer->Started))
+		{
+			TransferStartedAt = Bank->ReadyAt;
+			Transfer->Started = true;
+		}
+
+		HostOUTHead += Bank->Length;
+		if (HostOUTHead == Transfer->End)
+		{
+			memmove(&HostTransfers[0], &HostTransfers[1], (--HostTransferCount) * sizeof(Endpoint_Transfer_t));
+
+			if (!(HostTransferCount))
+			  HostOUTHead = 0;
+		}
+	}
+}
+
+/** Gets the current bank of the IN endpoint if the firmware may fill it, taking back a bank whose packet the host has
+ *  taken by now.
+ *
+ *  \return Pointer to the bank, or \c NULL if it is still waiting for the host
+ */
+static Endpoint_Bank_t* Endpoint_INBank(void)
+{
+	Endpoint_Bank_t* Bank = &EndpointIN.Banks[EndpointIN.Current];
+
+	if (Bank->Busy && (Bank->ReadyAt <= Host_Cycles))
+	{
+		Bank->Busy   = false;
+		Bank->Length = 0;
+	}
+
+	return (Bank->Busy ? NULL : Bank);
+}
+
+/** Gets the current bank of the OUT endpoint if a packet has arrived into it.
+ *
+ *  \return Pointer to the bank, or \c NULL if no packet has arrived yet
+ */
+static Endpoint_Bank_t* Endpoint_OUTBank(void)
+{
+	Endpoint_Bank_t* Bank = &EndpointOUT.Banks[EndpointOUT.Current];
+
+	return ((Bank->Busy && (Bank->ReadyAt <= Host_Cycles)) ? Bank : NULL);
+}
+
+/** Moves a stream of bytes through the selected endpoint, as the LUFA stream functions do: the banks are cleared as
+ *  they fill up or empty, and a partial transfer returns after clearing a bank if the caller tracks its progress.
+ *
+ *  \param[in,out] Buffer          First byte to move, or \c NULL to send zeros or discard the received bytes
+ *  \param[in]     Step            Offset from one byte of the buffer to the next, -1 for a big endian stream
+ *  \param[in]     Length          Number of bytes to move
+ *  \param[in,out] BytesProcessed  Number of bytes already moved by a partial transfer, or \c NULL
+ *
+ *  \return A value from the \ref Endpoint_Stream_RW_ErrorCodes_t enum
+ */
+static uint8_t Endpoint_Stream(uint8_t* Buffer,
+                               const int8_t Step,
+                               uint16_t Length,
+                               uint16_t* const BytesProcessed)
+{
+	bool     IsIN            = (SelectedAddress & ENDPOINT_DIR_IN);
+	uint16_t BytesInTransfer = 0;
+	uint8_t  ErrorCode;
+
+	if ((ErrorCode = Endpoint_WaitUntilReady()))
+	  return ErrorCode;
+
+	if (BytesProcessed != NULL)
+	{
+		Length -= *BytesProcessed;
+		if (Buffer)
+		  Buffer += (*BytesProcessed * Step);
+	}
+
+	while (Length)
+	{
+		if (!(Endpoint_IsReadWriteAllowed()))
+		{
+			if (IsIN)
+			  Endpoint_ClearIN();
+			else
+			  Endpoint_ClearOUT();
+
+			if (BytesProcessed != NULL)
+			{
+				*BytesProcessed += BytesInTransfer;
+				return ENDPOINT_RWSTREAM_IncompleteTransfer;
+			}
+
+			if ((ErrorCode = Endpoint_WaitUntilReady()))
+			  return ErrorCode;
+		}
+		else
+		{
+			if (IsIN)
+			{
+				Endpoint_Write_8(Buffer ? *Buffer : 0);
+			}
+			else
+			{
+				uint8_t Data = Endpoint_Read_8();
+
+				if (Buffer)
+				  *Buffer = Data;
+			}
+
+			if (Buffer)
+			  Buffer += Step;
+
+			Length--;
+			BytesInTransfer++;
+		}
+	}
+
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+/* The functions below stand in for the LUFA Endpoint API functions of the same name, for the Mass Storage endpoints */
+
+void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+	SelectedAddress = Address;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+	return SelectedAddress;
+}
+
+bool Endpoint_IsINReady(void)
+{
+	return (Endpoint_INBank() != NULL);
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+	return (Endpoint_OUTBank() != NULL);
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+	Endpoint_Bank_t* Bank;
+
+	if (SelectedAddress & ENDPOINT_DIR_IN)
+	{
+		Bank = Endpoint_INBank();
+		return (Bank && (Bank->Length < MASS_STORAGE_IO_EPSIZE));
+	}
+
+	Bank = Endpoint_OUTBank();
+	return (Bank && (Bank->Position < Bank->Length));
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+	Endpoint_Bank_t* Bank;
+
+	if (SelectedAddress & ENDPOINT_DIR_IN)
+	{
+		Bank = Endpoint_INBank();
+		return (Bank ? Bank->Length : 0);
+	}
+
+	Bank = Endpoint_OUTBank();
+	return (Bank ? (Bank->Length - Bank->Position) : 0);
+}
+
+/** Waits until the current bank of the selected endpoint is ready for the firmware, advancing the time to the moment
+ *  the host takes the IN packet in it or the OUT packet for it arrives. As on the target, the wait times out after
+ *  100ms, which is also the case when the host has nothing more to send.
+ *
+ *  \return A value from the \ref Endpoint_WaitUntilReady_ErrorCodes_t enum
+ */
+uint8_t Endpoint_WaitUntilReady(void)
+{
+	bool             IsIN    = (SelectedAddress & ENDPOINT_DIR_IN);
+	Endpoint_Bank_t* Bank    = IsIN ? &EndpointIN.Banks[EndpointIN.Current] : &EndpointOUT.Banks[EndpointOUT.Current];
+	uint64_t         Timeout = Host_Cycles + (F_CPU / 10);
+	uint64_t         ReadyAt;
+
+	Host_MarkStack();
+
+	if (IsIN ? Endpoint_IsINReady() : Endpoint_IsOUTReceived())
+	  return ENDPOINT_READYWAIT_NoError;
+
+	ReadyAt = Bank->Busy ? Bank->ReadyAt : UINT64_MAX;
+	if (ReadyAt > Timeout)
+	{
+		Host_Usage.EndpointWaitCycles += (Timeout - Host_Cycles);
+		Host_Advance(Timeout - Host_Cycles);
+		Endpoint_Stats.Timeouts++;
+		return ENDPOINT_READYWAIT_Timeout;
+	}
+
+	Host_Usage.EndpointWaitCycles += (ReadyAt - Host_Cycles);
+	Host_Advance(ReadyAt - Host_Cycles);
+
+	return ENDPOINT_READYWAIT_NoError;
+}
+
+/** Commits the current IN bank to the host, which takes its packet as soon as the bus is free. */
+void Endpoint_ClearIN(void)
+{
+	Endpoint_Bank_t* Bank = Endpoint_INBank();
+
+	if (!(SelectedAddress & ENDPOINT_DIR_IN) || !(Bank))
+	  return;
+
+	Bank->Busy    = true;
+	Bank->ReadyAt = MAX(BusFree, Host_Cycles) + Endpoint_PacketTime(Bank->Length);
+	BusFree       = Bank->ReadyAt;
+
+	if ((HostINLength + Bank->Length) <= sizeof(HostINData))
+	  memcpy(&HostINData[HostINLength], Bank->Data, Bank->Length);
+
+	HostINLength += Bank->Length;
+	Endpoint_Stats.INPackets++;
+	Endpoint_Stats.INBytes += Bank->Length;
+
+	EndpointIN.Current = ((EndpointIN.Current + 1) % ENDPOINT_BANKS);
+}
+
+/** Releases the current OUT bank, which the host then sends its next packet into. */
+void Endpoint_ClearOUT(void)
+{
+	Endpoint_Bank_t* Bank = Endpoint_OUTBank();
+
+	if ((SelectedAddress & ENDPOINT_DIR_IN) || !(Bank))
+	  return;
+
+	Bank->Busy = false;
+	Endpoint_Stats.OUTPackets++;
+	Endpoint_Stats.OUTBytes += Bank->Length;
+
+	EndpointOUT.Current = ((EndpointOUT.Current + 1) % ENDPOINT_BANKS);
+	Endpoint_ScheduleOUT();
+}
+
+/** Stalls the selected endpoint. The host clears the stall right away with a control request, which resets the
+ *  endpoint banks, and gives up the rest of an OUT transfer it was sending.
+ */
+void Endpoint_StallTransaction(void)
+{
+	Endpoint_Stats.Stalls++;
+	BusFree = MAX(BusFree, Host_Cycles) + Host_Costs.StallCycles;
+
+	if (SelectedAddress & ENDPOINT_DIR_IN)
+	  return;
+
+	memset(&EndpointOUT, 0, sizeof(EndpointOUT));
+
+	if (HostTransferCount && HostTransfers[0].Started)
+	{
+		HostOUTHead = HostTransfers[0].End;
+		memmove(&HostTransfers[0], &HostTransfers[1], (--HostTransferCount) * sizeof(Endpoint_Transfer_t));
+	}
+
+	if (!(HostTransferCount))
+	  HostOUTHead = 0;
+
+	Endpoint_ScheduleOUT();
+}
+
+uint8_t Endpoint_Read_8(void)
+{
+	Endpoint_Bank_t* Bank = Endpoint_OUTBank();
+
+	Host_Advance(Host_Costs.EndpointByteCycles);
+
+	return ((Bank && (Bank->Position < Bank->Length)) ? Bank->Data[Bank->Position++] : 0);
+}
+
+void Endpoint_Write_8(const uint8_t Data)
+{
+	Endpoint_Bank_t* Bank = Endpoint_INBank();
+
+	Host_Advance(Host_Costs.EndpointByteCycles);
+
+	if (Bank && (Bank->Length < MASS_STORAGE_IO_EPSIZE))
+	  Bank->Data[Bank->Length++] = Data;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer,
+                                 uint16_t Length,
+                                 uint16_t* const BytesProcessed)
+{
+	return Endpoint_Stream((uint8_t*)Buffer, 1, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Write_Stream_BE(const void* const Buffer,
+                                 uint16_t Length,
+                                 uint16_t* const BytesProcessed)
+{
+	return Endpoint_Stream((uint8_t*)Buffer + Length - 1, -1, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Read_Stream_LE(void* const Buffer,
+                                uint16_t Length,
+                                uint16_t* const BytesProcessed)
+{
+	return Endpoint_Stream((uint8_t*)Buffer, 1, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Null_Stream(uint16_t Length,
+                             uint16_t* const BytesProcessed)
+{
+	return Endpoint_Stream(NULL, 1, Length, BytesProcessed);
+}
+
+uint8_t Endpoint_Discard_Stream(uint16_t Length,
+                                uint16_t* const BytesProcessed)
+{
+	return Endpoint_Stream(NULL, 1, Length, BytesProcessed);
+}
+
+/** Resets the endpoints and the bus, dropping any queued transfer, and clears the traffic counters. */
+void Endpoint_HostReset(void)
+{
+	memset(&EndpointIN, 0, sizeof(EndpointIN));
+	memset(&EndpointOUT, 0, sizeof(EndpointOUT));
+	memset(&Endpoint_Stats, 0, sizeof(Endpoint_Stats));
+
+	BusFree           = Host_Cycles;
+	TransferStartedAt = Host_Cycles;
+	HostOUTHead       = 0;
+	HostTransferCount = 0;
+	HostINLength      = 0;
+}
+
+/** Queues an OUT transfer to be sent by the host, in packets of the endpoint size, after those queued before.
+ *
+ *  \param[in] Data       Data of the transfer
+ *  \param[in] Length     Number of bytes of the transfer
+ *  \param[in] NotBefore  Earliest time the host starts sending the transfer
+ *
+ *  \return Boolean \c true if the transfer was queued, \c false if there is no room for it
+ */
+bool Endpoint_HostSend(const void* const Data,
+                       const uint32_t Length,
+                       const uint64_t NotBefore)
+{
+	uint32_t Tail = HostTransferCount ? HostTransfers[HostTransferCount - 1].End : 0;
+
+	if (!(Length))
+	  return true;
+
+	if ((HostTransferCount == ENDPOINT_HOST_TRANSFERS) || ((Tail + Length) > sizeof(HostOUTData)))
+	  return false;
+
+	memcpy(&HostOUTData[Tail], Data, Length);
+	HostTransfers[HostTransferCount++] = (Endpoint_Transfer_t){.End = Tail + Length, .NotBefore = NotBefore};
+
+	Endpoint_ScheduleOUT();
+	return true;
+}
+
+/** Gets the number of bytes the host has taken from the IN endpoint since the last \ref Endpoint_HostDiscard() call,
+ *  which may be more than \ref Endpoint_HostData() holds.
+ *
+ *  \return Number of bytes taken by the host
+ */
+uint32_t Endpoint_HostReceived(void)
+{
+	return HostINLength;
+}
+
+/** Gets the bytes the host has taken from the IN endpoint, up to \ref ENDPOINT_HOST_BUFFER_SIZE of them.
+ *
+ *  \return Pointer to the bytes taken by the host
+ */
+const uint8_t* Endpoint_HostData(void)
+{
+	return HostINData;
+}
+
+/** Discards the bytes the host has taken from the IN endpoint so far. */
+void Endpoint_HostDiscard(void)
+{
+	HostINLength = 0;
+}
+
+/** Gets the time the bus finishes the packets scheduled so far, the last one being the command status once a command
+ *  is done.
+ *
+ *  \return Time the bus gets idle
+ */
+uint64_t Endpoint_HostIdleAt(void)
+{
+	return MAX(BusFree, Host_Cycles);
+}
+
+/** Gets the time the first packet of the last OUT transfer started by the host arrived, that of the command block
+ *  when the transfer is a command.
+ *
+ *  \return Arrival time of the first packet
+ */
+uint64_t Endpoint_HostCommandAt(void)
+{
+	return TransferStartedAt;
+}
+
+/** Puts bytes into the current IN bank as the firmware stores them into the endpoint FIFO register while clocking
+ *  the SPI bus, which costs no time of its own.
+ *
+ *  \param[in] Data    Bytes to put into the bank
+ *  \param[in] Length  Number of bytes
+ */
+void Endpoint_FIFOWrite(const uint8_t* Data,
+                        uint16_t Length)
+{
+	Endpoint_Bank_t* Bank = Endpoint_INBank();
+
+	Host_MarkStack();
+
+	for (; Length; Length--, Data++)
+	{
+		if (Bank && (Bank->Length < MASS_STORAGE_IO_EPSIZE))
+		  Bank->Data[Bank->Length++] = *Data;
+	}
+}
+
+/** Takes bytes out of the current OUT bank as the firmware loads them from the endpoint FIFO register while clocking
+ *  the SPI bus, which costs no time of its own.
+ *
+ *  \param[out] Data    Buffer to store the bytes
+ *  \param[in]  Length  Number of bytes
+ */
+void Endpoint_FIFORead(uint8_t* Data,
+                       uint16_t Length)
+{
+	Endpoint_Bank_t* Bank = Endpoint_OUTBank();
+
+	Host_MarkStack();
+
+	for (; Length; Length--, Data++)
+	  *Data = (Bank && (Bank->Position < Bank->Length)) ? Bank->Data[Bank->Position++] : 0;
+}
@@ -0,0 +1,87 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for Endpoint.c.
+ */
+
+#ifndef _ENDPOINT_H_
+#define _ENDPOINT_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <LUFA/Drivers/USB/USB.h>
+
+	/* Macros: */
+		/** Number of banks of each of the Mass Storage endpoints, as configured by the application. */
+		#define ENDPOINT_BANKS             2
+
+		/** Size of the buffers holding the data of the transfers in each direction, enough for a 1MB transfer and its
+		 *  command block or status.
+		 */
+		#define ENDPOINT_HOST_BUFFER_SIZE  (1024UL * 1024UL + 64)
+
+		/** Maximum number of OUT transfers queued by the host at a time. */
+		#define ENDPOINT_HOST_TRANSFERS    4
+
+	/* Type Defines: */
+		/** Type define for the traffic counters of the Mass Storage endpoints. */
+		typedef struct
+		{
+			uint32_t INPackets;          /**< Number of packets sent to the host */
+			uint32_t OUTPackets;         /**< Number of packets received from the host */
+			uint64_t INBytes;            /**< Number of bytes sent to the host */
+			uint64_t OUTBytes;           /**< Number of bytes received from the host */
+			uint32_t Stalls;             /**< Number of endpoint stalls cleared by the host */
+			uint32_t Timeouts;           /**< Number of waits for an endpoint bank that timed out */
+		} Endpoint_Stats_t;
+
+	/* External Variables: */
+		extern Endpoint_Stats_t Endpoint_Stats;
+
+	/* Function Prototypes: */
+		void           Endpoint_HostReset(void);
+		bool           Endpoint_HostSend(const void* const Data,
+		                                 const uint32_t Length,
+		                                 const uint64_t NotBefore);
+		uint32_t       Endpoint_HostReceived(void);
+		const uint8_t* Endpoint_HostData(void);
+		void           Endpoint_HostDiscard(void);
+		uint64_t       Endpoint_HostIdleAt(void);
+		uint64_t       Endpoint_HostCommandAt(void);
+		void           Endpoint_FIFOWrite(const uint8_t* Data,
+		                                  uint16_t Length);
+		void           Endpoint_FIFORead(uint8_t* Data,
+		                                 uint16_t Length);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  FAT32 formatter of the emulated card, writing the image directly. The card gets a partition table with a single
+ *  FAT32 partition, whose root directory may hold a small file such as the wahaha.ini configuration file. FatFs has
+ *  no formatter in this build (FF_USE_MKFS is off), and the host build sets the card up without any card traffic.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "Format.h"
+
+/** Stores a 16 bit value in little endian order. */
+static void Format_Store16(uint8_t* const Data,
+                           const uint16_t Value)
+{
+	Data[0] = (uint8_t)Value;
+	Data[1] = (uint8_t)(Value >> 8);
+}
+
+/** Stores a 32 bit value in little endian order. */
+static void Format_Store32(uint8_t* const Data,
+                           const uint32_t Value)
+{
+	Format_Store16(Data, (uint16_t)Value);
+	Format_Store16(&Data[2], (uint16_t)(Value >> 16));
+}
+
+/** Formats the card with a single FAT32 partition, erasing all its contents.
+ *
+ *  \param[in,out] Card      Emulated card
+ *  \param[in]     FileName  Name of a file to create in the root directory, in the 11 character 8.3 directory entry
+ *                           form (e.g. "WAHAHA  INI"), or \c NULL for none
+ *  \param[in]     FileData  Contents of the file, a string of less than a cluster
+ *
+ *  \return Boolean \c true if the card was formatted, \c false otherwise
+ */
+bool Format_FAT32(SDCard_t* const Card,
+                  const char* const FileName,
+                  const char* const FileData)
+{
+	uint8_t  Sector[SDCARD_BLOCK_SIZE];
+	uint32_t Sectors = Card->Blocks - FORMAT_PARTITION_START;
+	uint32_t FATSectors = 1;
+	uint32_t Clusters;
+	uint32_t Volume = FORMAT_PARTITION_START;
+	uint32_t Data;
+
+	/* Grow the FAT until it covers all the clusters left after it */
+	for (;;)
+	{
+		Clusters = (Sectors - FORMAT_RESERVED_SECTORS - (2 * FATSectors)) / FORMAT_CLUSTER_SECTORS;
+		if (((Clusters + 2) * 4) <= (FATSectors * SDCARD_BLOCK_SIZE))
+		  break;
+
+		FATSectors++;
+	}
+
+	if ((Card->Blocks <= FORMAT_PARTITION_START) || (Clusters < 65525))
+	  return false;
+
+	Data = Volume + FORMAT_RESERVED_SECTORS + (2 * FATSectors);
+
+	/* Start from a blank card, reading as zeros */
+	if (ftruncate(fileno(Card->Image), 0) || ftruncate(fileno(Card->Image), (off_t)Card->Blocks * SDCARD_BLOCK_SIZE))
+	  return false;
+
+	/* Partition table */
+	memset(Sector, 0, sizeof(Sector));
+	Sector[446 + 4] = 0x0C;
+	Format_Store32(&Sector[446 + 8], Volume);
+	Format_Store32(&Sector[446 + 12], Sectors);
+	Format_Store16(&Sector[510], 0xAA55);
+	if (!(SDCard_WriteBlock(Card, 0, Sector)))
+	  return false;
+
+	/* Boot sector, written again as the backup boot sector */
+	memset(Sector, 0, sizeof(Sector));
+	memcpy(Sector, "\xEB\x58\x90" "MSDOS5.0", 11);
+	Format_Store16(&Sector[11], SDCARD_BLOCK_SIZE);
+	Sector[13] = FORMAT_CLUSTER_SECTORS;
+	Format_Store16(&Sector[14], FORMAT_RESERVED_SECTORS);
+	Sector[16] = 2;
+	Sector[21] = 0xF8;
+	Format_Store16(&Sector[24], 63);
+	Format_Store16(&Sector[26], 255);
+	Format_Store32(&Sector[28], Volume);
+	Format_Store32(&Sector[32], Sectors);
+	Format_Store32(&Sector[36], FATSectors);
+	Format_Store32(&Sector[44], 2);
+	Format_Store16(&Sector[48], 1);
+	Format_Store16(&Sector[50], 6);
+	Sector[64] = 0x80;
+	Sector[66] = 0x29;
+	Format_Store32(&Sector[67], 0x20190314);
+	memcpy(&Sector[71], "NO NAME    FAT32   ", 19);
+	Format_Store16(&Sector[510], 0xAA55);
+	if (!(SDCard_WriteBlock(Card, Volume, Sector)) || !(SDCard_WriteBlock(Card, Volume + 6, Sector)))
+	  return false;
+
+	/* FSInfo sector, with the root directory and the file cluster taken */
+	memset(Sector, 0, sizeof(Sector));
+	Format_Store32(&Sector[0], 0x41615252);
+	Format_Store32(&Sector[484], 0x61417272);
+	Format_Store32(&Sector[488], Clusters - 2);
+	Format_Store32(&Sector[492], 4);
+	Format_Store32(&Sector[508], 0xAA550000);
+	if (!(SDCard_WriteBlock(Card, Volume + 1, Sector)) || !(SDCard_WriteBlock(Card, Volume + 7, Sector)))
+	  return false;
+
+	/* First sector of both FATs: media and end of chain markers, the root directory and the file in one cluster each */
+	memset(Sector, 0, sizeof(Sector));
+	Format_Store32(&Sector[0], 0x0FFFFFF8);
+	Format_Store32(&Sector[4], 0x0FFFFFFF);
+	Format_Store32(&Sector[8], 0x0FFFFFFF);
+	Format_Store32(&Sector[12], 0x0FFFFFFF);
+	if (!(SDCard_WriteBlock(Card, Volume + FORMAT_RESERVED_SECTORS, Sector)) ||
+	    !(SDCard_WriteBlock(Card, Volume + FORMAT_RESERVED_SECTORS + FATSectors, Sector)))
+	{
+		return false;
+	}
+
+	if (!(FileName))
+	  return true;
+
+	/* Root directory entry of the file in cluster 3 */
+	memset(Sector, 0, sizeof(Sector));
+	memcpy(Sector, FileName, 11);
+	Sector[11] = 0x20;
+	Format_Store16(&Sector[26], 3);
+	Format_Store32(&Sector[28], strlen(FileData));
+	if (!(SDCard_WriteBlock(Card, Data, Sector)))
+	  return false;
+
+	/* File contents */
+	memset(Sector, 0, sizeof(Sector));
+	memcpy(Sector, FileData, strlen(FileData));
+	return SDCard_WriteBlock(Card, Data + FORMAT_CLUSTER_SECTORS, Sector);
+}
@@ -0,0 +1,60 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for Format.c.
+ */
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include "SDCard.h"
+
+	/* Macros: */
+		/** First sector of the partition, aligned to 4MB as the SD card formatter does. */
+		#define FORMAT_PARTITION_START     8192
+
+		/** Number of sectors per cluster, 4KB clusters. */
+		#define FORMAT_CLUSTER_SECTORS     8
+
+		/** Number of reserved sectors at the start of the partition. */
+		#define FORMAT_RESERVED_SECTORS    32
+
+	/* Function Prototypes: */
+		bool Format_FAT32(SDCard_t* const Card,
+		                  const char* const FileName,
+		                  const char* const FileData);
+
+#endif
@@ -0,0 +1,366 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Host build core, standing in for the AT90USB1286 the storage stack runs on. It keeps the time in CPU cycles of
+ *  the target, runs the 100Hz timer procedures as the time goes by, clocks every SPI byte the card driver sends
+ *  through the emulated card at the SPI clock set in the SPI registers, and measures the heap and stack the firmware
+ *  code uses.
+ *
+ *  The card driver moves a data block straight between the SPI and endpoint FIFO data registers in its FIFO stream
+ *  functions, which a register file in host memory cannot follow. The calls the SCSI layer makes to them are
+ *  diverted by the linker (--wrap) to equivalents that move the block through a buffer with the plain block
+ *  transfer of the driver, at the same bus cost.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Host.h"
+#include "Endpoint.h"
+#include "Lib/SCSI.h"
+#include "Lib/diskio.h"
+#include "Lib/mmc_avr.h"
+#include "Lib/Timebase.h"
+
+/** Bit of the chip select line of the card in PORTB and DDRB. */
+#define HOST_CARD_CS            (1 << 0)
+
+/** Time in CPU cycles of the target since the host build started. */
+uint64_t Host_Cycles;
+
+/** Costs of the target operations not run cycle by cycle. */
+Host_Costs_t Host_Costs;
+
+/** Resource usage of the firmware code. */
+Host_Usage_t Host_Usage;
+
+/** Emulated card in the socket. */
+SDCard_t Host_Card;
+
+/** I/O register file of the target. */
+volatile uint8_t Host_IORegisters[0x100];
+
+/** Time the 100Hz system timer procedures are called next. */
+static uint64_t NextTimerTick;
+
+/** Address of a local variable of the main loop, the base of the stack depth measurements. */
+static uintptr_t StackBase;
+
+/** Names of the costs settable with \ref Host_SetCost(), with the offset of each in \ref Host_Costs_t. */
+static const struct
+{
+	const char* Name;
+	size_t      Offset;
+	uint8_t     Size;
+} CostOptions[] =
+	{
+		{"spi-gap",     offsetof(Host_Costs_t, SpiGapCycles),       sizeof(uint16_t)},
+		{"ep-byte",     offsetof(Host_Costs_t, EndpointByteCycles), sizeof(uint16_t)},
+		{"packet",      offsetof(Host_Costs_t, PacketCycles),       sizeof(uint16_t)},
+		{"stall",       offsetof(Host_Costs_t, StallCycles),        sizeof(uint16_t)},
+		{"loop",        offsetof(Host_Costs_t, LoopCycles),         sizeof(uint16_t)},
+		{"command-gap", offsetof(Host_Costs_t, CommandGapCycles),   sizeof(uint32_t)},
+	};
+
+
+/** Resets the time, the I/O registers and the resource usage, and sets the default costs: a SPIF polling loop of 4
+ *  cycles, 8 cycles per byte of the LUFA stream loops, 160 cycles of token, handshake and gaps per bulk packet so
+ *  that a full speed frame carries at most 19 full packets, and a command block sent as soon as the previous status
+ *  is taken.
+ */
+void Host_Reset(void)
+{
+	Host_Cycles   = 0;
+	NextTimerTick = HOST_CYCLES_PER_TIMER_TICK;
+
+	memset((void*)Host_IORegisters, 0, sizeof(Host_IORegisters));
+	memset(&Host_Usage, 0, sizeof(Host_Usage));
+	Host_Usage.HeapLimit = UINT32_MAX;
+
+	Host_Costs = (Host_Costs_t)
+		{
+			.SpiGapCycles       = 4,
+			.EndpointByteCycles = 8,
+			.PacketCycles       = 160,
+			.StallCycles        = 16000,
+			.LoopCycles         = 200,
+			.CommandGapCycles   = 0,
+		};
+}
+
+/** Sets one of the costs from a "name=value" option, the names being spi-gap, ep-byte, packet, stall, loop and
+ *  command-gap, all in CPU cycles.
+ *
+ *  \param[in] Option  Option string
+ *
+ *  \return Boolean \c true if the option names a cost, \c false otherwise
+ */
+bool Host_SetCost(const char* const Option)
+{
+	const char* Value = strchr(Option, '=');
+	size_t      NameLength;
+
+	if (!(Value))
+	  return false;
+
+	NameLength = (size_t)(Value++ - Option);
+
+	for (uint8_t n = 0; n < (sizeof(CostOptions) / sizeof(CostOptions[0])); n++)
+	{
+		if ((strlen(CostOptions[n].Name) == NameLength) && !(strncmp(Option, CostOptions[n].Name, NameLength)))
+		{
+			uint8_t* Cost = (uint8_t*)&Host_Costs + CostOptions[n].Offset;
+
+			if (CostOptions[n].Size == sizeof(uint16_t))
+			  *(uint16_t*)Cost = (uint16_t)strtoul(Value, NULL, 0);
+			else
+			  *(uint32_t*)Cost = (uint32_t)strtoul(Value, NULL, 0);
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/** Advances the time, calling the 100Hz system timer procedures of the firmware each time a period has elapsed, as
+ *  the TIMER0 compare interrupt does on the target.
+ *
+ *  \param[in] Cycles  Number of CPU cycles to advance the time by
+ */
+void Host_Advance(const uint32_t Cycles)
+{
+	Host_Cycles += Cycles;
+
+	while (Host_Cycles >= NextTimerTick)
+	{
+		NextTimerTick += HOST_CYCLES_PER_TIMER_TICK;
+
+		disk_timerproc();
+		SCSI_CacheTimerproc();
+	}
+}
+
+/** Sets the base of the stack depth measurements. This should be called from the main loop, before the firmware
+ *  tasks are run.
+ */
+void Host_SetStackBase(void)
+{
+	StackBase = (uintptr_t)__builtin_frame_address(0);
+}
+
+/** Records the stack depth of the firmware code calling this. It is called from the register and endpoint accesses,
+ *  which are the innermost calls of the firmware code paths.
+ */
+void Host_MarkStack(void)
+{
+	uintptr_t Depth = StackBase - (uintptr_t)__builtin_frame_address(0);
+
+	if (StackBase && (Depth < (1UL << 20)) && (Depth > Host_Usage.StackPeak))
+	  Host_Usage.StackPeak = Depth;
+}
+
+/** Polls a bit of an I/O register. Waiting for SPIF in SPSR is where the SPI transfer started by the preceding write
+ *  to SPDR takes place: the byte is exchanged with the card while the time advances by the 8 SPI clocks of the byte
+ *  and the SPIF polling gap, and the byte received is left in SPDR. The card is selected by the chip select line
+ *  driven low.
+ *
+ *  \param[in,out] Register  Register to poll
+ *  \param[in]     Bit       Bit of the register to poll
+ *
+ *  \return Non-zero if the bit is set, zero otherwise
+ */
+uint8_t Host_PollBit(volatile uint8_t* const Register,
+                     const uint8_t Bit)
+{
+	static const uint8_t SpiDivider[4] = {4, 16, 64, 128};
+
+	if ((Register == &SPSR) && (Bit == SPIF))
+	{
+		uint32_t Cycles = (uint32_t)SpiDivider[SPCR & ((1 << SPR1) | (1 << SPR0))] * 8;
+
+		if (SPSR & (1 << SPI2X))
+		  Cycles /= 2;
+
+		Host_MarkStack();
+
+		Cycles += Host_Costs.SpiGapCycles;
+		Host_Usage.SpiCycles += Cycles;
+		Host_Advance(Cycles);
+
+		SDCard_Select(&Host_Card, (DDRB & HOST_CARD_CS) && !(PORTB & HOST_CARD_CS));
+		SPDR = SDCard_Exchange(&Host_Card, SPDR, HOST_CYCLES_TO_NS(Host_Cycles));
+
+		return 1;
+	}
+
+	return (*Register & (1 << Bit));
+}
+
+/** Starts the high resolution timebase, which the host build derives from its time. */
+void Timebase_Init(void)
+{
+}
+
+/** Reads the current timebase count.
+ *
+ *  \return Number of \ref TIMEBASE_TICKS_PER_US ticks since the host build started, modulo 2^32
+ */
+uint32_t Timebase_GetTicks(void)
+{
+	return (uint32_t)(Host_Cycles / TIMEBASE_CYCLES_PER_TICK);
+}
+
+/** Services the other USB interfaces while the card is busy, of which the host build has none. */
+void mmc_yield(void)
+{
+}
+
+void __real_mmc_stream_read_part(BYTE* buff, UINT cnt, const BYTE* out, volatile BYTE* fifo);
+void __real_mmc_stream_write_part(const BYTE* buff, UINT cnt, BYTE* in, volatile BYTE* fifo);
+
+/** Host build equivalent of \c mmc_stream_read_fifo(), receiving the data into the current IN bank.
+ *
+ *  \param[in] cnt   Number of bytes to read
+ *  \param[in] fifo  FIFO data register, the endpoint being the selected one
+ */
+void __wrap_mmc_stream_read_fifo(UINT cnt,
+                                 volatile BYTE* fifo)
+{
+	BYTE Data[VIRTUAL_MEMORY_BLOCK_SIZE];
+
+	(void)fifo;
+
+	/* A dead transaction leaves the buffer untouched, the FIFO is then filled with 0xFF */
+	memset(Data, 0xFF, cnt);
+	__real_mmc_stream_read_part(Data, cnt, NULL, NULL);
+	Endpoint_FIFOWrite(Data, cnt);
+}
+
+/** Host build equivalent of \c mmc_stream_write_fifo(), sending the data of the current OUT bank.
+ *
+ *  \param[in] cnt   Number of bytes to write
+ *  \param[in] fifo  FIFO data register, the endpoint being the selected one
+ */
+void __wrap_mmc_stream_write_fifo(UINT cnt,
+                                  volatile BYTE* fifo)
+{
+	BYTE Data[VIRTUAL_MEMORY_BLOCK_SIZE];
+
+	(void)fifo;
+
+	Endpoint_FIFORead(Data, cnt);
+	__real_mmc_stream_write_part(Data, cnt, NULL, NULL);
+}
+
+/** Host build equivalent of \c mmc_stream_read_part(), putting the data to send into the current IN bank.
+ *
+ *  \param[out] buff  Buffer to store the read data
+ *  \param[in]  cnt   Number of bytes to read
+ *  \param[in]  out   Data to put into the FIFO meanwhile, or \c NULL for none
+ *  \param[in]  fifo  FIFO data register, the endpoint being the selected one
+ */
+void __wrap_mmc_stream_read_part(BYTE* buff,
+                                 UINT cnt,
+                                 const BYTE* out,
+                                 volatile BYTE* fifo)
+{
+	(void)fifo;
+
+	if (out)
+	  Endpoint_FIFOWrite(out, cnt);
+
+	__real_mmc_stream_read_part(buff, cnt, NULL, NULL);
+}
+
+/** Host build equivalent of \c mmc_stream_write_part(), taking the received data out of the current OUT bank.
+ *
+ *  \param[in]  buff  Data to write
+ *  \param[in]  cnt   Number of bytes to write
+ *  \param[out] in    Buffer to take the FIFO contents meanwhile, or \c NULL for none
+ *  \param[in]  fifo  FIFO data register, the endpoint being the selected one
+ */
+void __wrap_mmc_stream_write_part(const BYTE* buff,
+                                  UINT cnt,
+                                  BYTE* in,
+                                  volatile BYTE* fifo)
+{
+	(void)fifo;
+
+	/* Send first, in may be buff like on the target where each byte is sent before its place is taken */
+	__real_mmc_stream_write_part(buff, cnt, NULL, NULL);
+
+	if (in)
+	  Endpoint_FIFORead(in, cnt);
+}
+
+void* __real_malloc(size_t Size);
+void  __real_free(void* Pointer);
+
+/** Allocates memory for the firmware code, keeping track of the heap in use and failing beyond the heap limit.
+ *
+ *  \param[in] Size  Number of bytes to allocate
+ *
+ *  \return Pointer to the allocated memory, or \c NULL if it could not be allocated
+ */
+void* __wrap_malloc(size_t Size)
+{
+	size_t* Block;
+
+	if ((Host_Usage.HeapInUse + Size) > Host_Usage.HeapLimit)
+	  return NULL;
+
+	if (!(Block = __real_malloc(sizeof(size_t) + Size)))
+	  return NULL;
+
+	*Block = Size;
+	Host_Usage.HeapInUse += Size;
+	if (Host_Usage.HeapInUse > Host_Usage.HeapPeak)
+	  Host_Usage.HeapPeak = Host_Usage.HeapInUse;
+
+	return (Block + 1);
+}
+
+/** Frees memory allocated by the firmware code.
+ *
+ *  \param[in] Pointer  Pointer to the memory, or \c NULL
+ */
+void __wrap_free(void* Pointer)
+{
+	size_t* Block = (size_t*)Pointer - 1;
+
+	if (!(Pointer))
+	  return;
+
+	Host_Usage.HeapInUse -= *Block;
+	__real_free(Block);
+}
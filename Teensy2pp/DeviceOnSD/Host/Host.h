@@ -0,0 +1,94 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for Host.c.
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include "SDCard.h"
+
+	/* Macros: */
+		/** Number of CPU cycles between two calls of the 100Hz system timer procedures. */
+		#define HOST_CYCLES_PER_TIMER_TICK  (F_CPU / 100)
+
+		/** Converts a number of CPU cycles to nanoseconds, the unit of the card time. */
+		#define HOST_CYCLES_TO_NS(Cycles)   ((uint64_t)(Cycles) * 1000000000ULL / F_CPU)
+
+		/** Converts a number of CPU cycles to microseconds. */
+		#define HOST_CYCLES_TO_US(Cycles)   ((uint64_t)(Cycles) / (F_CPU / 1000000UL))
+
+	/* Type Defines: */
+		/** Type define for the costs of the target operations that the host build does not run cycle by cycle, in CPU
+		 *  cycles. Everything else the firmware does is taken as free, so the times are those of the card and USB
+		 *  traffic and of the byte loops feeding them.
+		 */
+		typedef struct
+		{
+			uint16_t SpiGapCycles;        /**< Cycles between the end of an SPI byte and the start of the next one */
+			uint16_t EndpointByteCycles;  /**< Cycles per byte moved by an Endpoint stream function or a byte access */
+			uint16_t PacketCycles;        /**< Bus overhead of a bulk packet, on top of 32/3 cycles per data byte */
+			uint16_t StallCycles;         /**< Bus time the host takes to clear a stalled endpoint */
+			uint16_t LoopCycles;          /**< Cycles of a main loop pass with nothing to do */
+			uint32_t CommandGapCycles;    /**< Host delay from a command status to the next command block */
+		} Host_Costs_t;
+
+		/** Type define for the resource usage of the firmware code run by the host build. */
+		typedef struct
+		{
+			uint64_t SpiCycles;           /**< Cycles spent clocking SPI bytes */
+			uint64_t EndpointWaitCycles;  /**< Cycles spent waiting for an endpoint bank */
+			uint32_t HeapInUse;           /**< Bytes currently allocated from the heap */
+			uint32_t HeapPeak;            /**< Most bytes ever allocated from the heap at a time */
+			uint32_t HeapLimit;           /**< Allocations that would take the heap beyond this many bytes fail */
+			uint32_t StackPeak;           /**< Deepest host stack below the main loop reached by the firmware code */
+		} Host_Usage_t;
+
+	/* External Variables: */
+		extern uint64_t     Host_Cycles;
+		extern Host_Costs_t Host_Costs;
+		extern Host_Usage_t Host_Usage;
+		extern SDCard_t     Host_Card;
+
+	/* Function Prototypes: */
+		void Host_Reset(void);
+		void Host_Advance(const uint32_t Cycles);
+		void Host_SetStackBase(void);
+		void Host_MarkStack(void);
+		bool Host_SetCost(const char* const Option);
+
+#endif
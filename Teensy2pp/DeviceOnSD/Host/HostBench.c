@@ -0,0 +1,526 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Storage benchmark of the host build. For each way the LUN can be backed, the emulated card is formatted with the
+ *  matching wahaha.ini, the firmware is started, and the SCSI commands of a host are replayed against it: sequential
+ *  writes and reads of large blocks, checked for integrity through the LUN and on the card itself, then single
+ *  commands to measure the overhead of each. The LUN modes are:
+ *
+ *  - \c raw: raw=1, the LUN is the whole card;
+ *  - \c mapped: raw=0, the LUN is the udisk.txt image, accessed through its cluster link map table;
+ *  - \c fatfs: raw=0, with the table allocation failing, so the image is accessed through FatFs.
+ *
+ *  Each mode runs in a process of its own, as the firmware keeps its state in static variables. The options are
+ *  given as name=value arguments, see \ref Usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "Host.h"
+#include "Endpoint.h"
+#include "Format.h"
+#include "Replay.h"
+#include "../Lib/SCSI.h"
+
+/** Capacity of the emulated card in blocks, 1GB. */
+#define BENCH_CARD_BLOCKS          2097152UL
+
+/** First block of the sequential runs, clear of the partition table and the volume metadata in the raw mode. */
+#define BENCH_START_BLOCK          65536UL
+
+/** Number of single commands timed for each kind of command. */
+#define BENCH_SINGLE_COMMANDS      32
+
+/** Largest number of blocks of a READ (10) or WRITE (10) command, as much as the host buffers hold. */
+#define BENCH_MAX_BLOCKS           ((ENDPOINT_HOST_BUFFER_SIZE - 64) / VIRTUAL_MEMORY_BLOCK_SIZE)
+
+/** Type define for a way of backing the LUN. */
+typedef struct
+{
+	const char* Name;                /**< Name of the mode */
+	const char* Config;              /**< Contents of the wahaha.ini file */
+	bool        LinkMap;             /**< The cluster link map table of the image can be allocated */
+} Bench_Mode_t;
+
+/** Type define for the timings of a series of commands, in CPU cycles. */
+typedef struct
+{
+	uint64_t Total;                  /**< Sum of the command times */
+	uint64_t Min;                    /**< Shortest command time */
+	uint64_t Max;                    /**< Longest command time */
+	uint32_t Count;                  /**< Number of commands */
+} Bench_Timing_t;
+
+/** LUN modes, in the order they are run. */
+static const Bench_Mode_t Modes[] =
+	{
+		{"raw",    "[wahaha]\r\nraw=1\r\n", true},
+		{"mapped", "[wahaha]\r\nraw=0\r\n", true},
+		{"fatfs",  "[wahaha]\r\nraw=0\r\n", false},
+	};
+
+/** Help text of the command line options. */
+static const char Usage[] =
+	"usage: hostbench [help] [name=value ...]\n"
+	"  image=PATH    card image file, created or overwritten (hostbench.img)\n"
+	"  mode=NAME     LUN mode to run, raw, mapped, fatfs or all (all)\n"
+	"  total=N       blocks written then read by the sequential runs (8192)\n"
+	"  blocks=N      blocks per READ (10) and WRITE (10) command of the sequential runs (128)\n"
+	"  card timing:  init read-first read-next register write-busy single-busy stop-busy erase-busy\n"
+	"                (in us), gc-interval (blocks), gc-stall (us), ncr (bytes), tran-speed (CSD code)\n"
+	"  host costs:   spi-gap ep-byte packet stall loop command-gap (in CPU cycles)\n";
+
+/** Path of the card image file. */
+static const char* ImagePath = "hostbench.img";
+
+/** Number of blocks written then read by the sequential runs. */
+static uint32_t TotalBlocks = 8192;
+
+/** Number of blocks per command of the sequential runs. */
+static uint16_t CommandBlocks = 128;
+
+/** Card timing and cost options, applied in each mode. */
+static char** Options;
+
+/** Number of entries in \ref Options. */
+static int OptionCount;
+
+/** Data of the commands sent and received. */
+static uint8_t Buffer[BENCH_MAX_BLOCKS * VIRTUAL_MEMORY_BLOCK_SIZE];
+
+
+/** Fills a block with a test pattern unique to its address and to the pass.
+ *
+ *  \param[out] Data   Block to fill
+ *  \param[in]  Block  Block address
+ *  \param[in]  Pass   Number of the pass
+ */
+static void Bench_Pattern(uint8_t* const Data,
+                          const uint32_t Block,
+                          const uint8_t Pass)
+{
+	uint32_t Value = (Block * 2654435761UL) ^ ((uint32_t)Pass << 24);
+
+	for (uint16_t n = 0; n < VIRTUAL_MEMORY_BLOCK_SIZE; n++)
+	{
+		Value   = (Value * 1103515245UL) + 12345;
+		Data[n] = (uint8_t)(Value >> 16);
+	}
+}
+
+/** Sends a READ (10) or WRITE (10) command.
+ *
+ *  \param[in]  IsDataRead  Boolean \c true for a READ (10), \c false for a WRITE (10)
+ *  \param[in]  Block       First block address
+ *  \param[in]  Blocks      Number of blocks
+ *  \param[out] Result      Outcome of the command
+ *
+ *  \return Boolean \c true if the command succeeded and moved all its data, \c false otherwise
+ */
+static bool Bench_ReadWrite(const bool IsDataRead,
+                            const uint32_t Block,
+                            const uint16_t Blocks,
+                            Replay_Result_t* const Result)
+{
+	uint8_t CommandData[10] =
+		{
+			IsDataRead ? SCSI_CMD_READ_10 : SCSI_CMD_WRITE_10, 0,
+			(uint8_t)(Block >> 24), (uint8_t)(Block >> 16), (uint8_t)(Block >> 8), (uint8_t)Block,
+			0, (uint8_t)(Blocks >> 8), (uint8_t)Blocks, 0
+		};
+
+	return (Replay_Command(CommandData, sizeof(CommandData), IsDataRead, (uint32_t)Blocks * VIRTUAL_MEMORY_BLOCK_SIZE,
+	                       Buffer, Result) && (Result->Status == MS_SCSI_COMMAND_Pass) && !(Result->Residue));
+}
+
+/** Adds the time of a command to a series.
+ *
+ *  \param[in,out] Timing  Timings of the series
+ *  \param[in]     Cycles  Time of the command
+ */
+static void Bench_Time(Bench_Timing_t* const Timing,
+                       const uint64_t Cycles)
+{
+	if (!(Timing->Count) || (Cycles < Timing->Min))
+	  Timing->Min = Cycles;
+	if (Cycles > Timing->Max)
+	  Timing->Max = Cycles;
+
+	Timing->Total += Cycles;
+	Timing->Count++;
+}
+
+/** Prints the time per command of a series.
+ *
+ *  \param[in] Name    Name of the command
+ *  \param[in] Timing  Timings of the series
+ */
+static void Bench_PrintTiming(const char* const Name,
+                              const Bench_Timing_t* const Timing)
+{
+	if (!(Timing->Count))
+	  return;
+
+	printf("  %-12s %7.1f us per command (min %.1f, max %.1f)\n", Name,
+	       (double)Timing->Total * 1e6 / F_CPU / Timing->Count, (double)Timing->Min * 1e6 / F_CPU,
+	       (double)Timing->Max * 1e6 / F_CPU);
+}
+
+/** Prints the throughput of a sequential run, with the card traffic and the SPI bus time it took.
+ *
+ *  \param[in] Name    Name of the run
+ *  \param[in] Blocks  Number of blocks moved
+ *  \param[in] Cycles  Time of the run
+ */
+static void Bench_PrintRun(const char* const Name,
+                           const uint32_t Blocks,
+                           const uint64_t Cycles)
+{
+	const SDCard_Stats_t* Stats = &Host_Card.Stats;
+
+	printf("  %-12s %7.1f KB/s, %7.0f sectors/s, %lu card commands, %.1f SPI bytes and %.1f busy bytes per sector,"
+	       " SPI %.0f%% of the time\n", Name,
+	       (double)Blocks * VIRTUAL_MEMORY_BLOCK_SIZE / 1024 * F_CPU / Cycles, (double)Blocks * F_CPU / Cycles,
+	       (unsigned long)Stats->Commands, (double)Stats->Bytes / Blocks, (double)Stats->BusyBytes / Blocks,
+	       (double)Host_Usage.SpiCycles * 100 / Cycles);
+}
+
+/** Clears the card and bus counters before a run. */
+static void Bench_ClearCounters(void)
+{
+	memset(&Host_Card.Stats, 0, sizeof(Host_Card.Stats));
+	Host_Usage.SpiCycles          = 0;
+	Host_Usage.EndpointWaitCycles = 0;
+}
+
+/** Runs the sequential write and read of the test blocks, in commands of \ref CommandBlocks blocks, then checks the
+ *  blocks on the card itself.
+ *
+ *  \return Boolean \c true if all the commands succeeded and the data read back matches, \c false otherwise
+ */
+static bool Bench_Sequential(void)
+{
+	Replay_Result_t Result;
+	uint8_t         Expected[VIRTUAL_MEMORY_BLOCK_SIZE];
+	uint64_t        Start;
+	uint32_t        Block;
+	uint16_t        Blocks;
+
+	Bench_ClearCounters();
+	Start = Endpoint_HostIdleAt();
+	for (Block = 0; Block < TotalBlocks; Block += Blocks)
+	{
+		Blocks = MIN(CommandBlocks, TotalBlocks - Block);
+		for (uint16_t n = 0; n < Blocks; n++)
+		  Bench_Pattern(&Buffer[n * VIRTUAL_MEMORY_BLOCK_SIZE], BENCH_START_BLOCK + Block + n, 1);
+
+		if (!(Bench_ReadWrite(false, BENCH_START_BLOCK + Block, Blocks, &Result)))
+		{
+			printf("  WRITE (10) of block %lu failed, status %u\n", (unsigned long)(BENCH_START_BLOCK + Block),
+			       (unsigned)Result.Status);
+			return false;
+		}
+	}
+	Bench_PrintRun("write", TotalBlocks, Endpoint_HostIdleAt() - Start);
+
+	/* Let a write-back of the sector cache finish before reading */
+	Replay_Idle(F_CPU);
+
+	Bench_ClearCounters();
+	Start = Endpoint_HostIdleAt();
+	for (Block = 0; Block < TotalBlocks; Block += Blocks)
+	{
+		Blocks = MIN(CommandBlocks, TotalBlocks - Block);
+		if (!(Bench_ReadWrite(true, BENCH_START_BLOCK + Block, Blocks, &Result)))
+		{
+			printf("  READ (10) of block %lu failed, status %u\n", (unsigned long)(BENCH_START_BLOCK + Block),
+			       (unsigned)Result.Status);
+			return false;
+		}
+
+		for (uint16_t n = 0; n < Blocks; n++)
+		{
+			Bench_Pattern(Expected, BENCH_START_BLOCK + Block + n, 1);
+			if (memcmp(&Buffer[n * VIRTUAL_MEMORY_BLOCK_SIZE], Expected, sizeof(Expected)))
+			{
+				printf("  block %lu read back differs\n", (unsigned long)(BENCH_START_BLOCK + Block + n));
+				return false;
+			}
+		}
+	}
+	Bench_PrintRun("read", TotalBlocks, Endpoint_HostIdleAt() - Start);
+
+	/* The blocks must also be where they belong on the card, not just read back the way they were written */
+	for (Block = 0; Block < TotalBlocks; Block++)
+	{
+		Bench_Pattern(Expected, BENCH_START_BLOCK + Block, 1);
+		if (!(SDCard_ReadBlock(&Host_Card, Replay_BlockSector(BENCH_START_BLOCK + Block), Buffer)) ||
+		    memcmp(Buffer, Expected, sizeof(Expected)))
+		{
+			printf("  block %lu differs on the card\n", (unsigned long)(BENCH_START_BLOCK + Block));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Times single commands: TEST UNIT READY, and single block READ (10) and WRITE (10) commands at consecutive
+ *  addresses, the writes then being checked on the card once written back.
+ *
+ *  \return Boolean \c true if all the commands succeeded and the written blocks are on the card, \c false otherwise
+ */
+static bool Bench_Single(void)
+{
+	static const uint8_t TestUnitReady[6] = {SCSI_CMD_TEST_UNIT_READY};
+
+	Replay_Result_t Result;
+	Bench_Timing_t  Timing;
+	uint8_t         Expected[VIRTUAL_MEMORY_BLOCK_SIZE];
+	uint32_t        Block = BENCH_START_BLOCK + TotalBlocks;
+
+	memset(&Timing, 0, sizeof(Timing));
+	for (uint8_t n = 0; n < BENCH_SINGLE_COMMANDS; n++)
+	{
+		if (!(Replay_Command(TestUnitReady, sizeof(TestUnitReady), false, 0, NULL, &Result)) ||
+		    (Result.Status != MS_SCSI_COMMAND_Pass))
+		{
+			puts("  TEST UNIT READY failed");
+			return false;
+		}
+
+		Bench_Time(&Timing, Result.Cycles);
+	}
+	Bench_PrintTiming("TEST UNIT", &Timing);
+
+	memset(&Timing, 0, sizeof(Timing));
+	for (uint8_t n = 0; n < BENCH_SINGLE_COMMANDS; n++)
+	{
+		if (!(Bench_ReadWrite(true, BENCH_START_BLOCK + n, 1, &Result)))
+		{
+			puts("  READ (10) failed");
+			return false;
+		}
+
+		Bench_Time(&Timing, Result.Cycles);
+	}
+	Bench_PrintTiming("READ 1", &Timing);
+
+	memset(&Timing, 0, sizeof(Timing));
+	for (uint8_t n = 0; n < BENCH_SINGLE_COMMANDS; n++)
+	{
+		Bench_Pattern(Buffer, Block + n, 2);
+		if (!(Bench_ReadWrite(false, Block + n, 1, &Result)))
+		{
+			puts("  WRITE (10) failed");
+			return false;
+		}
+
+		Bench_Time(&Timing, Result.Cycles);
+	}
+	Bench_PrintTiming("WRITE 1", &Timing);
+
+	/* Single block writes may sit in the sector cache until the drive has been idle for a while */
+	Replay_Idle(F_CPU);
+
+	for (uint8_t n = 0; n < BENCH_SINGLE_COMMANDS; n++)
+	{
+		Bench_Pattern(Expected, Block + n, 2);
+		if (!(SDCard_ReadBlock(&Host_Card, Replay_BlockSector(Block + n), Buffer)) ||
+		    memcmp(Buffer, Expected, sizeof(Expected)))
+		{
+			printf("  block %lu differs on the card\n", (unsigned long)(Block + n));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Waits for the LUN to get ready after the start-up, taking the unit attention reported for the new medium.
+ *
+ *  \return Boolean \c true if the LUN is ready, \c false otherwise
+ */
+static bool Bench_WaitReady(void)
+{
+	static const uint8_t TestUnitReady[6] = {SCSI_CMD_TEST_UNIT_READY};
+	static const uint8_t RequestSense[6]  = {SCSI_CMD_REQUEST_SENSE, 0, 0, 0, 18, 0};
+
+	Replay_Result_t Result;
+
+	for (uint8_t Tries = 0; Tries < 4; Tries++)
+	{
+		if (!(Replay_Command(TestUnitReady, sizeof(TestUnitReady), false, 0, NULL, &Result)))
+		  return false;
+
+		if (Result.Status == MS_SCSI_COMMAND_Pass)
+		  return true;
+
+		if (!(Replay_Command(RequestSense, sizeof(RequestSense), true, 18, Buffer, &Result)))
+		  return false;
+	}
+
+	return false;
+}
+
+/** Runs the benchmark in one LUN mode.
+ *
+ *  \param[in] Mode  LUN mode
+ *
+ *  \return Boolean \c true if the mode ran through with all data intact, \c false otherwise
+ */
+static bool Bench_RunMode(const Bench_Mode_t* const Mode)
+{
+	bool Success;
+
+	Host_Reset();
+	if (!(SDCard_Open(&Host_Card, ImagePath, BENCH_CARD_BLOCKS)))
+	{
+		printf("cannot open %s\n", ImagePath);
+		return false;
+	}
+
+	for (int n = 0; n < OptionCount; n++)
+	{
+		if (!(SDCard_SetTiming(&Host_Card.Timing, Options[n])))
+		  Host_SetCost(Options[n]);
+	}
+
+	if (!(Format_FAT32(&Host_Card, "WAHAHA  INI", Mode->Config)))
+	{
+		printf("cannot format %s\n", ImagePath);
+		return false;
+	}
+
+	Endpoint_HostReset();
+	Success = Replay_Boot(Mode->LinkMap);
+	printf("mode %s: start-up %s in %.1f ms, %lu blocks", Mode->Name, Success ? "done" : "failed",
+	       (double)Host_Cycles * 1000 / F_CPU, (unsigned long)media_blocks);
+	printf(", %s\n", RawStorage ? "raw card" : (MassStorage_Loopback.cltbl ? "image mapped" : "image through FatFs"));
+
+	if (Success && !(Bench_WaitReady()))
+	{
+		puts("  LUN not ready");
+		Success = false;
+	}
+
+	Success = Success && Bench_Sequential() && Bench_Single();
+
+	printf("  RAM: heap peak %lu bytes, stack peak %lu host bytes\n", (unsigned long)Host_Usage.HeapPeak,
+	       (unsigned long)Host_Usage.StackPeak);
+	printf("  integrity %s\n", Success ? "ok" : "FAILED");
+
+	SDCard_Close(&Host_Card);
+	return Success;
+}
+
+/** Main program entry point, running the LUN modes asked for in turn.
+ *
+ *  \return Zero if all the modes ran through with all data intact, non-zero otherwise
+ */
+int main(int argc,
+         char* argv[])
+{
+	const char* ModeName = "all";
+	bool        Success  = true;
+	bool        Found    = false;
+
+	Options = calloc(argc, sizeof(char*));
+	for (int n = 1; n < argc; n++)
+	{
+		if (!(strcmp(argv[n], "help")))
+		{
+			fputs(Usage, stdout);
+			return 0;
+		}
+		else if (!(strncmp(argv[n], "image=", 6)))
+		  ImagePath = &argv[n][6];
+		else if (!(strncmp(argv[n], "mode=", 5)))
+		  ModeName = &argv[n][5];
+		else if (!(strncmp(argv[n], "total=", 6)))
+		  TotalBlocks = strtoul(&argv[n][6], NULL, 0);
+		else if (!(strncmp(argv[n], "blocks=", 7)))
+		  CommandBlocks = (uint16_t)strtoul(&argv[n][7], NULL, 0);
+		else
+		  Options[OptionCount++] = argv[n];
+	}
+
+	Host_Reset();
+	for (int n = 0; n < OptionCount; n++)
+	{
+		SDCard_Timing_t Timing;
+
+		if (!(SDCard_SetTiming(&Timing, Options[n])) && !(Host_SetCost(Options[n])))
+		{
+			fprintf(stderr, "unknown option %s\n%s", Options[n], Usage);
+			return 2;
+		}
+	}
+
+	if (!(TotalBlocks) || !(CommandBlocks) || (CommandBlocks > BENCH_MAX_BLOCKS) ||
+	    ((BENCH_START_BLOCK + TotalBlocks + BENCH_SINGLE_COMMANDS) > 262144UL))
+	{
+		fputs(Usage, stderr);
+		return 2;
+	}
+
+	for (uint8_t n = 0; n < (sizeof(Modes) / sizeof(Modes[0])); n++)
+	{
+		pid_t Child;
+		int   Status;
+
+		if (strcmp(ModeName, "all") && strcmp(ModeName, Modes[n].Name))
+		  continue;
+
+		Found = true;
+
+		/* Each mode starts the firmware afresh */
+		fflush(stdout);
+		if ((Child = fork()) == 0)
+		  return (Bench_RunMode(&Modes[n]) ? 0 : 1);
+
+		if ((Child < 0) || (waitpid(Child, &Status, 0) != Child) || !(WIFEXITED(Status)) || WEXITSTATUS(Status))
+		  Success = false;
+	}
+
+	if (!(Found))
+	{
+		fputs(Usage, stderr);
+		return 2;
+	}
+
+	return (Success ? 0 : 1);
+}
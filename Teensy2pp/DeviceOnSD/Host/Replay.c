@@ -0,0 +1,517 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Replay driver of the host build. It runs the main loop of the firmware with the Mass Storage class driver and the
+ *  start-up of DeviceOnSD.c, and sends SCSI commands to it as a host would: each command block wrapper, with its data
+ *  for a write, is queued on the OUT endpoint, and the main loop runs until the command status has been sent back.
+ *
+ *  The LUFA class driver and the parts of DeviceOnSD.c serving the Mass Storage interface cannot be built for the
+ *  host, so they are mirrored here, following the originals statement for statement. The CDC and HID interfaces are
+ *  left out, as are the warm start (CARD_IDENTITY_EEPROM), which needs a card kept initialized across a reset, and
+ *  the mass storage reset request, which the host never sends.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Replay.h"
+#include "Host.h"
+#include "Endpoint.h"
+#include "../DeviceOnSD.h"
+#include "../Lib/diskio.h"
+#include "../Lib/mmc_avr.h"
+#include "../Lib/ini.h"
+#include "../Lib/Latency.h"
+
+/** Enum for the stages of the start-up, as in DeviceOnSD.c. */
+enum BootStages_t
+{
+	BOOT_PROBE  = 1, /**< Power cycling and probing the card, one step per pass of the main loop */
+	BOOT_MOUNT  = 2, /**< Mounting the volume of the card */
+	BOOT_CONFIG = 3, /**< Parsing the wahaha.ini configuration file */
+	BOOT_OPEN   = 4, /**< Opening the udisk.txt image behind the loopback LUN */
+	BOOT_EXPAND = 5, /**< Allocating the whole image on the volume */
+	BOOT_COUNT  = 6, /**< Counting the fragments of the image */
+	BOOT_MAP    = 7, /**< Building the cluster link map table of the image */
+	BOOT_DONE   = 8, /**< Start-up finished, successfully or not */
+};
+
+/** Mass Storage class driver interface configuration and state information, as in DeviceOnSD.c. */
+USB_ClassInfo_MS_Device_t Disk_MS_Interface =
+	{
+		.Config =
+			{
+				.InterfaceNumber                = INTERFACE_ID_MassStorage,
+				.DataINEndpoint                 =
+					{
+						.Address                = MASS_STORAGE_IN_EPADDR,
+						.Size                   = MASS_STORAGE_IO_EPSIZE,
+						.Banks                  = 2,
+					},
+				.DataOUTEndpoint                =
+					{
+						.Address                = MASS_STORAGE_OUT_EPADDR,
+						.Size                   = MASS_STORAGE_IO_EPSIZE,
+						.Banks                  = 2,
+					},
+				.TotalLUNs                      = TOTAL_LUNS,
+			},
+	};
+
+/** Number of blocks of the medium behind the LUN. */
+uint32_t media_blocks = 0;
+
+/** Identity of the card in the socket. */
+static MMC_IDENT CardIdentity;
+
+/** FatFs work area of the volume on the card. */
+static FATFS FatFs;
+
+/** Current stage of the start-up, a value from the \ref BootStages_t enum. The host build always starts cold. */
+static uint8_t BootStage = BOOT_PROBE;
+
+/** Set when the start-up has left the LUN without a medium. */
+static bool BootFailed;
+
+/** Size of the cluster link map table of the image in DWORDs, counted by the \ref BOOT_COUNT stage. */
+static DWORD ClmtSize;
+
+/** Set by the Mass Storage class driver once it has taken a command block, and answered it if it was valid. */
+static bool CommandDone;
+
+/** Tag of the last command block sent. */
+static uint32_t CommandTag;
+
+
+/** Mirror of the LUFA \c MS_Device_ReadInCommandBlock() function, reading and checking a command block wrapper.
+ *
+ *  \param[in,out] MSInterfaceInfo  Pointer to the Mass Storage class interface configuration structure
+ *
+ *  \return Boolean \c true if a valid command block was read, \c false otherwise
+ */
+static bool MS_Device_ReadInCommandBlock(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t BytesProcessed;
+
+	Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+
+	BytesProcessed = 0;
+	while (Endpoint_Read_Stream_LE(&MSInterfaceInfo->State.CommandBlock,
+	                               (sizeof(MS_CommandBlockWrapper_t) - 16), &BytesProcessed) ==
+	                               ENDPOINT_RWSTREAM_IncompleteTransfer);
+
+	if ((MSInterfaceInfo->State.CommandBlock.Signature         != CPU_TO_LE32(MS_CBW_SIGNATURE))     ||
+	    (MSInterfaceInfo->State.CommandBlock.LUN               >= MSInterfaceInfo->Config.TotalLUNs) ||
+	    (MSInterfaceInfo->State.CommandBlock.Flags              & 0x1F)                              ||
+	    (MSInterfaceInfo->State.CommandBlock.SCSICommandLength == 0)                                 ||
+	    (MSInterfaceInfo->State.CommandBlock.SCSICommandLength >  16))
+	{
+		Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+		Endpoint_StallTransaction();
+		Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+		Endpoint_StallTransaction();
+
+		return false;
+	}
+
+	BytesProcessed = 0;
+	while (Endpoint_Read_Stream_LE(&MSInterfaceInfo->State.CommandBlock.SCSICommandData,
+	                               MSInterfaceInfo->State.CommandBlock.SCSICommandLength, &BytesProcessed) ==
+	                               ENDPOINT_RWSTREAM_IncompleteTransfer);
+
+	Endpoint_ClearOUT();
+
+	return true;
+}
+
+/** Mirror of the LUFA \c MS_Device_ReturnCommandStatus() function, sending the command status wrapper. The host build
+ *  host clears a stalled endpoint at once, so there is no stall to wait for.
+ *
+ *  \param[in,out] MSInterfaceInfo  Pointer to the Mass Storage class interface configuration structure
+ */
+static void MS_Device_ReturnCommandStatus(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t BytesProcessed = 0;
+
+	Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+
+	while (Endpoint_Write_Stream_LE(&MSInterfaceInfo->State.CommandStatus,
+	                                sizeof(MS_CommandStatusWrapper_t), &BytesProcessed) ==
+	                                ENDPOINT_RWSTREAM_IncompleteTransfer);
+
+	Endpoint_ClearIN();
+}
+
+/** Mirror of the LUFA \c MS_Device_USBTask() function, processing the next command block received.
+ *
+ *  \param[in,out] MSInterfaceInfo  Pointer to the Mass Storage class interface configuration structure
+ */
+void MS_Device_USBTask(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataOUTEndpoint.Address);
+
+	if (!(Endpoint_IsOUTReceived()))
+	  return;
+
+	if (MS_Device_ReadInCommandBlock(MSInterfaceInfo))
+	{
+		if (MSInterfaceInfo->State.CommandBlock.Flags & MS_COMMAND_DIR_DATA_IN)
+		  Endpoint_SelectEndpoint(MSInterfaceInfo->Config.DataINEndpoint.Address);
+
+		bool SCSICommandResult = CALLBACK_MS_Device_SCSICommandReceived(MSInterfaceInfo);
+
+		MSInterfaceInfo->State.CommandStatus.Status              = (SCSICommandResult) ? MS_SCSI_COMMAND_Pass : MS_SCSI_COMMAND_Fail;
+		MSInterfaceInfo->State.CommandStatus.Signature           = CPU_TO_LE32(MS_CSW_SIGNATURE);
+		MSInterfaceInfo->State.CommandStatus.Tag                 = MSInterfaceInfo->State.CommandBlock.Tag;
+		MSInterfaceInfo->State.CommandStatus.DataTransferResidue = MSInterfaceInfo->State.CommandBlock.DataTransferLength;
+
+		if (!(SCSICommandResult) && (le32_to_cpu(MSInterfaceInfo->State.CommandStatus.DataTransferResidue)))
+		  Endpoint_StallTransaction();
+
+		MS_Device_ReturnCommandStatus(MSInterfaceInfo);
+	}
+
+	CommandDone = true;
+}
+
+/** Mirror of the DeviceOnSD.c Mass Storage class driver callback, processing a received SCSI command.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface configuration structure
+ *
+ *  \return Boolean \c true if the command succeeded, \c false otherwise
+ */
+bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	bool CommandSuccess;
+	LATENCY_DECLARE(Start);
+
+	LATENCY_START(Start);
+	CommandSuccess = SCSI_DecodeSCSICommand(MSInterfaceInfo);
+
+	#if defined(LATENCY_HISTOGRAMS)
+	switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
+	{
+		case SCSI_CMD_READ_10:
+			LATENCY_STOP(LATENCY_SCSI_READ, Start);
+			break;
+		case SCSI_CMD_WRITE_10:
+			LATENCY_STOP(LATENCY_SCSI_WRITE, Start);
+			break;
+		default:
+			LATENCY_STOP(LATENCY_SCSI_OTHER, Start);
+			break;
+	}
+	#endif
+
+	return CommandSuccess;
+}
+
+/** Mirror of the DeviceOnSD.c function allocating the whole udisk.txt image.
+ *
+ *  \return FatFs result of the operation that failed, FR_OK otherwise
+ */
+static FRESULT udisk_expand(void)
+{
+	FSIZE_t image_size = (FSIZE_t)media_blocks * VIRTUAL_MEMORY_BLOCK_SIZE;
+	FRESULT fr;
+
+	if (f_size(&MassStorage_Loopback) >= image_size)
+		return FR_OK;
+
+	fr = FR_DENIED;
+	if (f_size(&MassStorage_Loopback) == 0)
+		fr = f_expand(&MassStorage_Loopback, image_size, 1);
+	if (fr != FR_OK)
+		fr = f_lseek(&MassStorage_Loopback, image_size);
+	if (fr == FR_OK)
+		fr = f_sync(&MassStorage_Loopback);
+
+	return fr;
+}
+
+/** Mirror of the DeviceOnSD.c function attaching a cluster link map table to the udisk.txt image. */
+static void udisk_map(void)
+{
+	MassStorage_Loopback.cltbl = malloc(ClmtSize * sizeof(DWORD));
+	if (MassStorage_Loopback.cltbl)
+	{
+		MassStorage_Loopback.cltbl[0] = ClmtSize;
+		if (f_lseek(&MassStorage_Loopback, CREATE_LINKMAP) == FR_OK)
+			return;
+
+		free(MassStorage_Loopback.cltbl);
+	}
+
+	/* No table, fall back to accessing the image through FatFs */
+	MassStorage_Loopback.cltbl = NULL;
+}
+
+/** Mirror of the DeviceOnSD.c handler of the wahaha.ini configuration file entries. */
+static int ini_cb(void* user, const char* section, const char* name,
+	const char* value)
+{
+	const char * _s = "wahaha";
+	uint8_t enabled = (atoi(value) == 1);
+
+	(void)user;
+
+#define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
+	if (MATCH(_s, "raw"))
+	{
+		RawStorage = (enabled == 1);
+	}
+	else
+	{
+		return 0;  /* unknown section/name, error */
+	}
+	return 1;
+}
+
+/** Mirror of the DeviceOnSD.c start-up task, running its next stage from a cold start. */
+static void Boot_Task(void)
+{
+	FRESULT fr;
+
+	switch (BootStage)
+	{
+		case BOOT_PROBE:
+			if (mmc_disk_probe())
+				return;
+
+			if (mmc_disk_status() & STA_NOINIT)
+				break;
+
+			BootStage = BOOT_MOUNT;
+			return;
+
+		case BOOT_MOUNT:
+			f_mount(&FatFs, "", 1);
+
+			if (mmc_disk_identify(&CardIdentity) != RES_OK)
+				CardIdentity.sectors = 0;
+
+			BootStage = BOOT_CONFIG;
+			return;
+
+		case BOOT_CONFIG:
+			if (ini_parse("wahaha.ini", ini_cb, NULL) < 0)
+				RawStorage = 1;
+
+			if (!(RawStorage))
+			{
+				BootStage = BOOT_OPEN;
+				return;
+			}
+
+			media_blocks = CardIdentity.sectors;
+			if (media_blocks == 0 && (mmc_disk_ioctl(GET_SECTOR_COUNT, &media_blocks) != RES_OK || media_blocks == 0))
+				break;
+
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		case BOOT_OPEN:
+			if (f_open(&MassStorage_Loopback, "udisk.txt", FA_READ | FA_WRITE | FA_OPEN_ALWAYS))
+				break;
+
+			media_blocks = 262144;
+			BootStage = BOOT_EXPAND;
+			return;
+
+		case BOOT_EXPAND:
+			if (udisk_expand())
+				break;
+
+			BootStage = BOOT_COUNT;
+			return;
+
+		case BOOT_COUNT:
+			ClmtSize = 1;
+			MassStorage_Loopback.cltbl = &ClmtSize;
+			fr = f_lseek(&MassStorage_Loopback, CREATE_LINKMAP);
+			MassStorage_Loopback.cltbl = NULL;
+
+			if (fr == FR_NOT_ENOUGH_CORE)
+			{
+				BootStage = BOOT_MAP;
+				return;
+			}
+
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		case BOOT_MAP:
+			udisk_map();
+
+			BootStage = BOOT_DONE;
+			SCSI_SetMediaState(MEDIA_READY);
+			return;
+
+		default:
+			return;
+	}
+
+	BootStage  = BOOT_DONE;
+	BootFailed = true;
+	SCSI_SetMediaState(MEDIA_NOT_PRESENT);
+}
+
+/** Runs one pass of the firmware main loop, with the tasks serving the Mass Storage interface in their order in
+ *  DeviceOnSD.c, and the idle cost of the pass.
+ */
+void Replay_Pass(void)
+{
+	Host_SetStackBase();
+
+	MS_Device_USBTask(&Disk_MS_Interface);
+	SCSI_CacheTask();
+	mmc_stream_idle();
+	Boot_Task();
+
+	Host_Advance(Host_Costs.LoopCycles);
+}
+
+/** Runs the main loop until the start-up is over.
+ *
+ *  \param[in] LinkMap  Boolean \c false to make the allocation of the cluster link map table of the udisk.txt image
+ *                      fail as on a device out of heap, so that the image is accessed through FatFs
+ *
+ *  \return Boolean \c true if the medium behind the LUN is ready, \c false otherwise
+ */
+bool Replay_Boot(const bool LinkMap)
+{
+	while (BootStage != BOOT_DONE)
+	{
+		Host_Usage.HeapLimit = (!(LinkMap) && (BootStage == BOOT_MAP)) ? Host_Usage.HeapInUse : UINT32_MAX;
+		Replay_Pass();
+	}
+
+	Host_Usage.HeapLimit = UINT32_MAX;
+
+	return !(BootFailed);
+}
+
+/** Gets the card sector holding a block of the medium behind the LUN, to check the card contents directly. The
+ *  udisk.txt image is taken to be in one fragment, as it is when allocated on a freshly formatted volume.
+ *
+ *  \param[in] Block  Block address of the medium
+ *
+ *  \return Card sector of the block
+ */
+uint32_t Replay_BlockSector(const uint32_t Block)
+{
+	if (RawStorage)
+	  return Block;
+
+	return (FatFs.database + ((MassStorage_Loopback.obj.sclust - 2) * FatFs.csize) + Block);
+}
+
+/** Runs the main loop without any command from the host for a while, letting the idle time tasks of the firmware
+ *  run, such as the write-back of the sector cache.
+ *
+ *  \param[in] Cycles  Idle time in CPU cycles
+ */
+void Replay_Idle(const uint64_t Cycles)
+{
+	uint64_t End = MAX(Host_Cycles, Endpoint_HostIdleAt()) + Cycles;
+
+	while (Host_Cycles < End)
+	  Replay_Pass();
+}
+
+/** Sends a SCSI command to LUN 0 of the device and runs the main loop until the device has answered it. The host
+ *  sends the command block once it has taken the status of the previous command, after the command gap cost.
+ *
+ *  \param[in]     CommandData    SCSI command block
+ *  \param[in]     CommandLength  Length of the command block, 1 to 16 bytes
+ *  \param[in]     IsDataIn       Boolean \c true if the data stage is from the device to the host
+ *  \param[in]     DataLength     Number of bytes of the data stage, 0 for none
+ *  \param[in,out] Data           Data to send, or buffer of \c DataLength bytes for the data received
+ *  \param[out]    Result         Outcome of the command
+ *
+ *  \return Boolean \c true if the device sent back a valid status for the command, \c false otherwise
+ */
+bool Replay_Command(const uint8_t* const CommandData,
+                    const uint8_t CommandLength,
+                    const bool IsDataIn,
+                    const uint32_t DataLength,
+                    void* const Data,
+                    Replay_Result_t* const Result)
+{
+	MS_CommandBlockWrapper_t  CommandBlock;
+	MS_CommandStatusWrapper_t CommandStatus;
+	uint64_t                  SentAt = Endpoint_HostIdleAt() + Host_Costs.CommandGapCycles;
+	uint32_t                  Received;
+
+	memset(&CommandBlock, 0, sizeof(CommandBlock));
+	CommandBlock.Signature          = CPU_TO_LE32(MS_CBW_SIGNATURE);
+	CommandBlock.Tag                = CPU_TO_LE32(++CommandTag);
+	CommandBlock.DataTransferLength = CPU_TO_LE32(DataLength);
+	CommandBlock.Flags              = (IsDataIn && DataLength) ? MS_COMMAND_DIR_DATA_IN : MS_COMMAND_DIR_DATA_OUT;
+	CommandBlock.SCSICommandLength  = CommandLength;
+	memcpy(CommandBlock.SCSICommandData, CommandData, MIN(CommandLength, sizeof(CommandBlock.SCSICommandData)));
+
+	*Result = (Replay_Result_t){.Status = REPLAY_NO_STATUS};
+
+	Endpoint_HostDiscard();
+	if (!(Endpoint_HostSend(&CommandBlock, sizeof(CommandBlock), SentAt)) ||
+	    (!(IsDataIn) && !(Endpoint_HostSend(Data, DataLength, SentAt))))
+	{
+		return false;
+	}
+
+	CommandDone = false;
+	while (!(CommandDone) && (Host_Cycles < (SentAt + REPLAY_COMMAND_TIMEOUT)))
+	  Replay_Pass();
+
+	Result->Cycles = Endpoint_HostIdleAt() - SentAt;
+	Received       = Endpoint_HostReceived();
+
+	if (!(CommandDone) || (Received < sizeof(CommandStatus)) || (Received > ENDPOINT_HOST_BUFFER_SIZE))
+	  return false;
+
+	/* The status comes last, after the data the device sent */
+	memcpy(&CommandStatus, &Endpoint_HostData()[Received - sizeof(CommandStatus)], sizeof(CommandStatus));
+	Result->Received = Received - sizeof(CommandStatus);
+	if (IsDataIn)
+	  memcpy(Data, Endpoint_HostData(), MIN(Result->Received, DataLength));
+
+	if ((CommandStatus.Signature != CPU_TO_LE32(MS_CSW_SIGNATURE)) || (CommandStatus.Tag != CommandBlock.Tag))
+	  return false;
+
+	Result->Status  = CommandStatus.Status;
+	Result->Residue = le32_to_cpu(CommandStatus.DataTransferResidue);
+
+	return true;
+}
@@ -0,0 +1,75 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for Replay.c.
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+	/* Macros: */
+		/** Value of \ref Replay_Result_t Status for a command the device gave no status for. */
+		#define REPLAY_NO_STATUS           0xFF
+
+		/** Longest time a command may take before the replay gives up on it, in CPU cycles. */
+		#define REPLAY_COMMAND_TIMEOUT     (F_CPU * 10ULL)
+
+	/* Type Defines: */
+		/** Type define for the outcome of a command replayed against the device. */
+		typedef struct
+		{
+			uint8_t  Status;             /**< Status of the command status wrapper, or \ref REPLAY_NO_STATUS */
+			uint32_t Residue;            /**< Data residue of the command status wrapper */
+			uint32_t Received;           /**< Number of data bytes received, stored up to the size of the buffer */
+			uint64_t Cycles;             /**< Time from the host sending the command block until it took the status */
+		} Replay_Result_t;
+
+	/* External Variables: */
+		extern uint32_t media_blocks;
+
+	/* Function Prototypes: */
+		void     Replay_Pass(void);
+		bool     Replay_Boot(const bool LinkMap);
+		void     Replay_Idle(const uint64_t Cycles);
+		uint32_t Replay_BlockSector(const uint32_t Block);
+		bool     Replay_Command(const uint8_t* const CommandData,
+		                        const uint8_t CommandLength,
+		                        const bool IsDataIn,
+		                        const uint32_t DataLength,
+		                        void* const Data,
+		                        Replay_Result_t* const Result);
+
+#endif
@@ -0,0 +1,814 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Behavioral model of an SDHC card in SPI mode, driven one exchanged byte at a time. The card decodes the commands
+ *  the card driver sends, answers them after the configured delays and keeps its contents in an image file. Busy
+ *  times, data token latencies and garbage collection stalls are kept in card time, which the caller passes along
+ *  with each byte, so the same model serves the host build, where time is modeled, and the simulator harness, where
+ *  it follows the simulated CPU cycles.
+ *
+ *  Commands: CMD0, CMD8, CMD9, CMD10, CMD12, CMD16, CMD17, CMD18, CMD24, CMD25, CMD32, CMD33, CMD38, CMD55, CMD58,
+ *  CMD59, ACMD13, ACMD23 and ACMD41. Any other command is answered as an illegal one.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "SDCard.h"
+
+/** R1 response bits. */
+#define R1_IDLE             0x01
+#define R1_ILLEGAL_COMMAND  0x04
+#define R1_CRC_ERROR        0x08
+#define R1_ADDRESS_ERROR    0x20
+#define R1_PARAMETER_ERROR  0x40
+
+/** Data response tokens. */
+#define DATA_ACCEPTED       0x05
+#define DATA_CRC_ERROR      0x0B
+#define DATA_WRITE_ERROR    0x0D
+
+/** Data error token of a read past the end of the card. */
+#define DATA_OUT_OF_RANGE   0x08
+
+/** Number of nanoseconds per microsecond of the timing parameters. */
+#define NS_PER_US           1000ULL
+
+/** Names of the timing options of \ref SDCard_SetTiming(), with the microsecond or block count field each one sets. */
+static const struct
+{
+	const char* Name;
+	size_t      Offset;
+} TimingOptions[] =
+	{
+		{"init",        offsetof(SDCard_Timing_t, InitUs)},
+		{"read-first",  offsetof(SDCard_Timing_t, ReadFirstUs)},
+		{"read-next",   offsetof(SDCard_Timing_t, ReadNextUs)},
+		{"register",    offsetof(SDCard_Timing_t, RegisterUs)},
+		{"write-busy",  offsetof(SDCard_Timing_t, WriteBusyUs)},
+		{"single-busy", offsetof(SDCard_Timing_t, SingleWriteBusyUs)},
+		{"stop-busy",   offsetof(SDCard_Timing_t, StopBusyUs)},
+		{"erase-busy",  offsetof(SDCard_Timing_t, EraseBusyUs)},
+		{"gc-interval", offsetof(SDCard_Timing_t, GCInterval)},
+		{"gc-stall",    offsetof(SDCard_Timing_t, GCStallUs)},
+	};
+
+/** Computes the CRC7 of a command or a register, as sent in its last byte.
+ *
+ *  \param[in] Data    Command or register, without its last byte
+ *  \param[in] Length  Number of bytes to compute the CRC7 of
+ *
+ *  \return CRC7 of the data, shifted left with the stop bit set
+ */
+static uint8_t SDCard_CRC7(const uint8_t* Data,
+                           const uint8_t Length)
+{
+	uint8_t CRC = 0;
+
+	for (uint8_t n = 0; n < Length; n++)
+	{
+		uint8_t d = Data[n];
+
+		for (uint8_t i = 0; i < 8; i++)
+		{
+			CRC <<= 1;
+			if ((d ^ CRC) & 0x80)
+			  CRC ^= 0x09;
+			d <<= 1;
+		}
+	}
+
+	return (uint8_t)((CRC << 1) | 1);
+}
+
+/** Computes the CRC16 of a data block, as sent after it.
+ *
+ *  \param[in] Data    Data block
+ *  \param[in] Length  Size of the data block in bytes
+ *
+ *  \return CRC16 (XMODEM) of the data block
+ */
+static uint16_t SDCard_CRC16(const uint8_t* Data,
+                             const uint16_t Length)
+{
+	uint16_t CRC = 0;
+
+	for (uint16_t n = 0; n < Length; n++)
+	{
+		CRC ^= (uint16_t)Data[n] << 8;
+		for (uint8_t i = 0; i < 8; i++)
+		  CRC = (CRC & 0x8000) ? (uint16_t)((CRC << 1) ^ 0x1021) : (uint16_t)(CRC << 1);
+	}
+
+	return CRC;
+}
+
+/** Queues a byte to be sent to the host.
+ *
+ *  \param[in,out] Card  Emulated card
+ *  \param[in]     Data  Byte to send
+ */
+static void SDCard_Queue(SDCard_t* const Card,
+                         const uint8_t Data)
+{
+	if (Card->QueueTail < SDCARD_QUEUE_SIZE)
+	  Card->Queue[Card->QueueTail++] = Data;
+}
+
+/** Queues a data token, a data block and its CRC to be sent to the host.
+ *
+ *  \param[in,out] Card    Emulated card
+ *  \param[in]     Data    Data block
+ *  \param[in]     Length  Size of the data block in bytes
+ */
+static void SDCard_QueueBlock(SDCard_t* const Card,
+                              const uint8_t* Data,
+                              const uint16_t Length)
+{
+	uint16_t CRC = SDCard_CRC16(Data, Length);
+
+	SDCard_Queue(Card, 0xFE);
+	for (uint16_t n = 0; n < Length; n++)
+	  SDCard_Queue(Card, Data[n]);
+	SDCard_Queue(Card, (uint8_t)(CRC >> 8));
+	SDCard_Queue(Card, (uint8_t)CRC);
+}
+
+/** Adds a data block to the digest of the card traffic.
+ *
+ *  \param[in,out] Card  Emulated card
+ *  \param[in]     Data  Data block of \ref SDCARD_BLOCK_SIZE bytes
+ */
+static void SDCard_Digest(SDCard_t* const Card,
+                          const uint8_t* Data)
+{
+	uint32_t Hash = Card->Stats.Digest ? Card->Stats.Digest : 2166136261UL;
+
+	for (uint16_t n = 0; n < SDCARD_BLOCK_SIZE; n++)
+	  Hash = (Hash ^ Data[n]) * 16777619UL;
+
+	Card->Stats.Digest = Hash;
+}
+
+/** Queues the response of a command, after the command response delay.
+ *
+ *  \param[in,out] Card    Emulated card
+ *  \param[in]     R1      R1 response, the idle bit being added while the card is in the idle state
+ *  \param[in]     Extra   Bytes following R1 in an R2, R3 or R7 response
+ *  \param[in]     Length  Number of bytes following R1
+ */
+static void SDCard_Respond(SDCard_t* const Card,
+                           const uint8_t R1,
+                           const uint8_t* Extra,
+                           const uint8_t Length)
+{
+	Card->QueueHead = 0;
+	Card->QueueTail = 0;
+
+	for (uint8_t n = 0; n < Card->Timing.CommandDelay; n++)
+	  SDCard_Queue(Card, 0xFF);
+
+	SDCard_Queue(Card, R1 | (Card->Idle ? R1_IDLE : 0));
+	for (uint8_t n = 0; n < Length; n++)
+	  SDCard_Queue(Card, Extra[n]);
+}
+
+/** Fills in the CSD register of a version 2.0 (SDHC) card.
+ *
+ *  \param[in]  Card  Emulated card
+ *  \param[out] CSD   16 byte register
+ */
+static void SDCard_MakeCSD(const SDCard_t* const Card,
+                           uint8_t* CSD)
+{
+	uint32_t CSize = (Card->Blocks / 1024) - 1;
+
+	memset(CSD, 0, 16);
+	CSD[0]  = 0x40;                       /* CSD_STRUCTURE 1 */
+	CSD[1]  = 0x0E;                       /* TAAC 1ms */
+	CSD[3]  = Card->Timing.TranSpeed;
+	CSD[4]  = 0x5B;                       /* CCC */
+	CSD[5]  = 0x59;                       /* CCC, READ_BL_LEN 9 */
+	CSD[7]  = (uint8_t)((CSize >> 16) & 0x3F);
+	CSD[8]  = (uint8_t)(CSize >> 8);
+	CSD[9]  = (uint8_t)CSize;
+	CSD[10] = 0x7F;                       /* ERASE_BLK_EN, SECTOR_SIZE */
+	CSD[11] = 0x80;
+	CSD[12] = 0x0A;                       /* R2W_FACTOR, WRITE_BL_LEN 9 */
+	CSD[13] = 0x40;
+	CSD[15] = SDCard_CRC7(CSD, 15);
+}
+
+/** Fills in the CID register of the card.
+ *
+ *  \param[out] CID  16 byte register
+ */
+static void SDCard_MakeCID(uint8_t* CID)
+{
+	memset(CID, 0, 16);
+	memcpy(CID, "\x03SDEMU01\x10\x12\x34\x56\x78\x01\x3A", 15);
+	CID[15] = SDCard_CRC7(CID, 15);
+}
+
+/** Fills in the SD status register of the card, with an allocation unit of 4MB.
+ *
+ *  \param[out] Status  64 byte register
+ */
+static void SDCard_MakeStatus(uint8_t* Status)
+{
+	memset(Status, 0, 64);
+	Status[8]  = 0x04;                    /* SPEED_CLASS 10 */
+	Status[10] = 0x90;                    /* AU_SIZE 4MB */
+}
+
+/** Starts sending a register to the host, after the register access latency.
+ *
+ *  \param[in,out] Card    Emulated card
+ *  \param[in]     Now     Current card time in nanoseconds
+ *  \param[in]     Length  Size of the register in bytes, filled in \c Card->Register
+ */
+static void SDCard_SendRegister(SDCard_t* const Card,
+                                const uint64_t Now,
+                                const uint8_t Length)
+{
+	Card->RegisterLength = Length;
+	Card->DataAt         = Now + (Card->Timing.RegisterUs * NS_PER_US);
+	Card->State          = SDCARD_READ_REGISTER;
+}
+
+/** Erases the blocks selected by CMD32 and CMD33, which then read as zeros.
+ *
+ *  \param[in,out] Card  Emulated card
+ */
+static void SDCard_Erase(SDCard_t* const Card)
+{
+	static const uint8_t Zeros[SDCARD_BLOCK_SIZE];
+
+	for (uint32_t Block = Card->EraseStart; (Block <= Card->EraseEnd) && (Block < Card->Blocks); Block++)
+	  SDCard_WriteBlock(Card, Block, Zeros);
+}
+
+/** Executes a command received in full.
+ *
+ *  \param[in,out] Card  Emulated card
+ *  \param[in]     Now   Current card time in nanoseconds
+ */
+static void SDCard_Execute(SDCard_t* const Card,
+                           const uint64_t Now)
+{
+	uint8_t  Index      = Card->Command[0] & 0x3F;
+	uint32_t Argument   = ((uint32_t)Card->Command[1] << 24) | ((uint32_t)Card->Command[2] << 16) |
+	                      ((uint32_t)Card->Command[3] << 8)  | Card->Command[4];
+	bool     AppCommand = Card->AppCommand;
+	uint8_t  Extra[4];
+
+	Card->AppCommand = false;
+	Card->Stats.Commands++;
+	Card->Stats.CommandCount[AppCommand ? SDCARD_ACMD(Index) : Index]++;
+
+	/* CMD0 and CMD8 always carry a valid CRC, any other command only once CRC checking is turned on */
+	if ((Card->CRCOn || (Index == 0) || (Index == 8)) && (SDCard_CRC7(Card->Command, 5) != (Card->Command[5] | 1)))
+	{
+		Card->Stats.CRCErrors++;
+		SDCard_Respond(Card, R1_CRC_ERROR, NULL, 0);
+		return;
+	}
+
+	/* Only the initialization commands are accepted in the idle state */
+	if (Card->Idle && (Index != 0) && (Index != 8) && (Index != 55) && (Index != 58) && (Index != 59) &&
+	    !(AppCommand && (Index == 41)))
+	{
+		SDCard_Respond(Card, R1_ILLEGAL_COMMAND, NULL, 0);
+		return;
+	}
+
+	if (AppCommand)
+	{
+		switch (Index)
+		{
+			case 13:
+				Extra[0] = 0x00;
+				SDCard_Respond(Card, 0, Extra, 1);
+				SDCard_MakeStatus(Card->Register);
+				SDCard_SendRegister(Card, Now, 64);
+				return;
+
+			case 23:
+				SDCard_Respond(Card, 0, NULL, 0);
+				return;
+
+			case 41:
+				if (!(Card->InitStart))
+				  Card->InitStart = Now + 1;
+				if ((Now + 1 - Card->InitStart) >= (Card->Timing.InitUs * NS_PER_US))
+				  Card->Idle = false;
+				SDCard_Respond(Card, 0, NULL, 0);
+				return;
+		}
+	}
+
+	switch (Index)
+	{
+		case 0:
+			Card->Idle      = true;
+			Card->CRCOn     = false;
+			Card->InitStart = 0;
+			Card->State     = SDCARD_READY;
+			SDCard_Respond(Card, 0, NULL, 0);
+			break;
+
+		case 8:
+			Extra[0] = 0x00;
+			Extra[1] = 0x00;
+			Extra[2] = (uint8_t)((Argument >> 8) & 0x0F);
+			Extra[3] = (uint8_t)Argument;
+			SDCard_Respond(Card, 0, Extra, 4);
+			break;
+
+		case 9:
+			SDCard_Respond(Card, 0, NULL, 0);
+			SDCard_MakeCSD(Card, Card->Register);
+			SDCard_SendRegister(Card, Now, 16);
+			break;
+
+		case 10:
+			SDCard_Respond(Card, 0, NULL, 0);
+			SDCard_MakeCID(Card->Register);
+			SDCard_SendRegister(Card, Now, 16);
+			break;
+
+		case 12:
+			/* The byte after the command is a stuff byte, then R1 and the busy time of the stopped transfer */
+			Card->State     = SDCARD_READY;
+			SDCard_Respond(Card, 0, NULL, 0);
+			Card->BusyUntil = Now + (Card->Timing.StopBusyUs * NS_PER_US);
+			break;
+
+		case 16:
+			SDCard_Respond(Card, (Argument == SDCARD_BLOCK_SIZE) ? 0 : R1_PARAMETER_ERROR, NULL, 0);
+			break;
+
+		case 17:
+		case 18:
+			if (Argument >= Card->Blocks)
+			{
+				SDCard_Respond(Card, R1_ADDRESS_ERROR, NULL, 0);
+				break;
+			}
+
+			SDCard_Respond(Card, 0, NULL, 0);
+			Card->Block  = Argument;
+			Card->DataAt = Now + (Card->Timing.ReadFirstUs * NS_PER_US);
+			Card->State  = (Index == 17) ? SDCARD_READ_SINGLE : SDCARD_READ_MULTIPLE;
+			break;
+
+		case 24:
+		case 25:
+			if (Argument >= Card->Blocks)
+			{
+				SDCard_Respond(Card, R1_ADDRESS_ERROR, NULL, 0);
+				break;
+			}
+
+			SDCard_Respond(Card, 0, NULL, 0);
+			Card->Block = Argument;
+			Card->State = (Index == 24) ? SDCARD_WRITE_SINGLE : SDCARD_WRITE_MULTIPLE;
+			break;
+
+		case 32:
+			Card->EraseStart = Argument;
+			SDCard_Respond(Card, 0, NULL, 0);
+			break;
+
+		case 33:
+			Card->EraseEnd = Argument;
+			SDCard_Respond(Card, 0, NULL, 0);
+			break;
+
+		case 38:
+			SDCard_Erase(Card);
+			SDCard_Respond(Card, 0, NULL, 0);
+			Card->BusyUntil = Now + (Card->Timing.EraseBusyUs * NS_PER_US);
+			break;
+
+		case 55:
+			Card->AppCommand = true;
+			SDCard_Respond(Card, 0, NULL, 0);
+			break;
+
+		case 58:
+			Extra[0] = Card->Idle ? 0x40 : 0xC0;  /* Power up status once initialized, CCS */
+			Extra[1] = 0xFF;
+			Extra[2] = 0x80;
+			Extra[3] = 0x00;
+			SDCard_Respond(Card, 0, Extra, 4);
+			break;
+
+		case 59:
+			Card->CRCOn = (Argument & 1);
+			SDCard_Respond(Card, 0, NULL, 0);
+			break;
+
+		default:
+			SDCard_Respond(Card, R1_ILLEGAL_COMMAND, NULL, 0);
+			break;
+	}
+}
+
+/** Programs a data block received in full, and answers it with a data response.
+ *
+ *  \param[in,out] Card  Emulated card
+ *  \param[in]     Now   Current card time in nanoseconds
+ */
+static void SDCard_Program(SDCard_t* const Card,
+                           const uint64_t Now)
+{
+	uint16_t CRC      = ((uint16_t)Card->Data[SDCARD_BLOCK_SIZE] << 8) | Card->Data[SDCARD_BLOCK_SIZE + 1];
+	bool     Multiple = (Card->Command[0] & 0x3F) == 25;
+	uint32_t BusyUs   = Multiple ? Card->Timing.WriteBusyUs : Card->Timing.SingleWriteBusyUs;
+
+	Card->State      = Multiple ? SDCARD_WRITE_MULTIPLE : SDCARD_READY;
+	Card->QueueHead  = 0;
+	Card->QueueTail  = 0;
+	Card->Stats.WriteBlockNs += (Now - Card->BlockStart);
+
+	if (Card->CRCOn && (CRC != SDCard_CRC16(Card->Data, SDCARD_BLOCK_SIZE)))
+	{
+		Card->Stats.BlocksRejected++;
+		SDCard_Queue(Card, DATA_CRC_ERROR);
+		return;
+	}
+
+	if ((Card->Block >= Card->Blocks) || !(SDCard_WriteBlock(Card, Card->Block, Card->Data)))
+	{
+		SDCard_Queue(Card, DATA_WRITE_ERROR);
+		return;
+	}
+
+	Card->Block++;
+	Card->Stats.BlocksWritten++;
+	SDCard_Digest(Card, Card->Data);
+
+	if (Card->Timing.GCInterval && (++Card->Written >= Card->Timing.GCInterval))
+	{
+		Card->Written = 0;
+		Card->Stats.GCStalls++;
+		BusyUs += Card->Timing.GCStallUs;
+	}
+
+	SDCard_Queue(Card, DATA_ACCEPTED);
+	Card->BusyUntil = Now + (BusyUs * NS_PER_US);
+}
+
+/** Opens the image file holding the contents of an emulated card, creating it if needed, and resets the card to
+ *  its power up state with the default timing.
+ *
+ *  \param[out] Card    Emulated card
+ *  \param[in]  Path    Path of the image file
+ *  \param[in]  Blocks  Card capacity in blocks, a multiple of 1024, or 0 to take it from the size of an existing image
+ *
+ *  \return Boolean \c true if the image could be opened, \c false otherwise
+ */
+bool SDCard_Open(SDCard_t* const Card,
+                 const char* const Path,
+                 const uint32_t Blocks)
+{
+	memset(Card, 0, sizeof(SDCard_t));
+	SDCard_DefaultTiming(&Card->Timing);
+
+	Card->Image = fopen(Path, "r+b");
+	if (!(Card->Image))
+	  Card->Image = fopen(Path, "w+b");
+	if (!(Card->Image))
+	  return false;
+
+	fseeko(Card->Image, 0, SEEK_END);
+	Card->Blocks = Blocks ? Blocks : (uint32_t)(ftello(Card->Image) / SDCARD_BLOCK_SIZE);
+	Card->Blocks &= ~1023UL;
+
+	/* A sparse file reads as zeros where it has never been written */
+	if (!(Card->Blocks) || (ftruncate(fileno(Card->Image), (off_t)Card->Blocks * SDCARD_BLOCK_SIZE) != 0))
+	{
+		fclose(Card->Image);
+		Card->Image = NULL;
+		return false;
+	}
+
+	Card->Idle = true;
+	return true;
+}
+
+/** Closes the image file of an emulated card.
+ *
+ *  \param[in,out] Card  Emulated card
+ */
+void SDCard_Close(SDCard_t* const Card)
+{
+	if (Card->Image)
+	  fclose(Card->Image);
+
+	Card->Image = NULL;
+}
+
+/** Sets the timing of a typical class 10 card.
+ *
+ *  \param[out] Timing  Timing of the card
+ */
+void SDCard_DefaultTiming(SDCard_Timing_t* const Timing)
+{
+	Timing->InitUs            = 100000;
+	Timing->ReadFirstUs       = 250;
+	Timing->ReadNextUs        = 40;
+	Timing->RegisterUs        = 50;
+	Timing->WriteBusyUs       = 150;
+	Timing->SingleWriteBusyUs = 800;
+	Timing->StopBusyUs        = 500;
+	Timing->EraseBusyUs       = 2000;
+	Timing->GCInterval        = 512;
+	Timing->GCStallUs         = 20000;
+	Timing->CommandDelay      = 1;
+	Timing->TranSpeed         = 0x32;
+}
+
+/** Changes one field of a card timing from a \c name=value option: \c init, \c read-first, \c read-next,
+ *  \c register, \c write-busy, \c single-busy, \c stop-busy, \c erase-busy and \c gc-stall in microseconds,
+ *  \c gc-interval in blocks, \c ncr for the command response delay in bytes and \c tran-speed for the CSD
+ *  TRAN_SPEED field.
+ *
+ *  \param[in,out] Timing  Timing of the card
+ *  \param[in]     Option  Option to apply
+ *
+ *  \return Boolean \c true if the option names a timing field, \c false otherwise
+ */
+bool SDCard_SetTiming(SDCard_Timing_t* const Timing,
+                      const char* const Option)
+{
+	const char* Value = strchr(Option, '=');
+	size_t      NameLength;
+
+	if (!(Value))
+	  return false;
+
+	NameLength = (size_t)(Value++ - Option);
+
+	for (uint8_t n = 0; n < (sizeof(TimingOptions) / sizeof(TimingOptions[0])); n++)
+	{
+		if ((strlen(TimingOptions[n].Name) == NameLength) && !(strncmp(Option, TimingOptions[n].Name, NameLength)))
+		{
+			*(uint32_t*)((uint8_t*)Timing + TimingOptions[n].Offset) = (uint32_t)strtoul(Value, NULL, 0);
+			return true;
+		}
+	}
+
+	if ((NameLength == 3) && !(strncmp(Option, "ncr", 3)))
+	  Timing->CommandDelay = (uint8_t)strtoul(Value, NULL, 0);
+	else if ((NameLength == 10) && !(strncmp(Option, "tran-speed", 10)))
+	  Timing->TranSpeed = (uint8_t)strtoul(Value, NULL, 0);
+	else
+	  return false;
+
+	return true;
+}
+
+/** Asserts or releases the chip select of the card. The card keeps its state while released, as a suspended
+ *  multiple block transfer resumes where it stopped, only a command being received is dropped.
+ *
+ *  \param[in,out] Card      Emulated card
+ *  \param[in]     Selected  Chip select asserted
+ */
+void SDCard_Select(SDCard_t* const Card,
+                   const bool Selected)
+{
+	if (Card->Selected == Selected)
+	  return;
+
+	Card->Selected      = Selected;
+	Card->CommandLength = 0;
+}
+
+/** Exchanges a byte with the card, as clocked by the host. Nothing is received while the chip select is released,
+ *  and the card then leaves the data line high.
+ *
+ *  \param[in,out] Card  Emulated card
+ *  \param[in]     MOSI  Byte sent by the host
+ *  \param[in]     Now   Current card time in nanoseconds, never going backwards
+ *
+ *  \return Byte sent by the card
+ */
+uint8_t SDCard_Exchange(SDCard_t* const Card,
+                        const uint8_t MOSI,
+                        const uint64_t Now)
+{
+	uint8_t MISO = 0xFF;
+
+	Card->Stats.Bytes++;
+
+	if (!(Card->Selected))
+	  return MISO;
+
+	/* Every byte of a data block being received belongs to it */
+	if (Card->State == SDCARD_RECEIVE)
+	{
+		Card->Data[Card->DataLength++] = MOSI;
+		if (Card->DataLength == (SDCARD_BLOCK_SIZE + 2))
+		  SDCard_Program(Card, Now);
+
+		return MISO;
+	}
+
+	/* Send the queued bytes first, then hold the data line low while busy, then send the next data block once due */
+	if (Card->QueueHead < Card->QueueTail)
+	{
+		MISO = Card->Queue[Card->QueueHead++];
+
+		if (Card->QueueHead == Card->QueueTail)
+		{
+			Card->QueueHead = 0;
+			Card->QueueTail = 0;
+
+			/* The end of a data block rather than of a response */
+			if (Card->DataLength && ((Card->State == SDCARD_READ_SINGLE) || (Card->State == SDCARD_READ_MULTIPLE)))
+			  Card->Stats.ReadBlockNs += (Now - Card->BlockStart);
+
+			if (Card->DataLength && (Card->State == SDCARD_READ_MULTIPLE))
+			  Card->DataAt = Now + (Card->Timing.ReadNextUs * NS_PER_US);
+			else if (Card->DataLength && ((Card->State == SDCARD_READ_SINGLE) || (Card->State == SDCARD_READ_REGISTER)))
+			  Card->State = SDCARD_READY;
+		}
+	}
+	else if (Now < Card->BusyUntil)
+	{
+		MISO = 0x00;
+		Card->Stats.BusyBytes++;
+	}
+	else if ((Card->State == SDCARD_READ_SINGLE) || (Card->State == SDCARD_READ_MULTIPLE) ||
+	         (Card->State == SDCARD_READ_REGISTER))
+	{
+		if (Now < Card->DataAt)
+		{
+			Card->Stats.WaitBytes++;
+		}
+		else if (Card->State == SDCARD_READ_REGISTER)
+		{
+			SDCard_QueueBlock(Card, Card->Register, Card->RegisterLength);
+			Card->DataLength = Card->RegisterLength;
+			MISO = Card->Queue[Card->QueueHead++];
+		}
+		else if (Card->Block >= Card->Blocks)
+		{
+			SDCard_Queue(Card, DATA_OUT_OF_RANGE);
+			Card->DataAt = UINT64_MAX;
+			MISO = Card->Queue[Card->QueueHead++];
+		}
+		else
+		{
+			uint8_t Block[SDCARD_BLOCK_SIZE];
+
+			if (!(SDCard_ReadBlock(Card, Card->Block, Block)))
+			  memset(Block, 0, sizeof(Block));
+
+			SDCard_QueueBlock(Card, Block, SDCARD_BLOCK_SIZE);
+			SDCard_Digest(Card, Block);
+			Card->Block++;
+			Card->DataLength = SDCARD_BLOCK_SIZE;
+			Card->BlockStart = Now;
+			Card->Stats.BlocksRead++;
+			MISO = Card->Queue[Card->QueueHead++];
+		}
+	}
+
+	/* Then take in the byte the host sent: a command byte, a data token or anything else to be ignored */
+	if (Card->CommandLength)
+	{
+		Card->Command[Card->CommandLength++] = MOSI;
+		if (Card->CommandLength == 6)
+		{
+			Card->CommandLength = 0;
+			Card->DataLength    = 0;
+			SDCard_Execute(Card, Now);
+		}
+	}
+	else if (((Card->State == SDCARD_WRITE_SINGLE) || (Card->State == SDCARD_WRITE_MULTIPLE)) &&
+	         (Card->QueueHead == Card->QueueTail) && (Now >= Card->BusyUntil) && (MOSI != 0xFF))
+	{
+		if (MOSI == ((Card->State == SDCARD_WRITE_SINGLE) ? 0xFE : 0xFC))
+		{
+			Card->DataLength = 0;
+			Card->BlockStart = Now;
+			Card->State      = SDCARD_RECEIVE;
+		}
+		else if ((MOSI == 0xFD) && (Card->State == SDCARD_WRITE_MULTIPLE))
+		{
+			Card->State     = SDCARD_READY;
+			Card->BusyUntil = Now + (Card->Timing.StopBusyUs * NS_PER_US);
+		}
+	}
+	else if (((MOSI & 0xC0) == 0x40) && (Now >= Card->BusyUntil))
+	{
+		Card->Command[0]    = MOSI;
+		Card->CommandLength = 1;
+	}
+
+	return MISO;
+}
+
+/** Reads a block of the card contents directly from the image, without any card traffic.
+ *
+ *  \param[in]  Card    Emulated card
+ *  \param[in]  Block   Block number
+ *  \param[out] Buffer  Buffer of \ref SDCARD_BLOCK_SIZE bytes to read the block into
+ *
+ *  \return Boolean \c true if the block could be read, \c false otherwise
+ */
+bool SDCard_ReadBlock(SDCard_t* const Card,
+                      const uint32_t Block,
+                      uint8_t* const Buffer)
+{
+	if ((Block >= Card->Blocks) || (fseeko(Card->Image, (off_t)Block * SDCARD_BLOCK_SIZE, SEEK_SET) != 0))
+	  return false;
+
+	return (fread(Buffer, SDCARD_BLOCK_SIZE, 1, Card->Image) == 1);
+}
+
+/** Writes a block of the card contents directly to the image, without any card traffic.
+ *
+ *  \param[in,out] Card    Emulated card
+ *  \param[in]     Block   Block number
+ *  \param[in]     Buffer  Buffer of \ref SDCARD_BLOCK_SIZE bytes to write to the block
+ *
+ *  \return Boolean \c true if the block could be written, \c false otherwise
+ */
+bool SDCard_WriteBlock(SDCard_t* const Card,
+                       const uint32_t Block,
+                       const uint8_t* const Buffer)
+{
+	if ((Block >= Card->Blocks) || (fseeko(Card->Image, (off_t)Block * SDCARD_BLOCK_SIZE, SEEK_SET) != 0))
+	  return false;
+
+	return (fwrite(Buffer, SDCARD_BLOCK_SIZE, 1, Card->Image) == 1);
+}
+
+/** Prints the traffic counters of the card, followed by the count of each command received.
+ *
+ *  \param[in] Card    Emulated card
+ *  \param[in] Stream  Stream to print the counters to
+ */
+void SDCard_PrintStats(const SDCard_t* const Card,
+                       FILE* const Stream)
+{
+	const SDCard_Stats_t* Stats = &Card->Stats;
+
+	fprintf(Stream, "card: %lu commands, %llu SPI bytes (%llu busy, %llu token wait), %lu blocks read, "
+	        "%lu written, %lu rejected, %lu CRC errors, %lu GC stalls\n",
+	        (unsigned long)Stats->Commands, (unsigned long long)Stats->Bytes,
+	        (unsigned long long)Stats->BusyBytes, (unsigned long long)Stats->WaitBytes,
+	        (unsigned long)Stats->BlocksRead, (unsigned long)Stats->BlocksWritten,
+	        (unsigned long)Stats->BlocksRejected, (unsigned long)Stats->CRCErrors, (unsigned long)Stats->GCStalls);
+
+	fprintf(Stream, "card: %.0f ns per data block sent, %.0f ns per data block received, digest %08lx\n",
+	        Stats->BlocksRead ? ((double)Stats->ReadBlockNs / Stats->BlocksRead) : 0.0,
+	        (Stats->BlocksWritten + Stats->BlocksRejected) ?
+	          ((double)Stats->WriteBlockNs / (Stats->BlocksWritten + Stats->BlocksRejected)) : 0.0,
+	        (unsigned long)Stats->Digest);
+
+	fputs("card commands:", Stream);
+	for (uint8_t n = 0; n < 128; n++)
+	{
+		if (Stats->CommandCount[n])
+		  fprintf(Stream, " %sCMD%u=%lu", (n >= 64) ? "A" : "", (unsigned)(n & 63), (unsigned long)Stats->CommandCount[n]);
+	}
+	fputs("\n", Stream);
+}
@@ -0,0 +1,159 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for SDCard.c.
+ */
+
+#ifndef _SDCARD_H_
+#define _SDCARD_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+		#include <stdio.h>
+
+	/* Macros: */
+		/** Size in bytes of a card data block. */
+		#define SDCARD_BLOCK_SIZE          512
+
+		/** Index of the command counter of an application specific command ACMD<n> in \ref SDCard_Stats_t. */
+		#define SDCARD_ACMD(n)             (64 + (n))
+
+		/** Size of the output queue of the card, enough for a data token, a data block and its CRC. */
+		#define SDCARD_QUEUE_SIZE          (SDCARD_BLOCK_SIZE + 16)
+
+	/* Type Defines: */
+		/** Type define for the timing of the card. All durations are in microseconds of card time, which the caller
+		 *  supplies with every byte exchanged.
+		 */
+		typedef struct
+		{
+			uint32_t InitUs;             /**< Time from the first ACMD41 until the card leaves the idle state */
+			uint32_t ReadFirstUs;        /**< Time from a read command to the data token of its first block */
+			uint32_t ReadNextUs;         /**< Time from the end of a block to the data token of the next one in a CMD18 */
+			uint32_t RegisterUs;         /**< Time from a CMD9, CMD10 or ACMD13 to the data token of the register */
+			uint32_t WriteBusyUs;        /**< Busy time after each block of a CMD25 */
+			uint32_t SingleWriteBusyUs;  /**< Busy time after the block of a CMD24 */
+			uint32_t StopBusyUs;         /**< Busy time after a STOP_TRAN token or a CMD12 */
+			uint32_t EraseBusyUs;        /**< Busy time after a CMD38 */
+			uint32_t GCInterval;         /**< Number of blocks written between garbage collection stalls, 0 for none */
+			uint32_t GCStallUs;          /**< Busy time added to the block that triggers a garbage collection stall */
+			uint8_t  CommandDelay;       /**< Bytes from the end of a command to its response (NCR), 1 to 8 */
+			uint8_t  TranSpeed;          /**< TRAN_SPEED field of the CSD, 0x32 for 25MHz and 0x5A for 50MHz */
+		} SDCard_Timing_t;
+
+		/** Type define for the traffic counters of the card. */
+		typedef struct
+		{
+			uint32_t Commands;           /**< Number of commands received, an ACMD<n> counting as CMD55 and ACMD<n> */
+			uint32_t CommandCount[128];  /**< Number of each CMD<n>, and of each ACMD<n> at \ref SDCARD_ACMD(n) */
+			uint64_t Bytes;              /**< Number of bytes clocked, whether the card is selected or not */
+			uint64_t BusyBytes;          /**< Number of bytes clocked while the card was selected and busy */
+			uint64_t WaitBytes;          /**< Number of bytes clocked while the host waited for a data token */
+			uint32_t BlocksRead;         /**< Number of data blocks sent to the host */
+			uint32_t BlocksWritten;      /**< Number of data blocks programmed */
+			uint32_t BlocksRejected;     /**< Number of data blocks rejected on a CRC mismatch */
+			uint32_t CRCErrors;          /**< Number of commands rejected on a CRC mismatch */
+			uint32_t GCStalls;           /**< Number of garbage collection stalls */
+			uint64_t ReadBlockNs;        /**< Time from the data token to the end of the CRC of the data blocks sent */
+			uint64_t WriteBlockNs;       /**< Time from the data token to the end of the CRC of the data blocks received */
+			uint32_t Digest;             /**< FNV-1a hash of the data blocks sent and programmed, in order */
+		} SDCard_Stats_t;
+
+		/** Type define for the state of an emulated card, holding its contents in an image file. */
+		typedef struct
+		{
+			FILE*           Image;       /**< Image file holding the card contents */
+			uint32_t        Blocks;      /**< Card capacity in blocks */
+			SDCard_Timing_t Timing;      /**< Timing of the card */
+			SDCard_Stats_t  Stats;       /**< Traffic counters, cleared by the caller as needed */
+
+			bool     Selected;           /**< Chip select asserted */
+			uint8_t  State;              /**< Current state, a value from the \ref SDCard_States_t enum */
+			bool     Idle;               /**< In idle state, until ACMD41 completes the initialization */
+			bool     AppCommand;         /**< The previous command was CMD55 */
+			bool     CRCOn;              /**< Command and write data CRCs are checked (CMD59) */
+			uint64_t InitStart;          /**< Time of the first ACMD41 plus one, 0 if none yet */
+			uint64_t BusyUntil;          /**< Time the card gets ready after programming or erasing */
+			uint64_t DataAt;             /**< Time the next data token is sent in a read state */
+			uint64_t BlockStart;         /**< Time of the data token of the data block being sent or received */
+			uint32_t Block;              /**< Next block read or written */
+			uint32_t EraseStart;         /**< First block to erase, set by CMD32 */
+			uint32_t EraseEnd;           /**< Last block to erase, set by CMD33 */
+			uint32_t Written;            /**< Blocks written since the last garbage collection stall */
+			uint8_t  Command[6];         /**< Command being received */
+			uint8_t  CommandLength;      /**< Number of command bytes received, 0 if none */
+			uint8_t  Register[64];       /**< Register sent in the \ref SDCARD_READ_REGISTER state */
+			uint8_t  RegisterLength;     /**< Size of the register being sent */
+			uint16_t DataLength;         /**< Bytes of the data block received, or of the block or register queued to be sent */
+			uint8_t  Data[SDCARD_BLOCK_SIZE + 2];  /**< Data block being received, with its CRC */
+			uint8_t  Queue[SDCARD_QUEUE_SIZE];     /**< Bytes queued to be sent to the host */
+			uint16_t QueueHead;          /**< Next queued byte to send */
+			uint16_t QueueTail;          /**< Number of bytes queued */
+		} SDCard_t;
+
+	/* Enums: */
+		/** Enum for the states of an emulated card between commands. */
+		enum SDCard_States_t
+		{
+			SDCARD_READY         = 0, /**< Waiting for a command */
+			SDCARD_READ_SINGLE   = 1, /**< Sending the block of a CMD17 */
+			SDCARD_READ_MULTIPLE = 2, /**< Sending the blocks of a CMD18 until a CMD12 */
+			SDCARD_READ_REGISTER = 3, /**< Sending the register of a CMD9, CMD10 or ACMD13 */
+			SDCARD_WRITE_SINGLE  = 4, /**< Waiting for the data token of a CMD24 */
+			SDCARD_WRITE_MULTIPLE = 5, /**< Waiting for a data or STOP_TRAN token of a CMD25 */
+			SDCARD_RECEIVE       = 6, /**< Receiving a data block */
+		};
+
+	/* Function Prototypes: */
+		bool    SDCard_Open(SDCard_t* const Card,
+		                    const char* const Path,
+		                    const uint32_t Blocks);
+		void    SDCard_Close(SDCard_t* const Card);
+		void    SDCard_DefaultTiming(SDCard_Timing_t* const Timing);
+		bool    SDCard_SetTiming(SDCard_Timing_t* const Timing,
+		                         const char* const Option);
+		void    SDCard_Select(SDCard_t* const Card,
+		                      const bool Selected);
+		uint8_t SDCard_Exchange(SDCard_t* const Card,
+		                        const uint8_t MOSI,
+		                        const uint64_t Now);
+		bool    SDCard_ReadBlock(SDCard_t* const Card,
+		                         const uint32_t Block,
+		                         uint8_t* const Buffer);
+		bool    SDCard_WriteBlock(SDCard_t* const Card,
+		                          const uint32_t Block,
+		                          const uint8_t* const Buffer);
+		void    SDCard_PrintStats(const SDCard_t* const Card,
+		                          FILE* const Stream);
+
+#endif
@@ -0,0 +1,621 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Workload suite of the host build. A workload file holds the command block wrappers a host sends for a typical
+ *  task, such as probing a new drive, formatting it or copying files onto it. Each workload is replayed in each LUN
+ *  mode of \ref HostBench.c against a freshly formatted card and started firmware, and its throughput, card command
+ *  counts, SPI bytes and RAM high-water marks are compared with a baseline file, any regression failing the run.
+ *
+ *  A workload file is read line by line. Blank lines and lines starting with '#' are ignored, "idle MS" leaves the
+ *  drive idle for MS milliseconds, and any other line is a 31 byte command block wrapper in hex, as seen on the bus.
+ *  The wrapper must have the USBC signature and address LUN 0; its tag is ignored, the replay numbering the commands
+ *  itself. The data of a WRITE (10) is a test pattern unique to each block and command, the data of any other OUT
+ *  command is zeros. The blocks a WRITE (10) has put on the LUN are checked when read back by a READ (10), and on the
+ *  card at the end of the workload.
+ *
+ *  A baseline file has one line per workload and LUN mode, holding the workload file name, the mode name and the
+ *  values of \ref Metrics as name=value pairs. A metric regresses once it is worse than its baseline value by more
+ *  than its tolerance; a missing baseline line fails as well. update=1 writes the baseline file afresh instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "Host.h"
+#include "Endpoint.h"
+#include "Format.h"
+#include "Replay.h"
+#include "../Lib/SCSI.h"
+
+/** Capacity of the emulated card in blocks, 1GB. */
+#define WORKLOAD_CARD_BLOCKS       2097152UL
+
+/** Size of a command block wrapper. */
+#define WORKLOAD_CBW_SIZE          31
+
+/** Longest data stage of a command, as much as the host buffers hold. */
+#define WORKLOAD_MAX_DATA          (ENDPOINT_HOST_BUFFER_SIZE - 64)
+
+/** Number of metrics compared with the baseline. */
+#define WORKLOAD_METRICS           6
+
+/** Type define for a way of backing the LUN. */
+typedef struct
+{
+	const char* Name;                /**< Name of the mode */
+	const char* Config;              /**< Contents of the wahaha.ini file */
+	bool        LinkMap;             /**< The cluster link map table of the image can be allocated */
+} Workload_Mode_t;
+
+/** Type define for a metric of a workload run. */
+typedef struct
+{
+	const char* Name;                /**< Name of the metric in the baseline file */
+	bool        HigherIsBetter;      /**< The metric regresses when it drops rather than when it rises */
+	uint8_t     Tolerance;           /**< Change in percent allowed in the worse direction */
+} Workload_Metric_t;
+
+/** LUN modes, in the order they are run. */
+static const Workload_Mode_t Modes[] =
+	{
+		{"raw",    "[wahaha]\r\nraw=1\r\n", true},
+		{"mapped", "[wahaha]\r\nraw=0\r\n", true},
+		{"fatfs",  "[wahaha]\r\nraw=0\r\n", false},
+	};
+
+/** Metrics compared with the baseline. The stack peak is in host bytes, and varies a little between compilers. */
+static const Workload_Metric_t Metrics[WORKLOAD_METRICS] =
+	{
+		{"kbps",          true,  5},
+		{"card-commands", false, 5},
+		{"spi-bytes",     false, 5},
+		{"heap",          false, 0},
+		{"stack",         false, 25},
+		{"failed",        false, 0},
+	};
+
+/** Help text of the command line options. */
+static const char Usage[] =
+	"usage: workloadbench [help] [name=value ...] FILE.cbw ...\n"
+	"  image=PATH    card image file, created or overwritten (workloadbench.img)\n"
+	"  mode=NAME     LUN mode to run, raw, mapped, fatfs or all (all)\n"
+	"  baseline=PATH baseline file (workloads/baseline.txt)\n"
+	"  update=N      update=1 writes the baseline file afresh instead of checking it (0)\n"
+	"  card timing:  init read-first read-next register write-busy single-busy stop-busy erase-busy\n"
+	"                (in us), gc-interval (blocks), gc-stall (us), ncr (bytes), tran-speed (CSD code)\n"
+	"  host costs:   spi-gap ep-byte packet stall loop command-gap (in CPU cycles)\n";
+
+/** Path of the card image file. */
+static const char* ImagePath = "workloadbench.img";
+
+/** Path of the baseline file. */
+static const char* BaselinePath = "workloads/baseline.txt";
+
+/** Write the baseline file rather than checking against it. */
+static bool UpdateBaseline;
+
+/** Card timing and cost options, applied in each mode. */
+static char** Options;
+
+/** Number of entries in \ref Options. */
+static int OptionCount;
+
+/** Number of the WRITE (10) command that last wrote each block of the LUN, 0 if unknown. */
+static uint32_t* Written;
+
+/** Data of the commands sent and received. */
+static uint8_t Buffer[WORKLOAD_MAX_DATA];
+
+
+/** Fills a block with a test pattern unique to its address and to the command writing it.
+ *
+ *  \param[out] Data     Block to fill
+ *  \param[in]  Block    Block address
+ *  \param[in]  Command  Number of the command
+ */
+static void Workload_Pattern(uint8_t* const Data,
+                             const uint32_t Block,
+                             const uint32_t Command)
+{
+	uint32_t Value = (Block * 2654435761UL) ^ (Command << 12);
+
+	for (uint16_t n = 0; n < VIRTUAL_MEMORY_BLOCK_SIZE; n++)
+	{
+		Value   = (Value * 1103515245UL) + 12345;
+		Data[n] = (uint8_t)(Value >> 16);
+	}
+}
+
+/** Gets the base name of a path.
+ *
+ *  \param[in] Path  Path of a file
+ *
+ *  \return File name of the path
+ */
+static const char* Workload_BaseName(const char* const Path)
+{
+	const char* Slash = strrchr(Path, '/');
+
+	return (Slash ? &Slash[1] : Path);
+}
+
+/** Parses a command block wrapper written in hex.
+ *
+ *  \param[in]  Text  Line holding the wrapper
+ *  \param[out] CBW   Wrapper bytes
+ *
+ *  \return Boolean \c true if the line holds a valid wrapper, \c false otherwise
+ */
+static bool Workload_ParseCBW(const char* const Text,
+                              uint8_t* const CBW)
+{
+	for (uint8_t n = 0; n < WORKLOAD_CBW_SIZE; n++)
+	{
+		unsigned int Byte;
+
+		if (sscanf(&Text[n * 2], "%2x", &Byte) != 1)
+		  return false;
+
+		CBW[n] = (uint8_t)Byte;
+	}
+
+	return (!(memcmp(CBW, "USBC", 4)) && (Text[WORKLOAD_CBW_SIZE * 2] == '\0') && !(CBW[13]) &&
+	        (CBW[14] >= 1) && (CBW[14] <= 16));
+}
+
+/** Replays one command block wrapper, preparing its data and checking the data it returns.
+ *
+ *  \param[in]     CBW       Command block wrapper
+ *  \param[in]     Command   Number of the command in the workload
+ *  \param[in,out] Values    Metrics of the run, the command count and failures being updated
+ *  \param[in,out] Bytes     Data bytes moved by the commands
+ *  \param[in,out] Cycles    Time taken by the commands
+ *  \param[in,out] Errors    Number of blocks read back wrong
+ *
+ *  \return Boolean \c true if the device gave a valid status for the command, \c false otherwise
+ */
+static bool Workload_Command(const uint8_t* const CBW,
+                             const uint32_t Command,
+                             double* const Values,
+                             uint64_t* const Bytes,
+                             uint64_t* const Cycles,
+                             uint32_t* const Errors)
+{
+	const uint8_t*  CommandData = &CBW[15];
+	uint32_t        DataLength  = CBW[8] | ((uint32_t)CBW[9] << 8) | ((uint32_t)CBW[10] << 16) |
+	                              ((uint32_t)CBW[11] << 24);
+	bool            IsDataIn    = (CBW[12] & 0x80);
+	uint32_t        Block       = ((uint32_t)CommandData[2] << 24) | ((uint32_t)CommandData[3] << 16) |
+	                              ((uint32_t)CommandData[4] << 8) | CommandData[5];
+	uint32_t        Blocks      = MIN(((uint32_t)CommandData[7] << 8) | CommandData[8],
+	                                  DataLength / VIRTUAL_MEMORY_BLOCK_SIZE);
+	bool            IsWrite     = !(IsDataIn) && (CommandData[0] == SCSI_CMD_WRITE_10);
+	bool            IsRead      = IsDataIn && (CommandData[0] == SCSI_CMD_READ_10);
+	Replay_Result_t Result;
+
+	if (DataLength > WORKLOAD_MAX_DATA)
+	{
+		printf("  command %lu moves %lu bytes, more than the host buffers hold\n", (unsigned long)Command,
+		       (unsigned long)DataLength);
+		return false;
+	}
+
+	memset(Buffer, 0, DataLength);
+	if (IsWrite)
+	{
+		for (uint32_t n = 0; n < Blocks; n++)
+		  Workload_Pattern(&Buffer[n * VIRTUAL_MEMORY_BLOCK_SIZE], Block + n, Command);
+	}
+
+	if (!(Replay_Command(CommandData, CBW[14], IsDataIn, DataLength, Buffer, &Result)))
+	{
+		printf("  command %lu (%02X) got no status\n", (unsigned long)Command, (unsigned)CommandData[0]);
+		return false;
+	}
+
+	Values[5] += (Result.Status != MS_SCSI_COMMAND_Pass);
+	*Bytes    += IsDataIn ? MIN(Result.Received, DataLength) : (DataLength - MIN(Result.Residue, DataLength));
+	*Cycles   += Result.Cycles;
+
+	/* The blocks of a failed write are in an unknown state, and are no longer checked */
+	for (uint32_t n = 0; IsWrite && (n < Blocks) && ((Block + n) < media_blocks); n++)
+	  Written[Block + n] = (Result.Status == MS_SCSI_COMMAND_Pass) ? Command : 0;
+
+	if (!(IsRead) || (Result.Status != MS_SCSI_COMMAND_Pass))
+	  return true;
+
+	for (uint32_t n = 0; (n < Blocks) && ((Block + n) < media_blocks); n++)
+	{
+		uint8_t Expected[VIRTUAL_MEMORY_BLOCK_SIZE];
+
+		if (!(Written[Block + n]))
+		  continue;
+
+		Workload_Pattern(Expected, Block + n, Written[Block + n]);
+		if (memcmp(&Buffer[n * VIRTUAL_MEMORY_BLOCK_SIZE], Expected, sizeof(Expected)) && !((*Errors)++))
+		  printf("  block %lu read back differs\n", (unsigned long)(Block + n));
+	}
+
+	return true;
+}
+
+/** Replays a workload file against the started firmware.
+ *
+ *  \param[in]  Path    Workload file
+ *  \param[out] Values  Metrics of the run, in the order of \ref Metrics
+ *
+ *  \return Boolean \c true if all the commands got a status and all the data written is intact, \c false otherwise
+ */
+static bool Workload_Replay(const char* const Path,
+                            double* const Values)
+{
+	FILE*    File;
+	char     Line[256];
+	uint8_t  CBW[WORKLOAD_CBW_SIZE];
+	uint32_t LineNumber = 0;
+	uint32_t Commands   = 0;
+	uint32_t Errors     = 0;
+	uint64_t Bytes      = 0;
+	uint64_t Cycles     = 0;
+	bool     Success    = true;
+
+	if (!(File = fopen(Path, "r")))
+	{
+		printf("  cannot open %s\n", Path);
+		return false;
+	}
+
+	memset(&Host_Card.Stats, 0, sizeof(Host_Card.Stats));
+	Host_Usage.SpiCycles          = 0;
+	Host_Usage.EndpointWaitCycles = 0;
+
+	while (Success && fgets(Line, sizeof(Line), File))
+	{
+		char* Text = Line;
+
+		LineNumber++;
+		Text[strcspn(Text, "\r\n")] = '\0';
+		Text += strspn(Text, " \t");
+
+		if ((Text[0] == '\0') || (Text[0] == '#'))
+		  continue;
+
+		if (!(strncmp(Text, "idle ", 5)))
+		{
+			Replay_Idle(strtoull(&Text[5], NULL, 0) * (F_CPU / 1000));
+		}
+		else if (!(Workload_ParseCBW(Text, CBW)))
+		{
+			printf("  %s:%lu: not a command block wrapper\n", Path, (unsigned long)LineNumber);
+			Success = false;
+		}
+		else
+		{
+			Success = Workload_Command(CBW, ++Commands, Values, &Bytes, &Cycles, &Errors);
+		}
+	}
+
+	fclose(File);
+
+	/* Let the sector cache write back before checking the card and taking the counts */
+	Replay_Idle(F_CPU);
+
+	for (uint32_t Block = 0; Success && (Block < media_blocks); Block++)
+	{
+		uint8_t Expected[VIRTUAL_MEMORY_BLOCK_SIZE];
+
+		if (!(Written[Block]))
+		  continue;
+
+		Workload_Pattern(Expected, Block, Written[Block]);
+		if ((!(SDCard_ReadBlock(&Host_Card, Replay_BlockSector(Block), Buffer)) ||
+		     memcmp(Buffer, Expected, sizeof(Expected))) && !(Errors++))
+		{
+			printf("  block %lu differs on the card\n", (unsigned long)Block);
+		}
+	}
+
+	Values[0] = Cycles ? ((double)Bytes / 1024 * F_CPU / Cycles) : 0;
+	Values[1] = Host_Card.Stats.Commands;
+	Values[2] = Host_Card.Stats.Bytes;
+	Values[3] = Host_Usage.HeapPeak;
+	Values[4] = Host_Usage.StackPeak;
+
+	printf("  %lu commands, %.0f failed, %.1f KB moved in %.3f s busy, %.1f KB/s\n", (unsigned long)Commands,
+	       Values[5], (double)Bytes / 1024, (double)Cycles / F_CPU, Values[0]);
+	printf("  card: %lu commands (CMD17 %lu, CMD18 %lu, CMD24 %lu, CMD25 %lu, CMD12 %lu), %lu blocks read, "
+	       "%lu written, %.0f SPI bytes\n", (unsigned long)Host_Card.Stats.Commands,
+	       (unsigned long)Host_Card.Stats.CommandCount[17], (unsigned long)Host_Card.Stats.CommandCount[18],
+	       (unsigned long)Host_Card.Stats.CommandCount[24], (unsigned long)Host_Card.Stats.CommandCount[25],
+	       (unsigned long)Host_Card.Stats.CommandCount[12], (unsigned long)Host_Card.Stats.BlocksRead,
+	       (unsigned long)Host_Card.Stats.BlocksWritten, Values[2]);
+	printf("  RAM: heap peak %lu bytes, stack peak %lu host bytes\n", (unsigned long)Host_Usage.HeapPeak,
+	       (unsigned long)Host_Usage.StackPeak);
+
+	return (Success && !(Errors));
+}
+
+/** Checks the metrics of a run against the baseline file.
+ *
+ *  \param[in] Name    Workload file name
+ *  \param[in] Mode    LUN mode
+ *  \param[in] Values  Metrics of the run, in the order of \ref Metrics
+ *
+ *  \return Boolean \c true if the baseline has the run and no metric regressed, \c false otherwise
+ */
+static bool Workload_CheckBaseline(const char* const Name,
+                                   const Workload_Mode_t* const Mode,
+                                   const double* const Values)
+{
+	FILE* File;
+	char  Line[256];
+	bool  Found   = false;
+	bool  Success = true;
+
+	if (!(File = fopen(BaselinePath, "r")))
+	{
+		printf("  baseline %s missing\n", BaselinePath);
+		return false;
+	}
+
+	while (!(Found) && fgets(Line, sizeof(Line), File))
+	{
+		char   LineName[64];
+		char   LineMode[16];
+		int    Length;
+		double Baseline[WORKLOAD_METRICS];
+
+		if ((sscanf(Line, "%63s %15s %n", LineName, LineMode, &Length) != 2) || strcmp(LineName, Name) ||
+		    strcmp(LineMode, Mode->Name))
+		{
+			continue;
+		}
+
+		Found = true;
+		for (uint8_t n = 0; n < WORKLOAD_METRICS; n++)
+		{
+			char* Pair = strstr(&Line[Length], Metrics[n].Name);
+			double Limit;
+
+			if (!(Pair) || (Pair[strlen(Metrics[n].Name)] != '='))
+			{
+				printf("  baseline has no %s\n", Metrics[n].Name);
+				Success = false;
+				continue;
+			}
+
+			Baseline[n] = strtod(&Pair[strlen(Metrics[n].Name) + 1], NULL);
+			Limit       = Baseline[n] * (Metrics[n].HigherIsBetter ? (100 - Metrics[n].Tolerance) :
+			                                                         (100 + Metrics[n].Tolerance)) / 100;
+
+			if (Metrics[n].HigherIsBetter ? (Values[n] < Limit) : (Values[n] > Limit))
+			{
+				printf("  REGRESSED: %s %.1f against a baseline of %.1f\n", Metrics[n].Name, Values[n], Baseline[n]);
+				Success = false;
+			}
+		}
+	}
+
+	fclose(File);
+
+	if (!(Found))
+	  printf("  baseline %s has no %s %s\n", BaselinePath, Name, Mode->Name);
+	else if (Success)
+	  puts("  baseline ok");
+
+	return (Found && Success);
+}
+
+/** Adds the metrics of a run to the baseline file.
+ *
+ *  \param[in] Name    Workload file name
+ *  \param[in] Mode    LUN mode
+ *  \param[in] Values  Metrics of the run, in the order of \ref Metrics
+ *
+ *  \return Boolean \c true if the baseline file was written, \c false otherwise
+ */
+static bool Workload_WriteBaseline(const char* const Name,
+                                   const Workload_Mode_t* const Mode,
+                                   const double* const Values)
+{
+	FILE* File;
+
+	if (!(File = fopen(BaselinePath, "a")))
+	{
+		printf("  cannot write %s\n", BaselinePath);
+		return false;
+	}
+
+	fprintf(File, "%s %s", Name, Mode->Name);
+	for (uint8_t n = 0; n < WORKLOAD_METRICS; n++)
+	  fprintf(File, (n ? " %s=%.0f" : " %s=%.1f"), Metrics[n].Name, Values[n]);
+	fputc('\n', File);
+
+	return !(fclose(File));
+}
+
+/** Runs a workload in one LUN mode.
+ *
+ *  \param[in] Path  Workload file
+ *  \param[in] Mode  LUN mode
+ *
+ *  \return Boolean \c true if the workload ran through with all data intact and no regression, \c false otherwise
+ */
+static bool Workload_Run(const char* const Path,
+                         const Workload_Mode_t* const Mode)
+{
+	double Values[WORKLOAD_METRICS] = {0};
+	bool   Success;
+
+	Host_Reset();
+	if (!(SDCard_Open(&Host_Card, ImagePath, WORKLOAD_CARD_BLOCKS)))
+	{
+		printf("cannot open %s\n", ImagePath);
+		return false;
+	}
+
+	for (int n = 0; n < OptionCount; n++)
+	{
+		if (!(SDCard_SetTiming(&Host_Card.Timing, Options[n])))
+		  Host_SetCost(Options[n]);
+	}
+
+	if (!(Format_FAT32(&Host_Card, "WAHAHA  INI", Mode->Config)))
+	{
+		printf("cannot format %s\n", ImagePath);
+		return false;
+	}
+
+	printf("%s, %s LUN:\n", Workload_BaseName(Path), Mode->Name);
+
+	Endpoint_HostReset();
+	if (!(Success = Replay_Boot(Mode->LinkMap)))
+	  puts("  start-up failed");
+	else if (!(Written = calloc(media_blocks, sizeof(uint32_t))))
+	  Success = false;
+
+	Success = Success && Workload_Replay(Path, Values);
+	printf("  integrity %s\n", Success ? "ok" : "FAILED");
+
+	if (Success && UpdateBaseline)
+	  Success = Workload_WriteBaseline(Workload_BaseName(Path), Mode, Values);
+	else if (Success)
+	  Success = Workload_CheckBaseline(Workload_BaseName(Path), Mode, Values);
+
+	SDCard_Close(&Host_Card);
+	return Success;
+}
+
+/** Main program entry point, running the workloads given in each LUN mode asked for.
+ *
+ *  \return Zero if all the workloads ran through with all data intact and no regression, non-zero otherwise
+ */
+int main(int argc,
+         char* argv[])
+{
+	const char* ModeName  = "all";
+	bool        Success   = true;
+	bool        Found     = false;
+	int         Workloads = 0;
+
+	Options = calloc(argc, sizeof(char*));
+	for (int n = 1; n < argc; n++)
+	{
+		if (!(strcmp(argv[n], "help")))
+		{
+			fputs(Usage, stdout);
+			return 0;
+		}
+		else if (!(strncmp(argv[n], "image=", 6)))
+		  ImagePath = &argv[n][6];
+		else if (!(strncmp(argv[n], "mode=", 5)))
+		  ModeName = &argv[n][5];
+		else if (!(strncmp(argv[n], "baseline=", 9)))
+		  BaselinePath = &argv[n][9];
+		else if (!(strncmp(argv[n], "update=", 7)))
+		  UpdateBaseline = (atoi(&argv[n][7]) == 1);
+		else if (!(strchr(argv[n], '=')))
+		  Workloads++;
+		else
+		  Options[OptionCount++] = argv[n];
+	}
+
+	Host_Reset();
+	for (int n = 0; n < OptionCount; n++)
+	{
+		SDCard_Timing_t Timing;
+
+		if (!(SDCard_SetTiming(&Timing, Options[n])) && !(Host_SetCost(Options[n])))
+		{
+			fprintf(stderr, "unknown option %s\n%s", Options[n], Usage);
+			return 2;
+		}
+	}
+
+	if (!(Workloads))
+	{
+		fputs(Usage, stderr);
+		return 2;
+	}
+
+	if (UpdateBaseline)
+	{
+		FILE* File = fopen(BaselinePath, "w");
+
+		if (!(File))
+		{
+			fprintf(stderr, "cannot write %s\n", BaselinePath);
+			return 1;
+		}
+
+		fputs("# Workload suite baseline, written by workloadbench update=1 with the default card timing and costs.\n"
+		      "# workload mode kbps card-commands spi-bytes heap stack failed\n", File);
+		fclose(File);
+	}
+
+	for (int w = 1; w < argc; w++)
+	{
+		if (strchr(argv[w], '=') || !(strcmp(argv[w], "help")))
+		  continue;
+
+		for (uint8_t n = 0; n < (sizeof(Modes) / sizeof(Modes[0])); n++)
+		{
+			pid_t Child;
+			int   Status;
+
+			if (strcmp(ModeName, "all") && strcmp(ModeName, Modes[n].Name))
+			  continue;
+
+			Found = true;
+
+			/* Each run starts the firmware afresh */
+			fflush(stdout);
+			if ((Child = fork()) == 0)
+			  return (Workload_Run(argv[w], &Modes[n]) ? 0 : 1);
+
+			if ((Child < 0) || (waitpid(Child, &Status, 0) != Child) || !(WIFEXITED(Status)) || WEXITSTATUS(Status))
+			  Success = false;
+		}
+	}
+
+	if (!(Found))
+	{
+		fputs(Usage, stderr);
+		return 2;
+	}
+
+	printf("workloads %s\n", Success ? "ok" : "FAILED");
+	return (Success ? 0 : 1);
+}
@@ -0,0 +1,23 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the LUFA board button driver, the host build having no buttons.
+ */
+
+#ifndef _HOST_LUFA_BUTTONS_H_
+#define _HOST_LUFA_BUTTONS_H_
+
+	/* Macros: */
+		#define BUTTONS_BUTTON1                (1 << 0)
+
+		#define Buttons_Init()
+		#define Buttons_GetStatus()            0
+
+#endif
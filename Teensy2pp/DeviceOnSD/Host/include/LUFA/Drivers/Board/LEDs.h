@@ -0,0 +1,28 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the LUFA board LED driver, the host build having no LEDs.
+ */
+
+#ifndef _HOST_LUFA_LEDS_H_
+#define _HOST_LUFA_LEDS_H_
+
+	/* Macros: */
+		#define LEDS_LED1                      (1 << 0)
+		#define LEDS_LED2                      (1 << 1)
+		#define LEDS_LED3                      (1 << 2)
+		#define LEDS_LED4                      (1 << 3)
+		#define LEDS_ALL_LEDS                  (LEDS_LED1 | LEDS_LED2 | LEDS_LED3 | LEDS_LED4)
+		#define LEDS_NO_LEDS                   0
+
+		#define LEDs_Init()
+		#define LEDs_SetAllLEDs(LEDMask)
+
+#endif
@@ -0,0 +1,266 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the parts of the LUFA USB driver used by the storage stack: the Mass Storage class
+ *  types, the SCSI definitions and the endpoint stream API, whose mock in Host/Endpoint.c plays the part of the USB
+ *  controller and of the host on the other end of the bus.
+ */
+
+#ifndef _HOST_LUFA_USB_H_
+#define _HOST_LUFA_USB_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+		#include <stddef.h>
+
+	/* Macros: */
+		#define ATTR_PACKED                    __attribute__ ((packed))
+		#define ATTR_WARN_UNUSED_RESULT        __attribute__ ((warn_unused_result))
+		#define ATTR_NON_NULL_PTR_ARG(...)     __attribute__ ((nonnull (__VA_ARGS__)))
+		#define ATTR_ALWAYS_INLINE             __attribute__ ((always_inline))
+		#define ATTR_CONST                     __attribute__ ((const))
+		#define ATTR_NAKED
+		#define ATTR_INIT_SECTION(Section)
+
+		#define MIN(x, y)                      (((x) < (y)) ? (x) : (y))
+		#define MAX(x, y)                      (((x) > (y)) ? (x) : (y))
+
+		#define SwapEndian_16(Word)            ((uint16_t)((((Word) & 0xFF00) >> 8) | (((Word) & 0x00FF) << 8)))
+		#define SwapEndian_32(DWord)           ((uint32_t)((((DWord) & 0xFF000000UL) >> 24) | (((DWord) & 0x00FF0000UL) >> 8) | \
+		                                                   (((DWord) & 0x0000FF00UL) << 8)  | (((DWord) & 0x000000FFUL) << 24)))
+		#define CPU_TO_LE32(DWord)             (DWord)
+		#define le32_to_cpu(DWord)             (DWord)
+		#define cpu_to_le32(DWord)             (DWord)
+
+		#define ENDPOINT_DIR_MASK              0x80
+		#define ENDPOINT_DIR_OUT               0x00
+		#define ENDPOINT_DIR_IN                0x80
+
+		#define MS_CBW_SIGNATURE               0x43425355UL
+		#define MS_CSW_SIGNATURE               0x53425355UL
+		#define MS_COMMAND_DIR_DATA_OUT        (0 << 7)
+		#define MS_COMMAND_DIR_DATA_IN         (1 << 7)
+
+		#define SCSI_CMD_INQUIRY                               0x12
+		#define SCSI_CMD_REQUEST_SENSE                         0x03
+		#define SCSI_CMD_TEST_UNIT_READY                       0x00
+		#define SCSI_CMD_READ_CAPACITY_10                      0x25
+		#define SCSI_CMD_SEND_DIAGNOSTIC                       0x1D
+		#define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL          0x1E
+		#define SCSI_CMD_WRITE_10                              0x2A
+		#define SCSI_CMD_READ_10                               0x28
+		#define SCSI_CMD_WRITE_6                               0x0A
+		#define SCSI_CMD_READ_6                                0x08
+		#define SCSI_CMD_VERIFY_10                             0x2F
+		#define SCSI_CMD_MODE_SENSE_6                          0x1A
+		#define SCSI_CMD_MODE_SENSE_10                         0x5A
+		#define SCSI_CMD_START_STOP_UNIT                       0x1B
+
+		#define SCSI_SENSE_KEY_GOOD                            0x00
+		#define SCSI_SENSE_KEY_RECOVERED_ERROR                 0x01
+		#define SCSI_SENSE_KEY_NOT_READY                       0x02
+		#define SCSI_SENSE_KEY_MEDIUM_ERROR                    0x03
+		#define SCSI_SENSE_KEY_HARDWARE_ERROR                  0x04
+		#define SCSI_SENSE_KEY_ILLEGAL_REQUEST                 0x05
+		#define SCSI_SENSE_KEY_UNIT_ATTENTION                  0x06
+		#define SCSI_SENSE_KEY_DATA_PROTECT                    0x07
+
+		#define SCSI_ASENSE_NO_ADDITIONAL_INFORMATION          0x00
+		#define SCSI_ASENSE_LOGICAL_UNIT_NOT_READY             0x04
+		#define SCSI_ASENSE_INVALID_COMMAND                    0x20
+		#define SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE 0x21
+		#define SCSI_ASENSE_INVALID_FIELD_IN_CDB               0x24
+		#define SCSI_ASENSE_WRITE_PROTECTED                    0x27
+		#define SCSI_ASENSE_NOT_READY_TO_READY_CHANGE          0x28
+		#define SCSI_ASENSE_FORMAT_ERROR                       0x31
+		#define SCSI_ASENSE_MEDIUM_NOT_PRESENT                 0x3A
+
+		#define SCSI_ASENSEQ_NO_QUALIFIER                      0x00
+		#define SCSI_ASENSEQ_FORMAT_COMMAND_FAILED             0x01
+		#define SCSI_ASENSEQ_INITIALIZING_COMMAND_REQUIRED     0x02
+		#define SCSI_ASENSEQ_OPERATION_IN_PROGRESS             0x07
+
+	/* Type Defines: */
+		typedef struct
+		{
+			uint8_t  Address;
+			uint16_t Size;
+			uint8_t  Type;
+			uint8_t  Banks;
+		} USB_Endpoint_Table_t;
+
+		typedef struct
+		{
+			uint32_t Signature;
+			uint32_t Tag;
+			uint32_t DataTransferLength;
+			uint8_t  Flags;
+			uint8_t  LUN;
+			uint8_t  SCSICommandLength;
+			uint8_t  SCSICommandData[16];
+		} ATTR_PACKED MS_CommandBlockWrapper_t;
+
+		typedef struct
+		{
+			uint32_t Signature;
+			uint32_t Tag;
+			uint32_t DataTransferResidue;
+			uint8_t  Status;
+		} ATTR_PACKED MS_CommandStatusWrapper_t;
+
+		typedef struct
+		{
+			struct
+			{
+				uint8_t              InterfaceNumber;
+				USB_Endpoint_Table_t DataINEndpoint;
+				USB_Endpoint_Table_t DataOUTEndpoint;
+				uint8_t              TotalLUNs;
+			} Config;
+
+			struct
+			{
+				MS_CommandBlockWrapper_t  CommandBlock;
+				MS_CommandStatusWrapper_t CommandStatus;
+				bool                      IsMassStoreReset;
+			} State;
+		} USB_ClassInfo_MS_Device_t;
+
+		typedef struct
+		{
+			uint8_t DeviceType          : 5;
+			uint8_t PeripheralQualifier : 3;
+
+			uint8_t Reserved            : 7;
+			uint8_t Removable           : 1;
+
+			uint8_t Version;
+
+			uint8_t ResponseDataFormat  : 4;
+			uint8_t Reserved2           : 1;
+			uint8_t NormACA             : 1;
+			uint8_t TrmTsk              : 1;
+			uint8_t AERC                : 1;
+
+			uint8_t AdditionalLength;
+			uint8_t Reserved3[2];
+
+			uint8_t SoftReset           : 1;
+			uint8_t CmdQue              : 1;
+			uint8_t Reserved4           : 1;
+			uint8_t Linked              : 1;
+			uint8_t Sync                : 1;
+			uint8_t WideBus16Bit        : 1;
+			uint8_t WideBus32Bit        : 1;
+			uint8_t RelAddr             : 1;
+
+			uint8_t VendorID[8];
+			uint8_t ProductID[16];
+			uint8_t RevisionID[4];
+		} ATTR_PACKED SCSI_Inquiry_Response_t;
+
+		typedef struct
+		{
+			uint8_t ResponseCode;
+
+			uint8_t SegmentNumber;
+
+			uint8_t SenseKey            : 4;
+			uint8_t Reserved            : 1;
+			uint8_t ILI                 : 1;
+			uint8_t EOM                 : 1;
+			uint8_t FileMark            : 1;
+
+			uint8_t Information[4];
+			uint8_t AdditionalLength;
+			uint8_t CmdSpecificInformation[4];
+			uint8_t AdditionalSenseCode;
+			uint8_t AdditionalSenseQualifier;
+			uint8_t FieldReplaceableUnitCode;
+			uint8_t SenseKeySpecific[3];
+		} ATTR_PACKED SCSI_Request_Sense_Response_t;
+
+		typedef struct { uint8_t Size; uint8_t Type; } ATTR_PACKED USB_Descriptor_Header_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint16_t TotalConfigurationSize; uint8_t TotalInterfaces;
+		                 uint8_t ConfigurationNumber; uint8_t ConfigurationStrIndex; uint8_t ConfigAttributes;
+		                 uint8_t MaxPowerConsumption; } ATTR_PACKED USB_Descriptor_Configuration_Header_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t FirstInterfaceIndex; uint8_t TotalInterfaces;
+		                 uint8_t Class; uint8_t SubClass; uint8_t Protocol; uint8_t IADStrIndex; } ATTR_PACKED USB_Descriptor_Interface_Association_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t InterfaceNumber; uint8_t AlternateSetting;
+		                 uint8_t TotalEndpoints; uint8_t Class; uint8_t SubClass; uint8_t Protocol;
+		                 uint8_t InterfaceStrIndex; } ATTR_PACKED USB_Descriptor_Interface_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t EndpointAddress; uint8_t Attributes;
+		                 uint16_t EndpointSize; uint8_t PollingIntervalMS; } ATTR_PACKED USB_Descriptor_Endpoint_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint16_t CDCSpecification; } ATTR_PACKED USB_CDC_Descriptor_FunctionalHeader_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint8_t Capabilities; } ATTR_PACKED USB_CDC_Descriptor_FunctionalACM_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint8_t MasterInterfaceNumber;
+		                 uint8_t SlaveInterfaceNumber; } ATTR_PACKED USB_CDC_Descriptor_FunctionalUnion_t;
+		typedef struct { USB_Descriptor_Header_t Header; uint16_t HIDSpec; uint8_t CountryCode; uint8_t TotalReportDescriptors;
+		                 uint8_t HIDReportType; uint16_t HIDReportLength; } ATTR_PACKED USB_HID_Descriptor_HID_t;
+
+	/* Enums: */
+		enum MS_CommandStatusCodes_t
+		{
+			MS_SCSI_COMMAND_Pass       = 0,
+			MS_SCSI_COMMAND_Fail       = 1,
+			MS_SCSI_COMMAND_PhaseError = 2,
+		};
+
+		enum Endpoint_Stream_RW_ErrorCodes_t
+		{
+			ENDPOINT_RWSTREAM_NoError            = 0,
+			ENDPOINT_RWSTREAM_EndpointStalled    = 1,
+			ENDPOINT_RWSTREAM_DeviceDisconnected = 2,
+			ENDPOINT_RWSTREAM_BusSuspended       = 3,
+			ENDPOINT_RWSTREAM_Timeout            = 4,
+			ENDPOINT_RWSTREAM_IncompleteTransfer = 5,
+		};
+
+		enum Endpoint_WaitUntilReady_ErrorCodes_t
+		{
+			ENDPOINT_READYWAIT_NoError            = 0,
+			ENDPOINT_READYWAIT_EndpointStalled    = 1,
+			ENDPOINT_READYWAIT_DeviceDisconnected = 2,
+			ENDPOINT_READYWAIT_BusSuspended       = 3,
+			ENDPOINT_READYWAIT_Timeout            = 4,
+		};
+
+	/* Function Prototypes: */
+		void     Endpoint_SelectEndpoint(const uint8_t Address);
+		uint8_t  Endpoint_GetCurrentEndpoint(void);
+		uint8_t  Endpoint_WaitUntilReady(void);
+		bool     Endpoint_IsReadWriteAllowed(void);
+		bool     Endpoint_IsINReady(void);
+		bool     Endpoint_IsOUTReceived(void);
+		uint16_t Endpoint_BytesInEndpoint(void);
+		void     Endpoint_ClearIN(void);
+		void     Endpoint_ClearOUT(void);
+		void     Endpoint_StallTransaction(void);
+		uint8_t  Endpoint_Read_8(void);
+		void     Endpoint_Write_8(const uint8_t Data);
+		uint8_t  Endpoint_Write_Stream_LE(const void* const Buffer,
+		                                  uint16_t Length,
+		                                  uint16_t* const BytesProcessed);
+		uint8_t  Endpoint_Write_Stream_BE(const void* const Buffer,
+		                                  uint16_t Length,
+		                                  uint16_t* const BytesProcessed);
+		uint8_t  Endpoint_Read_Stream_LE(void* const Buffer,
+		                                 uint16_t Length,
+		                                 uint16_t* const BytesProcessed);
+		uint8_t  Endpoint_Null_Stream(uint16_t Length,
+		                              uint16_t* const BytesProcessed);
+		uint8_t  Endpoint_Discard_Stream(uint16_t Length,
+		                                 uint16_t* const BytesProcessed);
+
+		void     MS_Device_USBTask(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+		bool     CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+
+#endif
@@ -0,0 +1,17 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the LUFA platform drivers, with nothing to provide on the host.
+ */
+
+#ifndef _HOST_LUFA_PLATFORM_H_
+#define _HOST_LUFA_PLATFORM_H_
+
+#endif
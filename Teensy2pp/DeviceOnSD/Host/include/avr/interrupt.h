@@ -0,0 +1,23 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc interrupt definitions. The host build has no interrupts, the timer
+ *  service routines being called as the modeled time goes by.
+ */
+
+#ifndef _HOST_AVR_INTERRUPT_H_
+#define _HOST_AVR_INTERRUPT_H_
+
+	/* Macros: */
+		#define ISR(Vector, ...)               void Vector(void); void Vector(void)
+		#define sei()
+		#define cli()
+
+#endif
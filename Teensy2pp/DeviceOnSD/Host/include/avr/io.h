@@ -0,0 +1,69 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc I/O register definitions. The registers are bytes of a register file in
+ *  host memory, and waiting for the SPI transfer complete flag exchanges the byte in SPDR with the emulated card.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+	/* Includes: */
+		#include <stdint.h>
+
+	/* Macros: */
+		#define _SFR_MEM8(Address)             (Host_IORegisters[(Address)])
+		#define _SFR_IO8(Address)              _SFR_MEM8((Address) + 0x20)
+		#define _SFR_IO_ADDR(Register)         ((uint8_t)(&(Register) - Host_IORegisters) - 0x20)
+		#define _BV(Bit)                       (1 << (Bit))
+
+		#define bit_is_set(Register, Bit)      ((Register) & _BV(Bit))
+		#define bit_is_clear(Register, Bit)    (!((Register) & _BV(Bit)))
+		#define loop_until_bit_is_set(Register, Bit)    do { } while (!(Host_PollBit(&(Register), (Bit))))
+		#define loop_until_bit_is_clear(Register, Bit)  do { } while (Host_PollBit(&(Register), (Bit)))
+
+		#define PINB                           _SFR_IO8(0x03)
+		#define DDRB                           _SFR_IO8(0x04)
+		#define PORTB                          _SFR_IO8(0x05)
+		#define PIND                           _SFR_IO8(0x09)
+		#define DDRD                           _SFR_IO8(0x0A)
+		#define PORTD                          _SFR_IO8(0x0B)
+		#define PORTE                          _SFR_IO8(0x0E)
+		#define DDRE                           _SFR_IO8(0x0D)
+		#define TIFR1                          _SFR_IO8(0x16)
+		#define SPCR                           _SFR_IO8(0x2C)
+		#define SPSR                           _SFR_IO8(0x2D)
+		#define SPDR                           _SFR_IO8(0x2E)
+		#define TCCR1A                         _SFR_MEM8(0x80)
+		#define TCCR1B                         _SFR_MEM8(0x81)
+		#define TIMSK1                         _SFR_MEM8(0x6F)
+		#define UEINTX                         _SFR_MEM8(0xE8)
+		#define UEDATX                         _SFR_MEM8(0xF1)
+
+		#define SPR0                           0
+		#define SPR1                           1
+		#define MSTR                           4
+		#define SPE                            6
+		#define SPIE                           7
+		#define SPI2X                          0
+		#define WCOL                           6
+		#define SPIF                           7
+		#define TOV1                           0
+		#define TOIE1                          0
+		#define CS11                           1
+
+	/* External Variables: */
+		extern volatile uint8_t Host_IORegisters[0x100];
+
+	/* Function Prototypes: */
+		uint8_t Host_PollBit(volatile uint8_t* const Register,
+		                     const uint8_t Bit);
+
+#endif
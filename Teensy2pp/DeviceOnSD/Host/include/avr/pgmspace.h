@@ -0,0 +1,29 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc program space definitions, the host having a single address space.
+ */
+
+#ifndef _HOST_AVR_PGMSPACE_H_
+#define _HOST_AVR_PGMSPACE_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <string.h>
+
+	/* Macros: */
+		#define PROGMEM
+		#define PSTR(String)                   (String)
+		#define pgm_read_byte(Address)         (*(const uint8_t*)(Address))
+		#define pgm_read_word(Address)         (*(const uint16_t*)(Address))
+		#define memcpy_P                       memcpy
+		#define strcmp_P                       strcmp
+
+#endif
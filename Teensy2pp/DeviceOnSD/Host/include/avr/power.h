@@ -0,0 +1,21 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc power management functions, the host build having no clock prescaler.
+ */
+
+#ifndef _HOST_AVR_POWER_H_
+#define _HOST_AVR_POWER_H_
+
+	/* Macros: */
+		#define clock_div_1                    0
+		#define clock_prescale_set(Division)
+
+#endif
@@ -0,0 +1,21 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc watchdog functions, the host build having no watchdog.
+ */
+
+#ifndef _HOST_AVR_WDT_H_
+#define _HOST_AVR_WDT_H_
+
+	/* Macros: */
+		#define wdt_disable()
+		#define wdt_reset()
+
+#endif
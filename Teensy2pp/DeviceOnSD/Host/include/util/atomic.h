@@ -0,0 +1,22 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc atomic blocks, the host build having no interrupts.
+ */
+
+#ifndef _HOST_UTIL_ATOMIC_H_
+#define _HOST_UTIL_ATOMIC_H_
+
+	/* Macros: */
+		#define ATOMIC_BLOCK(Type)             for (int Host_AtomicOnce = 1; Host_AtomicOnce; Host_AtomicOnce = 0)
+		#define ATOMIC_RESTORESTATE
+		#define ATOMIC_FORCEON
+
+#endif
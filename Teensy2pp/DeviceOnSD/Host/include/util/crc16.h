@@ -0,0 +1,31 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/** \file
+ *
+ *  Host build replacement of the avr-libc CRC routines used by the card driver.
+ */
+
+#ifndef _HOST_UTIL_CRC16_H_
+#define _HOST_UTIL_CRC16_H_
+
+	/* Includes: */
+		#include <stdint.h>
+
+	/* Inline Functions: */
+		static inline uint16_t _crc_xmodem_update(uint16_t CRC,
+		                                          uint8_t Data)
+		{
+			CRC ^= (uint16_t)Data << 8;
+			for (uint8_t i = 0; i < 8; i++)
+			  CRC = (CRC & 0x8000) ? (uint16_t)((CRC << 1) ^ 0x1021) : (uint16_t)(CRC << 1);
+
+			return CRC;
+		}
+
+#endif
@@ -0,0 +1,234 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Benchmark firmware of the block transfer loops of the card driver, run under simavr by simbench (kernels=1). It is
+ *  built from the unmodified card driver with the C loops, with MMC_ASM_KERNELS and with MMC_USART_MSPIM, for the
+ *  ATmega1280: simavr has no AT90USB1286 core, and the ATmega1280 has the same AVR core, clock cycle counts, SPI
+ *  module, USART1, ports and timers at the same addresses. The firmware has no USB controller, so the endpoint FIFO
+ *  the loops move the data through is played by simbench at the address of UEDATX.
+ *
+ *  Once the card is initialized, a run of sectors is written with mmc_stream_write_fifo(), straight from the FIFO,
+ *  and the following run with mmc_stream_write_part(), clocking each sector out of a buffer while the next one is
+ *  taken from the FIFO into it, as the raw WRITE (10) path does. Both runs are then read back twice, straight into the
+ *  FIFO with mmc_stream_read_fifo() as the zero-copy raw READ (10) path does, and through two buffers with
+ *  mmc_stream_read_part() as the double buffered one does. Each phase is flagged in GPIOR0 for simbench to time it.
+ */
+
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "diskio.h"
+#include "mmc_avr.h"
+#include "Timebase.h"
+#include "KernelBench.h"
+
+/** FIFO register the data blocks are moved through, declared the way avr-libc declares UEDATX. */
+#define Fifo                       (&_SFR_MEM8(KERNELBENCH_FIFO))
+
+/** Size of a sector in bytes. */
+#define SECTOR_SIZE                512
+
+/** Size of the endpoint packets the sectors are moved in, as by the Mass Storage interface. */
+#define PACKET_SIZE                64
+
+/** Sector buffers of the buffered phases. */
+static uint8_t Buffer[2][SECTOR_SIZE];
+
+ISR(TIMER0_COMPA_vect)
+{
+	mmc_disk_timerproc();
+}
+
+/** Services the other interfaces while the card is busy, of which the benchmark has none. */
+void mmc_yield(void)
+{
+}
+
+/** Writes the first run of sectors, each one straight from the FIFO.
+ *
+ *  \return Boolean \c true if the card took all sectors, \c false otherwise
+ */
+static bool KernelBench_WriteFifo(void)
+{
+	if (mmc_stream_write_open(KERNELBENCH_FIRST_SECTOR, KERNELBENCH_SECTORS) != RES_OK)
+	  return false;
+
+	for (uint8_t Sector = 0; Sector < KERNELBENCH_SECTORS; Sector++)
+	{
+		if (mmc_stream_write_start() != RES_OK)
+		  return false;
+
+		for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte += PACKET_SIZE)
+		  mmc_stream_write_fifo(PACKET_SIZE, Fifo);
+
+		if (mmc_stream_write_finish() != RES_OK)
+		  return false;
+	}
+
+	return (mmc_stream_close() == RES_OK);
+}
+
+/** Writes the second run of sectors, each one clocked out of a buffer while the next one is taken from the FIFO into
+ *  the same buffer.
+ *
+ *  \return Boolean \c true if the card took all sectors, \c false otherwise
+ */
+static bool KernelBench_WritePart(void)
+{
+	if (mmc_stream_write_open(KERNELBENCH_FIRST_SECTOR + KERNELBENCH_SECTORS, KERNELBENCH_SECTORS) != RES_OK)
+	  return false;
+
+	for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte++)
+	  Buffer[0][Byte] = *Fifo;
+
+	for (uint8_t Sector = 1; Sector < KERNELBENCH_SECTORS; Sector++)
+	{
+		if (mmc_stream_write_start() != RES_OK)
+		  return false;
+
+		for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte += PACKET_SIZE)
+		  mmc_stream_write_part(&Buffer[0][Byte], PACKET_SIZE, &Buffer[0][Byte], Fifo);
+
+		if (mmc_stream_write_finish() != RES_OK)
+		  return false;
+	}
+
+	return ((mmc_stream_write(Buffer[0]) == RES_OK) && (mmc_stream_close() == RES_OK));
+}
+
+/** Reads both runs of sectors back, each one straight into the FIFO.
+ *
+ *  \return Boolean \c true if the card sent all sectors, \c false otherwise
+ */
+static bool KernelBench_ReadFifo(void)
+{
+	if (mmc_stream_read_open(KERNELBENCH_FIRST_SECTOR) != RES_OK)
+	  return false;
+
+	for (uint8_t Sector = 0; Sector < (2 * KERNELBENCH_SECTORS); Sector++)
+	{
+		if (mmc_stream_read_start() != RES_OK)
+		  return false;
+
+		for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte += PACKET_SIZE)
+		  mmc_stream_read_fifo(PACKET_SIZE, Fifo);
+
+		if (mmc_stream_read_finish() != RES_OK)
+		  return false;
+	}
+
+	return (mmc_stream_close() == RES_OK);
+}
+
+/** Reads both runs of sectors back through two buffers, each sector being put into the FIFO while the next one is
+ *  clocked into the other buffer.
+ *
+ *  \return Boolean \c true if the card sent all sectors, \c false otherwise
+ */
+static bool KernelBench_ReadPart(void)
+{
+	uint8_t Current = 0;
+
+	if ((mmc_stream_read_open(KERNELBENCH_FIRST_SECTOR) != RES_OK) || (mmc_stream_read(Buffer[Current]) != RES_OK))
+	  return false;
+
+	for (uint8_t Sector = 1; Sector < (2 * KERNELBENCH_SECTORS); Sector++)
+	{
+		if (mmc_stream_read_start() != RES_OK)
+		  return false;
+
+		for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte += PACKET_SIZE)
+		  mmc_stream_read_part(&Buffer[Current ^ 1][Byte], PACKET_SIZE, &Buffer[Current][Byte], Fifo);
+
+		if (mmc_stream_read_finish() != RES_OK)
+		  return false;
+
+		Current ^= 1;
+	}
+
+	for (uint16_t Byte = 0; Byte < SECTOR_SIZE; Byte++)
+	  *Fifo = Buffer[Current][Byte];
+
+	return (mmc_stream_close() == RES_OK);
+}
+
+/** Runs a phase of the benchmark, flagging it in GPIOR0 meanwhile.
+ *
+ *  \param[in] Phase   Phase, a value from the \ref KernelBench_Phases_t enum
+ *  \param[in] Kernel  Transfers of the phase
+ *
+ *  \return Boolean \c true if the transfers succeeded, \c false otherwise
+ */
+static bool KernelBench_Phase(const uint8_t Phase,
+                              bool (*Kernel)(void))
+{
+	bool Success;
+
+	GPIOR0  = Phase;
+	Success = Kernel();
+	GPIOR0  = KERNELBENCH_IDLE;
+
+	return Success;
+}
+
+/** Main program entry point, initializing the card and running the phases of the benchmark in turn. */
+int main(void)
+{
+	bool Success;
+
+	/* Start 100Hz system timer with TC0 */
+	OCR0A = F_CPU / 1024 / 100 - 1;
+	TCCR0A = _BV(WGM01);
+	TCCR0B = 0b101;
+	TIMSK0 = _BV(OCIE0A);
+
+	Timebase_Init();
+
+	sei();
+
+	Success = !(mmc_disk_initialize() & STA_NOINIT) &&
+	          KernelBench_Phase(KERNELBENCH_WRITE_FIFO, KernelBench_WriteFifo) &&
+	          KernelBench_Phase(KERNELBENCH_WRITE_PART, KernelBench_WritePart) &&
+	          KernelBench_Phase(KERNELBENCH_READ_FIFO, KernelBench_ReadFifo) &&
+	          KernelBench_Phase(KERNELBENCH_READ_PART, KernelBench_ReadPart);
+
+	GPIOR0 = (Success ? KERNELBENCH_DONE : KERNELBENCH_FAILED);
+
+	/* Sleeping with interrupts off ends the simulation */
+	cli();
+	sleep_mode();
+
+	for (;;);
+}
@@ -0,0 +1,70 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Interface between the block transfer loop benchmark firmware (KernelBench.c) and simbench, which runs it under
+ *  simavr.
+ */
+
+#ifndef _KERNELBENCH_H_
+#define _KERNELBENCH_H_
+
+	/* Macros: */
+		/** Data address of the FIFO register the data blocks are moved through, UEDATX of the AT90USB1286. simbench
+		 *  stands in for the endpoint, feeding a known byte stream to the writes and checking the reads against it.
+		 */
+		#define KERNELBENCH_FIFO           0xF1
+
+		/** Data address of the register the firmware writes the phase it enters to, GPIOR0. */
+		#define KERNELBENCH_MARKER         0x3E
+
+		/** First card sector written and read back. */
+		#define KERNELBENCH_FIRST_SECTOR   8192UL
+
+		/** Number of sectors written by each write phase, all of them being read back by each read phase. */
+		#define KERNELBENCH_SECTORS        64
+
+	/* Enums: */
+		/** Enum for the phases of the benchmark firmware, written to \ref KERNELBENCH_MARKER as they start. */
+		enum KernelBench_Phases_t
+		{
+			KERNELBENCH_IDLE       = 0,    /**< Between phases */
+			KERNELBENCH_WRITE_FIFO = 1,    /**< Sectors written straight from the FIFO */
+			KERNELBENCH_WRITE_PART = 2,    /**< Sectors written from a buffer refilled from the FIFO meanwhile */
+			KERNELBENCH_READ_FIFO  = 3,    /**< Sectors read straight into the FIFO */
+			KERNELBENCH_READ_PART  = 4,    /**< Sectors read into a buffer while the previous one goes to the FIFO */
+			KERNELBENCH_PHASES     = 5,    /**< Number of phases, the idle one included */
+			KERNELBENCH_DONE       = 0xFE, /**< All phases ran */
+			KERNELBENCH_FAILED     = 0xFF, /**< The card could not be initialized, or failed a transfer */
+		};
+
+#endif
@@ -0,0 +1,578 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Cycle count benchmark of the unmodified firmware under simavr. The DeviceOnSD ELF file is run on a simulated
+ *  AT90USB1286 at 16MHz, against the emulated card wired to its SPI module (SimCard.c), the card being formatted with
+ *  a wahaha.ini selecting the raw or the image backed LUN. No USB host is simulated, so the USB controller is never
+ *  powered and no SCSI command is ever received: the sector path of READ (10) and WRITE (10) is not measured here.
+ *  What is timed is the card traffic of the start-up of the firmware, which probes the card, mounts the volume,
+ *  reads the configuration and, for the image backed LUN, allocates the 128MB udisk.txt image, reading and writing
+ *  hundreds of sectors through mmc_disk_read() and mmc_disk_write() on behalf of FatFs. The run ends once the card
+ *  has been left alone for 100ms, and the cycles spent per sector on the SPI bus, from the data token to the end of
+ *  the CRC, are reported for these driver level reads and writes, along with the digest of the card traffic that two
+ *  builds moving the same data must agree on.
+ *
+ *  With compare=PATH, given up to four times, each other ELF file is run the same way against a freshly formatted
+ *  card, and compared with the first one: the run fails unless both moved the same blocks with the same digest, so a
+ *  faster block transfer loop, or the USART1 backend of the card driver, only counts once it is shown to move the
+ *  same bits.
+ *
+ *  With kernels=1, the builds of KernelBench.c are run instead, on an ATmega1280 core: these drive the block transfer
+ *  loops of the card driver that the start-up never reaches, mmc_stream_write_fifo(), mmc_stream_write_part(),
+ *  mmc_stream_read_fifo() and mmc_stream_read_part(), writing two runs of sectors and reading them back twice, with
+ *  simbench playing the endpoint FIFO: the writes are fed a known byte stream, which the reads must give back. The
+ *  cycles per sector of each of the four phases are reported, both on the SPI bus and overall, the latter including
+ *  the commands and the waits for the card, so the C and the assembly loops can be compared where they actually run.
+ *
+ *  The firmware is only run on an AT90USB1286 core, which the simavr in use must provide: stock simavr has none, and
+ *  no other core runs this ELF file faithfully, the ATmega32U4 for one lacking the RAMPZ register the start-up code
+ *  of the AT90USB1286 relies on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+
+#include "SimCard.h"
+#include "KernelBench.h"
+#include "../Format.h"
+
+/** CPU clock of the target. */
+#define SIMBENCH_F_CPU             16000000UL
+
+/** Capacity of the emulated card in blocks, 1GB. */
+#define SIMBENCH_CARD_BLOCKS       2097152UL
+
+/** Maximum number of firmware builds checked against the first one. */
+#define SIMBENCH_MAX_COMPARES      4
+
+/** Time without card traffic after which the start-up is taken as over, in CPU cycles. */
+#define SIMBENCH_IDLE_CYCLES       (SIMBENCH_F_CPU / 10)
+
+/** Help text of the command line options. */
+static const char Usage[] =
+	"usage: simbench [help] [name=value ...]\n"
+	"  elf=PATH      firmware to run (../../DeviceOnSD.elf)\n"
+	"  compare=PATH  other firmware to run and check against the first one, up to 4 times\n"
+	"  image=PATH    card image file, created or overwritten (simbench.img)\n"
+	"  kernels=N     kernels=1 to run builds of KernelBench.c (kernels-c.elf) rather than of the firmware (0)\n"
+	"  raw=N         raw=1 LUN in wahaha.ini, or raw=0 for the udisk.txt image (0)\n"
+	"  time=MS       longest simulated time to run for (20000)\n"
+	"  card timing:  init read-first read-next register write-busy single-busy stop-busy erase-busy\n"
+	"                (in us), gc-interval (blocks), gc-stall (us), ncr (bytes), tran-speed (CSD code)\n";
+
+/** Type define for the outcome of a run of the firmware. */
+typedef struct
+{
+	uint32_t BlocksRead;         /**< Number of data blocks sent by the card */
+	uint32_t BlocksWritten;      /**< Number of data blocks received by the card */
+	uint32_t Digest;             /**< Digest of the data blocks moved */
+	double   ReadCycles;         /**< CPU cycles per data block sent by the card */
+	double   WriteCycles;        /**< CPU cycles per data block received by the card */
+	uint32_t Mismatches;         /**< Bytes put into the FIFO that differ from the ones taken from it, kernels=1 only */
+	double   PhaseCycles[KERNELBENCH_PHASES]; /**< CPU cycles per sector of each phase of KernelBench.c */
+} SimBench_Result_t;
+
+/** Type define for the state of a run of KernelBench.c, shared with the register hooks. */
+typedef struct
+{
+	avr_t*            AVR;           /**< Simulated AVR */
+	SDCard_t*         Card;          /**< Emulated card */
+	uint8_t           Phase;         /**< Phase being run, a value from the \ref KernelBench_Phases_t enum */
+	avr_cycle_count_t PhaseStart;    /**< Cycle count at the start of the phase */
+	uint32_t          PhaseBlocks;   /**< Data blocks moved before the phase */
+	uint64_t          PhaseNs;       /**< Time spent on data blocks before the phase */
+	uint32_t          InPos;         /**< Number of bytes taken from the FIFO */
+	uint32_t          OutPos;        /**< Number of bytes put into the FIFO */
+	uint32_t          Mismatches;    /**< Bytes put into the FIFO that differ from the ones taken from it */
+	uint32_t          Blocks[KERNELBENCH_PHASES]; /**< Data blocks moved by each phase */
+	double            Cycles[KERNELBENCH_PHASES]; /**< CPU cycles per sector of each phase */
+	double            Bus[KERNELBENCH_PHASES];    /**< CPU cycles per sector on the SPI bus of each phase */
+} SimBench_Kernels_t;
+
+/** Names of the phases of KernelBench.c, indexed by \ref KernelBench_Phases_t. */
+static const char* const PhaseNames[KERNELBENCH_PHASES] =
+	{
+		[KERNELBENCH_WRITE_FIFO] = "write-fifo",
+		[KERNELBENCH_WRITE_PART] = "write-part",
+		[KERNELBENCH_READ_FIFO]  = "read-fifo",
+		[KERNELBENCH_READ_PART]  = "read-part",
+	};
+
+
+/** Computes and prints the cycles per sector of the data blocks moved in one direction.
+ *
+ *  \param[in] Name    Direction of the blocks
+ *  \param[in] Blocks  Number of blocks
+ *  \param[in] Ns      Time spent on the blocks, from the data token to the end of the CRC
+ *  \param[in] Ideal   Cycles of the 513 bytes after the data token at the final SPI clock, without any gap
+ *
+ *  \return CPU cycles per sector, 0 if no block was moved
+ */
+static double SimBench_PrintBlocks(const char* const Name,
+                                   const uint32_t Blocks,
+                                   const uint64_t Ns,
+                                   const uint32_t Ideal)
+{
+	double Cycles;
+
+	if (!(Blocks))
+	{
+		printf("  %-6s no sectors\n", Name);
+		return 0;
+	}
+
+	Cycles = (double)Ns * SIMBENCH_F_CPU / 1e9 / Blocks;
+	printf("  %-6s %lu sectors, %.1f cycles per sector, %.2f cycles per byte (%.0f%% over the SPI clock)\n", Name,
+	       (unsigned long)Blocks, Cycles, Cycles / 513, (Cycles - Ideal) * 100 / Ideal);
+
+	return Cycles;
+}
+
+/** Runs a firmware against a freshly formatted card until its start-up is over.
+ *
+ *  \param[in]  ElfPath    Firmware to run
+ *  \param[in]  ImagePath  Card image file
+ *  \param[in]  Raw        Select the raw LUN in wahaha.ini instead of the udisk.txt image
+ *  \param[in]  Limit      Longest simulated time to run for, in CPU cycles
+ *  \param[in]  Timing     Timing of the card
+ *  \param[out] Result     Outcome of the run
+ *
+ *  \return Boolean \c true if the firmware ran and read data blocks, \c false otherwise
+ */
+static bool SimBench_Run(const char* const ElfPath,
+                         const char* const ImagePath,
+                         const bool Raw,
+                         const uint64_t Limit,
+                         const SDCard_Timing_t* const Timing,
+                         SimBench_Result_t* const Result)
+{
+	SDCard_t       Card;
+	SimCard_t      Wiring;
+	elf_firmware_t Firmware;
+	avr_t*         AVR;
+	int            State;
+	uint32_t       ByteCycles;
+
+	memset(&Card, 0, sizeof(Card));
+	memset(&Firmware, 0, sizeof(Firmware));
+	memset(Result, 0, sizeof(SimBench_Result_t));
+
+	if (!(SDCard_Open(&Card, ImagePath, SIMBENCH_CARD_BLOCKS)))
+	{
+		fprintf(stderr, "cannot open %s\n", ImagePath);
+		return false;
+	}
+
+	/* SDCard_Open() resets the card timing */
+	Card.Timing = *Timing;
+
+	if (!(Format_FAT32(&Card, "WAHAHA  INI", Raw ? "[wahaha]\r\nraw=1\r\n" : "[wahaha]\r\nraw=0\r\n")))
+	{
+		fprintf(stderr, "cannot format %s\n", ImagePath);
+		SDCard_Close(&Card);
+		return false;
+	}
+
+	if (elf_read_firmware(ElfPath, &Firmware))
+	{
+		fprintf(stderr, "cannot read %s\n", ElfPath);
+		SDCard_Close(&Card);
+		return false;
+	}
+
+	if (!(AVR = avr_make_mcu_by_name("at90usb1286")))
+	{
+		fputs("simavr has no at90usb1286 core to run the firmware on\n", stderr);
+		SDCard_Close(&Card);
+		return false;
+	}
+
+	avr_init(AVR);
+	avr_load_firmware(AVR, &Firmware);
+	AVR->frequency = SIMBENCH_F_CPU;
+	SimCard_Attach(&Wiring, AVR, &Card);
+
+	do
+	{
+		State = avr_run(AVR);
+
+		/* The start-up is over once the card has been left alone for a while */
+		if (Card.Stats.BlocksRead && ((AVR->cycle - Wiring.LastByte) > SIMBENCH_IDLE_CYCLES))
+		  break;
+	}
+	while ((State != cpu_Done) && (State != cpu_Crashed) && (AVR->cycle < Limit));
+
+	/* The SPI clock the card driver settled on, whether it drives the card with the SPI module or with USART1 */
+	ByteCycles = (Wiring.ByteCycles ? Wiring.ByteCycles : 1);
+
+	printf("%s, %s LUN: start-up card traffic over after %.1f ms, SPI clock %lu Hz, "
+	       "%.1f%% of the time on the SPI bus%s\n", ElfPath, Raw ? "raw" : "image",
+	       (double)Wiring.LastByte * 1000 / SIMBENCH_F_CPU, (unsigned long)(SIMBENCH_F_CPU * 8 / ByteCycles),
+	       Wiring.LastByte ? ((double)Wiring.SpiCycles * 100 / Wiring.LastByte) : 0.0,
+	       (State == cpu_Crashed) ? ", CPU crashed" : "");
+
+	Result->BlocksRead    = Card.Stats.BlocksRead;
+	Result->BlocksWritten = Card.Stats.BlocksWritten + Card.Stats.BlocksRejected;
+	Result->Digest        = Card.Stats.Digest;
+	/* Only the driver level transfers of the start-up, no SCSI command being received */
+	Result->ReadCycles    = SimBench_PrintBlocks("read", Result->BlocksRead, Card.Stats.ReadBlockNs, ByteCycles * 513);
+	Result->WriteCycles   = SimBench_PrintBlocks("write", Result->BlocksWritten, Card.Stats.WriteBlockNs,
+	                                             ByteCycles * 513);
+	SDCard_PrintStats(&Card, stdout);
+
+	avr_terminate(AVR);
+	SDCard_Close(&Card);
+
+	return ((State != cpu_Crashed) && Result->BlocksRead);
+}
+
+/** Gives the byte of the stream fed to KernelBench.c at a position, varying with the sector as well, so that a
+ *  sector read back from the wrong place shows.
+ *
+ *  \param[in] Position  Position of the byte in the stream
+ *
+ *  \return Byte at the position
+ */
+static uint8_t SimBench_Pattern(const uint32_t Position)
+{
+	return (uint8_t)((Position * 7) ^ (Position >> 9));
+}
+
+/** Handles a write of the phase KernelBench.c enters to its marker register, timing the phase it leaves.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address written
+ *  \param[in] Value  Value written
+ *  \param[in] Param  State of the run
+ */
+static void SimBench_WriteMarker(avr_t* AVR,
+                                 avr_io_addr_t Addr,
+                                 uint8_t Value,
+                                 void* Param)
+{
+	SimBench_Kernels_t* Kernels = Param;
+	SDCard_Stats_t*     Stats   = &Kernels->Card->Stats;
+	uint32_t            Blocks  = Stats->BlocksRead + Stats->BlocksWritten + Stats->BlocksRejected;
+	uint64_t            Ns      = Stats->ReadBlockNs + Stats->WriteBlockNs;
+
+	AVR->data[Addr] = Value;
+
+	if ((Kernels->Phase != KERNELBENCH_IDLE) && (Kernels->Phase < KERNELBENCH_PHASES) &&
+	    (Blocks != Kernels->PhaseBlocks))
+	{
+		Kernels->Blocks[Kernels->Phase] = Blocks - Kernels->PhaseBlocks;
+		Kernels->Cycles[Kernels->Phase] = (double)(AVR->cycle - Kernels->PhaseStart) / Kernels->Blocks[Kernels->Phase];
+		Kernels->Bus[Kernels->Phase]    = (double)(Ns - Kernels->PhaseNs) * SIMBENCH_F_CPU / 1e9 /
+		                                  Kernels->Blocks[Kernels->Phase];
+	}
+
+	Kernels->Phase       = Value;
+	Kernels->PhaseStart  = AVR->cycle;
+	Kernels->PhaseBlocks = Blocks;
+	Kernels->PhaseNs     = Ns;
+}
+
+/** Handles a read of the FIFO register by KernelBench.c, giving the next byte of the stream written to the card.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address read
+ *  \param[in] Param  State of the run
+ *
+ *  \return Next byte of the stream
+ */
+static uint8_t SimBench_ReadFifo(avr_t* AVR,
+                                 avr_io_addr_t Addr,
+                                 void* Param)
+{
+	SimBench_Kernels_t* Kernels = Param;
+
+	(void)AVR;
+	(void)Addr;
+
+	return SimBench_Pattern(Kernels->InPos++);
+}
+
+/** Handles a write of the FIFO register by KernelBench.c, checking the byte against the stream written to the card,
+ *  which each read phase gives back whole.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address written
+ *  \param[in] Value  Value written
+ *  \param[in] Param  State of the run
+ */
+static void SimBench_WriteFifo(avr_t* AVR,
+                               avr_io_addr_t Addr,
+                               uint8_t Value,
+                               void* Param)
+{
+	SimBench_Kernels_t* Kernels = Param;
+
+	(void)AVR;
+	(void)Addr;
+
+	if (Value != SimBench_Pattern(Kernels->OutPos++ % (2UL * KERNELBENCH_SECTORS * 512)))
+	  Kernels->Mismatches++;
+}
+
+/** Runs a build of KernelBench.c against a blank card until all of its phases are over.
+ *
+ *  \param[in]  ElfPath    Firmware to run
+ *  \param[in]  ImagePath  Card image file
+ *  \param[in]  Limit      Longest simulated time to run for, in CPU cycles
+ *  \param[in]  Timing     Timing of the card
+ *  \param[out] Result     Outcome of the run
+ *
+ *  \return Boolean \c true if all phases ran and the data read back matched the data written, \c false otherwise
+ */
+static bool SimBench_RunKernels(const char* const ElfPath,
+                                const char* const ImagePath,
+                                const uint64_t Limit,
+                                const SDCard_Timing_t* const Timing,
+                                SimBench_Result_t* const Result)
+{
+	SDCard_t           Card;
+	SimCard_t          Wiring;
+	SimBench_Kernels_t Kernels;
+	elf_firmware_t     Firmware;
+	avr_t*             AVR;
+	avr_io_addr_t      IO;
+	int                State;
+	uint32_t           ByteCycles;
+
+	memset(&Card, 0, sizeof(Card));
+	memset(&Kernels, 0, sizeof(Kernels));
+	memset(&Firmware, 0, sizeof(Firmware));
+	memset(Result, 0, sizeof(SimBench_Result_t));
+
+	if (!(SDCard_Open(&Card, ImagePath, SIMBENCH_CARD_BLOCKS)))
+	{
+		fprintf(stderr, "cannot open %s\n", ImagePath);
+		return false;
+	}
+
+	/* SDCard_Open() resets the card timing */
+	Card.Timing = *Timing;
+
+	if (elf_read_firmware(ElfPath, &Firmware))
+	{
+		fprintf(stderr, "cannot read %s\n", ElfPath);
+		SDCard_Close(&Card);
+		return false;
+	}
+
+	/* KernelBench.c is built for the ATmega1280, of the same core and register map as the AT90USB1286 */
+	if (!(AVR = avr_make_mcu_by_name("atmega1280")))
+	{
+		fputs("simavr has no atmega1280 core to run the benchmark on\n", stderr);
+		SDCard_Close(&Card);
+		return false;
+	}
+
+	avr_init(AVR);
+	avr_load_firmware(AVR, &Firmware);
+	AVR->frequency = SIMBENCH_F_CPU;
+	SimCard_Attach(&Wiring, AVR, &Card);
+
+	Kernels.AVR  = AVR;
+	Kernels.Card = &Card;
+
+	IO = AVR_DATA_TO_IO(KERNELBENCH_MARKER);
+	AVR->io[IO].w.c     = SimBench_WriteMarker;
+	AVR->io[IO].w.param = &Kernels;
+
+	IO = AVR_DATA_TO_IO(KERNELBENCH_FIFO);
+	AVR->io[IO].r.c     = SimBench_ReadFifo;
+	AVR->io[IO].r.param = &Kernels;
+	AVR->io[IO].w.c     = SimBench_WriteFifo;
+	AVR->io[IO].w.param = &Kernels;
+
+	do
+	{
+		State = avr_run(AVR);
+	}
+	while ((State != cpu_Done) && (State != cpu_Crashed) && (AVR->cycle < Limit) &&
+	       (Kernels.Phase != KERNELBENCH_DONE) && (Kernels.Phase != KERNELBENCH_FAILED));
+
+	ByteCycles = (Wiring.ByteCycles ? Wiring.ByteCycles : 1);
+
+	printf("%s: %s after %.1f ms, SPI clock %lu Hz, %lu bytes in, %lu bytes out, %lu mismatched%s\n", ElfPath,
+	       (Kernels.Phase == KERNELBENCH_DONE) ? "all phases ran" : "phases FAILED",
+	       (double)AVR->cycle * 1000 / SIMBENCH_F_CPU, (unsigned long)(SIMBENCH_F_CPU * 8 / ByteCycles),
+	       (unsigned long)Kernels.InPos, (unsigned long)Kernels.OutPos, (unsigned long)Kernels.Mismatches,
+	       (State == cpu_Crashed) ? ", CPU crashed" : "");
+
+	for (uint8_t Phase = KERNELBENCH_WRITE_FIFO; Phase < KERNELBENCH_PHASES; Phase++)
+	{
+		if (!(Kernels.Blocks[Phase]))
+		{
+			printf("  %-10s no sectors\n", PhaseNames[Phase]);
+			continue;
+		}
+
+		printf("  %-10s %lu sectors, %.1f cycles per sector, %.1f of them on the SPI bus (%.0f%% over the SPI clock)\n",
+		       PhaseNames[Phase], (unsigned long)Kernels.Blocks[Phase], Kernels.Cycles[Phase], Kernels.Bus[Phase],
+		       (Kernels.Bus[Phase] - ByteCycles * 513) * 100 / (ByteCycles * 513));
+	}
+
+	Result->BlocksRead    = Card.Stats.BlocksRead;
+	Result->BlocksWritten = Card.Stats.BlocksWritten + Card.Stats.BlocksRejected;
+	Result->Digest        = Card.Stats.Digest;
+	Result->Mismatches    = Kernels.Mismatches;
+	memcpy(Result->PhaseCycles, Kernels.Cycles, sizeof(Result->PhaseCycles));
+
+	avr_terminate(AVR);
+	SDCard_Close(&Card);
+
+	/* Each read phase gives back both runs of sectors written */
+	return ((Kernels.Phase == KERNELBENCH_DONE) && !(Kernels.Mismatches) &&
+	        (Kernels.InPos == (2UL * KERNELBENCH_SECTORS * 512)) && (Kernels.OutPos == (2 * Kernels.InPos)));
+}
+
+/** Prints the change of the cycles per sector from one build to another.
+ *
+ *  \param[in] Name    Direction of the blocks
+ *  \param[in] Before  CPU cycles per sector of the first build
+ *  \param[in] After   CPU cycles per sector of the second build
+ */
+static void SimBench_PrintGain(const char* const Name,
+                               const double Before,
+                               const double After)
+{
+	if (!(Before) || !(After))
+	  return;
+
+	printf("  %-6s %.1f -> %.1f cycles per sector, %+.1f%%\n", Name, Before, After, (After - Before) * 100 / Before);
+}
+
+/** Main program entry point, running the firmware until its start-up is over, or KernelBench.c through its phases.
+ *
+ *  \return Zero if the firmware ran and moved data blocks, and the other firmware builds moved the same ones, non-zero
+ *          otherwise
+ */
+int main(int argc,
+         char* argv[])
+{
+	const char*       ElfPath     = NULL;
+	const char*       ComparePaths[SIMBENCH_MAX_COMPARES];
+	uint8_t           Compares    = 0;
+	bool              Failed      = false;
+	const char*       ImagePath   = "simbench.img";
+	bool              Raw         = false;
+	bool              Kernels     = false;
+	uint64_t          Limit       = 20000ULL * (SIMBENCH_F_CPU / 1000);
+	SDCard_Timing_t   Timing;
+	SimBench_Result_t First;
+	SimBench_Result_t Second;
+
+	SDCard_DefaultTiming(&Timing);
+
+	for (int n = 1; n < argc; n++)
+	{
+		if (!(strcmp(argv[n], "help")))
+		{
+			fputs(Usage, stdout);
+			return 0;
+		}
+		else if (!(strncmp(argv[n], "elf=", 4)))
+		{
+			ElfPath = &argv[n][4];
+		}
+		else if (!(strncmp(argv[n], "compare=", 8)) && (Compares < SIMBENCH_MAX_COMPARES))
+		{
+			ComparePaths[Compares++] = &argv[n][8];
+		}
+		else if (!(strncmp(argv[n], "image=", 6)))
+		{
+			ImagePath = &argv[n][6];
+		}
+		else if (!(strncmp(argv[n], "kernels=", 8)))
+		{
+			Kernels = (atoi(&argv[n][8]) == 1);
+		}
+		else if (!(strncmp(argv[n], "raw=", 4)))
+		{
+			Raw = (atoi(&argv[n][4]) == 1);
+		}
+		else if (!(strncmp(argv[n], "time=", 5)))
+		{
+			Limit = strtoull(&argv[n][5], NULL, 0) * (SIMBENCH_F_CPU / 1000);
+		}
+		else if (!(SDCard_SetTiming(&Timing, argv[n])))
+		{
+			fprintf(stderr, "unknown option %s\n%s", argv[n], Usage);
+			return 2;
+		}
+	}
+
+	if (!(ElfPath))
+	  ElfPath = (Kernels ? "kernels-c.elf" : "../../DeviceOnSD.elf");
+
+	if (Kernels ? !(SimBench_RunKernels(ElfPath, ImagePath, Limit, &Timing, &First)) :
+	              !(SimBench_Run(ElfPath, ImagePath, Raw, Limit, &Timing, &First)))
+	{
+		return 1;
+	}
+
+	for (uint8_t i = 0; i < Compares; i++)
+	{
+		if (Kernels ? !(SimBench_RunKernels(ComparePaths[i], ImagePath, Limit, &Timing, &Second)) :
+		              !(SimBench_Run(ComparePaths[i], ImagePath, Raw, Limit, &Timing, &Second)))
+		{
+			return 1;
+		}
+
+		printf("%s against %s:\n", ComparePaths[i], ElfPath);
+		SimBench_PrintGain("read", First.ReadCycles, Second.ReadCycles);
+		SimBench_PrintGain("write", First.WriteCycles, Second.WriteCycles);
+
+		for (uint8_t Phase = KERNELBENCH_WRITE_FIFO; Kernels && (Phase < KERNELBENCH_PHASES); Phase++)
+		  SimBench_PrintGain(PhaseNames[Phase], First.PhaseCycles[Phase], Second.PhaseCycles[Phase]);
+
+		if ((First.BlocksRead != Second.BlocksRead) || (First.BlocksWritten != Second.BlocksWritten) ||
+		    (First.Digest != Second.Digest))
+		{
+			printf("  data FAILED: %lu/%lu blocks read/written, digest %08lx against %lu/%lu, digest %08lx\n",
+			       (unsigned long)Second.BlocksRead, (unsigned long)Second.BlocksWritten, (unsigned long)Second.Digest,
+			       (unsigned long)First.BlocksRead, (unsigned long)First.BlocksWritten, (unsigned long)First.Digest);
+			Failed = true;
+			continue;
+		}
+
+		printf("  data ok, digest %08lx\n", (unsigned long)First.Digest);
+	}
+
+	return (Failed ? 1 : 0);
+}
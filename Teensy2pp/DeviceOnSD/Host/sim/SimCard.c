@@ -0,0 +1,372 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Wiring of the emulated card (Host/SDCard.c) to the SPI module and to USART1 of a simulated AVR, the two ways the
+ *  card driver can drive the card.
+ *
+ *  The simavr SPI module raises SPIF a fixed 100us after each write to SPDR, whatever the SPI clock, so the data
+ *  register is taken over here: a byte written to SPDR is shifted for 8 SPI clocks at the rate set in SPCR and SPSR,
+ *  exchanged with the card when done, and SPIF is then set in SPSR. Reading SPDR returns the byte received and clears
+ *  SPIF. The card is selected while PB0 is an output driven low.
+ *
+ *  The simavr USART has no master SPI mode, so UDR1 and UCSR1A are taken over as well, for the MMC_USART_MSPIM build
+ *  of the card driver. With UMSEL1 set to master SPI mode and the transmitter enabled, a byte written to UDR1 is
+ *  shifted at once if the shifter is idle, or else waits in the transmit buffer, clearing UDRE1 until the shifter
+ *  takes it. A byte takes 8 clocks of F_CPU / 2 / (UBRR1 + 1). At its end it is exchanged with the card, and the byte
+ *  received is put into the two byte receive buffer, setting RXC1, if the receiver is enabled. Reading UDR1 takes the
+ *  oldest byte out of the buffer. The card is selected while PD4 is an output driven low.
+ *
+ *  Neither the SPI nor the USART1 interrupts are raised, so the MMC_SPI_ISR build of the card driver cannot run
+ *  against this model.
+ */
+
+#include <string.h>
+
+#include <sim_io.h>
+#include <sim_cycle_timers.h>
+
+#include "SimCard.h"
+
+/** Mask of the SPI enable bit in SPCR. */
+#define SIMCARD_SPE                (1 << 6)
+
+/** Mask of the master mode bit in SPCR. */
+#define SIMCARD_MSTR               (1 << 4)
+
+/** Mask of the transfer complete flag in SPSR. */
+#define SIMCARD_SPIF               (1 << 7)
+
+/** Mask of the double speed bit in SPSR. */
+#define SIMCARD_SPI2X              (1 << 0)
+
+/** Mask of the receive complete flag in UCSR1A. */
+#define SIMCARD_RXC1               (1 << 7)
+
+/** Mask of the transmit complete flag in UCSR1A. */
+#define SIMCARD_TXC1               (1 << 6)
+
+/** Mask of the data register empty flag in UCSR1A. */
+#define SIMCARD_UDRE1              (1 << 5)
+
+/** Mask of the data overrun flag in UCSR1A. */
+#define SIMCARD_DOR1               (1 << 3)
+
+/** Mask of the receiver enable bit in UCSR1B. */
+#define SIMCARD_RXEN1              (1 << 4)
+
+/** Mask of the transmitter enable bit in UCSR1B. */
+#define SIMCARD_TXEN1              (1 << 3)
+
+/** Mask of the mode select bits in UCSR1C, all set in master SPI mode. */
+#define SIMCARD_UMSEL1             (3 << 6)
+
+
+static avr_cycle_count_t SimCard_ByteDone(avr_t* AVR,
+                                          avr_cycle_count_t When,
+                                          void* Param);
+
+/** Starts shifting a byte out to the card.
+ *
+ *  \param[in,out] Wiring  Wiring of the card
+ *  \param[in]     Value   Byte to shift out
+ *  \param[in]     Cycles  Number of CPU cycles the byte takes
+ *  \param[in]     Usart   Shift the byte with USART1 rather than with the SPI module
+ */
+static void SimCard_StartByte(SimCard_t* const Wiring,
+                              const uint8_t Value,
+                              const uint32_t Cycles,
+                              const bool Usart)
+{
+	Wiring->MOSI        = Value;
+	Wiring->Busy        = true;
+	Wiring->Usart       = Usart;
+	Wiring->ByteCycles  = Cycles;
+	Wiring->SpiCycles  += Cycles;
+
+	avr_cycle_timer_register(Wiring->AVR, Cycles, SimCard_ByteDone, Wiring);
+}
+
+/** Ends the byte being shifted: exchanges it with the card and flags it as complete. A byte shifted by USART1 is
+ *  put into its receive buffer, and the byte waiting in its transmit buffer, if any, is started.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] When   Cycle count the byte ends at
+ *  \param[in] Param  Wiring of the card
+ *
+ *  \return Zero, the timer not being repeated
+ */
+static avr_cycle_count_t SimCard_ByteDone(avr_t* AVR,
+                                          avr_cycle_count_t When,
+                                          void* Param)
+{
+	SimCard_t* Wiring = Param;
+	bool       Selected;
+
+	if (Wiring->Usart)
+	  Selected = (AVR->data[SIMCARD_DDRD] & 0x10) && !(AVR->data[SIMCARD_PORTD] & 0x10);
+	else
+	  Selected = (AVR->data[SIMCARD_DDRB] & 0x01) && !(AVR->data[SIMCARD_PORTB] & 0x01);
+
+	SDCard_Select(Wiring->Card, Selected);
+
+	Wiring->MISO     = SDCard_Exchange(Wiring->Card, Wiring->MOSI, When * 1000000000ULL / AVR->frequency);
+	Wiring->Busy     = false;
+	Wiring->LastByte = When;
+
+	if (!(Wiring->Usart))
+	{
+		AVR->data[SIMCARD_SPSR] |= SIMCARD_SPIF;
+		return 0;
+	}
+
+	if (AVR->data[SIMCARD_UCSR1B] & SIMCARD_RXEN1)
+	{
+		if (Wiring->RxCount < sizeof(Wiring->RxData))
+		  Wiring->RxData[Wiring->RxCount++] = Wiring->MISO;
+		else
+		  AVR->data[SIMCARD_UCSR1A] |= SIMCARD_DOR1;
+
+		AVR->data[SIMCARD_UCSR1A] |= SIMCARD_RXC1;
+	}
+
+	if (Wiring->TxFull)
+	{
+		Wiring->TxFull = false;
+		AVR->data[SIMCARD_UCSR1A] |= SIMCARD_UDRE1;
+		SimCard_StartByte(Wiring, Wiring->TxData, Wiring->ByteCycles, true);
+	}
+	else
+	{
+		AVR->data[SIMCARD_UCSR1A] |= SIMCARD_TXC1;
+	}
+
+	return 0;
+}
+
+/** Handles a write to SPDR, starting to shift the byte out if the SPI module is enabled as a master.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address written
+ *  \param[in] Value  Value written
+ *  \param[in] Param  Wiring of the card
+ */
+static void SimCard_WriteSPDR(avr_t* AVR,
+                              avr_io_addr_t Addr,
+                              uint8_t Value,
+                              void* Param)
+{
+	static const uint8_t Divider[4] = {4, 16, 64, 128};
+
+	SimCard_t* Wiring = Param;
+	uint8_t    SPCR   = AVR->data[SIMCARD_SPCR];
+	uint32_t   Cycles;
+
+	AVR->data[Addr] = Value;
+
+	if (Wiring->Busy || ((SPCR & (SIMCARD_SPE | SIMCARD_MSTR)) != (SIMCARD_SPE | SIMCARD_MSTR)))
+	  return;
+
+	Cycles = (uint32_t)Divider[SPCR & 0x03] * 8;
+	if (AVR->data[SIMCARD_SPSR] & SIMCARD_SPI2X)
+	  Cycles /= 2;
+
+	AVR->data[SIMCARD_SPSR] &= ~SIMCARD_SPIF;
+	SimCard_StartByte(Wiring, Value, Cycles, false);
+}
+
+/** Handles a read of SPDR, returning the byte received and clearing SPIF.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address read
+ *  \param[in] Param  Wiring of the card
+ *
+ *  \return Byte received
+ */
+static uint8_t SimCard_ReadSPDR(avr_t* AVR,
+                                avr_io_addr_t Addr,
+                                void* Param)
+{
+	SimCard_t* Wiring = Param;
+
+	(void)Addr;
+
+	AVR->data[SIMCARD_SPSR] &= ~SIMCARD_SPIF;
+	return Wiring->MISO;
+}
+
+/** Handles a write to UDR1, starting to shift the byte out or queueing it in the transmit buffer if USART1 is
+ *  enabled as a master SPI transmitter. A byte written while the transmit buffer is full is lost.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address written
+ *  \param[in] Value  Value written
+ *  \param[in] Param  Wiring of the card
+ */
+static void SimCard_WriteUDR1(avr_t* AVR,
+                              avr_io_addr_t Addr,
+                              uint8_t Value,
+                              void* Param)
+{
+	SimCard_t* Wiring = Param;
+	uint16_t   UBRR   = ((uint16_t)(AVR->data[SIMCARD_UBRR1H] & 0x0F) << 8) | AVR->data[SIMCARD_UBRR1L];
+
+	(void)Addr;
+
+	if (((AVR->data[SIMCARD_UCSR1C] & SIMCARD_UMSEL1) != SIMCARD_UMSEL1) ||
+	    !(AVR->data[SIMCARD_UCSR1B] & SIMCARD_TXEN1))
+	{
+		return;
+	}
+
+	AVR->data[SIMCARD_UCSR1A] &= ~SIMCARD_TXC1;
+
+	if (!(Wiring->Busy))
+	{
+		SimCard_StartByte(Wiring, Value, 16 * ((uint32_t)UBRR + 1), true);
+	}
+	else if (!(Wiring->TxFull))
+	{
+		Wiring->TxFull = true;
+		Wiring->TxData = Value;
+		AVR->data[SIMCARD_UCSR1A] &= ~SIMCARD_UDRE1;
+	}
+}
+
+/** Handles a read of UDR1, taking the oldest byte out of the receive buffer and clearing RXC1 once it is empty.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address read
+ *  \param[in] Param  Wiring of the card
+ *
+ *  \return Byte received
+ */
+static uint8_t SimCard_ReadUDR1(avr_t* AVR,
+                                avr_io_addr_t Addr,
+                                void* Param)
+{
+	SimCard_t* Wiring = Param;
+	uint8_t    Value  = Wiring->RxData[0];
+
+	(void)Addr;
+
+	if (Wiring->RxCount)
+	{
+		Wiring->RxData[0] = Wiring->RxData[1];
+		Wiring->RxCount--;
+	}
+
+	if (!(Wiring->RxCount))
+	  AVR->data[SIMCARD_UCSR1A] &= ~(SIMCARD_RXC1 | SIMCARD_DOR1);
+
+	return Value;
+}
+
+/** Handles a read of UCSR1A, returning the flags kept up to date by the USART1 model.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address read
+ *  \param[in] Param  Wiring of the card
+ *
+ *  \return Value of UCSR1A
+ */
+static uint8_t SimCard_ReadUCSR1A(avr_t* AVR,
+                                  avr_io_addr_t Addr,
+                                  void* Param)
+{
+	(void)Param;
+
+	return AVR->data[Addr];
+}
+
+/** Handles a write to UCSR1A, where writing a one clears TXC1.
+ *
+ *  \param[in] AVR    Simulated AVR
+ *  \param[in] Addr   Data address written
+ *  \param[in] Value  Value written
+ *  \param[in] Param  Wiring of the card
+ */
+static void SimCard_WriteUCSR1A(avr_t* AVR,
+                                avr_io_addr_t Addr,
+                                uint8_t Value,
+                                void* Param)
+{
+	(void)Param;
+
+	if (Value & SIMCARD_TXC1)
+	  AVR->data[Addr] &= ~SIMCARD_TXC1;
+}
+
+/** Replaces the read and write handlers of an I/O register of a simulated AVR.
+ *
+ *  \param[in] AVR      Simulated AVR
+ *  \param[in] Address  Data address of the register
+ *  \param[in] Read     Read handler
+ *  \param[in] Write    Write handler
+ *  \param[in] Param    Wiring of the card, passed to the handlers
+ */
+static void SimCard_Hook(avr_t* const AVR,
+                         const uint16_t Address,
+                         const avr_io_read_t Read,
+                         const avr_io_write_t Write,
+                         SimCard_t* const Param)
+{
+	avr_io_addr_t IO = AVR_DATA_TO_IO(Address);
+
+	AVR->io[IO].w.c     = Write;
+	AVR->io[IO].w.param = Param;
+	AVR->io[IO].r.c     = Read;
+	AVR->io[IO].r.param = Param;
+}
+
+/** Wires an emulated card to the SPI module and to USART1 of a simulated AVR, replacing the SPDR handlers of the
+ *  simavr SPI module and the UDR1 and UCSR1A handlers of the simavr USART. This must be called after \c avr_init().
+ *
+ *  \param[out] Wiring  Wiring state
+ *  \param[in]  AVR     Simulated AVR
+ *  \param[in]  Card    Emulated card
+ */
+void SimCard_Attach(SimCard_t* const Wiring,
+                    avr_t* const AVR,
+                    SDCard_t* const Card)
+{
+	memset(Wiring, 0, sizeof(SimCard_t));
+	Wiring->AVR  = AVR;
+	Wiring->Card = Card;
+	Wiring->MISO = 0xFF;
+
+	SimCard_Hook(AVR, SIMCARD_SPDR, SimCard_ReadSPDR, SimCard_WriteSPDR, Wiring);
+	SimCard_Hook(AVR, SIMCARD_UDR1, SimCard_ReadUDR1, SimCard_WriteUDR1, Wiring);
+	SimCard_Hook(AVR, SIMCARD_UCSR1A, SimCard_ReadUCSR1A, SimCard_WriteUCSR1A, Wiring);
+
+	/* Reset value of UCSR1A, the transmit buffer being empty */
+	AVR->data[SIMCARD_UCSR1A] = SIMCARD_UDRE1;
+}
@@ -0,0 +1,111 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+/** \file
+ *
+ *  Header file for SimCard.c.
+ */
+
+#ifndef _SIMCARD_H_
+#define _SIMCARD_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include <sim_avr.h>
+
+		#include "../SDCard.h"
+
+	/* Macros: */
+		/** Data address of the SPI control register of the AT90USB1286. */
+		#define SIMCARD_SPCR               0x4C
+
+		/** Data address of the SPI status register of the AT90USB1286. */
+		#define SIMCARD_SPSR               0x4D
+
+		/** Data address of the SPI data register of the AT90USB1286. */
+		#define SIMCARD_SPDR               0x4E
+
+		/** Data address of the PORTB data direction register, the card chip select being on bit 0. */
+		#define SIMCARD_DDRB               0x24
+
+		/** Data address of the PORTB output register, the card chip select being on bit 0. */
+		#define SIMCARD_PORTB              0x25
+
+		/** Data address of the PORTD data direction register, the card chip select of USART1 being on bit 4. */
+		#define SIMCARD_DDRD               0x2A
+
+		/** Data address of the PORTD output register, the card chip select of USART1 being on bit 4. */
+		#define SIMCARD_PORTD              0x2B
+
+		/** Data address of the USART1 control and status register A of the AT90USB1286. */
+		#define SIMCARD_UCSR1A             0xC8
+
+		/** Data address of the USART1 control and status register B of the AT90USB1286. */
+		#define SIMCARD_UCSR1B             0xC9
+
+		/** Data address of the USART1 control and status register C of the AT90USB1286. */
+		#define SIMCARD_UCSR1C             0xCA
+
+		/** Data address of the low byte of the USART1 baud rate register of the AT90USB1286. */
+		#define SIMCARD_UBRR1L             0xCC
+
+		/** Data address of the high byte of the USART1 baud rate register of the AT90USB1286. */
+		#define SIMCARD_UBRR1H             0xCD
+
+		/** Data address of the USART1 data register of the AT90USB1286. */
+		#define SIMCARD_UDR1               0xCE
+
+	/* Type Defines: */
+		/** Type define for an emulated card wired to the SPI module and USART1 of a simulated AVR. */
+		typedef struct
+		{
+			avr_t*             AVR;        /**< Simulated AVR */
+			SDCard_t*          Card;       /**< Emulated card */
+			uint8_t            MOSI;       /**< Byte being shifted out by the AVR */
+			uint8_t            MISO;       /**< Last byte shifted in from the card */
+			bool               Busy;       /**< A byte is being shifted */
+			bool               Usart;      /**< The byte is shifted by USART1 rather than by the SPI module */
+			bool               TxFull;     /**< A byte waits in the USART1 transmit buffer */
+			uint8_t            TxData;     /**< Byte waiting in the USART1 transmit buffer */
+			uint8_t            RxCount;    /**< Number of bytes in the USART1 receive buffer */
+			uint8_t            RxData[2];  /**< USART1 receive buffer, oldest byte first */
+			uint32_t           ByteCycles; /**< Cycles taken by the last byte shifted, at the SPI clock then set */
+			avr_cycle_count_t  LastByte;   /**< Cycle count at the end of the last byte exchanged */
+			uint64_t           SpiCycles;  /**< Cycles spent shifting bytes */
+		} SimCard_t;
+
+	/* Function Prototypes: */
+		void SimCard_Attach(SimCard_t* const Wiring,
+		                    avr_t* const AVR,
+		                    SDCard_t* const Card);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Storage benchmark run from the CDC console. Requests go straight to the card driver or through FatFs to the
+ *  loopback image file, so that the card and SPI limits are measured apart from USB and the host. Written blocks are
+ *  first read and then written back unchanged, so a benchmark never alters the stored data.
+ *
+ *  The Mass Storage interface is not serviced while a benchmark runs, only the console and keyboard interfaces are.
+ *  A host that has the drive mounted sees its commands stall until the run ends, and may reset the device if that
+ *  takes too long, so eject the drive before benchmarking.
+ */
+
+#define  INCLUDE_FROM_BENCH_C
+#include "Bench.h"
+
+/** State of the pseudo random block sequence, kept across runs so that each random benchmark visits other blocks. */
+static uint32_t BenchSeed = 1;
+
+/** Advances the pseudo random block sequence, a xorshift generator.
+ *
+ *  \return Next pseudo random number of the sequence
+ */
+static uint32_t Bench_Random(void)
+{
+	BenchSeed ^= BenchSeed << 13;
+	BenchSeed ^= BenchSeed >> 17;
+	BenchSeed ^= BenchSeed << 5;
+
+	return BenchSeed;
+}
+
+/** Issues a single benchmark request.
+ *
+ *  \param[in]     Target      Target of the request, 'd' for the card driver or 'f' for the loopback image file
+ *  \param[in]     IsDataRead  Indicates if the blocks are to be read or written
+ *  \param[in,out] Buffer      Buffer holding the blocks
+ *  \param[in]     Block       Address of the first block of the request
+ *  \param[in]     Blocks      Number of blocks of the request
+ *
+ *  \return Boolean \c true if the request succeeded, \c false otherwise
+ */
+static bool Bench_Transfer(const char Target,
+	const bool IsDataRead,
+	uint8_t* const Buffer,
+	const uint32_t Block,
+	const uint8_t Blocks)
+{
+	UINT Bytes;
+
+	if (Target == 'd')
+	{
+		if (IsDataRead)
+		  return (mmc_disk_read(Buffer, Block, Blocks) == RES_OK);
+		else
+		  return (mmc_disk_write(Buffer, Block, Blocks) == RES_OK);
+	}
+
+	if (f_lseek(&MassStorage_Loopback, (FSIZE_t)Block * 512) != FR_OK)
+	  return false;
+
+	if (IsDataRead)
+	  return ((f_read(&MassStorage_Loopback, Buffer, (UINT)Blocks * 512, &Bytes) == FR_OK) && (Bytes == (UINT)Blocks * 512));
+	else
+	  return ((f_write(&MassStorage_Loopback, Buffer, (UINT)Blocks * 512, &Bytes) == FR_OK) && (Bytes == (UINT)Blocks * 512));
+}
+
+/** Runs a benchmark and prints its throughput, CPU cycles per block and request latencies. The arguments are a test name followed by the
+ *  optional number of blocks per request and number of requests, for example "dsr 2 256". The test name is made of
+ *  the target ('d' for the card driver, 'f' for the loopback image file), the access pattern ('s' for sequential,
+ *  'r' for random) and the direction ('r' for read, 'w' for write).
+ *
+ *  \param[in] Stream  Console stream to print the results to
+ *  \param[in] Args    Arguments of the benchmark command
+ */
+void Bench_Run(FILE* const Stream,
+	const char* Args)
+{
+	char          Target, Pattern, Direction;
+	char*         End;
+	unsigned long BlockCount;
+	unsigned long RequestCount;
+	uint8_t       Blocks;
+	uint16_t      Requests;
+	uint32_t      Extent;
+	uint32_t      Block = 0;
+	uint32_t      Total = 0;
+	uint32_t      Min   = UINT32_MAX;
+	uint32_t      Max   = 0;
+	uint8_t*      Buffer;
+
+	while (*Args == ' ')
+	  Args++;
+
+	Target    = Args[0];
+	Pattern   = Target    ? Args[1] : 0;
+	Direction = Pattern   ? Args[2] : 0;
+	Args      = Direction ? &Args[3] : Args;
+
+	/* Parse the counts at full width, so that an out of range one is rejected rather than wrapped */
+	BlockCount   = strtoul(Args, &End, 10);
+	RequestCount = (End == Args) ? BENCH_DEFAULT_REQUESTS : strtoul(End, &End, 10);
+	if (!(BlockCount))
+	  BlockCount = 1;
+	if (!(RequestCount))
+	  RequestCount = BENCH_DEFAULT_REQUESTS;
+
+	if (((Target != 'd') && (Target != 'f')) || ((Pattern != 's') && (Pattern != 'r')) ||
+	    ((Direction != 'r') && (Direction != 'w')) || (BlockCount > BENCH_MAX_BLOCKS) ||
+	    (RequestCount > UINT16_MAX))
+	{
+		fprintf(Stream, "usage: b <d|f><s|r><r|w> [blocks 1-%u] [requests 1-%u]\r\n", BENCH_MAX_BLOCKS, UINT16_MAX);
+		return;
+	}
+
+	Blocks   = BlockCount;
+	Requests = RequestCount;
+
+	/* Find the number of blocks the requests may address */
+	if (Target == 'd')
+	{
+		if (mmc_disk_ioctl(GET_SECTOR_COUNT, &Extent) != RES_OK)
+		  Extent = 0;
+	}
+	else
+	{
+		Extent = MassStorage_Loopback.obj.fs ? (f_size(&MassStorage_Loopback) / 512) : 0;
+	}
+
+	if (Extent < Blocks)
+	{
+		fputs("bench: target not available\r\n", Stream);
+		return;
+	}
+
+	if (!(Buffer = malloc((size_t)Blocks * 512)))
+	{
+		fputs("bench: out of memory\r\n", Stream);
+		return;
+	}
+
+	for (uint16_t Request = 0; Request < Requests; Request++)
+	{
+		uint32_t Start;
+		uint32_t Ticks;
+		bool     Success;
+
+		if (Pattern == 'r')
+		  Block = Bench_Random() % (Extent - Blocks + 1);
+		else if (Block > (Extent - Blocks))
+		  Block = 0;
+
+		/* Write back what is there, so that the benchmark leaves the stored data as it was */
+		Success = ((Direction == 'r') || Bench_Transfer(Target, true, Buffer, Block, Blocks));
+
+		Start   = Timebase_GetTicks();
+		Success = Success && Bench_Transfer(Target, (Direction == 'r'), Buffer, Block, Blocks);
+		Ticks   = Timebase_GetTicks() - Start;
+
+		if (!(Success))
+		{
+			fprintf(Stream, "bench: request %u failed at block %lu\r\n", Request, (unsigned long)Block);
+			Requests = Request;
+			break;
+		}
+
+		Total += Ticks;
+		if (Ticks < Min)
+		  Min = Ticks;
+		if (Ticks > Max)
+		  Max = Ticks;
+
+		Block += Blocks;
+
+		/* Keep the console and keyboard interfaces alive during a long run, the Mass Storage one waits until the end */
+		mmc_yield();
+	}
+
+	if ((Target == 'f') && (Direction == 'w'))
+	  f_sync(&MassStorage_Loopback);
+
+	free(Buffer);
+
+	if (Requests)
+	{
+		uint32_t Micros = (Total / TIMEBASE_TICKS_PER_US) ? (Total / TIMEBASE_TICKS_PER_US) : 1;
+		uint32_t Rate   = (uint64_t)Requests * Blocks * 512 * 100 / Micros;
+
+		fprintf(Stream, "%c%c%c %u x %u: %lu.%02lu MB/s, %lu IOPS, %lu cycles/block, latency min/avg/max %lu/%lu/%lu us\r\n",
+		        Target, Pattern, Direction, Blocks, Requests,
+		        (unsigned long)(Rate / 100), (unsigned long)(Rate % 100),
+		        (unsigned long)((uint64_t)Requests * 1000000 / Micros),
+		        (unsigned long)((uint64_t)Total * TIMEBASE_CYCLES_PER_TICK / ((uint32_t)Requests * Blocks)),
+		        (unsigned long)(Min / TIMEBASE_TICKS_PER_US), (unsigned long)(Micros / Requests),
+		        (unsigned long)(Max / TIMEBASE_TICKS_PER_US));
+	}
+}
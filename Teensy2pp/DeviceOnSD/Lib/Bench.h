@@ -0,0 +1,77 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Header file for Bench.c.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+	/* Includes: */
+		#include <stdio.h>
+		#include <stdlib.h>
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include "ff.h"
+		#include "diskio.h"
+		#include "mmc_avr.h"
+		#include "Timebase.h"
+
+	/* Macros: */
+		/** Largest number of blocks a benchmark request may transfer. The request buffer is taken from the heap, which
+		 *  cannot spare more than two sectors beside the write-back cache lines and the stack.
+		 */
+		#define BENCH_MAX_BLOCKS           2
+
+		/** Number of requests a benchmark run issues when not given. */
+		#define BENCH_DEFAULT_REQUESTS     256
+
+	/* External Variables: */
+		extern FIL MassStorage_Loopback;
+
+	/* Function Prototypes: */
+		void Bench_Run(FILE* const Stream,
+		               const char* Args);
+
+		#if defined(INCLUDE_FROM_BENCH_C)
+			static uint32_t Bench_Random(void);
+			static bool Bench_Transfer(const char Target,
+			                           const bool IsDataRead,
+			                           uint8_t* const Buffer,
+			                           const uint32_t Block,
+			                           const uint8_t Blocks);
+		#endif
+
+#endif
+
@@ -0,0 +1,108 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Latency histograms of the storage layers. Each measured operation adds its duration, taken from the high
+ *  resolution timebase, to a log2 bucketed histogram kept in RAM, so that the rare slow operations caused by the card
+ *  garbage collection show up next to the usual ones.
+ */
+
+#include "Latency.h"
+
+#if defined(LATENCY_HISTOGRAMS)
+
+/** Latency histograms, indexed by probe then by bucket. The counts saturate rather than wrap. */
+static uint16_t LatencyHistogram[LATENCY_PROBES][LATENCY_BUCKETS];
+
+/** Longest duration seen by each probe, in timebase ticks. */
+static uint32_t LatencyMax[LATENCY_PROBES];
+
+/** Names of the probes, as printed by \ref Latency_Dump(). */
+static const char* const LatencyNames[LATENCY_PROBES] =
+	{
+		[LATENCY_DISK_READ]  = "disk read",
+		[LATENCY_DISK_WRITE] = "disk write",
+		[LATENCY_WAIT_READY] = "wait ready",
+		[LATENCY_DATA_BLOCK] = "data block",
+		[LATENCY_SCSI_READ]  = "scsi read",
+		[LATENCY_SCSI_WRITE] = "scsi write",
+		[LATENCY_SCSI_OTHER] = "scsi other",
+	};
+
+/** Adds the duration of an operation to the histogram of its probe.
+ *
+ *  \param[in] Probe  Measured operation, a value from the \ref LatencyProbes_t enum
+ *  \param[in] Ticks  Duration of the operation in timebase ticks
+ */
+void Latency_Record(const uint8_t Probe,
+	const uint32_t Ticks)
+{
+	uint32_t Micros = (Ticks / TIMEBASE_TICKS_PER_US);
+	uint8_t  Bucket = 0;
+
+	while ((Micros >>= 1) && (Bucket < (LATENCY_BUCKETS - 1)))
+	  Bucket++;
+
+	if (LatencyHistogram[Probe][Bucket] != UINT16_MAX)
+	  LatencyHistogram[Probe][Bucket]++;
+
+	if (Ticks > LatencyMax[Probe])
+	  LatencyMax[Probe] = Ticks;
+}
+
+/** Prints the latency histograms, one line per probe with the count of each bucket followed by the longest duration
+ *  in microseconds, then clears them so that the next dump covers the operations since this one.
+ *
+ *  \param[in] Stream  Console stream to print the histograms to
+ */
+void Latency_Dump(FILE* const Stream)
+{
+	fputs("latency [2^n us]", Stream);
+	for (uint8_t Bucket = 0; Bucket < LATENCY_BUCKETS; Bucket++)
+	  fprintf(Stream, " %5u", Bucket);
+	fputs("    max us\r\n", Stream);
+
+	for (uint8_t Probe = 0; Probe < LATENCY_PROBES; Probe++)
+	{
+		fprintf(Stream, "%-16s", LatencyNames[Probe]);
+		for (uint8_t Bucket = 0; Bucket < LATENCY_BUCKETS; Bucket++)
+		{
+			fprintf(Stream, " %5u", LatencyHistogram[Probe][Bucket]);
+			LatencyHistogram[Probe][Bucket] = 0;
+		}
+
+		fprintf(Stream, " %9lu\r\n", (unsigned long)(LatencyMax[Probe] / TIMEBASE_TICKS_PER_US));
+		LatencyMax[Probe] = 0;
+	}
+}
+
+#endif
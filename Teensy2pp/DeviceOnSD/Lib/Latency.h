@@ -0,0 +1,90 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Header file for Latency.c.
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+	/* Includes: */
+		#include <stdio.h>
+		#include <stdint.h>
+
+		#include "Config/AppConfig.h"
+		#include "Timebase.h"
+
+	/* Macros: */
+		/** Number of buckets of each latency histogram. Bucket n counts the operations that took from 2^n to 2^(n+1)
+		 *  microseconds, the first one also counts the quicker ones and the last one the slower ones.
+		 */
+		#define LATENCY_BUCKETS            16
+
+		#if defined(LATENCY_HISTOGRAMS)
+			/** Declares a variable holding the start time of a measured operation. */
+			#define LATENCY_DECLARE(Var)       uint32_t Var
+
+			/** Stores the start time of a measured operation. */
+			#define LATENCY_START(Var)         Var = Timebase_GetTicks()
+
+			/** Adds the time elapsed since the start of a measured operation to the histogram of a probe. */
+			#define LATENCY_STOP(Probe, Var)   Latency_Record((Probe), Timebase_GetTicks() - (Var))
+		#else
+			#define LATENCY_DECLARE(Var)
+			#define LATENCY_START(Var)
+			#define LATENCY_STOP(Probe, Var)
+		#endif
+
+	/* Enums: */
+		/** Enum for the measured operations, each having its own latency histogram. */
+		enum LatencyProbes_t
+		{
+			LATENCY_DISK_READ    = 0, /**< mmc_disk_read() call */
+			LATENCY_DISK_WRITE   = 1, /**< mmc_disk_write() call */
+			LATENCY_WAIT_READY   = 2, /**< Wait for the card to get ready before a command or data block */
+			LATENCY_DATA_BLOCK   = 3, /**< Reception of a data block, from the wait for its token on */
+			LATENCY_SCSI_READ    = 4, /**< SCSI READ (10) command */
+			LATENCY_SCSI_WRITE   = 5, /**< SCSI WRITE (10) command */
+			LATENCY_SCSI_OTHER   = 6, /**< Any other SCSI command */
+			LATENCY_PROBES       = 7, /**< Number of measured operations */
+		};
+
+	/* Function Prototypes: */
+		#if defined(LATENCY_HISTOGRAMS)
+		void Latency_Record(const uint8_t Probe,
+		                    const uint32_t Ticks);
+		void Latency_Dump(FILE* const Stream);
+		#endif
+
+#endif
+
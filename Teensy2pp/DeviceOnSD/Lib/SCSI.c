@@ -38,6 +38,7 @@
 #define  INCLUDE_FROM_SCSI_C
 #include "SCSI.h" 
 #include "mmc_avr.h"
+#include "Trace.h"
 
 FIL MassStorage_Loopback;
 uint8_t RawStorage = 0;
@@ -52,7 +53,7 @@ static const SCSI_Inquiry_Response_t InquiryData =
 
 		.Removable           = true,
 
-		.Version             = 0,
+		.Version             = 5,
 
 		.ResponseDataFormat  = 2,
 		.NormACA             = false,
@@ -74,6 +75,19 @@ static const SCSI_Inquiry_Response_t InquiryData =
 		.RevisionID          = {'0','.','0','0'},
 	};
 
+/** State of the storage medium behind the LUNs, a value from the \ref MediaStates_t enum. */
+static uint8_t MediaState = MEDIA_BECOMING_READY;
+
+/** Flag to indicate if the medium has become ready since the last command, which is reported to the host once. */
+static bool MediaChanged;
+
+/** Flag to indicate if a card write transaction closed since the last command failed, which is reported to the host
+ *  on the next command touching the medium. */
+static bool WriteFailed;
+
+/** Erase unit of the card in sectors, the granularity UNMAP commands are carried out with. Zero until first needed. */
+static uint32_t UnmapGranularity;
+
 /** Structure to hold the sense data for the last issued SCSI command, which is returned to the host after a SCSI REQUEST SENSE
  *  command is issued. This gives information on exactly why the last command failed to complete.
  */
@@ -83,10 +97,36 @@ static SCSI_Request_Sense_Response_t SenseData =
 		.AdditionalLength    = 0x0A,
 	};
 
+#if defined(WRITE_CACHE_SETS)
+/** RAM write-back sector cache, indexed by set then way. A block is always cached in the set selected by the low bits
+ *  of its address, so that consecutive blocks fall into consecutive sets.
+ */
+static Cache_Line_t CacheLines[WRITE_CACHE_SETS][WRITE_CACHE_WAYS];
+
+/** Clock of the write-back sector cache, advanced on each access to a cached sector. */
+static uint16_t CacheClock;
+
+/** Flag to indicate if the write-back sector cache holds sectors not yet written back to the medium. */
+static bool CacheDirty;
+
+/** Countdown in timer ticks since the last cached write, the dirty sectors are written back once it expires. */
+static volatile uint8_t CacheIdleTimer;
+#endif
+
+#if defined(READ_AHEAD_BLOCKS)
+/** Block following the last block of the previous READ (10) command, where a sequential read stream continues. */
+static uint32_t ReadStreamEnd = UINT32_MAX;
+
+/** Next block to be fetched ahead of a sequential read stream into the sector cache. */
+static uint32_t ReadAheadBlock;
+
+/** Number of blocks left to fetch ahead of the sequential read stream. */
+static uint8_t  ReadAheadLeft;
+#endif
+
 
-/** Main routine to process the SCSI command located in the Command Block Wrapper read from the host. This dispatches
- *  to the appropriate SCSI command handling routine if the issued command is supported by the device, else it returns
- *  a command failure due to a ILLEGAL REQUEST.
+/** Main routine to process the SCSI command located in the Command Block Wrapper read from the host. The command is
+ *  recorded into the SCSI command trace along with its timing and outcome, when enabled.
  *
  *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
  *
@@ -94,10 +134,84 @@ static SCSI_Request_Sense_Response_t SenseData =
  */
 bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-	bool CommandSuccess = false;
+	#if defined(SCSI_TRACE_ENTRIES)
+	uint32_t Start          = Timebase_GetTicks();
+	bool     CommandSuccess = SCSI_ProcessSCSICommand(MSInterfaceInfo);
+
+	Trace_Record(MSInterfaceInfo->State.CommandBlock.SCSICommandData, Start,
+	             SenseData.SenseKey, SenseData.AdditionalSenseCode, SenseData.AdditionalSenseQualifier);
+
+	return CommandSuccess;
+	#else
+	return SCSI_ProcessSCSICommand(MSInterfaceInfo);
+	#endif
+}
+
+/** Dispatches the SCSI command located in the Command Block Wrapper read from the host to the appropriate SCSI command
+ *  handling routine if the issued command is supported by the device, else it returns a command failure due to a
+ *  ILLEGAL REQUEST.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise
+ */
+static bool SCSI_ProcessSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	bool    CommandSuccess = false;
+	uint8_t Command        = MSInterfaceInfo->State.CommandBlock.SCSICommandData[0];
+
+	/* Only a READ (10) or WRITE (10) command may continue the card transaction suspended by the previous one */
+	if ((Command != SCSI_CMD_READ_10) && (Command != SCSI_CMD_WRITE_10))
+	  mmc_stream_close();
+
+	/* Keep a failure of the last blocks written in the closed transaction, wherever it was closed, for the host */
+	if (mmc_stream_error() != RES_OK)
+	  WriteFailed = true;
+
+	/* Only the commands not touching the medium are served until it is set up, the host is then told once that it
+	   has become ready */
+	if ((Command != SCSI_CMD_INQUIRY) && (Command != SCSI_CMD_REQUEST_SENSE))
+	{
+		if (MediaState == MEDIA_BECOMING_READY)
+		{
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+			               SCSI_ASENSE_LOGICAL_UNIT_NOT_READY,
+			               SCSI_ASENSEQ_BECOMING_READY);
+
+			return false;
+		}
+		else if (MediaState == MEDIA_NOT_PRESENT)
+		{
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+			               SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+		}
+		else if (MediaChanged)
+		{
+			MediaChanged = false;
+
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_UNIT_ATTENTION,
+			               SCSI_ASENSE_NOT_READY_TO_READY_CHANGE,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+		}
+		else if (WriteFailed)
+		{
+			WriteFailed = false;
+
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+			               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+		}
+	}
 
 	/* Run the appropriate SCSI command hander function based on the passed command */
-	switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
+	switch (Command)
 	{
 		case SCSI_CMD_INQUIRY:
 			CommandSuccess = SCSI_Command_Inquiry(MSInterfaceInfo);
@@ -108,6 +222,12 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 		case SCSI_CMD_READ_CAPACITY_10:
 			CommandSuccess = SCSI_Command_Read_Capacity_10(MSInterfaceInfo);
 			break;
+		case SCSI_CMD_SERVICE_ACTION_IN_16:
+			CommandSuccess = SCSI_Command_Read_Capacity_16(MSInterfaceInfo);
+			break;
+		case SCSI_CMD_UNMAP:
+			CommandSuccess = SCSI_Command_Unmap(MSInterfaceInfo);
+			break;
 		case SCSI_CMD_SEND_DIAGNOSTIC:
 			CommandSuccess = SCSI_Command_Send_Diagnostic(MSInterfaceInfo);
 			break;
@@ -120,7 +240,11 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 		case SCSI_CMD_MODE_SENSE_6:
 			CommandSuccess = SCSI_Command_ModeSense_6(MSInterfaceInfo);
 			break;
+		case SCSI_CMD_SYNCHRONIZE_CACHE_10:
 		case SCSI_CMD_START_STOP_UNIT:
+			/* The medium may be removed after a START STOP UNIT, so write back the cache as for a SYNCHRONIZE CACHE */
+			CommandSuccess = SCSI_Command_Synchronize_Cache_10(MSInterfaceInfo);
+			break;
 		case SCSI_CMD_TEST_UNIT_READY:
 		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
 		case SCSI_CMD_VERIFY_10:
@@ -161,6 +285,10 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
 	uint16_t AllocationLength  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
 	uint16_t BytesTransferred  = MIN(AllocationLength, sizeof(InquiryData));
 
+	/* Vital product data pages are requested with the EVPD bit */
+	if (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] == (1 << 0))
+	  return SCSI_Command_Inquiry_VPD(MSInterfaceInfo);
+
 	/* Only the standard INQUIRY data is supported, check if any optional INQUIRY bits set */
 	if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & ((1 << 0) | (1 << 1))) ||
 	     MSInterfaceInfo->State.CommandBlock.SCSICommandData[2])
@@ -187,6 +315,79 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
 	return true;
 }
 
+/** Command processing for an issued SCSI INQUIRY command with the EVPD bit set. This command returns one of the vital
+ *  product data pages, the Block Limits and Logical Block Provisioning pages telling the host how to issue UNMAP
+ *  commands to the device.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Inquiry_VPD(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
+	uint8_t  PageCode         = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2];
+	uint8_t  PageData[4 + 0x3C] = { DEVICE_TYPE_BLOCK, PageCode };
+	uint8_t  PageLength;
+	uint16_t BytesTransferred;
+
+	switch (PageCode)
+	{
+		case VPD_PAGE_SUPPORTED_PAGES:
+			PageData[4] = VPD_PAGE_SUPPORTED_PAGES;
+			PageData[5] = VPD_PAGE_BLOCK_LIMITS;
+			PageData[6] = VPD_PAGE_LOGICAL_BLOCK_PROVISIONING;
+			PageLength  = 3;
+			break;
+		case VPD_PAGE_BLOCK_LIMITS:
+			PageLength  = 0x3C;
+
+			if (Unmap_IsSupported())
+			{
+				uint32_t Granularity = Unmap_GetGranularity();
+				uint32_t Alignment   = 0;
+				uint32_t Run;
+
+				/* The image of a file-backed LUN does not necessarily start on an erase unit boundary */
+				if (!(RawStorage))
+				  Alignment = (Granularity - (Mapped_LookupBlock(0, &Run) % Granularity)) % Granularity;
+
+				*(uint32_t*)&PageData[20] = SwapEndian_32(UNMAP_MAX_BLOCKS);
+				*(uint32_t*)&PageData[24] = SwapEndian_32(UNMAP_MAX_DESCRIPTORS);
+				*(uint32_t*)&PageData[28] = SwapEndian_32(Granularity);
+				*(uint32_t*)&PageData[32] = SwapEndian_32(Alignment | (1UL << 31));
+			}
+			break;
+		case VPD_PAGE_LOGICAL_BLOCK_PROVISIONING:
+			PageData[5] = (Unmap_IsSupported() ? VPD_LBP_LBPU : 0);
+			PageLength  = 4;
+			break;
+		default:
+			/* Unsupported page requested - update the SENSE key and fail the request */
+			SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+			               SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+			               SCSI_ASENSEQ_NO_QUALIFIER);
+
+			return false;
+	}
+
+	PageData[3]      = PageLength;
+	BytesTransferred = MIN(AllocationLength, (uint16_t)(4 + PageLength));
+
+	Endpoint_Write_Stream_LE(PageData, BytesTransferred, NULL);
+
+	/* Pad out remaining bytes with 0x00 */
+	Endpoint_Null_Stream((AllocationLength - BytesTransferred), NULL);
+
+	/* Finalize the stream transfer to send the last packet */
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+	return true;
+}
+
 /** Command processing for an issued SCSI REQUEST SENSE command. This command returns information about the last issued command,
  *  including the error code and additional error information so that the host can determine why a command failed to complete.
  *
@@ -231,6 +432,43 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
 	return true;
 }
 
+/** Command processing for an issued SCSI READ CAPACITY (16) command. This command returns the same information as the
+ *  READ CAPACITY (10) command, along with the LBPME flag telling the host whether it may UNMAP blocks of the LUN.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint32_t AllocationLength = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[10]);
+	uint8_t  CapacityData[32] = { 0 };
+	uint8_t  BytesTransferred = MIN(AllocationLength, sizeof(CapacityData));
+
+	/* READ CAPACITY (16) is the only supported SERVICE ACTION IN (16) command */
+	if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & 0x1F) != SCSI_SAI_READ_CAPACITY_16)
+	{
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_INVALID_COMMAND,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* 64-bit last block address followed by the block size, both big-endian */
+	*(uint32_t*)&CapacityData[4]  = SwapEndian_32(LUN_MEDIA_BLOCKS - 1);
+	*(uint32_t*)&CapacityData[8]  = SwapEndian_32(VIRTUAL_MEMORY_BLOCK_SIZE);
+	CapacityData[14]              = (Unmap_IsSupported() ? READ_CAPACITY_16_LBPME : 0);
+
+	Endpoint_Write_Stream_LE(CapacityData, BytesTransferred, NULL);
+	Endpoint_ClearIN();
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+	return true;
+}
+
 /** Command processing for an issued SCSI SEND DIAGNOSTIC command. This command performs a quick check of the Dataflash ICs on the
  *  board, and indicates if they are present and functioning correctly. Only the Self-Test portion of the diagnostic command is
  *  supported.
@@ -276,14 +514,16 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
  *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
  *  \param[in] BlockAddress  Data block starting address for the read sequence
  *  \param[in] TotalBlocks   Number of blocks of data to read
+ *
+ *  \return Boolean \c false if a block could not be read from the image, \c true otherwise
  */
-void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+bool Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	uint32_t BlockAddress,
 	uint16_t TotalBlocks)
 {
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-		return;
+		return true;
 
 	while (TotalBlocks)
 	{
@@ -291,15 +531,11 @@ void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 		uint16_t BytesInBlockDiv16 = 0; // TODO
 		UINT reads;
 
-		if (RawStorage == 0)
-		{
-			f_lseek(&MassStorage_Loopback, VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress); // ERROR check
-			f_read(&MassStorage_Loopback, buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &reads);
-		}
-		else
-		{
-			mmc_disk_read(buffer, BlockAddress, 1);
-		}
+		/* Stop at a block the image failed to deliver, sending the blocks read so far */
+		if ((f_lseek(&MassStorage_Loopback, (FSIZE_t)VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress) != FR_OK) ||
+		    (f_read(&MassStorage_Loopback, buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &reads) != FR_OK) ||
+		    (reads != VIRTUAL_MEMORY_BLOCK_SIZE))
+		  break;
 
 		/* Read an endpoint packet sized data block from the Dataflash */
 		while (BytesInBlockDiv16 < VIRTUAL_MEMORY_BLOCK_SIZE)
@@ -313,7 +549,7 @@ void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 				/* Wait until the endpoint is ready for more data */
 				if (Endpoint_WaitUntilReady())
-					return;
+					return true;
 			}
 
 			/* Read one 16-byte chunk of data from the Dataflash */
@@ -324,7 +560,7 @@ void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 			/* Check if the current command is being aborted by the host */
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-				return;
+				return true;
 #else
 			uint16_t BytesProcessed = 0;
 			uint8_t  ErrorCode;
@@ -339,13 +575,13 @@ void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 					/* Wait until the host has sent another packet */
 					if (Endpoint_WaitUntilReady())
-						return;
+						return true;
 				}
 
 				ErrorCode = Endpoint_Write_Stream_LE(buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesProcessed);
 				/* Check if the current command is being aborted by the host */
 				if (MSInterfaceInfo->State.IsMassStoreReset)
-					return;
+					return true;
 			} while (ErrorCode == ENDPOINT_RWSTREAM_IncompleteTransfer);
 
 			BytesInBlockDiv16 += VIRTUAL_MEMORY_BLOCK_SIZE;
@@ -359,15 +595,25 @@ void Loopback_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	/* If the endpoint is full, send its contents to the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 		Endpoint_ClearIN();
+
+	return (TotalBlocks == 0);
 }
 
-void Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+/** Writes blocks from the pre-selected data OUT endpoint to the image file of the LUN through FatFs.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] BlockAddress  Data block starting address for the write sequence
+ *  \param[in] TotalBlocks   Number of blocks of data to write
+ *
+ *  \return Boolean \c false if a block could not be written to the image, \c true otherwise
+ */
+bool Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	uint32_t BlockAddress,
 	uint16_t TotalBlocks)
 {
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-		return;
+		return true;
 
 	while (TotalBlocks)
 	{
@@ -387,7 +633,7 @@ void Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 				/* Wait until the host has sent another packet */
 				if (Endpoint_WaitUntilReady())
-					return;
+					return true;
 			}
 
 			for (uint8_t i = 0; i < 16; i++)
@@ -397,7 +643,7 @@ void Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 			/* Check if the current command is being aborted by the host */
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-				return;
+				return true;
 #else
 			uint16_t BytesProcessed = 0;
 			uint8_t  ErrorCode;
@@ -412,28 +658,24 @@ void Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 					/* Wait until the host has sent another packet */
 					if (Endpoint_WaitUntilReady())
-						return;
+						return true;
 				}
 
 				ErrorCode = Endpoint_Read_Stream_LE(buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesProcessed);
 				/* Check if the current command is being aborted by the host */
 				if (MSInterfaceInfo->State.IsMassStoreReset)
-					return;
+					return true;
 			} while (ErrorCode == ENDPOINT_RWSTREAM_IncompleteTransfer);
 
 			BytesInBlockDiv16 += VIRTUAL_MEMORY_BLOCK_SIZE;
 #endif
 		}
 
-		if (RawStorage == 0)
-		{
-			f_lseek(&MassStorage_Loopback, VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress); // ERROR check
-			f_write(&MassStorage_Loopback, buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &written);
-		}
-		else
-		{
-			mmc_disk_write(buffer, BlockAddress, 1);
-		}
+		/* Stop at a block the image failed to take */
+		if ((f_lseek(&MassStorage_Loopback, (FSIZE_t)VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress) != FR_OK) ||
+		    (f_write(&MassStorage_Loopback, buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &written) != FR_OK) ||
+		    (written != VIRTUAL_MEMORY_BLOCK_SIZE))
+		  break;
 
 		/* Decrement the blocks remaining counter */
 		BlockAddress++;
@@ -443,88 +685,1220 @@ void Loopback_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	/* If the endpoint is empty, clear it ready for the next packet from the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 		Endpoint_ClearOUT();
+
+	return (TotalBlocks == 0);
 }
 
 
-/** Command processing for an issued SCSI READ (10) or WRITE (10) command. This command reads in the block start address
- *  and total number of blocks to process, then calls the appropriate low-level Dataflash routine to handle the actual
- *  reading and writing of the data.
+#if defined(RAW_ZERO_COPY)
+/** Reads blocks from the raw card into the pre-selected data IN endpoint, from the multiple block transaction opened
+ *  by the caller. Each byte is moved from the SPI data register straight into the endpoint FIFO one endpoint packet
+ *  at a time, so no sector buffer is needed.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
- *  \param[in] IsDataRead  Indicates if the command is a READ (10) command or WRITE (10) command (DATA_READ or DATA_WRITE)
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] TotalBlocks   Number of blocks of data to read
  *
- *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ *  \return Boolean \c false if a block could not be read from the card or the transfer was aborted, \c true otherwise
  */
-static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
-                                      const bool IsDataRead)
+static bool Raw_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint16_t TotalBlocks)
 {
-	uint32_t BlockAddress;
-	uint16_t TotalBlocks;
+	/* Wait until endpoint is ready before continuing */
+	if (Endpoint_WaitUntilReady())
+		return false;
 
-	/* Check if the disk is write protected or not */
-	if ((IsDataRead == DATA_WRITE) && DISK_READ_ONLY)
+	while (TotalBlocks)
 	{
-		/* Block address is invalid, update SENSE key and return command fail */
-		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
-		               SCSI_ASENSE_WRITE_PROTECTED,
-		               SCSI_ASENSEQ_NO_QUALIFIER);
+		/* Stop at a block the card failed to deliver, sending the blocks read so far */
+		if (mmc_stream_read_start() != RES_OK)
+		  break;
 
-		return false;
+		for (uint16_t BytesInBlock = 0; BytesInBlock < VIRTUAL_MEMORY_BLOCK_SIZE; BytesInBlock += MASS_STORAGE_IO_EPSIZE)
+		{
+			/* Check if the endpoint is currently full */
+			if (!(Endpoint_IsReadWriteAllowed()))
+			{
+				/* Clear the endpoint bank to send its contents to the host */
+				Endpoint_ClearIN();
+
+				/* Wait until the endpoint is ready for more data */
+				if (Endpoint_WaitUntilReady())
+					return false;
+			}
+
+			/* Clock one endpoint packet from the card straight into the endpoint FIFO */
+			mmc_stream_read_fifo(MASS_STORAGE_IO_EPSIZE, &UEDATX);
+
+			/* Check if the current command is being aborted by the host */
+			if (MSInterfaceInfo->State.IsMassStoreReset)
+				return false;
+		}
+
+		if (mmc_stream_read_finish() != RES_OK)
+		  break;
+
+		TotalBlocks--;
 	}
 
-	/* Load in the 32-bit block address (SCSI uses big-endian, so have to reverse the byte order) */
-	BlockAddress = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2]);
+	/* If the endpoint is full, send its contents to the host */
+	if (!(Endpoint_IsReadWriteAllowed()))
+		Endpoint_ClearIN();
 
-	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
-	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	return (TotalBlocks == 0);
+}
+#else
+/** Reads blocks from the raw card into the pre-selected data IN endpoint, from the multiple block transaction opened
+ *  by the caller. Two sector buffers are used in turn: while one of them is handed to the endpoint FIFO, the next
+ *  sector is clocked into the other one, so that each SPI byte transfer overlaps with an endpoint FIFO access.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] TotalBlocks   Number of blocks of data to read
+ *
+ *  \return Boolean \c false if a block could not be read from the card or the transfer was aborted, \c true otherwise
+ */
+static bool Raw_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint16_t TotalBlocks)
+{
+	uint8_t buffer[2][VIRTUAL_MEMORY_BLOCK_SIZE];
+	uint8_t Current = 0;
 
-	/* Check if the block address is outside the maximum allowable value for the LUN */
-	if (BlockAddress >= LUN_MEDIA_BLOCKS)
-	{
-		/* Block address is invalid, update SENSE key and return command fail */
-		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
-		               SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
-		               SCSI_ASENSEQ_NO_QUALIFIER);
+	/* Wait until endpoint is ready before continuing */
+	if (Endpoint_WaitUntilReady())
+		return false;
 
+	/* Prime the pipeline with the first sector */
+	if (TotalBlocks && (mmc_stream_read(buffer[Current]) != RES_OK))
 		return false;
+
+	while (TotalBlocks)
+	{
+		uint8_t* Drain     = buffer[Current];
+		uint8_t* Fill      = buffer[Current ^ 1];
+		bool     FetchNext = (TotalBlocks > 1);
+
+		/* Stop at a block the card failed to deliver, sending the blocks read so far */
+		if (FetchNext && (mmc_stream_read_start() != RES_OK))
+			break;
+
+		for (uint16_t BytesInBlock = 0; BytesInBlock < VIRTUAL_MEMORY_BLOCK_SIZE; BytesInBlock += MASS_STORAGE_IO_EPSIZE)
+		{
+			/* Check if the endpoint is currently full */
+			if (!(Endpoint_IsReadWriteAllowed()))
+			{
+				/* Clear the endpoint bank to send its contents to the host */
+				Endpoint_ClearIN();
+
+				/* Wait until the endpoint is ready for more data */
+				if (Endpoint_WaitUntilReady())
+					return false;
+			}
+
+			/* Hand one endpoint packet of the current sector over while the next sector is clocked in */
+			if (FetchNext)
+				mmc_stream_read_part(&Fill[BytesInBlock], MASS_STORAGE_IO_EPSIZE, &Drain[BytesInBlock], &UEDATX);
+			else
+				Endpoint_Write_Stream_LE(&Drain[BytesInBlock], MASS_STORAGE_IO_EPSIZE, NULL);
+
+			/* Check if the current command is being aborted by the host */
+			if (MSInterfaceInfo->State.IsMassStoreReset)
+				return false;
+		}
+
+		if (FetchNext && (mmc_stream_read_finish() != RES_OK))
+			break;
+
+		Current ^= 1;
+		TotalBlocks--;
 	}
 
-	#if (TOTAL_LUNS > 1)
-	/* Adjust the given block address to the real media address based on the selected LUN */
-	BlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
-	#endif
+	/* If the endpoint is full, send its contents to the host */
+	if (!(Endpoint_IsReadWriteAllowed()))
+		Endpoint_ClearIN();
 
-	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
-	if (IsDataRead == DATA_READ)
-	  Loopback_ReadBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
-	else
-	  Loopback_WriteBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	return (TotalBlocks == 0);
+}
+#endif
 
-	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+/** Completes the data packet of the sector being programmed when a write is cut short, from the part of the sector
+ *  still held in the buffer, so that the card never programs a sector the host has not fully sent.
+ *
+ *  \param[in] Data    Remaining part of the sector being programmed
+ *  \param[in] Length  Number of bytes remaining in the data packet
+ */
+static void Raw_CompleteWrite(const uint8_t* Data,
+	uint16_t Length)
+{
+	if (Length)
+	  mmc_stream_write_part(Data, Length, NULL, NULL);
 
-	return true;
+	mmc_stream_write_finish();
 }
 
-/** Command processing for an issued SCSI MODE SENSE (6) command. This command returns various informational pages about
- *  the SCSI device, as well as the device's Write Protect status.
+/** Writes blocks to the raw card from the pre-selected data OUT endpoint, into the multiple block transaction opened
+ *  by the caller. A sector is only started on the card once the host has sent all of it: while the previous sector
+ *  is clocked out to the card from the sector buffer, the next sector is taken out of the endpoint FIFO into the same
+ *  buffer, each byte replacing one already sent. If the host stops sending, the sector on the card is completed from
+ *  the rest of the buffer and the partly received one is dropped.
  *
- *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] TotalBlocks   Number of blocks of data to write
  *
- *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ *  \return Boolean \c false if a block could not be written to the card or the transfer was aborted, \c true otherwise
  */
-static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool Raw_WriteBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint16_t TotalBlocks)
 {
-	/* Send an empty header response with the Write Protect flag status */
-	Endpoint_Write_8(0x00);
-	Endpoint_Write_8(0x00);
-	Endpoint_Write_8(DISK_READ_ONLY ? 0x80 : 0x00);
-	Endpoint_Write_8(0x00);
-	Endpoint_ClearIN();
+	uint8_t buffer[VIRTUAL_MEMORY_BLOCK_SIZE];
+	bool    Pending = false;
 
-	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= 4;
+	/* Wait until endpoint is ready before continuing */
+	if (Endpoint_WaitUntilReady())
+		return false;
 
-	return true;
-}
+	while (TotalBlocks)
+	{
+		/* Stop at a block the card is not ready to take */
+		if (Pending && (mmc_stream_write_start() != RES_OK))
+			break;
 
+		for (uint16_t BytesInBlock = 0; BytesInBlock < VIRTUAL_MEMORY_BLOCK_SIZE; BytesInBlock += MASS_STORAGE_IO_EPSIZE)
+		{
+			/* Check if the endpoint is currently empty */
+			if (!(Endpoint_IsReadWriteAllowed()))
+			{
+				/* Clear the current endpoint bank */
+				Endpoint_ClearOUT();
+
+				/* Wait until the host has sent another packet */
+				if (Endpoint_WaitUntilReady())
+				{
+					if (Pending)
+					  Raw_CompleteWrite(&buffer[BytesInBlock], VIRTUAL_MEMORY_BLOCK_SIZE - BytesInBlock);
+
+					return false;
+				}
+			}
+
+			/* Take one endpoint packet of the next sector in while the previous sector is clocked out */
+			if (Pending)
+				mmc_stream_write_part(&buffer[BytesInBlock], MASS_STORAGE_IO_EPSIZE, &buffer[BytesInBlock], &UEDATX);
+			else
+				Endpoint_Read_Stream_LE(&buffer[BytesInBlock], MASS_STORAGE_IO_EPSIZE, NULL);
+
+			/* Check if the current command is being aborted by the host */
+			if (MSInterfaceInfo->State.IsMassStoreReset)
+			{
+				if (Pending)
+				  Raw_CompleteWrite(&buffer[BytesInBlock + MASS_STORAGE_IO_EPSIZE],
+				                    VIRTUAL_MEMORY_BLOCK_SIZE - MASS_STORAGE_IO_EPSIZE - BytesInBlock);
+
+				return false;
+			}
+		}
+
+		/* Stop at a block the card rejected */
+		if (Pending && (mmc_stream_write_finish() != RES_OK))
+			break;
+
+		Pending = true;
+		TotalBlocks--;
+	}
+
+	/* If the endpoint is empty, clear it ready for the next packet from the host */
+	if (!(Endpoint_IsReadWriteAllowed()))
+		Endpoint_ClearOUT();
+
+	if (TotalBlocks)
+		return false;
+
+	/* Program the last sector, there is nothing left to overlap it with */
+	return (!(Pending) || (mmc_stream_write(buffer) == RES_OK));
+}
+
+/** Transfers blocks between the host and a run of consecutive card sectors, with a single multiple block transaction
+ *  spanning the whole run. The transaction is left suspended afterwards, so that a following command picking up at
+ *  the next sector in the same direction continues it without a new card command.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] Sector       Card sector of the first block
+ *  \param[in] TotalBlocks  Number of blocks of data to transfer
+ *  \param[in] IsDataRead   Indicates if the data is to be read or written (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c false if the card failed the transfer, \c true otherwise
+ */
+static bool Raw_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint32_t Sector,
+	uint16_t TotalBlocks,
+	const bool IsDataRead)
+{
+	bool Success = true;
+
+	if (IsDataRead == DATA_READ)
+	{
+		if (TotalBlocks)
+		  Success = (mmc_stream_read_open(Sector) == RES_OK);
+
+		if (Success)
+		  Success = Raw_ReadBlocks(MSInterfaceInfo, TotalBlocks);
+	}
+	else
+	{
+		if (TotalBlocks)
+		  Success = (mmc_stream_write_open(Sector, TotalBlocks) == RES_OK);
+
+		if (Success)
+		  Success = Raw_WriteBlocks(MSInterfaceInfo, TotalBlocks);
+	}
+
+	mmc_stream_suspend();
+
+	return Success;
+}
+
+/** Translates a block address of the file-backed LUN to the card sector holding it, from the cluster link map table
+ *  built for the image when it was opened.
+ *
+ *  \param[in]  BlockAddress  Block address within the image
+ *  \param[out] Run           Number of blocks stored contiguously on the card from the returned sector onwards
+ *
+ *  \return Card sector of the block, or 0 if the block lies outside the image
+ */
+static uint32_t Mapped_LookupBlock(uint32_t BlockAddress,
+	uint32_t* const Run)
+{
+	FATFS*   fs      = MassStorage_Loopback.obj.fs;
+	DWORD*   tbl     = MassStorage_Loopback.cltbl + 1;
+	uint32_t Cluster = BlockAddress / fs->csize;
+	uint16_t Offset  = BlockAddress % fs->csize;
+	DWORD    ncl, tcl;
+
+	/* Walk the (length, top cluster) pairs of the image fragments */
+	while ((ncl = *tbl++) != 0)
+	{
+		tcl = *tbl++;
+
+		if (Cluster < ncl)
+		{
+			*Run = (ncl - Cluster) * fs->csize - Offset;
+			return fs->database + (tcl + Cluster - 2) * fs->csize + Offset;
+		}
+
+		Cluster -= ncl;
+	}
+
+	return 0;
+}
+
+/** Transfers blocks between the host and the file-backed LUN without going through FatFs. Each contiguous fragment
+ *  of the image is resolved to card sectors from its cluster link map and accessed the same way as the raw LUN.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] BlockAddress Data block starting address within the image
+ *  \param[in] TotalBlocks  Number of blocks of data to transfer
+ *  \param[in] IsDataRead   Indicates if the data is to be read or written (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c false if the card failed the transfer or a block lies outside the image, \c true otherwise
+ */
+static bool Mapped_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint32_t BlockAddress,
+	uint16_t TotalBlocks,
+	const bool IsDataRead)
+{
+	while (TotalBlocks && !(MSInterfaceInfo->State.IsMassStoreReset))
+	{
+		uint32_t Run;
+		uint32_t Sector = Mapped_LookupBlock(BlockAddress, &Run);
+
+		if (!(Sector))
+			return false;
+
+		if (Run > TotalBlocks)
+			Run = TotalBlocks;
+
+		if (!(Raw_TransferBlocks(MSInterfaceInfo, Sector, Run, IsDataRead)))
+			return false;
+
+		BlockAddress += Run;
+		TotalBlocks  -= Run;
+	}
+
+	return true;
+}
+
+/** Transfers blocks between the host and the storage medium of the LUN, with the access method selected at startup:
+ *  the raw card, the image file through its cluster link map, or the image file through FatFs.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] BlockAddress Data block starting address for the transfer
+ *  \param[in] TotalBlocks  Number of blocks of data to transfer
+ *  \param[in] IsDataRead   Indicates if the data is to be read or written (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c false if the medium failed the transfer, \c true otherwise
+ */
+static bool Media_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint32_t BlockAddress,
+	uint16_t TotalBlocks,
+	const bool IsDataRead)
+{
+	if (RawStorage)
+	  return Raw_TransferBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks, IsDataRead);
+	else if (MassStorage_Loopback.cltbl)
+	  return Mapped_TransferBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks, IsDataRead);
+	else if (IsDataRead == DATA_READ)
+	  return Loopback_ReadBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	else
+	  return Loopback_WriteBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+}
+
+/** Writes a single block held in RAM to the storage medium of the LUN.
+ *
+ *  \param[in] BlockAddress  Address of the block to write
+ *  \param[in] Buffer        Block data to write
+ *
+ *  \return Boolean \c true if the block was written, \c false otherwise
+ */
+static bool Media_WriteBlock(uint32_t BlockAddress,
+	const uint8_t* Buffer)
+{
+	uint32_t Run;
+	UINT     BytesWritten;
+
+	if (RawStorage)
+	  return (mmc_disk_write(Buffer, BlockAddress, 1) == RES_OK);
+
+	if (MassStorage_Loopback.cltbl)
+	{
+		uint32_t Sector = Mapped_LookupBlock(BlockAddress, &Run);
+
+		return (Sector && (mmc_disk_write(Buffer, Sector, 1) == RES_OK));
+	}
+
+	return ((f_lseek(&MassStorage_Loopback, (FSIZE_t)VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress) == FR_OK) &&
+	        (f_write(&MassStorage_Loopback, Buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesWritten) == FR_OK) &&
+	        (BytesWritten == VIRTUAL_MEMORY_BLOCK_SIZE));
+}
+
+#if defined(READ_AHEAD_BLOCKS)
+/** Reads a single block of the storage medium of the LUN into RAM.
+ *
+ *  \param[in]  BlockAddress  Address of the block to read
+ *  \param[out] Buffer        Buffer for the block data
+ *
+ *  \return Boolean \c true if the block was read, \c false otherwise
+ */
+static bool Media_ReadBlock(uint32_t BlockAddress,
+	uint8_t* Buffer)
+{
+	uint32_t Sector = BlockAddress;
+	uint32_t Run;
+	UINT     BytesRead;
+	bool     Success;
+
+	if (!(RawStorage))
+	{
+		if (!(MassStorage_Loopback.cltbl))
+		{
+			return ((f_lseek(&MassStorage_Loopback, (FSIZE_t)VIRTUAL_MEMORY_BLOCK_SIZE * BlockAddress) == FR_OK) &&
+			        (f_read(&MassStorage_Loopback, Buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesRead) == FR_OK) &&
+			        (BytesRead == VIRTUAL_MEMORY_BLOCK_SIZE));
+		}
+
+		if (!(Sector = Mapped_LookupBlock(BlockAddress, &Run)))
+		  return false;
+	}
+
+	/* Go on with the multiple block transaction the last READ (10) left suspended, so that the next one can too */
+	Success = ((mmc_stream_read_open(Sector) == RES_OK) && (mmc_stream_read(Buffer) == RES_OK));
+	mmc_stream_suspend();
+
+	return Success;
+}
+#endif
+
+/** Commits the blocks written to the storage medium of the LUN. The FatFs access method holds written data back in
+ *  the file sector buffer, the other ones in a suspended multiple block write transaction. A write transaction which
+ *  failed when it was closed earlier on is reported here, unless it has already been reported to the host.
+ *
+ *  \return Boolean \c true if the written blocks are on the card, \c false otherwise
+ */
+static bool Media_Sync(void)
+{
+	if (RawStorage || MassStorage_Loopback.cltbl)
+	{
+		mmc_stream_close();
+
+		return (mmc_stream_error() == RES_OK);
+	}
+
+	return (f_sync(&MassStorage_Loopback) == FR_OK);
+}
+
+#if defined(WRITE_CACHE_SETS)
+/** Looks up a block in the write-back sector cache.
+ *
+ *  \param[in] BlockAddress  Address of the block to look up
+ *
+ *  \return Pointer to the cache line holding the block, or NULL if the block is not cached
+ */
+static Cache_Line_t* Cache_FindLine(uint32_t BlockAddress)
+{
+	Cache_Line_t* Line = CacheLines[BlockAddress % WRITE_CACHE_SETS];
+
+	for (uint8_t Way = 0; Way < WRITE_CACHE_WAYS; Way++, Line++)
+	{
+		if ((Line->Flags & CACHE_LINE_VALID) && (Line->BlockAddress == BlockAddress))
+		  return Line;
+	}
+
+	return NULL;
+}
+
+/** Writes a cached sector back to the medium if it has been modified.
+ *
+ *  \param[in] Line  Cache line to write back
+ *
+ *  \return Boolean \c true if the medium holds the cached sector, \c false otherwise
+ */
+static bool Cache_FlushLine(Cache_Line_t* const Line)
+{
+	if (!(Line->Flags & CACHE_LINE_DIRTY))
+	  return true;
+
+	if (!(Media_WriteBlock(Line->BlockAddress, Line->Data)))
+	  return false;
+
+	Line->Flags &= ~CACHE_LINE_DIRTY;
+
+	return true;
+}
+
+/** Selects the cache line of a block's set to be reused for the block. A free line is taken first, then the least
+ *  recently used clean one, and only then the least recently used dirty one.
+ *
+ *  \param[in] BlockAddress  Address of the block to cache
+ *
+ *  \return Pointer to the cache line to reuse
+ */
+static Cache_Line_t* Cache_SelectVictim(uint32_t BlockAddress)
+{
+	Cache_Line_t* Way  = CacheLines[BlockAddress % WRITE_CACHE_SETS];
+	Cache_Line_t* Line = Way;
+
+	for (uint8_t i = 0; i < WRITE_CACHE_WAYS; i++, Way++)
+	{
+		bool WayDirty  = (Way->Flags & CACHE_LINE_DIRTY);
+		bool LineDirty = (Line->Flags & CACHE_LINE_DIRTY);
+
+		if (!(Way->Flags & CACHE_LINE_VALID))
+		{
+			Line = Way;
+			break;
+		}
+
+		if ((LineDirty && !(WayDirty)) ||
+		    ((LineDirty == WayDirty) && ((uint16_t)(CacheClock - Way->Stamp) > (uint16_t)(CacheClock - Line->Stamp))))
+		{
+			Line = Way;
+		}
+	}
+
+	return Line;
+}
+
+/** Returns the cache line holding a block, claiming one for it if it is not cached yet. A dirty line claimed for the
+ *  block is written back to the medium before being reused.
+ *
+ *  \param[in] BlockAddress  Address of the block to cache
+ *
+ *  \return Pointer to the cache line assigned to the block, or \c NULL if the dirty line could not be written back
+ */
+static Cache_Line_t* Cache_AllocateLine(uint32_t BlockAddress)
+{
+	Cache_Line_t* Line = Cache_FindLine(BlockAddress);
+
+	if (Line)
+	  return Line;
+
+	Line = Cache_SelectVictim(BlockAddress);
+
+	/* Keep the evicted sector dirty in its line if it cannot be written back, rather than dropping it */
+	if (!(Cache_FlushLine(Line)))
+	  return NULL;
+
+	Line->BlockAddress = BlockAddress;
+	Line->Flags        = CACHE_LINE_VALID;
+
+	return Line;
+}
+
+/** Drops the cached copies of a range of blocks, when they are about to be overwritten on the medium directly.
+ *
+ *  \param[in] BlockAddress  Address of the first block of the range
+ *  \param[in] TotalBlocks   Number of blocks in the range
+ */
+static void Cache_Invalidate(uint32_t BlockAddress,
+	uint32_t TotalBlocks)
+{
+	Cache_Line_t* Line = &CacheLines[0][0];
+
+	for (uint8_t i = 0; i < (WRITE_CACHE_SETS * WRITE_CACHE_WAYS); i++, Line++)
+	{
+		if ((Line->Flags & CACHE_LINE_VALID) && ((Line->BlockAddress - BlockAddress) < TotalBlocks))
+		  Line->Flags = 0;
+	}
+}
+
+#if defined(READ_AHEAD_BLOCKS)
+/** Fetches a block of the medium into the sector cache ahead of a sequential read stream. Only free or clean cache
+ *  lines are used, pending writes are never evicted for data the host may not ask for.
+ *
+ *  \param[in] BlockAddress  Address of the block to fetch
+ *
+ *  \return Boolean \c true if the block is now cached, \c false otherwise
+ */
+static bool Cache_ReadAhead(uint32_t BlockAddress)
+{
+	Cache_Line_t* Line;
+
+	if (Cache_FindLine(BlockAddress))
+	  return true;
+
+	Line = Cache_SelectVictim(BlockAddress);
+	if (Line->Flags & CACHE_LINE_DIRTY)
+	  return false;
+
+	Line->Flags = 0;
+	if (!(Media_ReadBlock(BlockAddress, Line->Data)))
+	  return false;
+
+	Line->BlockAddress = BlockAddress;
+	Line->Stamp        = ++CacheClock;
+	Line->Flags        = CACHE_LINE_VALID;
+
+	return true;
+}
+#endif
+
+/** Writes back all dirty sectors of the write-back sector cache, then commits them to the card.
+ *
+ *  \return Boolean \c true if all cached sectors are on the card, \c false otherwise
+ */
+static bool Cache_Flush(void)
+{
+	Cache_Line_t* Line    = &CacheLines[0][0];
+	bool          Success = true;
+
+	for (uint8_t i = 0; i < (WRITE_CACHE_SETS * WRITE_CACHE_WAYS); i++, Line++)
+	  Success &= Cache_FlushLine(Line);
+
+	Success &= Media_Sync();
+
+	CacheDirty = !(Success);
+
+	return Success;
+}
+
+/** Writes back the first dirty sector of the write-back sector cache, or commits the written sectors to the card once
+ *  none is left. This lets the cache be written back a sector at a time, with the host commands served in between.
+ *
+ *  \return Boolean \c true if the step succeeded, \c false otherwise
+ */
+static bool Cache_FlushNext(void)
+{
+	Cache_Line_t* Line = &CacheLines[0][0];
+
+	for (uint8_t i = 0; i < (WRITE_CACHE_SETS * WRITE_CACHE_WAYS); i++, Line++)
+	{
+		if (Line->Flags & CACHE_LINE_DIRTY)
+		  return Cache_FlushLine(Line);
+	}
+
+	CacheDirty = !(Media_Sync());
+
+	/* No command is waiting on the commit, the next one reports its failure to the host */
+	if (CacheDirty)
+	  WriteFailed = true;
+
+	return !(CacheDirty);
+}
+
+/** Transfers a cached sector between the host and RAM through the pre-selected data endpoint.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] Line        Cache line holding the sector
+ *  \param[in] IsDataRead  Indicates if the data is to be read or written (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c true if the whole sector was transferred, \c false if the host aborted the command part way
+ */
+static bool Cache_TransferLine(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	Cache_Line_t* const Line,
+	const bool IsDataRead)
+{
+	/* Wait until endpoint is ready before continuing */
+	if (Endpoint_WaitUntilReady())
+		return false;
+
+	for (uint16_t BytesInBlock = 0; BytesInBlock < VIRTUAL_MEMORY_BLOCK_SIZE; BytesInBlock += MASS_STORAGE_IO_EPSIZE)
+	{
+		/* Check if the endpoint bank is done with */
+		if (!(Endpoint_IsReadWriteAllowed()))
+		{
+			/* Send the full bank to the host, or release the empty one */
+			if (IsDataRead == DATA_READ)
+			  Endpoint_ClearIN();
+			else
+			  Endpoint_ClearOUT();
+
+			/* Wait until the endpoint is ready for more data */
+			if (Endpoint_WaitUntilReady())
+				return false;
+		}
+
+		if (IsDataRead == DATA_READ)
+		  Endpoint_Write_Stream_LE(&Line->Data[BytesInBlock], MASS_STORAGE_IO_EPSIZE, NULL);
+		else
+		  Endpoint_Read_Stream_LE(&Line->Data[BytesInBlock], MASS_STORAGE_IO_EPSIZE, NULL);
+
+		/* Check if the current command is being aborted by the host */
+		if (MSInterfaceInfo->State.IsMassStoreReset)
+			return false;
+	}
+
+	/* Hand the endpoint bank over if it is done with */
+	if (!(Endpoint_IsReadWriteAllowed()))
+	{
+		if (IsDataRead == DATA_READ)
+		  Endpoint_ClearIN();
+		else
+		  Endpoint_ClearOUT();
+	}
+
+	return true;
+}
+
+/** Transfers blocks between the host and the storage medium through the write-back sector cache. Writes of up to
+ *  \ref WRITE_CACHE_SETS blocks, such as the file system metadata updates, are coalesced in RAM, longer ones are streamed
+ *  to the medium directly. Reads are served from RAM for the cached blocks, and from the medium for runs of uncached
+ *  blocks in between.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] BlockAddress Data block starting address for the transfer
+ *  \param[in] TotalBlocks  Number of blocks of data to transfer
+ *  \param[in] IsDataRead   Indicates if the data is to be read or written (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c false if the medium failed the transfer, \c true otherwise
+ */
+static bool Cache_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+	uint32_t BlockAddress,
+	uint16_t TotalBlocks,
+	const bool IsDataRead)
+{
+	#if defined(READ_AHEAD_BLOCKS)
+	/* A read starting where the previous one ended is part of a sequential stream, fetch what follows it while the
+	   host is busy with the status and next command. Any other command ends the stream. */
+	ReadAheadLeft = 0;
+	if (IsDataRead == DATA_READ)
+	{
+		if (BlockAddress == ReadStreamEnd)
+		  ReadAheadLeft = READ_AHEAD_BLOCKS;
+
+		ReadStreamEnd  = BlockAddress + TotalBlocks;
+		ReadAheadBlock = ReadStreamEnd;
+	}
+	else
+	{
+		ReadStreamEnd = UINT32_MAX;
+	}
+	#endif
+
+	if ((IsDataRead == DATA_WRITE) && (TotalBlocks > WRITE_CACHE_SETS))
+	{
+		/* Long write, any cached copy of the blocks is superseded */
+		Cache_Invalidate(BlockAddress, TotalBlocks);
+		return Media_TransferBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks, DATA_WRITE);
+	}
+
+	while (TotalBlocks && !(MSInterfaceInfo->State.IsMassStoreReset))
+	{
+		Cache_Line_t* Line = (IsDataRead == DATA_READ) ? Cache_FindLine(BlockAddress) : Cache_AllocateLine(BlockAddress);
+		uint16_t      Run  = 1;
+
+		/* No line could be freed for the written block, the medium failed to take the sector held in it */
+		if (!(Line) && (IsDataRead == DATA_WRITE))
+		  return false;
+
+		if (Line)
+		{
+			Line->Stamp = ++CacheClock;
+
+			if (!(Cache_TransferLine(MSInterfaceInfo, Line, IsDataRead)))
+			{
+				/* A sector only partly received from the host is neither the old nor the new data, drop it */
+				if (IsDataRead == DATA_WRITE)
+				  Line->Flags = 0;
+
+				return true;
+			}
+
+			/* The line only differs from the medium once the whole sector has arrived */
+			if (IsDataRead == DATA_WRITE)
+			{
+				Line->Flags   |= CACHE_LINE_DIRTY;
+				CacheDirty     = true;
+				CacheIdleTimer = WRITE_CACHE_IDLE_TICKS;
+			}
+		}
+		else
+		{
+			/* Read the whole run of uncached blocks from the medium in one go */
+			while ((Run < TotalBlocks) && !(Cache_FindLine(BlockAddress + Run)))
+			  Run++;
+
+			if (!(Media_TransferBlocks(MSInterfaceInfo, BlockAddress, Run, DATA_READ)))
+			  return false;
+		}
+
+		BlockAddress += Run;
+		TotalBlocks  -= Run;
+	}
+
+	return true;
+}
+#else
+/** Commits the written blocks to the card, there being no write-back sector cache to flush.
+ *
+ *  \return Boolean \c true if the written blocks are on the card, \c false otherwise
+ */
+static bool Cache_Flush(void)
+{
+	return Media_Sync();
+}
+#endif
+
+/** Writes back the dirty sectors of the write-back sector cache once no cached write has been received for
+ *  \ref WRITE_CACHE_IDLE_TICKS timer ticks, and fetches the blocks following a sequential read stream into the cache.
+ *  Both are done one sector at a time between SCSI commands, and a sector is written back only once the card has
+ *  finished programming the previous one. This should be called from the main program loop.
+ */
+void SCSI_CacheTask(void)
+{
+	#if defined(READ_AHEAD_BLOCKS)
+	if (ReadAheadLeft)
+	{
+		if ((ReadAheadBlock < ((uint32_t)LUN_MEDIA_BLOCKS * TOTAL_LUNS)) && Cache_ReadAhead(ReadAheadBlock))
+		{
+			ReadAheadBlock++;
+			ReadAheadLeft--;
+		}
+		else
+		{
+			ReadAheadLeft = 0;
+		}
+
+		return;
+	}
+	#endif
+
+	#if defined(WRITE_CACHE_SETS)
+	/* Write back a sector only once the card is done programming the previous one, rather than waiting for it here,
+	   and retry a failed write back only after another idle period */
+	if (CacheDirty && !(CacheIdleTimer) && !(mmc_disk_busy()) && !(Cache_FlushNext()))
+	  CacheIdleTimer = WRITE_CACHE_IDLE_TICKS;
+	#endif
+}
+
+/** Sets the state of the storage medium behind the LUNs. The application sets the medium up after USB is running,
+ *  and calls this once it is done, or has failed to.
+ *
+ *  \param[in] State  New state of the medium, a value from the \ref MediaStates_t enum
+ */
+void SCSI_SetMediaState(const uint8_t State)
+{
+	if ((State == MEDIA_READY) && (MediaState != MEDIA_READY))
+	  MediaChanged = true;
+
+	MediaState = State;
+}
+
+/** Advances the idle timer of the write-back sector cache. This should be called from the 100Hz system timer
+ *  interrupt.
+ */
+void SCSI_CacheTimerproc(void)
+{
+	#if defined(WRITE_CACHE_SETS)
+	uint8_t n;
+
+	n = CacheIdleTimer;
+	if (n) CacheIdleTimer = --n;
+	#endif
+}
+
+/** Command processing for an issued SCSI READ (10) or WRITE (10) command. This command reads in the block start address
+ *  and total number of blocks to process, then calls the appropriate low-level Dataflash routine to handle the actual
+ *  reading and writing of the data.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *  \param[in] IsDataRead  Indicates if the command is a READ (10) command or WRITE (10) command (DATA_READ or DATA_WRITE)
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                      const bool IsDataRead)
+{
+	uint32_t BlockAddress;
+	uint16_t TotalBlocks;
+
+	/* Check if the disk is write protected or not */
+	if ((IsDataRead == DATA_WRITE) && DISK_READ_ONLY)
+	{
+		/* Block address is invalid, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+		               SCSI_ASENSE_WRITE_PROTECTED,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Load in the 32-bit block address (SCSI uses big-endian, so have to reverse the byte order) */
+	BlockAddress = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2]);
+
+	/* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
+	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+
+	/* Check if the block address is outside the maximum allowable value for the LUN */
+	if (BlockAddress >= LUN_MEDIA_BLOCKS)
+	{
+		/* Block address is invalid, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	#if (TOTAL_LUNS > 1)
+	/* Adjust the given block address to the real media address based on the selected LUN */
+	BlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+	#endif
+
+	/* Transfer the blocks, through the write-back sector cache if enabled */
+	#if defined(WRITE_CACHE_SETS)
+	if (!(Cache_TransferBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks, IsDataRead)))
+	#else
+	if (!(Media_TransferBlocks(MSInterfaceInfo, BlockAddress, TotalBlocks, IsDataRead)))
+	#endif
+	{
+		/* The medium failed part way, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Update the bytes transferred counter and succeed the command */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+
+	return true;
+}
+
+/** Command processing for an issued SCSI MODE SENSE (6) command. This command returns various informational pages about
+ *  the SCSI device, as well as the device's Write Protect status. Only the Caching mode page is supported, telling the
+ *  host whether the device holds written data back in its write-back sector cache.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint8_t PageCode         = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] & 0x3F);
+	uint8_t PageControl      = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] >> 6);
+	uint8_t AllocationLength = MSInterfaceInfo->State.CommandBlock.SCSICommandData[4];
+	uint8_t ModeData[4 + 20] = { 0 };
+	uint8_t ModeDataLength   = 4;
+	uint8_t BytesTransferred;
+
+	/* Mode parameter header with the Write Protect flag status */
+	ModeData[2] = (DISK_READ_ONLY ? 0x80 : 0x00);
+
+	if ((PageCode == MODE_PAGE_CACHING) || (PageCode == MODE_PAGE_ALL))
+	{
+		ModeData[4] = MODE_PAGE_CACHING;
+		ModeData[5] = 0x12;
+
+		#if defined(WRITE_CACHE_SETS)
+		/* Report the write cache as enabled, but not as something the host may change */
+		if (PageControl != MODE_PAGE_CONTROL_CHANGEABLE)
+		  ModeData[6] = MODE_CACHING_WCE;
+		#else
+		(void)PageControl;
+		#endif
+
+		ModeDataLength += 20;
+	}
+
+	/* Mode data length, excluding itself */
+	ModeData[0] = (ModeDataLength - 1);
+
+	BytesTransferred = MIN(AllocationLength, ModeDataLength);
+
+	Endpoint_Write_Stream_LE(ModeData, BytesTransferred, NULL);
+	Endpoint_ClearIN();
+
+	/* Update the bytes transferred counter and succeed the command */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+	return true;
+}
+
+/** Command processing for an issued SCSI SYNCHRONIZE CACHE (10) command. This command writes back all the data held in
+ *  the write-back sector cache to the card. The requested block range is ignored, the whole cache is always written back.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Synchronize_Cache_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	if (!(Cache_Flush()))
+	{
+		/* Write back failed, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	/* Succeed the command and update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+
+	return true;
+}
+
+/** Indicates if the blocks of the LUN can be unmapped. This is the case when the LUN blocks are known card sectors, the
+ *  raw card or the image file through its cluster link map, and the disk is writable.
+ *
+ *  \return Boolean \c true if UNMAP commands are carried out, \c false otherwise
+ */
+static bool Unmap_IsSupported(void)
+{
+	return (!(DISK_READ_ONLY) && (RawStorage || MassStorage_Loopback.cltbl));
+}
+
+/** Retrieves the erase unit of the card, the first time it is needed.
+ *
+ *  \return Number of sectors in the erase unit of the card
+ */
+static uint32_t Unmap_GetGranularity(void)
+{
+	if (!(UnmapGranularity) && ((mmc_disk_ioctl(GET_BLOCK_SIZE, &UnmapGranularity) != RES_OK) || !(UnmapGranularity)))
+	  UnmapGranularity = 1;
+
+	return UnmapGranularity;
+}
+
+/** Erases the whole erase units of the card lying within a run of consecutive sectors. The partial erase units at
+ *  either end of the run are left alone, as erasing them would cost more than leaving them mapped. The run is erased
+ *  in steps of at most \ref UNMAP_ERASE_BLOCKS sectors, each one started once the card is done with the previous one,
+ *  and the card is left erasing the last one.
+ *
+ *  \param[in] Sector       First card sector of the run
+ *  \param[in] TotalBlocks  Number of sectors in the run
+ *
+ *  \return Boolean \c false if the card failed an erase command, \c true otherwise
+ */
+static bool Unmap_EraseSectors(uint32_t Sector,
+	uint32_t TotalBlocks)
+{
+	uint32_t Granularity = Unmap_GetGranularity();
+	uint32_t Step        = Granularity;
+	uint32_t End         = ((Sector + TotalBlocks) / Granularity) * Granularity;
+	DWORD    Range[2];
+
+	/* Erase as many whole erase units at a time as fit into an erase step */
+	if (UNMAP_ERASE_BLOCKS > Granularity)
+	  Step = (UNMAP_ERASE_BLOCKS / Granularity) * Granularity;
+
+	Range[0] = ((Sector + Granularity - 1) / Granularity) * Granularity;
+
+	while (Range[0] < End)
+	{
+		Range[1] = (((End - Range[0]) > Step) ? (Range[0] + Step) : End);
+
+		/* The erase command takes the last sector of the range, not the one past it, a card without sector erase
+		   just keeps the sectors mapped */
+		Range[1]--;
+		switch (mmc_disk_ioctl(CTRL_TRIM, Range))
+		{
+			case RES_OK:
+			case RES_PARERR:
+				break;
+			default:
+				return false;
+		}
+
+		Range[0] = Range[1] + 1;
+	}
+
+	return true;
+}
+
+/** Unmaps a range of blocks of the LUN, erasing the card sectors holding them.
+ *
+ *  \param[in] BlockAddress  Address of the first block of the range
+ *  \param[in] TotalBlocks   Number of blocks in the range
+ *
+ *  \return Boolean \c false if the card failed to erase the blocks, \c true otherwise
+ */
+static bool Unmap_Blocks(uint32_t BlockAddress,
+	uint32_t TotalBlocks)
+{
+	#if defined(WRITE_CACHE_SETS)
+	/* Pending writes to the unmapped blocks are moot now */
+	Cache_Invalidate(BlockAddress, TotalBlocks);
+	#endif
+
+	if (RawStorage)
+	  return Unmap_EraseSectors(BlockAddress, TotalBlocks);
+
+	while (TotalBlocks)
+	{
+		uint32_t Run;
+		uint32_t Sector = Mapped_LookupBlock(BlockAddress, &Run);
+
+		if (!(Sector))
+			break;
+
+		if (Run > TotalBlocks)
+			Run = TotalBlocks;
+
+		if (!(Unmap_EraseSectors(Sector, Run)))
+			return false;
+
+		BlockAddress += Run;
+		TotalBlocks  -= Run;
+	}
+
+	return true;
+}
+
+/** Command processing for an issued SCSI UNMAP command. This command reads in the list of block ranges the host no
+ *  longer uses, then erases them on the card so that its write performance does not degrade as it fills up. Adjacent
+ *  ranges are merged, so that they are erased in one go.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Unmap(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+	uint16_t ParameterListLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+	uint16_t BytesProcessed      = 0;
+	uint8_t  Descriptor[16];
+	uint32_t PendingAddress      = 0;
+	uint32_t PendingBlocks       = 0;
+	bool     InRange             = true;
+	bool     Erased              = true;
+
+	/* Check if the disk is write protected or not */
+	if (DISK_READ_ONLY)
+	{
+		/* Disk is write protected, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+		               SCSI_ASENSE_WRITE_PROTECTED,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	if (ParameterListLength)
+	{
+		/* Wait until endpoint is ready before continuing */
+		if (Endpoint_WaitUntilReady())
+			return false;
+
+		/* Skip the parameter list header, the block descriptor count follows from the list length */
+		if (ParameterListLength >= 8)
+		{
+			Endpoint_Discard_Stream(8, NULL);
+			BytesProcessed = 8;
+		}
+
+		while ((ParameterListLength - BytesProcessed) >= sizeof(Descriptor))
+		{
+			Endpoint_Read_Stream_LE(Descriptor, sizeof(Descriptor), NULL);
+			BytesProcessed += sizeof(Descriptor);
+
+			/* Check if the current command is being aborted by the host */
+			if (MSInterfaceInfo->State.IsMassStoreReset)
+				return false;
+
+			/* Load in the block address and total blocks (SCSI uses big-endian, so have to reverse the byte order) */
+			uint32_t BlockAddress = SwapEndian_32(*(uint32_t*)&Descriptor[4]);
+			uint32_t TotalBlocks  = SwapEndian_32(*(uint32_t*)&Descriptor[8]);
+
+			/* Check if the range is outside the maximum allowable value for the LUN */
+			if (*(uint32_t*)&Descriptor[0] || (BlockAddress >= LUN_MEDIA_BLOCKS) ||
+			    (TotalBlocks > (LUN_MEDIA_BLOCKS - BlockAddress)))
+			{
+				InRange = false;
+				continue;
+			}
+
+			#if (TOTAL_LUNS > 1)
+			/* Adjust the given block address to the real media address based on the selected LUN */
+			BlockAddress += ((uint32_t)MSInterfaceInfo->State.CommandBlock.LUN * LUN_MEDIA_BLOCKS);
+			#endif
+
+			/* Merge a range following on from the pending one, erase the pending one otherwise */
+			if (PendingBlocks && (BlockAddress == (PendingAddress + PendingBlocks)))
+			{
+				PendingBlocks += TotalBlocks;
+				continue;
+			}
+
+			if (PendingBlocks && Unmap_IsSupported())
+			  Erased &= Unmap_Blocks(PendingAddress, PendingBlocks);
+
+			PendingAddress = BlockAddress;
+			PendingBlocks  = TotalBlocks;
+		}
+
+		/* Throw away any trailing partial descriptor */
+		Endpoint_Discard_Stream((ParameterListLength - BytesProcessed), NULL);
+
+		/* If the endpoint is empty, clear it ready for the next packet from the host */
+		if (!(Endpoint_IsReadWriteAllowed()))
+			Endpoint_ClearOUT();
+	}
+
+	if (PendingBlocks && Unmap_IsSupported())
+	  Erased &= Unmap_Blocks(PendingAddress, PendingBlocks);
+
+	/* Update the bytes transferred counter */
+	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ParameterListLength;
+
+	if (!(InRange))
+	{
+		/* Block address is invalid, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+		               SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	if (!(Erased))
+	{
+		/* The card failed an erase, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
+
+	return true;
+}
@@ -72,22 +72,177 @@
 		/** Value for the DeviceType entry in the SCSI_Inquiry_Response_t enum, indicating a CD-ROM device. */
 		#define DEVICE_TYPE_CDROM   0x05
 
+		#if !defined(SCSI_CMD_SYNCHRONIZE_CACHE_10)
+			/** SCSI Command Code for a SYNCHRONIZE CACHE (10) command. */
+			#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+		#endif
+
+		#if !defined(SCSI_CMD_SERVICE_ACTION_IN_16)
+			/** SCSI Command Code for a SERVICE ACTION IN (16) command, carrying a READ CAPACITY (16) command. */
+			#define SCSI_CMD_SERVICE_ACTION_IN_16   0x9E
+		#endif
+
+		#if !defined(SCSI_CMD_UNMAP)
+			/** SCSI Command Code for an UNMAP command. */
+			#define SCSI_CMD_UNMAP                  0x42
+		#endif
+
+		#if !defined(SCSI_ASENSEQ_BECOMING_READY)
+			/** Additional sense code qualifier of a LOGICAL UNIT NOT READY sense, indicating it is becoming ready. */
+			#define SCSI_ASENSEQ_BECOMING_READY     0x01
+		#endif
+
+		/** Service action of a SERVICE ACTION IN (16) command, indicating a READ CAPACITY (16) command. */
+		#define SCSI_SAI_READ_CAPACITY_16       0x10
+
+		/** Mask for the LBPME flag of the READ CAPACITY (16) response, indicating the blocks of the LUN can be unmapped. */
+		#define READ_CAPACITY_16_LBPME          (1 << 7)
+
+		/** Page code of the Supported VPD Pages vital product data page. */
+		#define VPD_PAGE_SUPPORTED_PAGES        0x00
+
+		/** Page code of the Block Limits vital product data page. */
+		#define VPD_PAGE_BLOCK_LIMITS           0xB0
+
+		/** Page code of the Logical Block Provisioning vital product data page. */
+		#define VPD_PAGE_LOGICAL_BLOCK_PROVISIONING  0xB2
+
+		/** Mask for the LBPU flag of the Logical Block Provisioning page, indicating UNMAP commands are supported. */
+		#define VPD_LBP_LBPU                    (1 << 7)
+
+		/** Maximum number of blocks the host may unmap with a single UNMAP command. With at most one erase of
+		 *  \ref UNMAP_ERASE_BLOCKS blocks in progress at a time, this bounds the time an UNMAP command takes.
+		 */
+		#define UNMAP_MAX_BLOCKS                0x00040000UL
+
+		/** Maximum number of blocks erased by a single card erase command, an allocation unit of the usual 4MB. The
+		 *  card is left erasing in background, and each erase is kept short enough to end within the ready wait of
+		 *  the card access following it.
+		 */
+		#define UNMAP_ERASE_BLOCKS              0x00002000UL
+
+		/** Maximum number of block descriptors the host may send with a single UNMAP command. */
+		#define UNMAP_MAX_DESCRIPTORS           16
+
+		/** Page code of the Caching mode page, returned by the \ref SCSI_Command_ModeSense_6() function. */
+		#define MODE_PAGE_CACHING   0x08
+
+		/** Page code requesting all supported mode pages in a MODE SENSE command. */
+		#define MODE_PAGE_ALL       0x3F
+
+		/** Page control value of a MODE SENSE command, requesting the mask of the changeable mode page fields. */
+		#define MODE_PAGE_CONTROL_CHANGEABLE  1
+
+		/** Mask for the Write Cache Enable bit of the Caching mode page. */
+		#define MODE_CACHING_WCE    (1 << 2)
+
+		/** Mask for the \ref Cache_Line_t Flags entry, indicating the cache line holds a sector. */
+		#define CACHE_LINE_VALID    (1 << 0)
+
+		/** Mask for the \ref Cache_Line_t Flags entry, indicating the cached sector differs from the medium. */
+		#define CACHE_LINE_DIRTY    (1 << 1)
+
 #define LUN_MEDIA_BLOCKS (media_blocks)
 #define VIRTUAL_MEMORY_BLOCK_SIZE 512
 extern FIL MassStorage_Loopback;
 extern uint8_t RawStorage;
 
+	/* Preprocessor Checks: */
+		#if defined(READ_AHEAD_BLOCKS) && !defined(WRITE_CACHE_SETS)
+			#error READ_AHEAD_BLOCKS requires the write-back sector cache, WRITE_CACHE_SETS must be defined.
+		#endif
+
+	/* Enums: */
+		/** Enum for the states of the storage medium behind the LUNs, set by the application with
+		 *  \ref SCSI_SetMediaState() as it sets the medium up.
+		 */
+		enum MediaStates_t
+		{
+			MEDIA_BECOMING_READY = 0, /**< Medium being set up, the LUNs report NOT READY until it is done */
+			MEDIA_READY          = 1, /**< Medium set up and accessible */
+			MEDIA_NOT_PRESENT    = 2, /**< Medium could not be set up, the LUNs report MEDIUM NOT PRESENT */
+		};
+
+	/* Type Defines: */
+		/** Type define for a sector held by the RAM write-back sector cache. */
+		typedef struct
+		{
+			uint32_t BlockAddress; /**< Block address of the cached sector */
+			uint16_t Stamp; /**< Cache clock value at the last access to the sector, for least recently used eviction */
+			uint8_t  Flags; /**< Mask of CACHE_LINE_* flags of the cache line */
+			uint8_t  Data[VIRTUAL_MEMORY_BLOCK_SIZE]; /**< Sector data */
+		} Cache_Line_t;
+
 	/* Function Prototypes: */
 		bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+		void SCSI_CacheTask(void);
+		void SCSI_CacheTimerproc(void);
+		void SCSI_SetMediaState(const uint8_t State);
 
 		#if defined(INCLUDE_FROM_SCSI_C)
+			static bool SCSI_ProcessSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
 			static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 			                                      const bool IsDataRead);
+			static bool Raw_ReadBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                           uint16_t TotalBlocks);
+			static void Raw_CompleteWrite(const uint8_t* Data,
+			                              uint16_t Length);
+			static bool Raw_WriteBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                            uint16_t TotalBlocks);
+			static bool Raw_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                               uint32_t Sector,
+			                               uint16_t TotalBlocks,
+			                               const bool IsDataRead);
+			static uint32_t Mapped_LookupBlock(uint32_t BlockAddress,
+			                                   uint32_t* const Run);
+			static bool Mapped_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                                  uint32_t BlockAddress,
+			                                  uint16_t TotalBlocks,
+			                                  const bool IsDataRead);
+			static bool Media_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                                 uint32_t BlockAddress,
+			                                 uint16_t TotalBlocks,
+			                                 const bool IsDataRead);
+			static bool Media_WriteBlock(uint32_t BlockAddress,
+			                             const uint8_t* Buffer);
+			static bool Media_Sync(void);
+			#if defined(READ_AHEAD_BLOCKS)
+			static bool Media_ReadBlock(uint32_t BlockAddress,
+			                            uint8_t* Buffer);
+			static bool Cache_ReadAhead(uint32_t BlockAddress);
+			#endif
+			static bool Cache_Flush(void);
+			#if defined(WRITE_CACHE_SETS)
+			static Cache_Line_t* Cache_FindLine(uint32_t BlockAddress);
+			static Cache_Line_t* Cache_SelectVictim(uint32_t BlockAddress);
+			static Cache_Line_t* Cache_AllocateLine(uint32_t BlockAddress);
+			static bool Cache_FlushLine(Cache_Line_t* const Line);
+			static bool Cache_FlushNext(void);
+			static void Cache_Invalidate(uint32_t BlockAddress,
+			                             uint32_t TotalBlocks);
+			static bool Cache_TransferLine(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                               Cache_Line_t* const Line,
+			                               const bool IsDataRead);
+			static bool Cache_TransferBlocks(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+			                                 uint32_t BlockAddress,
+			                                 uint16_t TotalBlocks,
+			                                 const bool IsDataRead);
+			#endif
 			static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Synchronize_Cache_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Inquiry_VPD(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool SCSI_Command_Unmap(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+			static bool Unmap_IsSupported(void);
+			static uint32_t Unmap_GetGranularity(void);
+			static bool Unmap_EraseSectors(uint32_t Sector,
+			                               uint32_t TotalBlocks);
+			static bool Unmap_Blocks(uint32_t BlockAddress,
+			                         uint32_t TotalBlocks);
 		#endif
 
 #endif
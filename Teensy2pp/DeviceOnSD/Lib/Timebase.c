@@ -0,0 +1,76 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Free running high resolution timebase, for measuring the time spent in the storage layers. TIMER1 counts at F_CPU/8
+ *  and its overflows extend the count to 32 bits, which wraps after about 35 minutes at 16MHz.
+ */
+
+#include "Timebase.h"
+
+/** Upper half of the timebase count, advanced on each TIMER1 overflow. */
+static volatile uint16_t TimebaseHigh;
+
+ISR(TIMER1_OVF_vect)
+{
+	TimebaseHigh++;
+}
+
+/** Starts the free running timebase. This should be called once at start-up, before interrupts are enabled. */
+void Timebase_Init(void)
+{
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11);
+	TIMSK1 = (1 << TOIE1);
+}
+
+/** Reads the current timebase count.
+ *
+ *  \return Number of \ref TIMEBASE_TICKS_PER_US ticks since the timebase was started, modulo 2^32
+ */
+uint32_t Timebase_GetTicks(void)
+{
+	uint16_t High;
+	uint16_t Low;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		High = TimebaseHigh;
+		Low  = TCNT1;
+
+		/* Account for an overflow not serviced yet, unless the counter was read before it */
+		if ((TIFR1 & (1 << TOV1)) && !(Low & 0x8000))
+		  High++;
+	}
+
+	return (((uint32_t)High << 16) | Low);
+}
@@ -0,0 +1,58 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Header file for Timebase.c.
+ */
+
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+	/* Includes: */
+		#include <avr/io.h>
+		#include <avr/interrupt.h>
+		#include <util/atomic.h>
+		#include <stdint.h>
+
+	/* Macros: */
+		/** Number of CPU cycles per high resolution timebase tick, the timer running at F_CPU/8. */
+		#define TIMEBASE_CYCLES_PER_TICK   8
+
+		/** Number of high resolution timebase ticks per microsecond. */
+		#define TIMEBASE_TICKS_PER_US      (F_CPU / TIMEBASE_CYCLES_PER_TICK / 1000000)
+
+	/* Function Prototypes: */
+		void     Timebase_Init(void);
+		uint32_t Timebase_GetTicks(void);
+
+#endif
+
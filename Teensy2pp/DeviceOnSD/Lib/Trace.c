@@ -0,0 +1,110 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Ring buffer trace of the SCSI commands issued by the host, with their timing and the sense data they ended with.
+ *  The recording only copies a few bytes per command, the entries are decoded when the trace is printed.
+ */
+
+#include "Trace.h"
+
+#if defined(SCSI_TRACE_ENTRIES)
+
+/** Ring buffer of the last SCSI commands. */
+static Trace_Entry_t TraceRing[SCSI_TRACE_ENTRIES];
+
+/** Index of the trace entry to be written next. */
+static uint8_t TraceHead;
+
+/** Number of valid entries in the trace. */
+static uint8_t TraceCount;
+
+/** Records a SCSI command into the trace once it has been processed.
+ *
+ *  \param[in] CommandData               Command block of the command
+ *  \param[in] Start                     Timebase count at the start of the command
+ *  \param[in] SenseKey                  Sense key set by the command
+ *  \param[in] AdditionalSenseCode       Additional sense code set by the command
+ *  \param[in] AdditionalSenseQualifier  Additional sense code qualifier set by the command
+ */
+void Trace_Record(const uint8_t* const CommandData,
+	const uint32_t Start,
+	const uint8_t SenseKey,
+	const uint8_t AdditionalSenseCode,
+	const uint8_t AdditionalSenseQualifier)
+{
+	Trace_Entry_t* Entry    = &TraceRing[TraceHead];
+	uint32_t       Duration = (Timebase_GetTicks() - Start) >> 4;
+
+	Entry->Start                    = Start;
+	Entry->Duration                 = (Duration > UINT16_MAX) ? UINT16_MAX : Duration;
+	Entry->Opcode                   = CommandData[0];
+	memcpy(Entry->Address, &CommandData[2], sizeof(Entry->Address));
+	memcpy(Entry->Length,  &CommandData[7], sizeof(Entry->Length));
+	Entry->SenseKey                 = SenseKey;
+	Entry->AdditionalSenseCode      = AdditionalSenseCode;
+	Entry->AdditionalSenseQualifier = AdditionalSenseQualifier;
+
+	TraceHead = (TraceHead + 1) & (SCSI_TRACE_ENTRIES - 1);
+	if (TraceCount < SCSI_TRACE_ENTRIES)
+	  TraceCount++;
+}
+
+/** Prints the trace as a timeline, oldest command first, then clears it. Each line gives the start of the command
+ *  relative to the oldest one and its duration in microseconds, its operation code, logical block address and
+ *  transfer length fields, and the sense key, code and qualifier it ended with.
+ *
+ *  \param[in] Stream  Console stream to print the trace to
+ */
+void Trace_Dump(FILE* const Stream)
+{
+	uint8_t  Index = (TraceHead - TraceCount) & (SCSI_TRACE_ENTRIES - 1);
+	uint32_t Epoch = TraceRing[Index].Start;
+
+	fputs("      start us  duration us  op  address     length  sense\r\n", Stream);
+
+	for (; TraceCount; TraceCount--, Index = (Index + 1) & (SCSI_TRACE_ENTRIES - 1))
+	{
+		Trace_Entry_t* Entry = &TraceRing[Index];
+
+		fprintf(Stream, "%14lu %12lu  %02X  %10lu  %6u  %X/%02X/%02X\r\n",
+		        (unsigned long)((Entry->Start - Epoch) / TIMEBASE_TICKS_PER_US),
+		        (unsigned long)Entry->Duration * 16 / TIMEBASE_TICKS_PER_US,
+		        Entry->Opcode,
+		        ((unsigned long)Entry->Address[0] << 24) | ((unsigned long)Entry->Address[1] << 16) |
+		        ((unsigned long)Entry->Address[2] << 8)  | Entry->Address[3],
+		        ((unsigned)Entry->Length[0] << 8) | Entry->Length[1],
+		        Entry->SenseKey, Entry->AdditionalSenseCode, Entry->AdditionalSenseQualifier);
+	}
+}
+
+#endif
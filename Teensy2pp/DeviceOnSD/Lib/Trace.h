@@ -0,0 +1,80 @@
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2019.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+/*
+  Copyright 2019  Dean Camera (dean [at] fourwalledcubicle [dot] com)
+
+  Permission to use, copy, modify, distribute, and sell this
+  software and its documentation for any purpose is hereby granted
+  without fee, provided that the above copyright notice appear in
+  all copies and that both that the copyright notice and this
+  permission notice and warranty disclaimer appear in supporting
+  documentation, and that the name of the author not be used in
+  advertising or publicity pertaining to distribution of the
+  software without specific, written prior permission.
+
+  The author disclaims all warranties with regard to this
+  software, including all implied warranties of merchantability
+  and fitness.  In no event shall the author be liable for any
+  special, indirect or consequential damages or any damages
+  whatsoever resulting from loss of use, data or profits, whether
+  in an action of contract, negligence or other tortious action,
+  arising out of or in connection with the use or performance of
+  this software.
+*/
+
+
+/** \file
+ *
+ *  Header file for Trace.c.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+	/* Includes: */
+		#include <stdio.h>
+		#include <stdint.h>
+		#include <string.h>
+
+		#include "Config/AppConfig.h"
+		#include "Timebase.h"
+
+	/* Preprocessor Checks: */
+		#if defined(SCSI_TRACE_ENTRIES) && (SCSI_TRACE_ENTRIES & (SCSI_TRACE_ENTRIES - 1))
+			#error SCSI_TRACE_ENTRIES must be a power of two.
+		#endif
+
+	/* Type Defines: */
+		/** Type define for an entry of the SCSI command trace. The command fields are copied from the command block as
+		 *  they are, in the big endian order of the READ (10) and WRITE (10) commands, to keep the recording short.
+		 */
+		typedef struct
+		{
+			uint32_t Start; /**< Timebase count at the start of the command */
+			uint16_t Duration; /**< Duration of the command in units of 16 timebase ticks, saturated */
+			uint8_t  Opcode; /**< Operation code of the command */
+			uint8_t  Address[4]; /**< Bytes 2 to 5 of the command block, the logical block address of a READ (10) */
+			uint8_t  Length[2]; /**< Bytes 7 and 8 of the command block, the transfer length of a READ (10) */
+			uint8_t  SenseKey; /**< Sense key set by the command */
+			uint8_t  AdditionalSenseCode; /**< Additional sense code set by the command */
+			uint8_t  AdditionalSenseQualifier; /**< Additional sense code qualifier set by the command */
+		} Trace_Entry_t;
+
+	/* Function Prototypes: */
+		#if defined(SCSI_TRACE_ENTRIES)
+		void Trace_Record(const uint8_t* const CommandData,
+		                  const uint32_t Start,
+		                  const uint8_t SenseKey,
+		                  const uint8_t AdditionalSenseCode,
+		                  const uint8_t AdditionalSenseQualifier);
+		void Trace_Dump(FILE* const Stream);
+		#endif
+
+#endif
+
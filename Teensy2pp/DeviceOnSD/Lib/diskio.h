@@ -82,12 +82,17 @@ void disk_timerproc (void);
 #define ISDIO_READ			55	/* Read data form SD iSDIO register */
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
+#define MMC_GET_SCLK		58	/* Get read/write SPI clock */
+#define MMC_GET_ERRCNT		59	/* Get number of data packet errors */
 
 /* ATA/CF specific command (Not used by FatFs) */
 #define ATA_GET_REV			60	/* Get F/W revision */
 #define ATA_GET_MODEL		61	/* Get model name */
 #define ATA_GET_SN			62	/* Get serial number */
 
+/* MMC/SDC specific command numbered after the ATA/CF ones (Not used by FatFs) */
+#define MMC_GET_XFERCNT		63	/* Get and clear numbers of commands and data packets */
+
 
 /* MMC card type flags (MMC_GET_TYPE) */
 #define CT_MMC		0x01		/* MMC ver 3 */
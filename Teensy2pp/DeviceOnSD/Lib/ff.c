@@ -241,6 +241,12 @@
 #endif
 
 
+/* Disk access window cache */
+#if FF_WIN_CACHE < 1 || FF_WIN_CACHE > 8 || (FF_WIN_CACHE > 1 && FF_FS_TINY)
+#error Wrong FF_WIN_CACHE setting
+#endif
+
+
 /* Timestamp */
 #if FF_FS_NORTC == 1
 #if FF_NORTC_YEAR < 1980 || FF_NORTC_YEAR > 2107 || FF_NORTC_MON < 1 || FF_NORTC_MON > 12 || FF_NORTC_MDAY < 1 || FF_NORTC_MDAY > 31
@@ -1039,28 +1045,114 @@ static void clear_lock (	/* Clear lock entries of the volume */
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
 #if !FF_FS_READONLY
+static FRESULT write_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,			/* Filesystem object */
+	const BYTE* buff,	/* Window buffer to write back */
+	DWORD sector		/* Sector held in the window buffer */
+)
+{
+	if (disk_write(fs->pdrv, buff, sector, 1) != RES_OK) return FR_DISK_ERR;	/* Write back the window */
+	if (sector - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
+		if (fs->n_fats == 2) disk_write(fs->pdrv, buff, sector + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+	}
+	return FR_OK;
+}
+
+
 static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs			/* Filesystem object */
 )
 {
 	FRESULT res = FR_OK;
+#if FF_WIN_CACHE > 1
+	UINT i;
 
 
-	if (fs->wflag) {	/* Is the disk access window dirty */
-		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write back the window */
-			fs->wflag = 0;	/* Clear window dirty flag */
-			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
-			}
-		} else {
-			res = FR_DISK_ERR;
+	for (i = 0; i < FF_WIN_CACHE - 1 && res == FR_OK; i++) {	/* Write back the dirty spare window slots */
+		if (fs->wflags[i]) {
+			res = write_window(fs, fs->wbuf[i], fs->wsects[i]);
+			if (res == FR_OK) fs->wflags[i] = 0;
 		}
 	}
+#endif
+
+	if (res == FR_OK && fs->wflag) {	/* Is the disk access window dirty */
+		res = write_window(fs, fs->win, fs->winsect);
+		if (res == FR_OK) fs->wflag = 0;	/* Clear window dirty flag */
+	}
 	return res;
 }
 #endif
 
 
+#if FF_WIN_CACHE > 1
+static void clear_window (
+	FATFS* fs			/* Filesystem object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_WIN_CACHE - 1; i++) {	/* Invalidate all spare window slots */
+		fs->wlru[i] = (BYTE)i;
+		fs->wflags[i] = 0;
+		fs->wsects[i] = 0xFFFFFFFF;
+	}
+}
+
+
+#if !FF_FS_READONLY
+static void drop_window (
+	FATFS* fs,			/* Filesystem object */
+	DWORD sector,		/* Top of the sectors written without the window */
+	UINT count			/* Number of the sectors */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_WIN_CACHE - 1; i++) {	/* Invalidate the spare window slots holding any of them */
+		if (fs->wsects[i] - sector < count) {
+			fs->wflags[i] = 0;
+			fs->wsects[i] = 0xFFFFFFFF;
+		}
+	}
+}
+#endif
+
+
+static FRESULT park_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,			/* Filesystem object */
+	DWORD sector		/* Sector number to make appearance in the fs->win[] next */
+)
+{
+	UINT n;
+	BYTE i, b, *p, *q;
+	DWORD sect;
+
+
+	for (n = 0; n < FF_WIN_CACHE - 2 && fs->wsects[fs->wlru[n]] != sector; n++) ;	/* Find the spare slot holding the sector, else take the least recently used one */
+	i = fs->wlru[n];
+#if !FF_FS_READONLY
+	if (fs->wsects[i] != sector && fs->wflags[i]) {	/* Write back the slot to be reused */
+		if (write_window(fs, fs->wbuf[i], fs->wsects[i]) != FR_OK) return FR_DISK_ERR;
+		fs->wflags[i] = 0;
+	}
+#endif
+	for ( ; n > 0; n--) fs->wlru[n] = fs->wlru[n - 1];	/* Make it the most recently used one */
+	fs->wlru[0] = i;
+
+	for (p = fs->win, q = fs->wbuf[i], n = SS(fs); n; n--) {	/* Exchange the window and the slot */
+		b = *p; *p++ = *q; *q++ = b;
+	}
+	sect = fs->wsects[i]; fs->wsects[i] = fs->winsect; fs->winsect = sect;
+	b = fs->wflags[i]; fs->wflags[i] = fs->wflag; fs->wflag = b;
+
+	return FR_OK;
+}
+#endif
+
+
 static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs,			/* Filesystem object */
 	DWORD sector		/* Sector number to make appearance in the fs->win[] */
@@ -1070,10 +1162,12 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (sector != fs->winsect) {	/* Window offset changed? */
-#if !FF_FS_READONLY
+#if FF_WIN_CACHE > 1
+		res = park_window(fs, sector);	/* Put the window aside, taking the sector back if it was put aside before */
+#elif !FF_FS_READONLY
 		res = sync_window(fs);		/* Write-back changes */
 #endif
-		if (res == FR_OK) {			/* Fill sector window with new data */
+		if (res == FR_OK && sector != fs->winsect) {	/* Fill sector window with new data */
 			if (disk_read(fs->pdrv, fs->win, sector, 1) != RES_OK) {
 				sector = 0xFFFFFFFF;	/* Invalidate window if read data is not valid */
 				res = FR_DISK_ERR;
@@ -1112,6 +1206,9 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 			/* Write it into the FSInfo sector */
 			fs->winsect = fs->volbase + 1;
 			disk_write(fs->pdrv, fs->win, fs->winsect, 1);
+#if FF_WIN_CACHE > 1
+			drop_window(fs, fs->winsect, 1);
+#endif
 			fs->fsi_flag = 0;
 		}
 		/* Make sure that no pending write process in the lower layer */
@@ -1655,6 +1752,9 @@ static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
 	fs->winsect = sect;				/* Set window to top of the cluster */
 	mem_set(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
+#if FF_WIN_CACHE > 1
+	drop_window(fs, sect, fs->csize);	/* The spare window slots do not follow the cleared sectors */
+#endif
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
 	/* Allocate a temporary buffer */
 	for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
@@ -3188,6 +3288,9 @@ static BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:
 )
 {
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+#if FF_WIN_CACHE > 1
+	clear_window(fs);
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always here regardless of the sector size) */
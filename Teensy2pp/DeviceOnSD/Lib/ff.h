@@ -164,6 +164,12 @@ typedef struct {
 #endif
 	DWORD	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
+#if FF_WIN_CACHE > 1
+	BYTE	wlru[FF_WIN_CACHE - 1];		/* Spare window slots from the most to the least recently used */
+	BYTE	wflags[FF_WIN_CACHE - 1];	/* wflag of each spare window slot */
+	DWORD	wsects[FF_WIN_CACHE - 1];	/* winsect of each spare window slot */
+	BYTE	wbuf[FF_WIN_CACHE - 1][FF_MAX_SS];	/* Spare window slots */
+#endif
 } FATFS;
 
 
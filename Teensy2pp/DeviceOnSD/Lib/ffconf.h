@@ -42,11 +42,11 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -230,6 +230,15 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#define FF_WIN_CACHE	2
+/* This option specifies the number of sectors cached by the disk access window. (1-8)
+/  With more than one, the sectors the window moves away from are kept in spare slots with
+/  least recently used replacement and written back only when evicted or synchronized, so
+/  that switching between directory, FAT and FSINFO sectors does not write back and read
+/  again each time. Each spare slot adds FF_MAX_SS bytes to the filesystem object (FATFS).
+/  It must be 1 at the tiny configuration. */
+
+
 #define FF_FS_EXFAT		0
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
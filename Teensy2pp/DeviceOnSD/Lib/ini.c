@@ -30,6 +30,14 @@ typedef struct {
     size_t num_left;
 } ini_parse_string_ctx;
 
+/* Used by ini_parse_file() to keep track of buffered file reading state. */
+typedef struct {
+    FIL* file;
+    char* buf;
+    UINT pos;
+    UINT len;
+} ini_parse_file_ctx;
+
 /* Strip whitespace chars off end of given string, in place. Return s. */
 static char* rstrip(char* s)
 {
@@ -211,10 +219,74 @@ int ini_parse_stream(ini_reader reader, void* stream, ini_handler handler,
     return error;
 }
 
+/* An ini_reader function to read the next line from a file. This is the
+   f_gets() equivalent used by ini_parse_file(), but it reads the file a buffer
+   at a time instead of calling f_read() for every character. */
+static char* ini_reader_file(char* str, int num, void* stream) {
+    ini_parse_file_ctx* ctx = (ini_parse_file_ctx*)stream;
+    char* strp = str;
+    const char* eol = NULL;
+    UINT n;
+
+    if (num < 2)
+        return NULL;
+
+    num--;
+    while (num > 0 && !eol) {
+        if (ctx->pos == ctx->len) {
+            ctx->pos = 0;
+            if (f_read(ctx->file, ctx->buf, INI_FILE_BUFFER, &ctx->len) != FR_OK)
+                ctx->len = 0;
+            if (ctx->len == 0)
+                break;
+        }
+        n = ctx->len - ctx->pos;
+        if (n > (UINT)num)
+            n = num;
+        eol = memchr(ctx->buf + ctx->pos, '\n', n);
+        if (eol)
+            n = eol - (ctx->buf + ctx->pos) + 1;
+        memcpy(strp, ctx->buf + ctx->pos, n);
+        strp += n;
+        ctx->pos += n;
+        num -= n;
+    }
+
+    if (strp == str)
+        return NULL;
+    *strp = '\0';
+    return str;
+}
+
 /* See documentation in header file. */
 int ini_parse_file(FIL* file, ini_handler handler, void* user)
 {
-    return ini_parse_stream((ini_reader)f_gets, file, handler, user);
+#if INI_USE_STACK
+    char buf[INI_FILE_BUFFER];
+#else
+    char* buf;
+#endif
+    ini_parse_file_ctx ctx;
+    int error;
+
+#if !INI_USE_STACK
+    buf = (char*)malloc(INI_FILE_BUFFER);
+    if (!buf) {
+        return -2;
+    }
+#endif
+
+    ctx.file = file;
+    ctx.buf = buf;
+    ctx.pos = 0;
+    ctx.len = 0;
+    error = ini_parse_stream((ini_reader)ini_reader_file, &ctx, handler,
+                             user);
+
+#if !INI_USE_STACK
+    free(buf);
+#endif
+    return error;
 }
 
 /* See documentation in header file. */
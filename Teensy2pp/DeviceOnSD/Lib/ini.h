@@ -50,7 +50,8 @@ typedef char* (*ini_reader)(char* str, int num, void* stream);
 */
 int ini_parse(const char* filename, ini_handler handler, void* user);
 
-/* Same as ini_parse(), but takes a FILE* instead of filename. This doesn't
+/* Same as ini_parse(), but takes a FIL* instead of filename. The file is read
+   INI_FILE_BUFFER bytes at a time from its current position. This doesn't
    close the file when it's finished -- the caller must do that. */
 int ini_parse_file(FIL* file, ini_handler handler, void* user);
 
@@ -118,6 +119,13 @@ int ini_parse_string(const char* string, ini_handler handler, void* user);
 #define INI_INITIAL_ALLOC 200
 #endif
 
+/* Size in bytes of the buffer ini_parse_file() reads the file into (stack or
+   heap, as the line buffer). A multiple of the sector size lets FatFs read the
+   sectors straight into it. */
+#ifndef INI_FILE_BUFFER
+#define INI_FILE_BUFFER 512
+#endif
+
 /* Stop parsing on first error (default is to keep parsing). */
 #ifndef INI_STOP_ON_FIRST_ERROR
 #define INI_STOP_ON_FIRST_ERROR 0
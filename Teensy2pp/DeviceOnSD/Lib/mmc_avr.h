@@ -12,6 +12,15 @@
 extern "C" {
 #endif
 
+/* Card identity recorded by the application for a warm start */
+
+typedef struct {
+	BYTE cid[16];		/* CID register */
+	BYTE type;			/* Card type flags */
+	BYTE sclk;			/* Fastest read/write SPI clock step */
+	DWORD sectors;		/* Number of sectors on the card */
+} MMC_IDENT;
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
@@ -21,6 +30,34 @@ DRESULT mmc_disk_read (BYTE* buff, DWORD sector, UINT count);
 DRESULT mmc_disk_write (const BYTE* buff, DWORD sector, UINT count);
 DRESULT mmc_disk_ioctl (BYTE cmd, void* buff);
 void mmc_disk_timerproc (void);
+int mmc_disk_busy (void);
+int mmc_disk_probe (void);
+DSTATUS mmc_disk_resume (const MMC_IDENT* id);
+DRESULT mmc_disk_identify (MMC_IDENT* id);
+DRESULT mmc_disk_check (DWORD sector, BYTE* buff, DWORD* cycles);
+
+/* Prototypes for multiple block streaming */
+
+DRESULT mmc_stream_read_open (DWORD sector);
+DRESULT mmc_stream_read_start (void);
+void mmc_stream_read_part (BYTE* buff, UINT cnt, const BYTE* out, volatile BYTE* fifo);
+void mmc_stream_read_fifo (UINT cnt, volatile BYTE* fifo);
+DRESULT mmc_stream_read_finish (void);
+DRESULT mmc_stream_read (BYTE* buff);
+DRESULT mmc_stream_write_open (DWORD sector, UINT count);
+DRESULT mmc_stream_write_start (void);
+void mmc_stream_write_part (const BYTE* buff, UINT cnt, BYTE* in, volatile BYTE* fifo);
+void mmc_stream_write_fifo (UINT cnt, volatile BYTE* fifo);
+DRESULT mmc_stream_write_finish (void);
+DRESULT mmc_stream_write (const BYTE* buff);
+DRESULT mmc_stream_close (void);
+void mmc_stream_suspend (void);
+void mmc_stream_idle (void);
+DRESULT mmc_stream_error (void);
+
+/* Callback to be provided by the application, called while the card is busy */
+
+void mmc_yield (void);
 
 #ifdef __cplusplus
 }
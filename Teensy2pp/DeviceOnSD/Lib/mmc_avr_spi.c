@@ -12,15 +12,33 @@
 /-------------------------------------------------------------------------*/
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "ff.h"
 #include "diskio.h"
 #include "mmc_avr.h"
+#include "Latency.h"
+#include <util/crc16.h>
 
 #define MMC_NO_CARD_DETECT
+/*#define MMC_SPI_ISR*/	/* Move data blocks in the SPI interrupt, calling mmc_yield() meanwhile */
+/*#define MMC_USART_MSPIM*/	/* Drive the card with USART1 in master SPI mode instead of the SPI module */
+/*#define MMC_ASM_KERNELS*/	/* Use the hand scheduled assembly block transfer loops of the SPI module */
+
+#if defined(MMC_USART_MSPIM) && defined(MMC_SPI_ISR)
+#error MMC_SPI_ISR works with the SPI module only
+#endif
+#if defined(MMC_USART_MSPIM) && defined(MMC_ASM_KERNELS)
+#error MMC_ASM_KERNELS works with the SPI module only
+#endif
 
 /* Peripheral controls (Platform dependent) */
+#ifdef MMC_USART_MSPIM
+#define CS_LOW()		PORTD &= ~_BV(4)	/* Set MMC_CS = low */
+#define	CS_HIGH()		PORTD |= _BV(4)	/* Set MMC_CS = high */
+#else
 #define CS_LOW()		PORTB &= ~_BV(0)	/* Set MMC_CS = low */
 #define	CS_HIGH()		PORTB |= _BV(0)	/* Set MMC_CS = high */
+#endif
 #ifdef MMC_NO_CARD_DETECT
 #define MMC_CD			(1)	/* Test if card detected.   yes:true, no:false, default:true */
 #define MMC_WP			(0)	/* Test if write protected. yes:true, no:false, default:false */
@@ -28,8 +46,17 @@
 #define MMC_CD			(!(PINB & 0x10))	/* Test if card detected.   yes:true, no:false, default:true */
 #define MMC_WP			(PINB & 0x20)	/* Test if write protected. yes:true, no:false, default:false */
 #endif
+#ifdef MMC_USART_MSPIM
+#define	FCLK_SLOW()		UBRR1 = F_CPU / 2 / 400000 - 1	/* Set SPI clock for initialization (100-400kHz) */
+#define	FCLK_FAST()		UBRR1 = (1 << SpiDiv) - 1	/* Set SPI clock for read/write (F_CPU/2 >> SpiDiv) */
+#else
 #define	FCLK_SLOW()		SPCR = 0x52	/* Set SPI clock for initialization (100-400kHz) */
-#define	FCLK_FAST()		SPCR = 0x50	/* Set SPI clock for read/write (20MHz max) */
+#define	FCLK_FAST()		do { SPCR = 0x50 | (SpiDiv >> 1); SPSR = (SpiDiv & 1) ? 0 : 1; } while (0)	/* Set SPI clock for read/write (F_CPU/2 >> SpiDiv) */
+#endif
+
+#define FCLK_STEPS		6		/* Number of read/write SPI clock steps (F_CPU/2 .. F_CPU/64) */
+#define FCLK_ERR_LIMIT	2		/* Number of successive data packet errors to step the SPI clock down */
+#define FCLK_RETRY		4096	/* Number of good data packets to try the next faster SPI clock again */
 
 
 /*--------------------------------------------------------------------------
@@ -61,6 +88,12 @@
 #define	CMD49	(49)		/* WRITE_EXTR_SINGLE */
 #define CMD55	(55)		/* APP_CMD */
 #define CMD58	(58)		/* READ_OCR */
+#define CMD59	(59)		/* CRC_ON_OFF */
+
+/* Steps of mmc_disk_probe() */
+#define PROBE_START	0		/* Power off the socket to reset the card */
+#define PROBE_POWER	1		/* Waiting for the power off time, then entering SPI mode */
+#define PROBE_IDLE	2		/* Polling for the card to leave idle state */
 
 
 static volatile
@@ -72,6 +105,65 @@ BYTE Timer1, Timer2;	/* 100Hz decrement timer */
 static
 BYTE CardType;			/* Card type flags (b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing) */
 
+static
+BYTE StreamCmd;			/* Multiple block transfer in progress (0:None, CMD18:Reading, CMD25:Writing) */
+
+static
+WORD StreamLeft;		/* Number of bytes left in the data packet being streamed */
+
+static
+DWORD StreamNext;		/* Sector to be transferred next in the multiple block transfer */
+
+static volatile
+BYTE StreamTimer;		/* 100Hz decrement timer to close a suspended multiple block transfer */
+
+static
+BYTE StreamFail;		/* A multiple block write has been closed with an error since last checked */
+
+static
+BYTE CardBusy;			/* The card may still be programming written data (busy check pending) */
+
+static
+BYTE SpiDiv, SpiMax;	/* Current and fastest read/write SPI clock step (SPI clock = F_CPU/2 >> step) */
+
+static
+BYTE ErrRun;			/* Number of successive data packet errors */
+
+static
+WORD GoodRun;			/* Number of good data packets since the last error */
+
+static
+WORD ErrCnt;			/* Number of data packet errors since the card was initialized */
+
+static
+DWORD CmdCnt, PktCnt;	/* Number of commands and data packets sent since last read by MMC_GET_XFERCNT */
+
+static
+BYTE CrcOn;				/* The card checks command CRCs (1:Send a valid CRC7 with every command) */
+
+static
+BYTE Resumed;			/* The card was taken over by mmc_disk_resume() or mmc_disk_probe() (1:Keep it at next initialization) */
+
+static
+BYTE ProbeStep;			/* Current step of mmc_disk_probe() (PROBE_START, PROBE_POWER or PROBE_IDLE) */
+
+static
+BYTE ProbeType, ProbeCmd;	/* Card type found and command polled for leaving idle state by mmc_disk_probe() */
+
+#ifdef MMC_SPI_ISR
+static
+BYTE *volatile SpiPtr;	/* Next byte of the data block being transferred in background */
+
+static volatile
+UINT SpiCnt;			/* Number of bytes left in the background transfer (only touched by the interrupt once started) */
+
+static volatile
+BYTE SpiDone;			/* The background transfer is done (set by the interrupt, read in one access unlike SpiCnt) */
+
+static volatile
+BYTE SpiRcvr;			/* Direction of the background transfer (1:Receive, 0:Send) */
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -91,6 +183,17 @@ void power_on (void)
 		/*for (Timer1 = 2; Timer1; );*/	/* Wait for 20ms */
 	/*}*/
 
+#ifdef MMC_USART_MSPIM
+	/* Configure MOSI/MISO/SCLK/CS pins (TXD1=PD3, RXD1=PD2, XCK1=PD5, CS=PD4) */
+	PORTD |= 0b00011000;	/* Configure SCK/MOSI/CS as output */
+	DDRD |= 0b00111000;
+
+	/* Enable USART1 in master SPI mode 0, MSB first */
+	UBRR1 = 0;
+	UCSR1C = _BV(UMSEL11) | _BV(UMSEL10);
+	UCSR1B = _BV(RXEN1) | _BV(TXEN1);
+	FCLK_SLOW();			/* Baud rate must be set after enabling the transmitter */
+#else
 	/* Configure MOSI/MISO/SCLK/CS pins */
 	PORTB |= 0b00000101;	/* Configure SCK/MOSI/CS as output */
 	DDRB |= 0b00000111;
@@ -98,18 +201,29 @@ void power_on (void)
 	/* Enable SPI module in SPI mode 0 */
 	SPCR = 0x52;			/* Enable SPI function in mode 0 */
 	SPSR = 0x01;			/* SPI 2x mode */
+#endif
 }
 
 
 static
 void power_off (void)
 {
+#ifdef MMC_USART_MSPIM
+	/* Disable USART1 */
+	UCSR1B = 0;
+	UCSR1C = 0;
+
+	/* De-configure MOSI/MISO/SCLK/CS pins (set hi-z) */
+	DDRD &= ~0b00111000;	/* Set SCK/MOSI/CS as hi-z */
+	PORTD &= ~0b00111000;
+#else
 	/* Disable SPI function */
 	SPCR = 0;				/* Disable SPI function */
 
 	/* De-configure MOSI/MISO/SCLK/CS pins (set hi-z) */
 	DDRB &= ~0b00000111;	/* Set SCK/MOSI/CS as hi-z */
 	PORTB &= ~0b00000111;
+#endif
 #ifndef MMC_NO_CARD_DETECT
 	DDRB &=  ~0b00110000;	/* INS#/WP as pull-up */
 	PORTB |=  0b00110000;
@@ -126,6 +240,145 @@ void power_off (void)
 /* Transmit/Receive data from/to MMC via SPI  (Platform dependent)       */
 /*-----------------------------------------------------------------------*/
 
+#ifdef MMC_USART_MSPIM
+/* USART1 in master SPI mode has a transmit buffer, so the next byte is */
+/* queued while the current one is being shifted and the bytes go out  */
+/* back to back. Every received byte is read out to keep RXC in step.   */
+
+/* Exchange a byte */
+static
+BYTE xchg_spi (		/* Returns received data */
+	BYTE dat		/* Data to be sent */
+)
+{
+	UDR1 = dat;
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	return UDR1;
+}
+
+
+/* Receive a data block fast */
+static
+void rcvr_spi_multi (
+	BYTE *p,	/* Data read buffer */
+	UINT cnt	/* Size of data block */
+)
+{
+	UDR1 = 0xFF;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = 0xFF;	/* Queue the next byte */
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		*p++ = UDR1;
+	}
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	*p = UDR1;
+}
+
+
+/* Send a data block fast */
+static
+void xmit_spi_multi (
+	const BYTE *p,	/* Data block to be sent */
+	UINT cnt		/* Size of data block */
+)
+{
+	UDR1 = *p++;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = *p++;	/* Queue the next byte */
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		(void)UDR1;
+	}
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	(void)UDR1;
+}
+
+
+/* Receive a data block fast while putting another one into a FIFO register */
+static
+void rcvr_spi_multi_fifo (
+	BYTE *p,			/* Data read buffer */
+	const BYTE *q,		/* Data block to be put into the FIFO */
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	UDR1 = 0xFF;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = 0xFF;	/* Queue the next byte */
+		*fifo = *q++;
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		*p++ = UDR1;
+	}
+	*fifo = *q;
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	*p = UDR1;
+}
+
+
+/* Send a data block fast while taking another one out of a FIFO register */
+static
+void xmit_spi_multi_fifo (
+	const BYTE *p,		/* Data block to be sent */
+	BYTE *q,			/* Data buffer to store the FIFO contents */
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	UDR1 = *p++;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = *p++;	/* Queue the next byte */
+		*q++ = *fifo;	/* q may be p, it lags behind */
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		(void)UDR1;
+	}
+	*q = *fifo;
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	(void)UDR1;
+}
+
+
+/* Receive a data block straight into a FIFO register */
+static
+void rcvr_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	UDR1 = 0xFF;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = 0xFF;	/* Queue the next byte */
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		*fifo = UDR1;
+	}
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	*fifo = UDR1;
+}
+
+
+/* Send a data block straight from a FIFO register */
+static
+void xmit_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	UDR1 = *fifo;
+	while (--cnt) {
+		loop_until_bit_is_set(UCSR1A, UDRE1);
+		UDR1 = *fifo;	/* Queue the next byte */
+		loop_until_bit_is_set(UCSR1A, RXC1);
+		(void)UDR1;
+	}
+	loop_until_bit_is_set(UCSR1A, RXC1);
+	(void)UDR1;
+}
+
+#else
 /* Exchange a byte */
 static
 BYTE xchg_spi (		/* Returns received data */
@@ -138,6 +391,131 @@ BYTE xchg_spi (		/* Returns received data */
 }
 
 
+#ifdef MMC_SPI_ISR
+/* SPI transfer complete interrupt: move the next byte of the block */
+ISR(SPI_STC_vect)
+{
+	BYTE *p = SpiPtr;
+
+
+	if (SpiRcvr) {
+		*p = SPDR;
+	}
+	p++;
+	if (--SpiCnt) {
+		SPDR = SpiRcvr ? 0xFF : *p;
+		SpiPtr = p;
+	} else {
+		SPCR &= ~_BV(SPIE);	/* Block done, back to polled transfers */
+		SpiDone = 1;
+	}
+}
+
+
+/* Move a data block in background and yield until it is done */
+static
+void xfer_spi_isr (
+	BYTE *p,	/* Data block to be sent or read buffer */
+	UINT cnt,	/* Size of data block */
+	BYTE rcvr	/* 1:Receive, 0:Send */
+)
+{
+	SpiPtr = p;
+	SpiCnt = cnt;
+	SpiRcvr = rcvr;
+	SpiDone = 0;
+	SPDR = rcvr ? 0xFF : *p;	/* Start the first byte, the interrupt takes over from there */
+	SPCR |= _BV(SPIE);
+
+	while (!SpiDone) mmc_yield();
+}
+
+
+/* Receive a data block in background */
+static
+void rcvr_spi_multi (
+	BYTE *p,	/* Data read buffer */
+	UINT cnt	/* Size of data block */
+)
+{
+	xfer_spi_isr(p, cnt, 1);
+}
+
+
+/* Send a data block in background */
+static
+void xmit_spi_multi (
+	const BYTE *p,	/* Data block to be sent */
+	UINT cnt		/* Size of data block */
+)
+{
+	xfer_spi_isr((BYTE*)p, cnt, 0);
+}
+#elif defined(MMC_ASM_KERNELS)
+/* The assembly loops below start the next byte as soon as SPIF is seen */
+/* and do all the pointer and counter work while that byte is shifted,  */
+/* which leaves only the SPIF polling latency between two bytes.        */
+
+/* Receive a data block fast */
+static
+void rcvr_spi_multi (
+	BYTE *p,	/* Data read buffer */
+	UINT cnt	/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	__asm__ __volatile__ (
+		"	out	%[spdr], %[ff]		\n"	/* Start the first byte */
+		"	rjmp	2f			\n"
+		"1:	out	%[spdr], %[ff]		\n"	/* Start the next byte */
+		"	st	%a[p]+, %[d]		\n"	/* Store the previous one while it is being shifted in */
+		"2:	sbiw	%[cnt], 1		\n"
+		"3:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the byte in flight */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	3b			\n"
+		"	in	%[d], %[spdr]		\n"
+		"	brne	1b			\n"	/* Flags are still those of the byte count */
+		"	st	%a[p]+, %[d]		\n"
+		: [p] "+e" (p), [cnt] "+w" (cnt), [d] "=&r" (d)
+		: [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)), [spif] "I" (SPIF), [ff] "r" ((BYTE)0xFF)
+		: "memory"
+	);
+}
+
+
+/* Send a data block fast */
+static
+void xmit_spi_multi (
+	const BYTE *p,	/* Data block to be sent */
+	UINT cnt		/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	__asm__ __volatile__ (
+		"	ld	%[d], %a[p]+		\n"
+		"	out	%[spdr], %[d]		\n"	/* Start the first byte */
+		"1:	sbiw	%[cnt], 1		\n"
+		"	breq	3f			\n"
+		"	ld	%[d], %a[p]+		\n"	/* Fetch the next byte while this one is being shifted out */
+		"2:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the byte in flight */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	2b			\n"
+		"	out	%[spdr], %[d]		\n"	/* Start the next byte */
+		"	rjmp	1b			\n"
+		"3:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the last byte */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	3b			\n"
+		"	in	__tmp_reg__, %[spdr]	\n"	/* Clear SPIF */
+		: [p] "+e" (p), [cnt] "+w" (cnt), [d] "=&r" (d)
+		: [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)), [spif] "I" (SPIF)
+		: "memory"
+	);
+}
+#else
 /* Receive a data block fast */
 static
 void rcvr_spi_multi (
@@ -170,6 +548,204 @@ void xmit_spi_multi (
 		loop_until_bit_is_set(SPSR, SPIF);
 	} while (cnt -= 2);
 }
+#endif
+
+
+/* Receive a data block fast while putting another one into a FIFO register */
+static
+void rcvr_spi_multi_fifo (
+	BYTE *p,			/* Data read buffer */
+	const BYTE *q,		/* Data block to be put into the FIFO */
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	do {
+		SPDR = 0xFF;
+		*fifo = *q++;	/* Done while the byte is being shifted in */
+		loop_until_bit_is_set(SPSR, SPIF);
+		*p++ = SPDR;
+	} while (--cnt);
+}
+
+
+/* Send a data block fast while taking another one out of a FIFO register */
+static
+void xmit_spi_multi_fifo (
+	const BYTE *p,		/* Data block to be sent */
+	BYTE *q,			/* Data buffer to store the FIFO contents */
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	do {
+		SPDR = *p++;
+		*q++ = *fifo;	/* Done while the byte is being shifted out (q may be p) */
+		loop_until_bit_is_set(SPSR, SPIF);
+	} while (--cnt);
+}
+
+
+#ifdef MMC_ASM_KERNELS
+/* Receive a data block straight into a FIFO register */
+static
+void rcvr_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	__asm__ __volatile__ (
+		"	out	%[spdr], %[ff]		\n"	/* Start the first byte */
+		"	rjmp	2f			\n"
+		"1:	out	%[spdr], %[ff]		\n"	/* Start the next byte */
+		"	st	%a[f], %[d]		\n"	/* Put the previous one into the FIFO while it is being shifted in */
+		"2:	sbiw	%[cnt], 1		\n"
+		"3:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the byte in flight */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	3b			\n"
+		"	in	%[d], %[spdr]		\n"
+		"	brne	1b			\n"	/* Flags are still those of the byte count */
+		"	st	%a[f], %[d]		\n"
+		: [cnt] "+w" (cnt), [d] "=&r" (d)
+		: [f] "e" (fifo), [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)), [spif] "I" (SPIF), [ff] "r" ((BYTE)0xFF)
+		: "memory"
+	);
+}
+
+
+/* Send a data block straight from a FIFO register */
+static
+void xmit_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	__asm__ __volatile__ (
+		"	ld	%[d], %a[f]		\n"
+		"	out	%[spdr], %[d]		\n"	/* Start the first byte */
+		"1:	sbiw	%[cnt], 1		\n"
+		"	breq	3f			\n"
+		"	ld	%[d], %a[f]		\n"	/* Take the next byte out of the FIFO while this one is being shifted out */
+		"2:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the byte in flight */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	2b			\n"
+		"	out	%[spdr], %[d]		\n"	/* Start the next byte */
+		"	rjmp	1b			\n"
+		"3:	in	__tmp_reg__, %[spsr]	\n"	/* Wait for the last byte */
+		"	sbrs	__tmp_reg__, %[spif]	\n"
+		"	rjmp	3b			\n"
+		"	in	__tmp_reg__, %[spdr]	\n"	/* Clear SPIF */
+		: [cnt] "+w" (cnt), [d] "=&r" (d)
+		: [f] "e" (fifo), [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)), [spif] "I" (SPIF)
+		: "memory"
+	);
+}
+#else
+/* Receive a data block straight into a FIFO register */
+static
+void rcvr_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	SPDR = 0xFF;
+	while (--cnt) {
+		loop_until_bit_is_set(SPSR, SPIF);
+		d = SPDR;
+		SPDR = 0xFF;	/* Start the next byte before storing this one */
+		*fifo = d;
+	}
+	loop_until_bit_is_set(SPSR, SPIF);
+	*fifo = SPDR;
+}
+
+
+/* Send a data block straight from a FIFO register */
+static
+void xmit_spi_fifo (
+	volatile BYTE *fifo,	/* FIFO data register */
+	UINT cnt			/* Size of data block */
+)
+{
+	BYTE d;
+
+
+	d = *fifo;
+	while (--cnt) {
+		SPDR = d;
+		d = *fifo;		/* Fetch the next byte while this one is being shifted out */
+		loop_until_bit_is_set(SPSR, SPIF);
+	}
+	SPDR = d;
+	loop_until_bit_is_set(SPSR, SPIF);
+}
+#endif
+#endif	/* MMC_USART_MSPIM */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* SPI clock management                                                  */
+/*-----------------------------------------------------------------------*/
+/* The read/write clock starts at the fastest step the CSD TRAN_SPEED    */
+/* allows. Each data packet is tallied, and the clock is stepped down on */
+/* repeated errors and stepped back up after a long run of good packets. */
+
+static
+BYTE fclk_limit (		/* Returns the fastest SPI clock step the card allows */
+	BYTE tran_speed		/* TRAN_SPEED field of the CSD */
+)
+{
+	static const BYTE tv[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};	/* Time value x10 */
+	DWORD khz;
+	BYTE n;
+
+
+	khz = tv[(tran_speed >> 3) & 15];	/* Max transfer rate [kHz] = time value x 100kHz..100MHz */
+	n = tran_speed & 7;
+	if (n > 3) n = 3;
+	for (n++; n; n--) khz *= 10;
+
+	for (n = 0; n < FCLK_STEPS - 1 && (F_CPU / 2000 >> n) > khz; n++) ;
+
+	return n;
+}
+
+
+static
+void fclk_tally (
+	int ok		/* 1:Data packet transferred, 0:Data packet error */
+)
+{
+	PktCnt++;
+	if (Stat & STA_NOINIT) return;	/* The clock is not settled yet */
+
+	if (ok) {
+		ErrRun = 0;
+		if (SpiDiv > SpiMax && ++GoodRun >= FCLK_RETRY) {	/* Try the next faster clock again */
+			SpiDiv--;
+			GoodRun = 0;
+			FCLK_FAST();
+		}
+	} else {
+		if (ErrCnt != 0xFFFF) ErrCnt++;
+		GoodRun = 0;
+		if (++ErrRun >= FCLK_ERR_LIMIT && SpiDiv < FCLK_STEPS - 1) {	/* Step down on repeated errors */
+			SpiDiv++;
+			ErrRun = 0;
+			FCLK_FAST();
+		}
+	}
+}
 
 
 
@@ -183,17 +759,24 @@ int wait_ready (	/* 1:Ready, 0:Timeout */
 )
 {
 	BYTE d;
+	LATENCY_DECLARE(t);
 
 
+	LATENCY_START(t);
 	Timer2 = wt / 10;
-	do
+	do {
 		d = xchg_spi(0xFF);
 
-		/* This loop takes a time. Insert rot_rdq() here for multitask envilonment. */
+		/* This loop takes a time. Let the application do something else meanwhile. */
+		if (d != 0xFF) mmc_yield();
+
+	} while (d != 0xFF && Timer2);
+	LATENCY_STOP(LATENCY_WAIT_READY, t);
 
-	while (d != 0xFF && Timer2);
+	if (d != 0xFF) return 0;
+	CardBusy = 0;		/* Any background programming is over */
 
-	return (d == 0xFF) ? 1 : 0;
+	return 1;
 }
 
 
@@ -240,17 +823,24 @@ int rcvr_datablock (
 )
 {
 	BYTE token;
+	LATENCY_DECLARE(t);
 
 
+	LATENCY_START(t);
 	Timer1 = 20;
 	do {							/* Wait for data packet in timeout of 200ms */
 		token = xchg_spi(0xFF);
 	} while ((token == 0xFF) && Timer1);
-	if (token != 0xFE) return 0;	/* If not valid data token, retutn with error */
+	fclk_tally(token == 0xFE);
+	if (token != 0xFE) {			/* If not valid data token, retutn with error */
+		LATENCY_STOP(LATENCY_DATA_BLOCK, t);
+		return 0;
+	}
 
 	rcvr_spi_multi(buff, btr);		/* Receive the data block into buffer */
 	xchg_spi(0xFF);					/* Discard CRC */
 	xchg_spi(0xFF);
+	LATENCY_STOP(LATENCY_DATA_BLOCK, t);
 
 	return 1;						/* Return with success */
 }
@@ -274,18 +864,47 @@ int xmit_datablock (
 	if (!wait_ready(500)) return 0;		/* Leading busy check: Wait for card ready to accept data block */
 
 	xchg_spi(token);					/* Xmit data token */
+	CardBusy = 1;						/* The card goes busy after the data block or StopTran */
 	if (token == 0xFD) return 1;		/* Do not send data if token is StopTran */
 
 	xmit_spi_multi(buff, 512);			/* Data */
 	xchg_spi(0xFF); xchg_spi(0xFF);		/* Dummy CRC */
 
 	resp = xchg_spi(0xFF);				/* Receive data resp */
+	fclk_tally((resp & 0x1F) == 0x05);
 
 	return (resp & 0x1F) == 0x05 ? 1 : 0;	/* Data was accepted or not */
 
-	/* Busy check is done at next transmission */
+	/* Busy check is done at next transmission */
+}
+#endif
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Calculate the CRC7 of a command packet                                */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE crc7_cmd (		/* Returns CRC7 + Stop bit */
+	BYTE cmd,		/* Command index */
+	DWORD arg		/* Argument */
+)
+{
+	BYTE n, i, d, crc = 0;
+
+
+	for (n = 0; n < 5; n++) {
+		d = n ? (BYTE)(arg >> (32 - 8 * n)) : 0x40 | cmd;
+		for (i = 0; i < 8; i++) {	/* x^7 + x^3 + 1 */
+			crc <<= 1;
+			if ((d ^ crc) & 0x80) crc ^= 0x09;
+			d <<= 1;
+		}
+	}
+
+	return (crc << 1) | 1;
 }
-#endif
 
 
 
@@ -315,6 +934,7 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
 	}
 
 	/* Send command packet */
+	CmdCnt++;
 	xchg_spi(0x40 | cmd);				/* Start + Command index */
 	xchg_spi((BYTE)(arg >> 24));		/* Argument[31..24] */
 	xchg_spi((BYTE)(arg >> 16));		/* Argument[23..16] */
@@ -323,6 +943,7 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
 	n = 0x01;							/* Dummy CRC + Stop */
 	if (cmd == CMD0) n = 0x95;			/* Valid CRC for CMD0(0) + Stop */
 	if (cmd == CMD8) n = 0x87;			/* Valid CRC for CMD8(0x1AA) Stop */
+	if (CrcOn) n = crc7_cmd(cmd, arg);	/* Valid CRC for any command while the card checks them */
 	xchg_spi(n);
 
 	/* Receive command response */
@@ -345,62 +966,242 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
 
 
 /*-----------------------------------------------------------------------*/
-/* Initialize Disk Drive                                                 */
+/* Probe the Card a Step at a Time                                       */
 /*-----------------------------------------------------------------------*/
-
-DSTATUS mmc_disk_initialize (void)
+/* The card initialization takes the 100ms power cycle and then up to a  */
+/* second of ACMD41 polling. This function runs it as a state machine,   */
+/* one step per call, so that the caller can go on with other work in    */
+/* between instead of blocking all the while. It is called repeatedly    */
+/* until it returns 0. The probed card is kept by the following          */
+/* mmc_disk_initialize() call, as a resumed one is.                      */
+
+int mmc_disk_probe (void)	/* 1:In progress, 0:Done (see mmc_disk_status() for the result) */
 {
-	BYTE n, cmd, ty, ocr[4];
+	BYTE n, ocr[4], csd[16];
 
 
-	power_off();						/* Turn off the socket power to reset the card */
-	for (Timer1 = 10; Timer1; ) ;		/* Wait for 100ms */
+	switch (ProbeStep) {
+	case PROBE_START:
+		Resumed = 0;
+		if (StreamCmd) mmc_stream_close();
+		power_off();						/* Turn off the socket power to reset the card */
+		Timer1 = 10;						/* Power off time of 100 msec */
+		ProbeStep = PROBE_POWER;
+		return 1;
+
+	case PROBE_POWER:
+		if (Timer1) return 1;				/* Wait for the power off time */
 #ifndef MMC_NO_CARD_DETECT
-	if (Stat & STA_NODISK) return Stat;	/* No card in the socket? */
+		if (Stat & STA_NODISK) break;		/* No card in the socket? */
 #endif
+		power_on();							/* Turn on the socket power */
+		FCLK_SLOW();
+		for (n = 10; n; n--) xchg_spi(0xFF);	/* 80 dummy clocks */
 
-	power_on();							/* Turn on the socket power */
-	FCLK_SLOW();
-	for (n = 10; n; n--) xchg_spi(0xFF);	/* 80 dummy clocks */
-
-	ty = 0;
-	if (send_cmd(CMD0, 0) == 1) {			/* Put the card SPI mode */
+		ProbeType = 0;
+		if (send_cmd(CMD0, 0) != 1) break;	/* Put the card SPI mode */
 		Timer1 = 100;						/* Initialization timeout of 1000 msec */
 		if (send_cmd(CMD8, 0x1AA) == 1) {	/* Is the card SDv2? */
 			for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);	/* Get trailing return value of R7 resp */
-			if (ocr[2] == 0x01 && ocr[3] == 0xAA) {				/* The card can work at vdd range of 2.7-3.6V */
-				while (Timer1 && send_cmd(ACMD41, 1UL << 30));	/* Wait for leaving idle state (ACMD41 with HCS bit) */
-				if (Timer1 && send_cmd(CMD58, 0) == 0) {		/* Check CCS bit in the OCR */
-					for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);
-					ty = (ocr[0] & 0x40) ? CT_SD2 | CT_BLOCK : CT_SD2;	/* Check if the card is SDv2 */
-				}
-			}
+			if (ocr[2] != 0x01 || ocr[3] != 0xAA) break;		/* The card can work at vdd range of 2.7-3.6V? */
+			ProbeType = CT_SD2; ProbeCmd = ACMD41;
 		} else {							/* SDv1 or MMCv3 */
 			if (send_cmd(ACMD41, 0) <= 1) 	{
-				ty = CT_SD1; cmd = ACMD41;	/* SDv1 */
+				ProbeType = CT_SD1; ProbeCmd = ACMD41;	/* SDv1 */
 			} else {
-				ty = CT_MMC; cmd = CMD1;	/* MMCv3 */
+				ProbeType = CT_MMC; ProbeCmd = CMD1;	/* MMCv3 */
 			}
-			while (Timer1 && send_cmd(cmd, 0));			/* Wait for leaving idle state */
-			if (!Timer1 || send_cmd(CMD16, 512) != 0)	/* Set R/W block length to 512 */
-				ty = 0;
 		}
-	}
-	CardType = ty;
-	deselect();
+		deselect();
+		ProbeStep = PROBE_IDLE;
+		return 1;
+
+	case PROBE_IDLE:						/* Wait for leaving idle state, one attempt per call */
+		if (send_cmd(ProbeCmd, (ProbeType == CT_SD2) ? 1UL << 30 : 0)) {	/* ACMD41 with HCS bit for SDv2 */
+			deselect();
+			if (!Timer1) break;
+			return 1;
+		}
+		if (ProbeType == CT_SD2) {
+			if (send_cmd(CMD58, 0) != 0) break;	/* Check CCS bit in the OCR */
+			for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);
+			if (ocr[0] & 0x40) ProbeType |= CT_BLOCK;	/* Check if the card is SDv2 */
+		} else {
+			if (send_cmd(CMD16, 512) != 0) break;	/* Set R/W block length to 512 */
+		}
+		deselect();
 
-	if (ty) {			/* Initialization succeded */
+		CardType = ProbeType;	/* Initialization succeded */
+		SpiMax = 0;
+		if (send_cmd(CMD9, 0) == 0 && rcvr_datablock(csd, 16)) SpiMax = fclk_limit(csd[3]);	/* Fastest clock the card allows */
+		deselect();
+		SpiDiv = SpiMax;
+		ErrRun = 0; GoodRun = 0; ErrCnt = 0;
 		Stat &= ~STA_NOINIT;		/* Clear STA_NOINIT */
 		FCLK_FAST();
-	} else {			/* Initialization failed */
-		power_off();
+		Resumed = 1;				/* Keep it at the next initialization */
+		ProbeStep = PROBE_START;
+		return 0;
+	}
+
+	CardType = 0;			/* Initialization failed */
+	deselect();
+	power_off();
+	ProbeStep = PROBE_START;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize Disk Drive                                                 */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS mmc_disk_initialize (void)
+{
+	if (Resumed) {						/* Keep the card taken over at warm start or probed as it is */
+		Resumed = 0;
+		return Stat;
+	}
+
+	ProbeStep = PROBE_START;
+	while (mmc_disk_probe()) ;			/* Run the whole probe at once */
+	Resumed = 0;
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Resume the Card Left Initialized at Warm Start                        */
+/*-----------------------------------------------------------------------*/
+/* After a restart of the MCU alone, the card is still powered and ready */
+/* for data transfer. When it reports so and its CID matches the one     */
+/* recorded at the previous boot, the recorded card type and SPI clock   */
+/* are taken as they are, skipping the power cycle and the probing. The  */
+/* mmc_disk_initialize() call done by FatFs at mount then keeps it.      */
+
+DSTATUS mmc_disk_resume (
+	const MMC_IDENT *id	/* Identity recorded at the previous boot */
+)
+{
+	BYTE n, ocr[4], cid[16];
+
+
+	if (StreamCmd) mmc_stream_close();
+	if (!(id->type & CT_SD2) || id->sclk >= FCLK_STEPS) return Stat;	/* Only SDv2 cards are resumed */
+#ifndef MMC_NO_CARD_DETECT
+	if (Stat & STA_NODISK) return Stat;	/* No card in the socket? */
+#endif
+
+	power_on();							/* Take the SPI bus without power cycling the card */
+	FCLK_SLOW();
+	for (n = 10; n; n--) xchg_spi(0xFF);	/* 80 dummy clocks */
+
+	if (send_cmd(CMD58, 0) == 0) {		/* Is the card out of idle state? */
+		for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);
+		if ((ocr[0] & 0x80)				/* Power up done, in the addressing mode recorded */
+			&& ((ocr[0] & 0x40) ? CT_SD2 | CT_BLOCK : CT_SD2) == id->type
+			&& send_cmd(CMD10, 0) == 0 && rcvr_datablock(cid, 16)) {	/* Is it the same card? */
+			for (n = 0; n < 16 && cid[n] == id->cid[n]; n++) ;
+			if (n == 16) {
+				CardType = id->type;
+				SpiMax = SpiDiv = id->sclk;
+				ErrRun = 0; GoodRun = 0; ErrCnt = 0;
+				Stat &= ~STA_NOINIT;	/* Clear STA_NOINIT */
+				FCLK_FAST();
+				Resumed = 1;
+			}
+		}
 	}
+	deselect();
 
 	return Stat;
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Get the Identity of the Card to Resume it at Next Warm Start          */
+/*-----------------------------------------------------------------------*/
+
+DRESULT mmc_disk_identify (
+	MMC_IDENT *id		/* Identity record to be filled */
+)
+{
+	if (mmc_disk_ioctl(MMC_GET_CID, id->cid) != RES_OK) return RES_ERROR;
+	if (mmc_disk_ioctl(GET_SECTOR_COUNT, &id->sectors) != RES_OK) return RES_ERROR;
+	id->type = CardType;
+	id->sclk = SpiMax;
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Check the Data Block Transfer Loops Against the Card CRC              */
+/*-----------------------------------------------------------------------*/
+/* With CRC checking enabled by CMD59, the card sends the CRC16 of every */
+/* data block it reads out and checks the one of every block written to  */
+/* it. A sector is read and written back unchanged with the data block   */
+/* transfer loops of this build (SPI module, USART in master SPI mode,   */
+/* assembly kernels or SPI interrupt), so that any bit they get wrong    */
+/* shows up as a CRC mismatch, and the CPU cycles spent in each loop are  */
+/* measured with the timebase.                                           */
+
+DRESULT mmc_disk_check (
+	DWORD sector,		/* Sector to read and write back */
+	BYTE *buff,			/* 512 byte work buffer */
+	DWORD *cycles		/* Cycles spent receiving and transmitting the data block [2] */
+)
+{
+	DRESULT res;
+	WORD crc, rcrc, n;
+	BYTE token;
+	uint32_t t;
+
+
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (StreamCmd) mmc_stream_close();
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+
+	res = RES_ERROR;
+	cycles[0] = cycles[1] = 0;
+	if (send_cmd(CMD59, 1) == 0) {		/* CRC_ON_OFF: the card checks and sends CRCs from now on */
+		CrcOn = 1;
+		if (send_cmd(CMD17, sector) == 0) {	/* READ_SINGLE_BLOCK */
+			Timer1 = 20;
+			do token = xchg_spi(0xFF); while (token == 0xFF && Timer1);
+			if (token == 0xFE) {
+				t = Timebase_GetTicks();
+				rcvr_spi_multi(buff, 512);	/* Receive loop under test */
+				cycles[0] = (Timebase_GetTicks() - t) * TIMEBASE_CYCLES_PER_TICK;
+				rcrc = (WORD)xchg_spi(0xFF) << 8; rcrc |= xchg_spi(0xFF);	/* CRC16 sent by the card */
+				for (crc = 0, n = 0; n < 512; n++) crc = _crc_xmodem_update(crc, buff[n]);
+
+				if (crc == rcrc && send_cmd(CMD24, sector) == 0 && wait_ready(500)) {	/* WRITE_BLOCK */
+					xchg_spi(0xFE);				/* Data token */
+					t = Timebase_GetTicks();
+					xmit_spi_multi(buff, 512);	/* Transmit loop under test */
+					cycles[1] = (Timebase_GetTicks() - t) * TIMEBASE_CYCLES_PER_TICK;
+					xchg_spi((BYTE)(crc >> 8)); xchg_spi((BYTE)crc);	/* Valid CRC, the card rejects the block on a mismatch */
+					if ((xchg_spi(0xFF) & 0x1F) == 0x05 && wait_ready(500)) res = RES_OK;
+				}
+			}
+		}
+		send_cmd(CMD59, 0);				/* Back to CRC off, the command itself still needs a valid CRC */
+		CrcOn = 0;
+	}
+	deselect();
+
+	return res;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
@@ -412,6 +1213,30 @@ DSTATUS mmc_disk_status (void)
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Check if the Card is Still Programming                                */
+/*-----------------------------------------------------------------------*/
+/* A write returns as soon as the card accepted the data and the card    */
+/* programs it in background. The next access waits for the end of it,  */
+/* and this function polls for it without blocking so that the caller    */
+/* can do something else until the card gets ready.                      */
+
+int mmc_disk_busy (void)	/* 1:Busy, 0:Ready */
+{
+	if (!CardBusy || (Stat & STA_NOINIT)) return 0;
+
+	if (!StreamCmd) {		/* Select the card unless a suspended transaction keeps it selected */
+		CS_LOW();
+		xchg_spi(0xFF);		/* Dummy clock (force DO enabled) */
+	}
+	if (xchg_spi(0xFF) == 0xFF) CardBusy = 0;
+	if (!StreamCmd) deselect();
+
+	return CardBusy;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
@@ -423,10 +1248,13 @@ DRESULT mmc_disk_read (
 )
 {
 	BYTE cmd;
+	LATENCY_DECLARE(t);
 
 
 	if (!count) return RES_PARERR;
 	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	LATENCY_START(t);
+	if (StreamCmd) mmc_stream_close();
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
@@ -439,12 +1267,289 @@ DRESULT mmc_disk_read (
 		if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
 	}
 	deselect();
+	LATENCY_STOP(LATENCY_DISK_READ, t);
 
 	return count ? RES_ERROR : RES_OK;
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Streaming Read/Write Sector(s)                                        */
+/*-----------------------------------------------------------------------*/
+/* A READ_MULTIPLE_BLOCK or WRITE_MULTIPLE_BLOCK transaction is kept     */
+/* open across the calls so that the caller can move each sector to or   */
+/* from the host in between, without paying a command and a select cycle */
+/* per sector. Each data packet can also be transferred in parts, either */
+/* straight from/to a FIFO register or with a FIFO register served while */
+/* every byte is being shifted on the bus.                               */
+/* At the end of a host command the transaction can be suspended with    */
+/* the card kept selected. Opening a transaction in the same direction   */
+/* at the sector that follows it continues it, anything else closes it.  */
+/* A suspended transaction is also closed after 100ms of inactivity.     */
+/* A write transaction failing to close, wherever it is closed, is kept  */
+/* pending for mmc_stream_error().                                       */
+
+DRESULT mmc_stream_read_open (
+	DWORD sector		/* Start sector number (LBA) */
+)
+{
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (StreamCmd == CMD18 && !StreamLeft && sector == StreamNext) return RES_OK;	/* Continue the suspended transaction */
+	if (StreamCmd) mmc_stream_close();
+
+	StreamNext = sector;
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+
+	if (send_cmd(CMD18, sector) != 0) {		/* READ_MULTIPLE_BLOCK */
+		deselect();
+		return RES_ERROR;
+	}
+	StreamCmd = CMD18;
+
+	return RES_OK;
+}
+
+
+DRESULT mmc_stream_read_start (void)
+{
+	BYTE token;
+
+
+	if (StreamCmd != CMD18) return RES_ERROR;
+
+	Timer1 = 20;
+	do {							/* Wait for data packet in timeout of 200ms */
+		token = xchg_spi(0xFF);
+	} while ((token == 0xFF) && Timer1);
+	fclk_tally(token == 0xFE);
+	if (token != 0xFE) {			/* Abort the transaction on a bad data packet */
+		mmc_stream_close();
+		return RES_ERROR;
+	}
+	StreamLeft = 512;
+
+	return RES_OK;
+}
+
+
+void mmc_stream_read_part (
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	UINT cnt,			/* Number of bytes to read (even number) */
+	const BYTE *out,	/* Data to be put into the FIFO meanwhile (NULL:None) */
+	volatile BYTE *fifo	/* FIFO data register */
+)
+{
+	if (StreamCmd == CMD18 && StreamLeft >= cnt) {
+		StreamLeft -= cnt;
+		if (out) {
+			rcvr_spi_multi_fifo(buff, out, fifo, cnt);
+		} else {
+			rcvr_spi_multi(buff, cnt);
+		}
+	} else if (out) {				/* Transaction is dead, still serve the FIFO */
+		do *fifo = *out++; while (--cnt);
+	}
+}
+
+
+void mmc_stream_read_fifo (
+	UINT cnt,			/* Number of bytes to read */
+	volatile BYTE *fifo	/* FIFO data register to put read data into */
+)
+{
+	if (StreamCmd == CMD18 && StreamLeft >= cnt) {
+		StreamLeft -= cnt;
+		rcvr_spi_fifo(fifo, cnt);
+	} else {						/* Transaction is dead, still fill the FIFO */
+		do *fifo = 0xFF; while (--cnt);
+	}
+}
+
+
+DRESULT mmc_stream_read_finish (void)
+{
+	if (StreamCmd != CMD18 || StreamLeft) return RES_ERROR;
+
+	xchg_spi(0xFF);					/* Discard CRC */
+	xchg_spi(0xFF);
+	StreamNext++;
+
+	return RES_OK;
+}
+
+
+DRESULT mmc_stream_read (
+	BYTE *buff			/* Pointer to the 512 byte data buffer to store read data */
+)
+{
+	if (mmc_stream_read_start() != RES_OK) return RES_ERROR;
+	mmc_stream_read_part(buff, 512, 0, 0);
+
+	return mmc_stream_read_finish();
+}
+
+
+#if _USE_WRITE
+DRESULT mmc_stream_write_open (
+	DWORD sector,		/* Start sector number (LBA) */
+	UINT count			/* Number of sectors the host is going to send */
+)
+{
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (Stat & STA_PROTECT) return RES_WRPRT;
+	if (StreamCmd == CMD25 && !StreamLeft && sector == StreamNext) return RES_OK;	/* Continue the suspended transaction */
+	if (StreamCmd) mmc_stream_close();
+
+	StreamNext = sector;
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+
+	if (((CardType & CT_SDC) && send_cmd(ACMD23, count) != 0) ||	/* Let the card pre-erase the whole run */
+		send_cmd(CMD25, sector) != 0) {		/* WRITE_MULTIPLE_BLOCK */
+		deselect();
+		return RES_ERROR;
+	}
+	StreamCmd = CMD25;
+
+	return RES_OK;
+}
+
+
+DRESULT mmc_stream_write_start (void)
+{
+	if (StreamCmd != CMD25) return RES_ERROR;
+
+	if (!wait_ready(500)) {			/* Leading busy check: Wait for card ready to accept data block */
+		mmc_stream_close();
+		return RES_ERROR;
+	}
+	xchg_spi(0xFC);					/* Xmit data token */
+	StreamLeft = 512;
+
+	return RES_OK;
+}
+
+
+void mmc_stream_write_part (
+	const BYTE *buff,	/* Pointer to the data to be written */
+	UINT cnt,			/* Number of bytes to write (even number) */
+	BYTE *in,			/* Data buffer to take the FIFO contents meanwhile (NULL:None) */
+	volatile BYTE *fifo	/* FIFO data register */
+)
+{
+	if (StreamCmd == CMD25 && StreamLeft >= cnt) {
+		StreamLeft -= cnt;
+		if (in) {
+			xmit_spi_multi_fifo(buff, in, fifo, cnt);
+		} else {
+			xmit_spi_multi(buff, cnt);
+		}
+	} else if (in) {				/* Transaction is dead, still drain the FIFO */
+		do *in++ = *fifo; while (--cnt);
+	}
+}
+
+
+void mmc_stream_write_fifo (
+	UINT cnt,			/* Number of bytes to write */
+	volatile BYTE *fifo	/* FIFO data register to take write data from */
+)
+{
+	if (StreamCmd == CMD25 && StreamLeft >= cnt) {
+		StreamLeft -= cnt;
+		xmit_spi_fifo(fifo, cnt);
+	} else {						/* Transaction is dead, still drain the FIFO */
+		do (void)*fifo; while (--cnt);
+	}
+}
+
+
+DRESULT mmc_stream_write_finish (void)
+{
+	BYTE resp;
+
+
+	if (StreamCmd != CMD25 || StreamLeft) return RES_ERROR;
+
+	xchg_spi(0xFF); xchg_spi(0xFF);	/* Dummy CRC */
+	resp = xchg_spi(0xFF);			/* Receive data resp */
+	fclk_tally((resp & 0x1F) == 0x05);
+	if ((resp & 0x1F) != 0x05) {	/* Abort the transaction on a rejected data packet */
+		mmc_stream_close();
+		return RES_ERROR;
+	}
+	CardBusy = 1;
+	StreamNext++;
+
+	return RES_OK;	/* Busy check is done at next transmission */
+}
+
+
+DRESULT mmc_stream_write (
+	const BYTE *buff	/* Pointer to the 512 byte data block to be written */
+)
+{
+	if (mmc_stream_write_start() != RES_OK) return RES_ERROR;
+	mmc_stream_write_part(buff, 512, 0, 0);
+
+	return mmc_stream_write_finish();
+}
+#endif
+
+
+DRESULT mmc_stream_close (void)
+{
+	DRESULT res = RES_OK;
+
+
+	if (StreamCmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+#if _USE_WRITE
+	if (StreamCmd == CMD25) {
+		if (StreamLeft) {			/* Clock out an interrupted data packet to get the bus back in step. */
+			do xchg_spi(0xFF); while (--StreamLeft);	/* The padded sector is programmed, so the */
+			xchg_spi(0xFF); xchg_spi(0xFF); xchg_spi(0xFF);	/* write is failed. Callers complete their */
+			res = RES_ERROR;			/* last packet from a buffer to avoid this. */
+		}
+		if (!xmit_datablock(0, 0xFD)) res = RES_ERROR;	/* STOP_TRAN token */
+		if (res != RES_OK) StreamFail = 1;
+	}
+#endif
+	StreamCmd = 0;
+	StreamLeft = 0;
+	deselect();
+
+	return res;
+}
+
+
+void mmc_stream_suspend (void)
+{
+	if (StreamCmd && !StreamLeft) {	/* Keep the transaction open between data packets */
+		StreamTimer = 10;			/* Close it unless continued in 100ms */
+	} else {
+		mmc_stream_close();
+	}
+}
+
+
+void mmc_stream_idle (void)
+{
+	if (StreamCmd && !StreamTimer && !mmc_disk_busy()) mmc_stream_close();	/* Close the suspended transaction on timeout */
+}
+
+
+DRESULT mmc_stream_error (void)
+{
+	DRESULT res = StreamFail ? RES_ERROR : RES_OK;
+
+
+	StreamFail = 0;					/* Report a failed write once */
+
+	return res;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
@@ -456,9 +1561,14 @@ DRESULT mmc_disk_write (
 	UINT count			/* Sector count (1..128) */
 )
 {
+	LATENCY_DECLARE(t);
+
+
 	if (!count) return RES_PARERR;
 	if (Stat & STA_NOINIT) return RES_NOTRDY;
 	if (Stat & STA_PROTECT) return RES_WRPRT;
+	LATENCY_START(t);
+	if (StreamCmd) mmc_stream_close();
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
@@ -479,6 +1589,7 @@ DRESULT mmc_disk_write (
 		}
 	}
 	deselect();
+	LATENCY_STOP(LATENCY_DISK_WRITE, t);
 
 	return count ? RES_ERROR : RES_OK;
 }
@@ -505,6 +1616,7 @@ DRESULT mmc_disk_ioctl (
 #endif
 
 	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (StreamCmd) mmc_stream_close();
 
 	res = RES_ERROR;
 	switch (cmd) {
@@ -552,16 +1664,20 @@ DRESULT mmc_disk_ioctl (
 		break;
 
 	case CTRL_TRIM:		/* Erase a block of sectors (used when _USE_TRIM in ffconf.h is 1) */
+		res = RES_PARERR;								/* Not supported by the card */
 		if (!(CardType & CT_SDC)) break;				/* Check if the card is SDC */
 		if (mmc_disk_ioctl(MMC_GET_CSD, csd)) break;	/* Get CSD */
 		if (!(csd[0] >> 6) && !(csd[10] & 0x40)) break;	/* Check if sector erase can be applied to the card */
+		res = RES_ERROR;
 		dp = buff; st = dp[0]; ed = dp[1];				/* Load sector block */
 		if (!(CardType & CT_BLOCK)) {
 			st *= 512; ed *= 512;
 		}
-		if (send_cmd(CMD32, st) == 0 && send_cmd(CMD33, ed) == 0 && send_cmd(CMD38, 0) == 0 && wait_ready(30000)) {	/* Erase sector block */
+		if (send_cmd(CMD32, st) == 0 && send_cmd(CMD33, ed) == 0 && send_cmd(CMD38, 0) == 0) {	/* Erase sector block */
+			CardBusy = 1;	/* The card erases in background, the next access waits for the end of it */
 			res = RES_OK;	/* FatFs does not check result of this command */
 		}
+		deselect();
 		break;
 
 	/* Following commands are never used by FatFs module */
@@ -571,6 +1687,22 @@ DRESULT mmc_disk_ioctl (
 		res = RES_OK;
 		break;
 
+	case MMC_GET_SCLK :		/* Get read/write SPI clock in Hz (DWORD) */
+		*(DWORD*)buff = F_CPU / 2 >> SpiDiv;
+		res = RES_OK;
+		break;
+
+	case MMC_GET_ERRCNT :	/* Get number of data packet errors (WORD) */
+		*(WORD*)buff = ErrCnt;
+		res = RES_OK;
+		break;
+
+	case MMC_GET_XFERCNT :	/* Get and clear number of commands and data packets (DWORD[2]) */
+		((DWORD*)buff)[0] = CmdCnt; CmdCnt = 0;
+		((DWORD*)buff)[1] = PktCnt; PktCnt = 0;
+		res = RES_OK;
+		break;
+
 	case MMC_GET_CSD :		/* Receive CSD as a data block (16 bytes) */
 		if (send_cmd(CMD9, 0) == 0 && rcvr_datablock(ptr, 16)) {	/* READ_CSD */
 			res = RES_OK;
@@ -667,6 +1799,8 @@ void mmc_disk_timerproc (void)
 	if (n) Timer1 = --n;
 	n = Timer2;
 	if (n) Timer2 = --n;
+	n = StreamTimer;
+	if (n) StreamTimer = --n;
 
 #ifndef MMC_NO_CARD_DETECT
 	s = Stat;
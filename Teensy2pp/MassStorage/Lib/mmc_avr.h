@@ -59,6 +59,14 @@ uint8_t mmc_disk_write (const uint8_t* buff, uint32_t sector, unsigned int count
 uint8_t mmc_disk_ioctl (uint8_t cmd, void* buff);
 void mmc_disk_timerproc (void);
 
+/* Prototypes for multiple block streaming */
+
+uint8_t mmc_stream_read_open (uint32_t sector);
+uint8_t mmc_stream_read (uint8_t* buff);
+uint8_t mmc_stream_write_open (uint32_t sector, unsigned int count);
+uint8_t mmc_stream_write (const uint8_t* buff);
+uint8_t mmc_stream_close (void);
+
 #ifdef __cplusplus
 }
 #endif
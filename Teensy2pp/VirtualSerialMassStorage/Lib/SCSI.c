@@ -273,21 +273,30 @@ static bool SCSI_Command_Send_Diagnostic(USB_ClassInfo_MS_Device_t* const MSInte
  *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
  *  \param[in] BlockAddress  Data block starting address for the read sequence
  *  \param[in] TotalBlocks   Number of blocks of data to read
+ *
+ *  \return Boolean \c false if a block could not be read from the card, \c true otherwise
  */
-void MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+bool MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	uint32_t BlockAddress,
 	uint16_t TotalBlocks)
 {
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-		return;
+		return true;
 
 	while (TotalBlocks)
 	{
 		uint8_t buffer[VIRTUAL_MEMORY_BLOCK_SIZE];
 		uint16_t BytesInBlockDiv16 = 0; // TODO
 
-		mmc_disk_read(buffer, BlockAddress, 1) ;
+		/* Stop at a block the card failed to deliver, sending the blocks read so far */
+		if (mmc_stream_read(buffer) != RES_OK)
+		{
+			if (!(Endpoint_IsReadWriteAllowed()))
+				Endpoint_ClearIN();
+
+			return false;
+		}
 
 		/* Read an endpoint packet sized data block from the Dataflash */
 		while (BytesInBlockDiv16 < VIRTUAL_MEMORY_BLOCK_SIZE)
@@ -301,7 +310,7 @@ void MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 				/* Wait until the endpoint is ready for more data */
 				if (Endpoint_WaitUntilReady())
-					return;
+					return true;
 			}
 
 			/* Read one 16-byte chunk of data from the Dataflash */
@@ -312,7 +321,7 @@ void MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 			/* Check if the current command is being aborted by the host */
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-				return;
+				return true;
 #else
 			uint16_t BytesProcessed = 0;
 			uint8_t  ErrorCode;
@@ -327,13 +336,13 @@ void MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 					/* Wait until the host has sent another packet */
 					if (Endpoint_WaitUntilReady())
-						return;
+						return true;
 				}
 
 				ErrorCode = Endpoint_Write_Stream_LE(buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesProcessed);
 				/* Check if the current command is being aborted by the host */
 				if (MSInterfaceInfo->State.IsMassStoreReset)
-					return;
+					return true;
 			} while (ErrorCode == ENDPOINT_RWSTREAM_IncompleteTransfer);
 
 			BytesInBlockDiv16 += VIRTUAL_MEMORY_BLOCK_SIZE;
@@ -342,20 +351,34 @@ void MMC_ReadBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 		BlockAddress++;
 		TotalBlocks--;
+
+		/* Update the bytes transferred counter */
+		MSInterfaceInfo->State.CommandBlock.DataTransferLength -= VIRTUAL_MEMORY_BLOCK_SIZE;
 	}
 
 	/* If the endpoint is full, send its contents to the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 		Endpoint_ClearIN();
+
+	return true;
 }
 
-void MMC_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+/** Writes blocks from the pre-selected data OUT endpoint to the card, through the WRITE_MULTIPLE_BLOCK transaction
+ *  opened by the caller.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to a structure containing a Mass Storage Class configuration and state
+ *  \param[in] BlockAddress  Data block starting address for the write sequence
+ *  \param[in] TotalBlocks   Number of blocks of data to write
+ *
+ *  \return Boolean \c false if a block could not be written to the card, \c true otherwise
+ */
+bool MMC_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 	uint32_t BlockAddress,
 	uint16_t TotalBlocks)
 {
 	/* Wait until endpoint is ready before continuing */
 	if (Endpoint_WaitUntilReady())
-		return;
+		return true;
 
 	while (TotalBlocks)
 	{
@@ -374,7 +397,7 @@ void MMC_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 				/* Wait until the host has sent another packet */
 				if (Endpoint_WaitUntilReady())
-					return;
+					return true;
 			}
 
 			for (uint8_t i = 0; i < 16; i++)
@@ -384,7 +407,7 @@ void MMC_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 			/* Check if the current command is being aborted by the host */
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-				return;
+				return true;
 #else
 			uint16_t BytesProcessed = 0;
 			uint8_t  ErrorCode;
@@ -399,29 +422,36 @@ void MMC_WriteBlocks2(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
 
 					/* Wait until the host has sent another packet */
 					if (Endpoint_WaitUntilReady())
-						return;
+						return true;
 				}
 
 				ErrorCode = Endpoint_Read_Stream_LE(buffer, VIRTUAL_MEMORY_BLOCK_SIZE, &BytesProcessed);
 				/* Check if the current command is being aborted by the host */
 				if (MSInterfaceInfo->State.IsMassStoreReset)
-					return;
+					return true;
 			} while (ErrorCode == ENDPOINT_RWSTREAM_IncompleteTransfer);
 
 			BytesInBlockDiv16 += VIRTUAL_MEMORY_BLOCK_SIZE;
 #endif
 		}
 
-		mmc_disk_write(buffer, BlockAddress, 1);
+		/* Stop at a block the card rejected */
+		if (mmc_stream_write(buffer) != RES_OK)
+			return false;
 
 		/* Decrement the blocks remaining counter */
 		BlockAddress++;
 		TotalBlocks--;
+
+		/* Update the bytes transferred counter */
+		MSInterfaceInfo->State.CommandBlock.DataTransferLength -= VIRTUAL_MEMORY_BLOCK_SIZE;
 	}
 
 	/* If the endpoint is empty, clear it ready for the next packet from the host */
 	if (!(Endpoint_IsReadWriteAllowed()))
 		Endpoint_ClearOUT();
+
+	return true;
 }
 
 int8_t is_disk_read_only = 1;
@@ -439,6 +469,7 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 {
 	uint32_t BlockAddress;
 	uint16_t TotalBlocks;
+	bool     Success;
 
 	/* Check if the disk is write protected or not */
 	if ((IsDataRead == DATA_WRITE) && DISK_READ_ONLY)
@@ -474,13 +505,36 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 	#endif
 
 	/* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
-	if (IsDataRead == DATA_READ)
-	  MMC_ReadBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	if (!(TotalBlocks))
+	{
+		Success = true;
+	}
+	else if (IsDataRead == DATA_READ)
+	{
+		/* Read the whole request with a single READ_MULTIPLE_BLOCK */
+		Success = (mmc_stream_read_open(BlockAddress) == RES_OK) &&
+		          MMC_ReadBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	}
 	else
-	  MMC_WriteBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	{
+		/* Write the whole request with a single pre-erased WRITE_MULTIPLE_BLOCK */
+		Success = (mmc_stream_write_open(BlockAddress, TotalBlocks) == RES_OK) &&
+		          MMC_WriteBlocks2(MSInterfaceInfo, BlockAddress, TotalBlocks);
+	}
 
-	/* Update the bytes transferred counter and succeed the command */
-	MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)TotalBlocks * VIRTUAL_MEMORY_BLOCK_SIZE);
+	/* The STOP_TRAN token of a write fails if the card could not program the last blocks */
+	if (TotalBlocks && (mmc_stream_close() != RES_OK))
+	  Success = false;
+
+	if (!(Success))
+	{
+		/* The card failed the transfer, update SENSE key and return command fail */
+		SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+		               SCSI_ASENSE_NO_ADDITIONAL_INFORMATION,
+		               SCSI_ASENSEQ_NO_QUALIFIER);
+
+		return false;
+	}
 
 	return true;
 }
@@ -88,6 +88,9 @@ uint8_t Timer1, Timer2;	/* 100Hz decrement timer */
 static
 uint8_t CardType;			/* Card type flags (b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing) */
 
+static
+uint8_t StreamCmd;			/* Multiple block transfer in progress (0:None, CMD18:Reading, CMD25:Writing) */
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -457,6 +460,100 @@ uint8_t mmc_disk_read (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Streaming Read/Write Sector(s)                                        */
+/*-----------------------------------------------------------------------*/
+/* A READ_MULTIPLE_BLOCK or WRITE_MULTIPLE_BLOCK transaction is kept     */
+/* open across the calls so that the caller can move each sector to or   */
+/* from the host in between, without paying a command and a select cycle */
+/* per sector.                                                           */
+
+uint8_t mmc_stream_read_open (
+	uint32_t sector		/* Start sector number (LBA) */
+)
+{
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (StreamCmd) mmc_stream_close();
+
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+
+	if (send_cmd(CMD18, sector) != 0) {		/* READ_MULTIPLE_BLOCK */
+		deselect();
+		return RES_ERROR;
+	}
+	StreamCmd = CMD18;
+
+	return RES_OK;
+}
+
+
+uint8_t mmc_stream_read (
+	uint8_t *buff			/* Pointer to the 512 byte data buffer to store read data */
+)
+{
+	if (StreamCmd != CMD18) return RES_ERROR;
+
+	if (!rcvr_datablock(buff, 512)) {		/* Abort the transaction on a bad data packet */
+		mmc_stream_close();
+		return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+uint8_t mmc_stream_write_open (
+	uint32_t sector,		/* Start sector number (LBA) */
+	unsigned int count			/* Number of sectors the host is going to send */
+)
+{
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (Stat & STA_PROTECT) return RES_WRPRT;
+	if (StreamCmd) mmc_stream_close();
+
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
+
+	if (((CardType & CT_SDC) && send_cmd(ACMD23, count) != 0) ||	/* Let the card pre-erase the whole run */
+		send_cmd(CMD25, sector) != 0) {		/* WRITE_MULTIPLE_BLOCK */
+		deselect();
+		return RES_ERROR;
+	}
+	StreamCmd = CMD25;
+
+	return RES_OK;
+}
+
+
+uint8_t mmc_stream_write (
+	const uint8_t *buff	/* Pointer to the 512 byte data block to be written */
+)
+{
+	if (StreamCmd != CMD25) return RES_ERROR;
+
+	if (!xmit_datablock(buff, 0xFC)) {		/* Abort the transaction on a rejected data packet */
+		mmc_stream_close();
+		return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+uint8_t mmc_stream_close (void)
+{
+	uint8_t res = RES_OK;
+
+
+	if (StreamCmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+	if (StreamCmd == CMD25 && !xmit_datablock(0, 0xFD)) res = RES_ERROR;	/* STOP_TRAN token */
+	StreamCmd = 0;
+	deselect();
+
+	return res;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/